@@ -0,0 +1,694 @@
+/*
+ * Stub CUDA Driver API
+ *
+ * In-process stand-ins used when building with -DSTUB_CUDA (no GPU needed).
+ * Device memory is plain host memory, and all stream work (copies, event
+ * records, host functions) completes before the call returns. Device-side
+ * work on a capturing stream is recorded into a graph instead.
+ */
+
+#ifndef CUDA_STUB_H
+#define CUDA_STUB_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Stub CUDA types and results */
+typedef int CUdevice;
+typedef void *CUcontext;
+typedef unsigned long long CUdeviceptr;
+typedef int CUresult;
+typedef struct CUstream_st *CUstream;
+typedef struct CUevent_st *CUevent;
+typedef void (*CUhostFn)(void *userData);
+typedef struct CUgraph_st *CUgraph;
+typedef struct CUgraph_st *CUgraphExec;
+
+#define CUDA_SUCCESS            0
+#define CUDA_ERROR_INVALID_VALUE 1
+#define CUDA_ERROR_OUT_OF_MEMORY 2
+#define CUDA_ERROR_INVALID_DEVICE 101
+#define CUDA_ERROR_NOT_READY    600
+#define CUDA_ERROR_PEER_ACCESS_ALREADY_ENABLED 704
+#define CUDA_CB
+
+#define CU_STREAM_NON_BLOCKING  0x1
+#define CU_MEMHOSTREGISTER_PORTABLE 0x1
+
+/* Stub GPUs (STUB_GPU_COUNT overrides) and their memory (STUB_GPU_MEMORY_MB
+ * overrides, enforced by cuMemAlloc) */
+#define STUB_GPU_COUNT_MAX      16
+#define STUB_GPU_MEMORY         (16ull << 30)
+
+#define CUDA_VERSION            12040
+#define CUDA_ERROR_NOT_FOUND    500
+#define CUDA_ERROR_NOT_SUPPORTED 801
+
+#define CUDA_ERROR_STREAM_CAPTURE_UNSUPPORTED 900
+#define CUDA_ERROR_STREAM_CAPTURE_INVALIDATED 901
+
+#define CU_STREAM_CAPTURE_MODE_GLOBAL       0
+#define CU_STREAM_CAPTURE_MODE_THREAD_LOCAL 1
+#define CU_STREAM_CAPTURE_MODE_RELAXED      2
+typedef int CUstreamCaptureMode;
+
+#define CU_LAUNCH_PARAM_END            ((void *)0x00)
+#define CU_LAUNCH_PARAM_BUFFER_POINTER ((void *)0x01)
+#define CU_LAUNCH_PARAM_BUFFER_SIZE    ((void *)0x02)
+
+/* Stub stream: work runs inline unless it is being captured */
+struct CUstream_st {
+    unsigned int flags;
+    CUgraph capture;       /* Graph recording launches, or NULL */
+};
+
+/* Stub event: remembers when it was recorded */
+struct CUevent_st {
+    struct timespec recorded;
+};
+
+/* Current context and memory in use per GPU, shared by every translation
+ * unit including this header (hence weak rather than static) */
+__attribute__((weak)) __thread CUcontext stub_current_ctx;
+__attribute__((weak)) unsigned long long stub_mem_used[STUB_GPU_COUNT_MAX];
+
+#define STUB_CTX_BASE           0x12345678ul
+
+static inline unsigned long long stub_gpu_memory(void) {
+    const char *env = getenv("STUB_GPU_MEMORY_MB");
+    unsigned long long mb = env && *env ? strtoull(env, NULL, 10) : 0;
+    return mb ? mb << 20 : STUB_GPU_MEMORY;
+}
+
+/* GPU of the current context (0 if none was made current) */
+static inline int stub_current_device(void) {
+    unsigned long dev = (unsigned long)stub_current_ctx - STUB_CTX_BASE;
+    return stub_current_ctx && dev < STUB_GPU_COUNT_MAX ? (int)dev : 0;
+}
+
+static inline CUresult cuInit(unsigned int flags) {
+    (void)flags;
+    printf("[STUB] cuInit called\n");
+    return CUDA_SUCCESS;
+}
+
+static inline CUresult cuDeviceGetCount(int *count) {
+    const char *env = getenv("STUB_GPU_COUNT");
+    *count = env && *env ? atoi(env) : 1;
+    if (*count < 1 || *count > STUB_GPU_COUNT_MAX) {
+        *count = 1;
+    }
+    printf("[STUB] cuDeviceGetCount: %d device(s)\n", *count);
+    return CUDA_SUCCESS;
+}
+
+static inline CUresult cuDeviceGet(CUdevice *device, int ordinal) {
+    *device = ordinal;
+    printf("[STUB] cuDeviceGet: device %d\n", ordinal);
+    return CUDA_SUCCESS;
+}
+
+static inline CUresult cuDeviceGetName(char *name, int len, CUdevice dev) {
+    snprintf(name, len, "STUB GPU Device %d", dev);
+    printf("[STUB] cuDeviceGetName: %s\n", name);
+    return CUDA_SUCCESS;
+}
+
+/* Device attributes (CUdevice_attribute values; the stub knows these) */
+typedef int CUdevice_attribute;
+#define CU_DEVICE_ATTRIBUTE_MAX_THREADS_PER_BLOCK              1
+#define CU_DEVICE_ATTRIBUTE_MAX_BLOCK_DIM_X                    2
+#define CU_DEVICE_ATTRIBUTE_MAX_BLOCK_DIM_Y                    3
+#define CU_DEVICE_ATTRIBUTE_MAX_BLOCK_DIM_Z                    4
+#define CU_DEVICE_ATTRIBUTE_MAX_GRID_DIM_X                     5
+#define CU_DEVICE_ATTRIBUTE_MAX_GRID_DIM_Y                     6
+#define CU_DEVICE_ATTRIBUTE_MAX_GRID_DIM_Z                     7
+#define CU_DEVICE_ATTRIBUTE_MAX_SHARED_MEMORY_PER_BLOCK        8
+#define CU_DEVICE_ATTRIBUTE_TOTAL_CONSTANT_MEMORY              9
+#define CU_DEVICE_ATTRIBUTE_WARP_SIZE                          10
+#define CU_DEVICE_ATTRIBUTE_MAX_REGISTERS_PER_BLOCK            12
+#define CU_DEVICE_ATTRIBUTE_CLOCK_RATE                         13
+#define CU_DEVICE_ATTRIBUTE_MULTIPROCESSOR_COUNT               16
+#define CU_DEVICE_ATTRIBUTE_CONCURRENT_KERNELS                 31
+#define CU_DEVICE_ATTRIBUTE_PCI_BUS_ID                         33
+#define CU_DEVICE_ATTRIBUTE_PCI_DEVICE_ID                      34
+#define CU_DEVICE_ATTRIBUTE_MEMORY_CLOCK_RATE                  36
+#define CU_DEVICE_ATTRIBUTE_GLOBAL_MEMORY_BUS_WIDTH            37
+#define CU_DEVICE_ATTRIBUTE_L2_CACHE_SIZE                      38
+#define CU_DEVICE_ATTRIBUTE_MAX_THREADS_PER_MULTIPROCESSOR     39
+#define CU_DEVICE_ATTRIBUTE_ASYNC_ENGINE_COUNT                 40
+#define CU_DEVICE_ATTRIBUTE_UNIFIED_ADDRESSING                 41
+#define CU_DEVICE_ATTRIBUTE_PCI_DOMAIN_ID                      50
+#define CU_DEVICE_ATTRIBUTE_COMPUTE_CAPABILITY_MAJOR           75
+#define CU_DEVICE_ATTRIBUTE_COMPUTE_CAPABILITY_MINOR           76
+#define CU_DEVICE_ATTRIBUTE_MAX_SHARED_MEMORY_PER_MULTIPROCESSOR 81
+#define CU_DEVICE_ATTRIBUTE_MAX_REGISTERS_PER_MULTIPROCESSOR   82
+
+typedef struct CUuuid_st {
+    char bytes[16];
+} CUuuid;
+
+static inline CUresult cuDriverGetVersion(int *version) {
+    *version = CUDA_VERSION;
+    return CUDA_SUCCESS;
+}
+
+/* Roughly an A100: compute capability 8.0, 108 SMs */
+static inline CUresult cuDeviceGetAttribute(int *pi, CUdevice_attribute attrib, CUdevice dev) {
+    switch (attrib) {
+        case CU_DEVICE_ATTRIBUTE_MAX_THREADS_PER_BLOCK:           *pi = 1024; break;
+        case CU_DEVICE_ATTRIBUTE_MAX_BLOCK_DIM_X:                 *pi = 1024; break;
+        case CU_DEVICE_ATTRIBUTE_MAX_BLOCK_DIM_Y:                 *pi = 1024; break;
+        case CU_DEVICE_ATTRIBUTE_MAX_BLOCK_DIM_Z:                 *pi = 64; break;
+        case CU_DEVICE_ATTRIBUTE_MAX_GRID_DIM_X:                  *pi = 2147483647; break;
+        case CU_DEVICE_ATTRIBUTE_MAX_GRID_DIM_Y:                  *pi = 65535; break;
+        case CU_DEVICE_ATTRIBUTE_MAX_GRID_DIM_Z:                  *pi = 65535; break;
+        case CU_DEVICE_ATTRIBUTE_MAX_SHARED_MEMORY_PER_BLOCK:     *pi = 49152; break;
+        case CU_DEVICE_ATTRIBUTE_TOTAL_CONSTANT_MEMORY:           *pi = 65536; break;
+        case CU_DEVICE_ATTRIBUTE_WARP_SIZE:                       *pi = 32; break;
+        case CU_DEVICE_ATTRIBUTE_MAX_REGISTERS_PER_BLOCK:         *pi = 65536; break;
+        case CU_DEVICE_ATTRIBUTE_CLOCK_RATE:                      *pi = 1410000; break;
+        case CU_DEVICE_ATTRIBUTE_MULTIPROCESSOR_COUNT:            *pi = 108; break;
+        case CU_DEVICE_ATTRIBUTE_CONCURRENT_KERNELS:              *pi = 1; break;
+        case CU_DEVICE_ATTRIBUTE_PCI_BUS_ID:                      *pi = 0x10 + dev; break;
+        case CU_DEVICE_ATTRIBUTE_PCI_DEVICE_ID:                   *pi = 0; break;
+        case CU_DEVICE_ATTRIBUTE_MEMORY_CLOCK_RATE:               *pi = 1215000; break;
+        case CU_DEVICE_ATTRIBUTE_GLOBAL_MEMORY_BUS_WIDTH:         *pi = 5120; break;
+        case CU_DEVICE_ATTRIBUTE_L2_CACHE_SIZE:                   *pi = 40 << 20; break;
+        case CU_DEVICE_ATTRIBUTE_MAX_THREADS_PER_MULTIPROCESSOR:  *pi = 2048; break;
+        case CU_DEVICE_ATTRIBUTE_ASYNC_ENGINE_COUNT:              *pi = 3; break;
+        case CU_DEVICE_ATTRIBUTE_UNIFIED_ADDRESSING:              *pi = 1; break;
+        case CU_DEVICE_ATTRIBUTE_PCI_DOMAIN_ID:                   *pi = 0; break;
+        case CU_DEVICE_ATTRIBUTE_COMPUTE_CAPABILITY_MAJOR:        *pi = 8; break;
+        case CU_DEVICE_ATTRIBUTE_COMPUTE_CAPABILITY_MINOR:        *pi = 0; break;
+        case CU_DEVICE_ATTRIBUTE_MAX_SHARED_MEMORY_PER_MULTIPROCESSOR: *pi = 167936; break;
+        case CU_DEVICE_ATTRIBUTE_MAX_REGISTERS_PER_MULTIPROCESSOR: *pi = 65536; break;
+        default:
+            return CUDA_ERROR_INVALID_VALUE;
+    }
+    return CUDA_SUCCESS;
+}
+
+static inline CUresult cuDeviceGetUuid(CUuuid *uuid, CUdevice dev) {
+    for (int i = 0; i < 16; i++) {
+        uuid->bytes[i] = (char)(0x50 + i * 7 + dev);
+    }
+    return CUDA_SUCCESS;
+}
+
+static inline CUresult cuDeviceTotalMem(size_t *bytes, CUdevice dev) {
+    (void)dev;
+    *bytes = stub_gpu_memory();
+    return CUDA_SUCCESS;
+}
+
+static inline CUresult cuCtxCreate(CUcontext *pctx, unsigned int flags, CUdevice dev) {
+    (void)flags;
+    *pctx = (void *)(STUB_CTX_BASE + (unsigned long)dev);
+    stub_current_ctx = *pctx;
+    printf("[STUB] cuCtxCreate: context created\n");
+    return CUDA_SUCCESS;
+}
+
+static inline CUresult cuCtxSetCurrent(CUcontext ctx) {
+    stub_current_ctx = ctx;
+    return CUDA_SUCCESS;
+}
+
+static inline CUresult cuCtxGetCurrent(CUcontext *pctx) {
+    *pctx = stub_current_ctx;
+    return CUDA_SUCCESS;
+}
+
+static inline CUresult cuCtxSynchronize(void) {
+    return CUDA_SUCCESS;
+}
+
+/* Every pair of stub GPUs is peer capable */
+static inline CUresult cuDeviceCanAccessPeer(int *can_access, CUdevice dev, CUdevice peer) {
+    *can_access = dev != peer;
+    return CUDA_SUCCESS;
+}
+
+static inline CUresult cuCtxEnablePeerAccess(CUcontext peer, unsigned int flags) {
+    (void)peer;
+    (void)flags;
+    return CUDA_SUCCESS;
+}
+
+static inline CUresult cuGetErrorString(CUresult error, const char **pStr) {
+    (void)error;
+    *pStr = "stub error";
+    return CUDA_SUCCESS;
+}
+
+/* Memory */
+
+/* Header in front of each allocation: size and GPU (keeps malloc's alignment) */
+#define STUB_ALLOC_HEADER       64
+
+static inline CUresult cuMemAlloc(CUdeviceptr *ptr, size_t size) {
+    int dev = stub_current_device();
+    unsigned long long used = __atomic_add_fetch(&stub_mem_used[dev], size, __ATOMIC_RELAXED);
+    if (used > stub_gpu_memory()) {
+        __atomic_sub_fetch(&stub_mem_used[dev], size, __ATOMIC_RELAXED);
+        return CUDA_ERROR_OUT_OF_MEMORY;
+    }
+
+    unsigned char *base = malloc(STUB_ALLOC_HEADER + size);
+    if (!base) {
+        __atomic_sub_fetch(&stub_mem_used[dev], size, __ATOMIC_RELAXED);
+        return CUDA_ERROR_OUT_OF_MEMORY;
+    }
+    ((size_t *)base)[0] = size;
+    ((size_t *)base)[1] = (size_t)dev;
+
+    *ptr = (CUdeviceptr)(base + STUB_ALLOC_HEADER);
+    return CUDA_SUCCESS;
+}
+
+static inline CUresult cuMemFree(CUdeviceptr ptr) {
+    if (!ptr) {
+        return CUDA_SUCCESS;
+    }
+    unsigned char *base = (unsigned char *)ptr - STUB_ALLOC_HEADER;
+    __atomic_sub_fetch(&stub_mem_used[((size_t *)base)[1]], ((size_t *)base)[0],
+                       __ATOMIC_RELAXED);
+    free(base);
+    return CUDA_SUCCESS;
+}
+
+static inline CUresult cuMemHostRegister(void *p, size_t size, unsigned int flags) {
+    (void)p;
+    (void)size;
+    (void)flags;
+    return CUDA_SUCCESS;
+}
+
+static inline CUresult cuMemHostUnregister(void *p) {
+    (void)p;
+    return CUDA_SUCCESS;
+}
+
+static inline CUresult cuMemcpyHtoD(CUdeviceptr dst, const void *src, size_t size) {
+    memcpy((void *)dst, src, size);
+    return CUDA_SUCCESS;
+}
+
+static inline CUresult cuMemcpyDtoH(void *dst, CUdeviceptr src, size_t size) {
+    memcpy(dst, (void *)src, size);
+    return CUDA_SUCCESS;
+}
+
+static inline CUresult cuMemcpyHtoDAsync(CUdeviceptr dst, const void *src, size_t size,
+                                         CUstream stream) {
+    (void)stream;
+    return cuMemcpyHtoD(dst, src, size);
+}
+
+static inline CUresult cuMemcpyDtoHAsync(void *dst, CUdeviceptr src, size_t size,
+                                         CUstream stream) {
+    (void)stream;
+    return cuMemcpyDtoH(dst, src, size);
+}
+
+/* Streams */
+
+static inline CUresult cuStreamCreateWithPriority(CUstream *stream, unsigned int flags,
+                                                  int priority) {
+    (void)priority;
+    *stream = calloc(1, sizeof(struct CUstream_st));
+    if (!*stream) {
+        return CUDA_ERROR_OUT_OF_MEMORY;
+    }
+    (*stream)->flags = flags;
+    return CUDA_SUCCESS;
+}
+
+static inline CUresult cuStreamDestroy(CUstream stream) {
+    free(stream);
+    return CUDA_SUCCESS;
+}
+
+static inline CUresult cuStreamSynchronize(CUstream stream) {
+    (void)stream;
+    return CUDA_SUCCESS;
+}
+
+static inline CUresult cuStreamWaitEvent(CUstream stream, CUevent event, unsigned int flags) {
+    (void)stream;
+    (void)event;
+    (void)flags;
+    return CUDA_SUCCESS;
+}
+
+static inline CUresult cuLaunchHostFunc(CUstream stream, CUhostFn fn, void *userData) {
+    (void)stream;
+    fn(userData);
+    return CUDA_SUCCESS;
+}
+
+/* Events */
+
+static inline CUresult cuEventCreate(CUevent *event, unsigned int flags) {
+    (void)flags;
+    *event = calloc(1, sizeof(struct CUevent_st));
+    return *event ? CUDA_SUCCESS : CUDA_ERROR_OUT_OF_MEMORY;
+}
+
+static inline CUresult cuEventDestroy(CUevent event) {
+    free(event);
+    return CUDA_SUCCESS;
+}
+
+static inline CUresult cuEventRecord(CUevent event, CUstream stream) {
+    (void)stream;
+    clock_gettime(CLOCK_MONOTONIC, &event->recorded);
+    return CUDA_SUCCESS;
+}
+
+static inline CUresult cuEventSynchronize(CUevent event) {
+    (void)event;
+    return CUDA_SUCCESS;
+}
+
+static inline CUresult cuEventQuery(CUevent event) {
+    (void)event;
+    return CUDA_SUCCESS;
+}
+
+static inline CUresult cuEventElapsedTime(float *ms, CUevent start, CUevent end) {
+    *ms = (end->recorded.tv_sec - start->recorded.tv_sec) * 1e3f +
+          (end->recorded.tv_nsec - start->recorded.tv_nsec) / 1e6f;
+    return CUDA_SUCCESS;
+}
+
+/*
+ * Modules
+ *
+ * Images aren't compiled; a few built-in kernels are found by name and
+ * run on the CPU, one loop iteration per thread (x dimension only).
+ */
+
+typedef struct CUmod_st *CUmodule;
+typedef const struct CUfunc_st *CUfunction;
+
+struct CUmod_st {
+    size_t image_size;
+};
+
+struct CUfunc_st {
+    const char *name;
+    unsigned int num_params;
+    size_t offsets[4];
+    size_t sizes[4];
+    void (*run)(const unsigned char *args, unsigned int thread);
+};
+
+/* fill_u32(unsigned int *data, unsigned int value, unsigned int n) */
+static inline void stub_fill_u32(const unsigned char *args, unsigned int thread) {
+    unsigned int *data;
+    unsigned int value, n;
+    memcpy(&data, args, sizeof(data));
+    memcpy(&value, args + 8, sizeof(value));
+    memcpy(&n, args + 12, sizeof(n));
+    if (thread < n) {
+        data[thread] = value;
+    }
+}
+
+/* scale_f32(float *data, float factor, unsigned int n) */
+static inline void stub_scale_f32(const unsigned char *args, unsigned int thread) {
+    float *data;
+    float factor;
+    unsigned int n;
+    memcpy(&data, args, sizeof(data));
+    memcpy(&factor, args + 8, sizeof(factor));
+    memcpy(&n, args + 12, sizeof(n));
+    if (thread < n) {
+        data[thread] *= factor;
+    }
+}
+
+static const struct CUfunc_st stub_kernels[] = {
+    { "fill_u32", 3, { 0, 8, 12 }, { 8, 4, 4 }, stub_fill_u32 },
+    { "scale_f32", 3, { 0, 8, 12 }, { 8, 4, 4 }, stub_scale_f32 },
+};
+
+static inline CUresult cuModuleLoadData(CUmodule *module, const void *image) {
+    (void)image;
+    *module = calloc(1, sizeof(struct CUmod_st));
+    return *module ? CUDA_SUCCESS : CUDA_ERROR_OUT_OF_MEMORY;
+}
+
+static inline CUresult cuModuleUnload(CUmodule module) {
+    free(module);
+    return CUDA_SUCCESS;
+}
+
+static inline CUresult cuModuleGetFunction(CUfunction *func, CUmodule module, const char *name) {
+    (void)module;
+    for (size_t i = 0; i < sizeof(stub_kernels) / sizeof(stub_kernels[0]); i++) {
+        if (strcmp(stub_kernels[i].name, name) == 0) {
+            *func = &stub_kernels[i];
+            return CUDA_SUCCESS;
+        }
+    }
+    return CUDA_ERROR_NOT_FOUND;
+}
+
+static inline CUresult cuFuncGetParamInfo(CUfunction func, size_t index,
+                                          size_t *offset, size_t *size) {
+    if (index >= func->num_params) {
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+    *offset = func->offsets[index];
+    *size = func->sizes[index];
+    return CUDA_SUCCESS;
+}
+
+/*
+ * Graphs
+ *
+ * A graph is the list of launches, fills and copies captured on a stream;
+ * replaying runs them in order.
+ */
+
+#define STUB_ARGS_MAX 32
+
+struct stub_graph_node {
+    CUfunction func;       /* Kernel, or NULL for a fill or copy */
+    unsigned int threads;
+    unsigned char args[STUB_ARGS_MAX];
+    CUdeviceptr dst;       /* Fill or copy */
+    CUdeviceptr src;       /* Copy (width bytes) */
+    size_t pitch, width, height;
+    unsigned int value, element_size;
+};
+
+struct CUgraph_st {
+    unsigned int count;
+    unsigned int cap;
+    struct stub_graph_node *nodes;
+};
+
+static inline struct stub_graph_node *stub_graph_push(CUgraph graph) {
+    if (graph->count == graph->cap) {
+        unsigned int cap = graph->cap ? graph->cap * 2 : 8;
+        struct stub_graph_node *nodes = realloc(graph->nodes, cap * sizeof(*nodes));
+        if (!nodes) {
+            return NULL;
+        }
+        graph->nodes = nodes;
+        graph->cap = cap;
+    }
+    return memset(&graph->nodes[graph->count++], 0, sizeof(struct stub_graph_node));
+}
+
+static inline void stub_fill(CUdeviceptr dst, size_t pitch, unsigned int value,
+                             unsigned int element_size, size_t width, size_t height) {
+    for (size_t row = 0; row < height; row++) {
+        unsigned char *p = (unsigned char *)(dst + row * pitch);
+        for (size_t i = 0; i < width; i++) {
+            memcpy(p + i * element_size, &value, element_size);
+        }
+    }
+}
+
+static inline void stub_graph_run(const struct stub_graph_node *node) {
+    if (node->src) {
+        memmove((void *)node->dst, (const void *)node->src, node->width);
+        return;
+    }
+    if (!node->func) {
+        stub_fill(node->dst, node->pitch, node->value, node->element_size,
+                  node->width, node->height);
+        return;
+    }
+    for (unsigned int t = 0; t < node->threads; t++) {
+        node->func->run(node->args, t);
+    }
+}
+
+/* Fill now, or record it if the stream is capturing */
+static inline CUresult stub_memset(CUdeviceptr dst, size_t pitch, unsigned int value,
+                                   unsigned int element_size, size_t width, size_t height,
+                                   CUstream stream) {
+    if (stream && stream->capture) {
+        struct stub_graph_node *node = stub_graph_push(stream->capture);
+        if (!node) {
+            return CUDA_ERROR_OUT_OF_MEMORY;
+        }
+        *node = (struct stub_graph_node){
+            .dst = dst, .pitch = pitch, .width = width, .height = height,
+            .value = value, .element_size = element_size
+        };
+        return CUDA_SUCCESS;
+    }
+    stub_fill(dst, pitch, value, element_size, width, height);
+    return CUDA_SUCCESS;
+}
+
+static inline CUresult cuMemcpyDtoDAsync(CUdeviceptr dst, CUdeviceptr src, size_t size,
+                                         CUstream stream) {
+    if (stream && stream->capture) {
+        struct stub_graph_node *node = stub_graph_push(stream->capture);
+        if (!node) {
+            return CUDA_ERROR_OUT_OF_MEMORY;
+        }
+        *node = (struct stub_graph_node){ .dst = dst, .src = src, .width = size };
+        return CUDA_SUCCESS;
+    }
+    memmove((void *)dst, (const void *)src, size);
+    return CUDA_SUCCESS;
+}
+
+static inline CUresult cuMemcpyPeerAsync(CUdeviceptr dst, CUcontext dst_ctx, CUdeviceptr src,
+                                         CUcontext src_ctx, size_t size, CUstream stream) {
+    (void)dst_ctx;
+    (void)src_ctx;
+    return cuMemcpyDtoDAsync(dst, src, size, stream);
+}
+
+static inline CUresult cuMemsetD8Async(CUdeviceptr dst, unsigned char value, size_t n,
+                                       CUstream stream) {
+    return stub_memset(dst, n, value, 1, n, 1, stream);
+}
+
+static inline CUresult cuMemsetD16Async(CUdeviceptr dst, unsigned short value, size_t n,
+                                        CUstream stream) {
+    return stub_memset(dst, n * 2, value, 2, n, 1, stream);
+}
+
+static inline CUresult cuMemsetD32Async(CUdeviceptr dst, unsigned int value, size_t n,
+                                        CUstream stream) {
+    return stub_memset(dst, n * 4, value, 4, n, 1, stream);
+}
+
+static inline CUresult cuMemsetD2D8Async(CUdeviceptr dst, size_t pitch, unsigned char value,
+                                         size_t width, size_t height, CUstream stream) {
+    return stub_memset(dst, pitch, value, 1, width, height, stream);
+}
+
+static inline CUresult cuMemsetD2D16Async(CUdeviceptr dst, size_t pitch, unsigned short value,
+                                          size_t width, size_t height, CUstream stream) {
+    return stub_memset(dst, pitch, value, 2, width, height, stream);
+}
+
+static inline CUresult cuMemsetD2D32Async(CUdeviceptr dst, size_t pitch, unsigned int value,
+                                          size_t width, size_t height, CUstream stream) {
+    return stub_memset(dst, pitch, value, 4, width, height, stream);
+}
+
+static inline CUresult cuLaunchKernel(CUfunction func,
+                                      unsigned int gx, unsigned int gy, unsigned int gz,
+                                      unsigned int bx, unsigned int by, unsigned int bz,
+                                      unsigned int shared_mem, CUstream stream,
+                                      void **params, void **extra) {
+    (void)gy; (void)gz; (void)by; (void)bz;
+    (void)shared_mem;
+    (void)stream;
+    (void)params;
+
+    /* Only the packed-buffer form is used by the proxy */
+    if (!extra || extra[0] != CU_LAUNCH_PARAM_BUFFER_POINTER) {
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+    const unsigned char *args = extra[1];
+
+    if (stream && stream->capture) {
+        struct stub_graph_node *node = stub_graph_push(stream->capture);
+        if (!node) {
+            return CUDA_ERROR_OUT_OF_MEMORY;
+        }
+        node->func = func;
+        node->threads = gx * bx;
+        memcpy(node->args, args,
+               func->offsets[func->num_params - 1] + func->sizes[func->num_params - 1]);
+        return CUDA_SUCCESS;
+    }
+
+    for (unsigned int t = 0; t < gx * bx; t++) {
+        func->run(args, t);
+    }
+    return CUDA_SUCCESS;
+}
+
+static inline CUresult cuStreamBeginCapture(CUstream stream, CUstreamCaptureMode mode) {
+    (void)mode;
+    if (!stream || stream->capture) {
+        return CUDA_ERROR_STREAM_CAPTURE_UNSUPPORTED;
+    }
+    stream->capture = calloc(1, sizeof(struct CUgraph_st));
+    return stream->capture ? CUDA_SUCCESS : CUDA_ERROR_OUT_OF_MEMORY;
+}
+
+static inline CUresult cuStreamEndCapture(CUstream stream, CUgraph *graph) {
+    if (!stream || !stream->capture) {
+        return CUDA_ERROR_STREAM_CAPTURE_INVALIDATED;
+    }
+    *graph = stream->capture;
+    stream->capture = NULL;
+    return CUDA_SUCCESS;
+}
+
+static inline CUresult cuGraphDestroy(CUgraph graph) {
+    free(graph->nodes);
+    free(graph);
+    return CUDA_SUCCESS;
+}
+
+static inline CUresult cuGraphInstantiate(CUgraphExec *exec, CUgraph graph,
+                                          unsigned long long flags) {
+    (void)flags;
+    struct CUgraph_st *copy = calloc(1, sizeof(*copy));
+    if (!copy) {
+        return CUDA_ERROR_OUT_OF_MEMORY;
+    }
+    for (unsigned int i = 0; i < graph->count; i++) {
+        struct stub_graph_node *node = stub_graph_push(copy);
+        if (!node) {
+            cuGraphDestroy(copy);
+            return CUDA_ERROR_OUT_OF_MEMORY;
+        }
+        *node = graph->nodes[i];
+    }
+    *exec = copy;
+    return CUDA_SUCCESS;
+}
+
+static inline CUresult cuGraphExecDestroy(CUgraphExec exec) {
+    return cuGraphDestroy(exec);
+}
+
+static inline CUresult cuGraphLaunch(CUgraphExec exec, CUstream stream) {
+    (void)stream;
+    for (unsigned int i = 0; i < exec->count; i++) {
+        stub_graph_run(&exec->nodes[i]);
+    }
+    return CUDA_SUCCESS;
+}
+
+#endif /* CUDA_STUB_H */
@@ -0,0 +1,489 @@
+/*
+ * GPU Devices and Placement Implementation
+ */
+
+#define _GNU_SOURCE
+#include "devices.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <pthread.h>
+
+/* Zones with a placement */
+#define DEVICES_MAX_ZONES 64
+
+/* A zone's virtual devices */
+struct zone_map {
+    uint32_t zone_id;
+    uint32_t count;
+    uint8_t phys[DEVICES_MAX]; /* Virtual device -> GPU index */
+};
+
+static struct gpu_device gpus[DEVICES_MAX];
+static int gpu_count = 0;
+static cpu_set_t gpu_cpus[DEVICES_MAX];   /* CPUs local to each GPU (allowed ones) */
+static bool peer_access[DEVICES_MAX][DEVICES_MAX];
+
+static struct zone_map zone_maps[DEVICES_MAX_ZONES];
+static int zone_map_count = 0;
+
+static const char *policy_names[] = {
+    [PLACE_PACK] = "pack",
+    [PLACE_SPREAD] = "spread",
+    [PLACE_MEMORY] = "memory",
+};
+
+/**
+ * Print a driver error
+ */
+static void report(const char *call, CUresult res)
+{
+    const char *err_str;
+    cuGetErrorString(res, &err_str);
+    fprintf(stderr, "%s failed: %s\n", call, err_str);
+}
+
+/**
+ * Query everything guests may ask about a GPU
+ */
+static void query_props(struct gpu_device *gpu)
+{
+    struct idm_gpu_props *props = &gpu->props;
+    memset(props, 0, sizeof(*props));
+
+    memcpy(props->name, gpu->name, sizeof(props->name) - 1);
+    props->total_mem = gpu->total_mem;
+
+    CUuuid uuid;
+    if (cuDeviceGetUuid(&uuid, gpu->device) == CUDA_SUCCESS) {
+        memcpy(props->uuid, uuid.bytes, sizeof(props->uuid));
+    }
+
+    int version = 0;
+    if (cuDriverGetVersion(&version) == CUDA_SUCCESS) {
+        props->driver_version = version;
+    }
+
+    /* The driver rejects IDs it doesn't know; the guest does the same */
+    int valid = 0;
+    props->attr_count = IDM_PROPS_ATTR_MAX;
+    for (uint32_t attr = 1; attr < IDM_PROPS_ATTR_MAX; attr++) {
+        int value;
+        if (cuDeviceGetAttribute(&value, (CUdevice_attribute)attr, gpu->device) == CUDA_SUCCESS) {
+            props->attrs[attr] = value;
+            props->attr_valid[attr / 8] |= (uint8_t)(1u << (attr % 8));
+            valid++;
+        }
+    }
+
+    int major = 0, minor = 0;
+    idm_props_attr(props, CU_DEVICE_ATTRIBUTE_COMPUTE_CAPABILITY_MAJOR, &major);
+    idm_props_attr(props, CU_DEVICE_ATTRIBUTE_COMPUTE_CAPABILITY_MINOR, &minor);
+    printf("  Compute capability %d.%d, %d attribute(s)\n", major, minor, valid);
+}
+
+/**
+ * Parse a sysfs CPU list ("0-15,32-47") into a set
+ *
+ * @return CPUs in the set
+ */
+static int parse_cpu_list(const char *list, cpu_set_t *set)
+{
+    CPU_ZERO(set);
+
+    const char *p = list;
+    while (*p && *p != '\n') {
+        char *end;
+        long first = strtol(p, &end, 10);
+        long last = first;
+        if (end == p) {
+            break;
+        }
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+        }
+        for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+            CPU_SET((int)cpu, set);
+        }
+        p = (*end == ',') ? end + 1 : end;
+    }
+
+    return CPU_COUNT(set);
+}
+
+/**
+ * Find the NUMA node and CPUs next to a GPU's PCIe root
+ *
+ * Read from sysfs by PCI address. Without it (stub mode, containers
+ * without /sys, single-node machines) the node is unknown and every CPU
+ * the process may use counts as local.
+ */
+static void query_locality(int index)
+{
+    struct gpu_device *gpu = &gpus[index];
+    cpu_set_t *cpus = &gpu_cpus[index];
+
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+        CPU_ZERO(&allowed);
+    }
+
+    gpu->numa_node = -1;
+    *cpus = allowed;
+
+    int domain = 0, bus = 0, dev = 0;
+    idm_props_attr(&gpu->props, CU_DEVICE_ATTRIBUTE_PCI_DOMAIN_ID, &domain);
+    if (idm_props_attr(&gpu->props, CU_DEVICE_ATTRIBUTE_PCI_BUS_ID, &bus) &&
+        idm_props_attr(&gpu->props, CU_DEVICE_ATTRIBUTE_PCI_DEVICE_ID, &dev)) {
+        char path[128], buf[1024];
+
+        snprintf(path, sizeof(path), "/sys/bus/pci/devices/%04x:%02x:%02x.0/numa_node",
+                 domain, bus, dev);
+        FILE *f = fopen(path, "r");
+        if (f) {
+            if (fgets(buf, sizeof(buf), f)) {
+                gpu->numa_node = atoi(buf);
+            }
+            fclose(f);
+        }
+
+        snprintf(path, sizeof(path), "/sys/bus/pci/devices/%04x:%02x:%02x.0/local_cpulist",
+                 domain, bus, dev);
+        f = fopen(path, "r");
+        if (f) {
+            cpu_set_t local;
+            if (fgets(buf, sizeof(buf), f) && parse_cpu_list(buf, &local) > 0) {
+                CPU_AND(&local, &local, &allowed);
+                if (CPU_COUNT(&local) > 0) {
+                    *cpus = local;
+                }
+            }
+            fclose(f);
+        }
+    }
+
+    gpu->cpu_count = CPU_COUNT(cpus);
+    if (gpu->numa_node >= 0) {
+        printf("  NUMA node %d, %d local CPU(s)\n", gpu->numa_node, gpu->cpu_count);
+    }
+}
+
+/**
+ * Open one GPU
+ */
+static int open_gpu(struct gpu_device *gpu, int ordinal)
+{
+    CUresult res = cuDeviceGet(&gpu->device, ordinal);
+    if (res != CUDA_SUCCESS) {
+        report("cuDeviceGet", res);
+        return -ENODEV;
+    }
+
+    gpu->ordinal = ordinal;
+    if (cuDeviceGetName(gpu->name, sizeof(gpu->name), gpu->device) != CUDA_SUCCESS) {
+        snprintf(gpu->name, sizeof(gpu->name), "GPU %d", ordinal);
+    }
+    if (cuDeviceTotalMem(&gpu->total_mem, gpu->device) != CUDA_SUCCESS) {
+        gpu->total_mem = 0;
+    }
+
+    res = cuCtxCreate(&gpu->context, 0, gpu->device);
+    if (res != CUDA_SUCCESS) {
+        report("cuCtxCreate", res);
+        return -ENODEV;
+    }
+
+    printf("Using device %d: %s (%zu MB)\n", ordinal, gpu->name, gpu->total_mem >> 20);
+    query_props(gpu);
+    return 0;
+}
+
+/**
+ * Enable peer access between every pair of GPUs that supports it
+ */
+static void enable_peers(void)
+{
+    int pairs = 0;
+
+    for (int i = 0; i < gpu_count; i++) {
+        if (cuCtxSetCurrent(gpus[i].context) != CUDA_SUCCESS) {
+            continue;
+        }
+
+        for (int j = 0; j < gpu_count; j++) {
+            int can_access = 0;
+            if (i == j ||
+                cuDeviceCanAccessPeer(&can_access, gpus[i].device, gpus[j].device) != CUDA_SUCCESS ||
+                !can_access) {
+                continue;
+            }
+
+            CUresult res = cuCtxEnablePeerAccess(gpus[j].context, 0);
+            if (res == CUDA_SUCCESS || res == CUDA_ERROR_PEER_ACCESS_ALREADY_ENABLED) {
+                peer_access[i][j] = true;
+                pairs++;
+            } else {
+                report("cuCtxEnablePeerAccess", res);
+            }
+        }
+    }
+
+    if (gpu_count > 1) {
+        printf("Peer access: %d of %d GPU pair(s)\n", pairs, gpu_count * (gpu_count - 1));
+    }
+}
+
+/**
+ * Open GPUs and create their contexts
+ */
+int devices_init(const int *ordinals, int count)
+{
+    int available = 0;
+    CUresult res = cuDeviceGetCount(&available);
+    if (res != CUDA_SUCCESS) {
+        report("cuDeviceGetCount", res);
+        return -ENODEV;
+    }
+
+    if (available == 0) {
+        fprintf(stderr, "No CUDA devices found!\n");
+        return -ENODEV;
+    }
+
+    printf("Found %d CUDA device(s)\n", available);
+
+    if (!ordinals) {
+        count = available < DEVICES_MAX ? available : DEVICES_MAX;
+    }
+    if (count <= 0 || count > DEVICES_MAX) {
+        return -EINVAL;
+    }
+
+    gpu_count = 0;
+    for (int i = 0; i < count; i++) {
+        int ordinal = ordinals ? ordinals[i] : i;
+        if (ordinal < 0 || ordinal >= available) {
+            fprintf(stderr, "No CUDA device %d\n", ordinal);
+            return -ENODEV;
+        }
+
+        int ret = open_gpu(&gpus[gpu_count], ordinal);
+        if (ret < 0) {
+            return ret;
+        }
+        query_locality(gpu_count);
+        gpu_count++;
+    }
+
+    enable_peers();
+    return gpu_count;
+}
+
+/**
+ * Get a GPU by index
+ */
+const struct gpu_device *devices_get(int index)
+{
+    if (index < 0 || index >= gpu_count) {
+        return NULL;
+    }
+    return &gpus[index];
+}
+
+int devices_count(void)
+{
+    return gpu_count;
+}
+
+bool devices_peer(int from, int to)
+{
+    if (from < 0 || from >= gpu_count || to < 0 || to >= gpu_count) {
+        return false;
+    }
+    return peer_access[from][to];
+}
+
+/**
+ * Pin the calling thread next to a GPU
+ */
+int devices_bind_thread(int index, int slot)
+{
+    if (index < 0 || index >= gpu_count || gpus[index].cpu_count == 0) {
+        return -EINVAL;
+    }
+
+    cpu_set_t set = gpu_cpus[index];
+    int cpu = -1;
+
+    if (slot >= 0) {
+        /* The slot-th local CPU, wrapping around */
+        int want = slot % gpus[index].cpu_count;
+        for (int i = 0; i < CPU_SETSIZE; i++) {
+            if (CPU_ISSET(i, &set) && want-- == 0) {
+                cpu = i;
+                break;
+            }
+        }
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+    }
+
+    int ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (ret != 0) {
+        return -ret;
+    }
+
+    return slot >= 0 ? cpu : 0;
+}
+
+/**
+ * Parse a policy name
+ */
+int devices_parse_policy(const char *name, enum placement_policy *policy_out)
+{
+    for (size_t i = 0; i < sizeof(policy_names) / sizeof(policy_names[0]); i++) {
+        if (strcmp(name, policy_names[i]) == 0) {
+            *policy_out = (enum placement_policy)i;
+            return 0;
+        }
+    }
+    return -EINVAL;
+}
+
+const char *devices_policy_name(enum placement_policy policy)
+{
+    return policy <= PLACE_MEMORY ? policy_names[policy] : "unknown";
+}
+
+/**
+ * Whether a GPU is a better home for the next zone than another
+ */
+static bool better(enum placement_policy policy, uint64_t quota,
+                   const struct gpu_device *a, const struct gpu_device *b)
+{
+    switch (policy) {
+        case PLACE_PACK: {
+            /* Lowest index with room (b comes first, so only beat it if it's full) */
+            bool a_fits = !quota || a->committed + quota <= a->total_mem;
+            bool b_fits = !quota || b->committed + quota <= b->total_mem;
+            return a_fits && !b_fits;
+        }
+
+        case PLACE_SPREAD:
+            return a->zone_count < b->zone_count;
+
+        case PLACE_MEMORY: {
+            uint64_t a_free = a->total_mem > a->committed + quota ?
+                              a->total_mem - a->committed - quota : 0;
+            uint64_t b_free = b->total_mem > b->committed + quota ?
+                              b->total_mem - b->committed - quota : 0;
+            uint64_t a_share = a_free / (a->zone_count + 1);
+            uint64_t b_share = b_free / (b->zone_count + 1);
+            if (a_share != b_share) {
+                return a_share > b_share;
+            }
+            return a->zone_count < b->zone_count;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Place a zone on GPUs
+ */
+int devices_place(uint32_t zone_id, int want, enum placement_policy policy, uint64_t quota)
+{
+    if (gpu_count == 0) {
+        return -ENODEV;
+    }
+    if (zone_map_count == DEVICES_MAX_ZONES) {
+        return -ENOSPC;
+    }
+    if (devices_zone_count(zone_id) > 0) {
+        return -EEXIST;
+    }
+
+    if (want < 1) {
+        want = 1;
+    }
+    if (want > gpu_count) {
+        want = gpu_count;
+    }
+
+    struct zone_map *map = &zone_maps[zone_map_count];
+    bool taken[DEVICES_MAX] = {false};
+
+    map->zone_id = zone_id;
+    map->count = 0;
+
+    for (int n = 0; n < want; n++) {
+        int pick = -1;
+        for (int i = 0; i < gpu_count; i++) {
+            if (taken[i]) {
+                continue;
+            }
+            if (pick < 0 || better(policy, quota, &gpus[i], &gpus[pick])) {
+                pick = i;
+            }
+        }
+
+        taken[pick] = true;
+        gpus[pick].zone_count++;
+        gpus[pick].committed += quota;
+        map->phys[map->count++] = (uint8_t)pick;
+    }
+
+    zone_map_count++;
+    return (int)map->count;
+}
+
+/**
+ * Find a zone's map
+ */
+static const struct zone_map *zone_map_find(uint32_t zone_id)
+{
+    for (int i = 0; i < zone_map_count; i++) {
+        if (zone_maps[i].zone_id == zone_id) {
+            return &zone_maps[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Get a zone's virtual device count
+ */
+int devices_zone_count(uint32_t zone_id)
+{
+    const struct zone_map *map = zone_map_find(zone_id);
+    return map ? (int)map->count : 0;
+}
+
+/**
+ * Map a zone's virtual device to a GPU index
+ */
+int devices_physical(uint32_t zone_id, uint32_t vdev)
+{
+    const struct zone_map *map = zone_map_find(zone_id);
+    if (!map || vdev >= map->count) {
+        return -1;
+    }
+    return map->phys[vdev];
+}
+
+/**
+ * Forget placements and GPUs
+ */
+void devices_cleanup(void)
+{
+    memset(zone_maps, 0, sizeof(zone_maps));
+    zone_map_count = 0;
+    memset(gpus, 0, sizeof(gpus));
+    memset(gpu_cpus, 0, sizeof(gpu_cpus));
+    memset(peer_access, 0, sizeof(peer_access));
+    gpu_count = 0;
+}
@@ -0,0 +1,124 @@
+/*
+ * GPU Devices and Placement
+ *
+ * The proxy keeps one context per physical GPU it serves. Each zone is
+ * placed on one or more of them at startup; the guest sees those as its
+ * virtual devices 0..n-1, in placement order. A zone's first device is
+ * its home: the zone runs on a worker of that GPU's worker group.
+ *
+ * Placement policies:
+ * - PACK: fill the lowest-numbered GPU that still has room for the zone's
+ *   quota, leaving the others free (without a quota, everyone shares GPU 0)
+ * - SPREAD: the GPU with the fewest zones
+ * - MEMORY: the GPU with the most memory per zone once this one is added
+ *   (quota reservations count against it), so bigger GPUs take more zones
+ *
+ * GPUs that can reach each other directly (NVLink or PCIe peer to peer)
+ * get peer access both ways at startup, so copies between them and
+ * kernels touching the other's memory skip host memory.
+ *
+ * Each GPU's NUMA node and local CPUs (those next to its PCIe root) are
+ * looked up at startup, so threads serving it can be pinned there and
+ * the memory they first touch lands on that node.
+ *
+ * The zone map is written before workers start and read-only after.
+ */
+
+#ifndef DEVICES_H
+#define DEVICES_H
+
+#include "../idm-protocol/idm.h"
+
+#ifndef STUB_CUDA
+#include <cuda.h>
+#else
+#include "cuda_stub.h"
+#endif
+
+#define DEVICES_MAX IDM_MAX_DEVICES
+
+enum placement_policy {
+    PLACE_PACK = 0,
+    PLACE_SPREAD,
+    PLACE_MEMORY
+};
+
+/* A physical GPU */
+struct gpu_device {
+    int ordinal;               /* CUDA device ordinal */
+    CUdevice device;
+    CUcontext context;
+    char name[256];
+    size_t total_mem;
+    uint32_t zone_count;       /* Zones placed on it */
+    uint64_t committed;        /* Quota of those zones */
+    struct idm_gpu_props props; /* What guests are told about it (GET_PROPS) */
+    int numa_node;             /* Node of its PCIe root (-1 = unknown) */
+    int cpu_count;             /* CPUs local to it that we may run on */
+};
+
+/**
+ * Open GPUs and create their contexts
+ *
+ * @param ordinals CUDA ordinals to serve (NULL = every device)
+ * @param count Entries in ordinals
+ * @return Number of GPUs, or negative errno on failure
+ */
+int devices_init(const int *ordinals, int count);
+
+/**
+ * Get a GPU by index (0..devices_count()-1)
+ */
+const struct gpu_device *devices_get(int index);
+int devices_count(void);
+
+/**
+ * Whether GPU from has peer access to GPU to's memory (indices as for
+ * devices_get)
+ */
+bool devices_peer(int from, int to);
+
+/**
+ * Pin the calling thread next to a GPU
+ *
+ * @param slot Pin to the slot-th of the GPU's local CPUs (wrapping
+ *             around), or to all of them if negative
+ * @return CPU pinned to (slot >= 0) or 0, negative errno on failure
+ */
+int devices_bind_thread(int index, int slot);
+
+/**
+ * Parse a policy name ("pack", "spread", "memory")
+ *
+ * @return 0 on success, -EINVAL if unknown
+ */
+int devices_parse_policy(const char *name, enum placement_policy *policy_out);
+const char *devices_policy_name(enum placement_policy policy);
+
+/**
+ * Place a zone on GPUs
+ *
+ * @param want Virtual devices to give it (capped at the GPU count)
+ * @param quota Device bytes the zone may reserve (0 = unlimited)
+ * @return Devices placed on, or negative errno on failure
+ */
+int devices_place(uint32_t zone_id, int want, enum placement_policy policy, uint64_t quota);
+
+/**
+ * Get a zone's virtual device count (0 = not placed)
+ */
+int devices_zone_count(uint32_t zone_id);
+
+/**
+ * Map a zone's virtual device to a GPU index
+ *
+ * @return Index for devices_get, or -1 if the zone has no such device
+ */
+int devices_physical(uint32_t zone_id, uint32_t vdev);
+
+/**
+ * Forget placements and GPUs
+ */
+void devices_cleanup(void);
+
+#endif /* DEVICES_H */
@@ -0,0 +1,797 @@
+/*
+ * Request Dispatch Implementation
+ *
+ * A zone always maps to the same worker and has one FIFO there, which
+ * gives per-zone ordering without any per-request bookkeeping. It also
+ * means a connection's borrowed messages are released in the order they
+ * were peeked, as the transport requires. Each worker picks which of its
+ * zones goes next (see dispatch.h for the policy).
+ *
+ * Work items are recycled through a per-worker free list, so steady-state
+ * dispatch does not allocate.
+ */
+
+#include "dispatch.h"
+#include "stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+/* Forward declarations from transport.c */
+extern void idm_free_message(struct idm_message *msg);
+extern int idm_conn_release(struct idm_connection *conn, const struct idm_message *msg);
+
+/* Requests cost at most this much (bounds the rounds a turn can take) */
+#define MAX_COST (1ull << 30)
+
+/* Queued request */
+struct work_item {
+    const struct idm_message *msg;
+    struct idm_connection *conn;   /* Ring msg is borrowed from (NULL = heap) */
+    uint64_t enqueued_ns;          /* When it was submitted (stats) */
+    uint64_t cost;                 /* Scheduling cost (request_cost) */
+    enum dispatch_class cls;
+    struct work_item *next;
+};
+
+/* One zone's requests on its worker */
+struct zone_queue {
+    uint32_t zone_id;
+    enum dispatch_class cls;
+    int64_t quantum;               /* Cost granted per turn */
+    int64_t deficit;               /* Cost left to spend this turn */
+    bool turn;                     /* Quantum granted for current turn */
+    bool active;                   /* On its class's active list */
+    struct work_item *head;
+    struct work_item *tail;
+    struct zone_queue *next_active;
+    struct zone_queue *next;       /* All zones of the worker */
+};
+
+/* Zones of one class with requests waiting, in round robin order */
+struct active_list {
+    struct zone_queue *head;
+    struct zone_queue *tail;
+};
+
+/* Worker thread and its queues */
+struct worker {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct zone_queue *zones;
+    struct active_list active[DISPATCH_CLASSES];
+    struct work_item *free_items;  /* Recycled work items */
+    unsigned int latency_streak;   /* Latency picks since the last batch one */
+    uint64_t queued;       /* Items in queues */
+    uint64_t completed;    /* Items handled */
+    uint64_t class_completed[DISPATCH_CLASSES];
+    uint64_t held;         /* Waits for admission */
+    bool admit_wait;       /* Sleeping until running cost drops */
+    bool stopping;         /* Exit once queues are empty */
+    bool started;          /* Thread was created */
+};
+
+/* Class, weight and worker group of a zone */
+struct zone_config {
+    uint32_t zone_id;
+    enum dispatch_class cls;
+    unsigned int weight;
+    unsigned int group;
+};
+
+static struct worker *workers = NULL;
+static unsigned int worker_count = 0;
+static unsigned int group_count = 1;
+static dispatch_handler_fn handler_fn = NULL;
+static dispatch_thread_init_fn thread_init_fn = NULL;
+static dispatch_thread_exit_fn thread_exit_fn = NULL;
+
+/* Startup handshake: workers report whether thread_init succeeded */
+static pthread_mutex_t startup_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t startup_cond = PTHREAD_COND_INITIALIZER;
+static unsigned int workers_ready = 0;
+static unsigned int workers_failed = 0;
+
+/* Completions of workers already shut down (stats stay monotonic) */
+static uint64_t retired_completed = 0;
+static uint64_t retired_class_completed[DISPATCH_CLASSES];
+static uint64_t retired_held = 0;
+
+/* Scheduling configuration (set before dispatch_init, read-only after) */
+static struct zone_config zone_configs[DISPATCH_MAX_ZONES];
+static int zone_config_count = 0;
+static uint64_t admit_limit = DISPATCH_ADMIT_DEFAULT;
+
+/* Cost of requests running on all workers, and workers waiting for it to drop */
+static uint64_t running_cost = 0;
+static unsigned int admit_waiters = 0;
+
+/* ============================================================================
+ * Scheduling
+ * ============================================================================ */
+
+/**
+ * Find a zone's configuration
+ *
+ * @param create Add a default entry if there is none yet
+ */
+static struct zone_config *zone_config_get(uint32_t zone_id, bool create)
+{
+    for (int i = 0; i < zone_config_count; i++) {
+        if (zone_configs[i].zone_id == zone_id) {
+            return &zone_configs[i];
+        }
+    }
+
+    if (!create || zone_config_count == DISPATCH_MAX_ZONES) {
+        return NULL;
+    }
+
+    struct zone_config *cfg = &zone_configs[zone_config_count++];
+    cfg->zone_id = zone_id;
+    cfg->cls = DISPATCH_BATCH;
+    cfg->weight = 1;
+    cfg->group = 0;
+    return cfg;
+}
+
+/**
+ * Set a zone's class
+ */
+int dispatch_set_zone_class(uint32_t zone_id, enum dispatch_class cls)
+{
+    if (workers) {
+        return -EBUSY;
+    }
+    if (cls >= DISPATCH_CLASSES) {
+        return -EINVAL;
+    }
+
+    struct zone_config *cfg = zone_config_get(zone_id, true);
+    if (!cfg) {
+        return -ENOSPC;
+    }
+    cfg->cls = cls;
+    return 0;
+}
+
+/**
+ * Set a zone's weight
+ */
+int dispatch_set_zone_weight(uint32_t zone_id, unsigned int weight)
+{
+    if (workers) {
+        return -EBUSY;
+    }
+    if (weight == 0 || weight > 1024) {
+        return -EINVAL;
+    }
+
+    struct zone_config *cfg = zone_config_get(zone_id, true);
+    if (!cfg) {
+        return -ENOSPC;
+    }
+    cfg->weight = weight;
+    return 0;
+}
+
+/**
+ * Split workers into groups
+ */
+int dispatch_set_groups(unsigned int groups)
+{
+    if (workers) {
+        return -EBUSY;
+    }
+    if (groups == 0 || groups > DISPATCH_MAX_WORKERS) {
+        return -EINVAL;
+    }
+
+    group_count = groups;
+    return 0;
+}
+
+/**
+ * Put a zone in a worker group
+ */
+int dispatch_set_zone_group(uint32_t zone_id, unsigned int group)
+{
+    if (workers) {
+        return -EBUSY;
+    }
+    if (group >= group_count) {
+        return -EINVAL;
+    }
+
+    struct zone_config *cfg = zone_config_get(zone_id, true);
+    if (!cfg) {
+        return -ENOSPC;
+    }
+    cfg->group = group;
+    return 0;
+}
+
+/**
+ * Limit the cost of running requests batch work may start into
+ */
+void dispatch_set_admission(uint64_t max_cost)
+{
+    admit_limit = max_cost;
+}
+
+/**
+ * Estimate what a request costs: the host data it moves, plus a base
+ *
+ * Device-side work (D2D, memset, launches) is answered once queued, so
+ * it costs the proxy no more than any other small request.
+ */
+static uint64_t request_cost(uint16_t msg_type, const uint8_t *payload, size_t len)
+{
+    uint64_t cost = DISPATCH_BASE_COST;
+
+    switch (msg_type) {
+        case IDM_GPU_COPY_H2D:
+            if (len >= sizeof(struct idm_gpu_copy_h2d)) {
+                cost += ((const struct idm_gpu_copy_h2d *)payload)->size;
+            }
+            break;
+
+        case IDM_GPU_COPY_D2H:
+            if (len >= sizeof(struct idm_gpu_copy_d2h)) {
+                cost += ((const struct idm_gpu_copy_d2h *)payload)->size;
+            }
+            break;
+
+        case IDM_BATCH: {
+            if (len < sizeof(struct idm_batch)) {
+                break;
+            }
+            const struct idm_batch *batch = (const struct idm_batch *)payload;
+            size_t off = sizeof(*batch);
+            cost = 0;
+
+            for (uint32_t i = 0; i < batch->count && off + sizeof(struct idm_batch_cmd) <= len; i++) {
+                const struct idm_batch_cmd *cmd = (const struct idm_batch_cmd *)(payload + off);
+                size_t body = off + sizeof(*cmd);
+                if (cmd->payload_len > len - body || cmd->msg_type == IDM_BATCH) {
+                    break;
+                }
+                cost += request_cost(cmd->msg_type, payload + body, cmd->payload_len);
+                off += IDM_BATCH_CMD_SPACE(cmd->payload_len);
+            }
+
+            if (cost == 0) {
+                cost = DISPATCH_BASE_COST;
+            }
+            break;
+        }
+
+        default:
+            break;
+    }
+
+    return cost < MAX_COST ? cost : MAX_COST;
+}
+
+/**
+ * Start a batch request if it fits the admission limit (reserving its cost)
+ *
+ * One always fits when nothing is running, however large.
+ */
+static bool admit(uint64_t cost)
+{
+    uint64_t cur = __atomic_load_n(&running_cost, __ATOMIC_SEQ_CST);
+    do {
+        if (admit_limit && cur > 0 && cur + cost > admit_limit) {
+            return false;
+        }
+    } while (!__atomic_compare_exchange_n(&running_cost, &cur, cur + cost, false,
+                                          __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+    return true;
+}
+
+/**
+ * A request finished: drop its cost and wake workers waiting for admission
+ */
+static void release_cost(uint64_t cost)
+{
+    __atomic_fetch_sub(&running_cost, cost, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&admit_waiters, __ATOMIC_SEQ_CST) == 0) {
+        return;
+    }
+
+    for (unsigned int i = 0; i < worker_count; i++) {
+        struct worker *w = &workers[i];
+        pthread_mutex_lock(&w->lock);
+        if (w->admit_wait) {
+            pthread_cond_signal(&w->cond);
+        }
+        pthread_mutex_unlock(&w->lock);
+    }
+}
+
+/**
+ * Find (or add) a zone's queue on its worker (worker lock held)
+ */
+static struct zone_queue *zone_queue_get(struct worker *w, uint32_t zone_id)
+{
+    for (struct zone_queue *z = w->zones; z; z = z->next) {
+        if (z->zone_id == zone_id) {
+            return z;
+        }
+    }
+
+    struct zone_queue *z = calloc(1, sizeof(*z));
+    if (!z) {
+        return NULL;
+    }
+
+    const struct zone_config *cfg = zone_config_get(zone_id, false);
+    z->zone_id = zone_id;
+    z->cls = cfg ? cfg->cls : DISPATCH_BATCH;
+    z->quantum = (int64_t)(cfg ? cfg->weight : 1) * DISPATCH_QUANTUM;
+    z->next = w->zones;
+    w->zones = z;
+    return z;
+}
+
+/**
+ * Take the next request of a class, by deficit round robin (worker lock held)
+ *
+ * @param held [out] Set when the zone whose turn it is waits for admission
+ */
+static struct work_item *pick_class(struct worker *w, enum dispatch_class cls, bool *held)
+{
+    struct active_list *list = &w->active[cls];
+
+    while (list->head) {
+        struct zone_queue *z = list->head;
+        struct work_item *item = z->head;
+
+        if (!z->turn) {
+            z->deficit += z->quantum;
+            z->turn = true;
+        }
+
+        if ((int64_t)item->cost > z->deficit) {
+            if (list->head == list->tail) {
+                /* Alone in its class: nobody to take turns with */
+                z->deficit = (int64_t)item->cost;
+            } else {
+                /* Turn over; the deficit carries to the next round */
+                z->turn = false;
+                list->head = z->next_active;
+                z->next_active = NULL;
+                list->tail->next_active = z;
+                list->tail = z;
+                continue;
+            }
+        }
+
+        if (cls == DISPATCH_BATCH) {
+            if (!admit(item->cost)) {
+                *held = true;
+                return NULL;
+            }
+        } else {
+            __atomic_fetch_add(&running_cost, item->cost, __ATOMIC_SEQ_CST);
+        }
+
+        z->head = item->next;
+        if (!z->head) {
+            z->tail = NULL;
+        }
+        z->deficit -= (int64_t)item->cost;
+
+        /* Nothing left: off the list, and no saving up deficit while idle */
+        if (!z->head) {
+            list->head = z->next_active;
+            if (!list->head) {
+                list->tail = NULL;
+            }
+            z->next_active = NULL;
+            z->active = false;
+            z->turn = false;
+            z->deficit = 0;
+        }
+
+        return item;
+    }
+
+    return NULL;
+}
+
+/**
+ * Take the next request of any class (worker lock held)
+ *
+ * @param held [out] Set when batch work is waiting for admission
+ */
+static struct work_item *pick(struct worker *w, bool *held)
+{
+    *held = false;
+
+    /* Latency class first, unless batch work has waited a whole burst */
+    bool batch_turn = w->latency_streak >= DISPATCH_LATENCY_BURST;
+
+    struct work_item *item = batch_turn ? NULL : pick_class(w, DISPATCH_LATENCY, held);
+    if (!item) {
+        item = pick_class(w, DISPATCH_BATCH, held);
+        if (item) {
+            w->latency_streak = 0;
+            return item;
+        }
+    }
+    if (!item && batch_turn) {
+        item = pick_class(w, DISPATCH_LATENCY, held);
+    }
+
+    if (item) {
+        w->latency_streak = w->active[DISPATCH_BATCH].head ? w->latency_streak + 1 : 0;
+    }
+    return item;
+}
+
+/* ============================================================================
+ * Workers
+ * ============================================================================ */
+
+/**
+ * Pick worker for a zone (one of its group's)
+ */
+static struct worker *worker_for_zone(uint32_t zone_id)
+{
+    const struct zone_config *cfg = zone_config_get(zone_id, false);
+    unsigned int group = cfg ? cfg->group : 0;
+    unsigned int in_group = (worker_count - group + group_count - 1) / group_count;
+
+    return &workers[group + group_count * (zone_id % in_group)];
+}
+
+/**
+ * Give a handled (or dropped) message back to where it came from
+ */
+static void finish_message(struct work_item *item)
+{
+    if (item->conn) {
+        idm_conn_release(item->conn, item->msg);
+    } else {
+        idm_free_message((struct idm_message *)item->msg);
+    }
+}
+
+/**
+ * Worker main loop
+ */
+static void *worker_main(void *arg)
+{
+    struct worker *w = arg;
+    unsigned int group = (unsigned int)(w - workers) % group_count;
+    unsigned int index = (unsigned int)(w - workers) / group_count;
+
+    int init_ret = thread_init_fn ? thread_init_fn(group, index) : 0;
+
+    pthread_mutex_lock(&startup_lock);
+    if (init_ret < 0) {
+        workers_failed++;
+    }
+    workers_ready++;
+    pthread_cond_broadcast(&startup_cond);
+    pthread_mutex_unlock(&startup_lock);
+
+    if (init_ret < 0) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&w->lock);
+
+    for (;;) {
+        bool held;
+        struct work_item *item = pick(w, &held);
+
+        if (!item && held) {
+            /* Announce the wait before checking again, so the worker that
+             * lowers the running cost either lets us in now or wakes us */
+            w->admit_wait = true;
+            __atomic_fetch_add(&admit_waiters, 1, __ATOMIC_SEQ_CST);
+            item = pick(w, &held);
+            if (!item) {
+                w->held++;
+                pthread_cond_wait(&w->cond, &w->lock);
+            }
+            __atomic_fetch_sub(&admit_waiters, 1, __ATOMIC_SEQ_CST);
+            w->admit_wait = false;
+            if (!item) {
+                continue;
+            }
+        }
+
+        if (!item) {
+            if (w->stopping) {
+                break;  /* Stopping and drained */
+            }
+            pthread_cond_wait(&w->cond, &w->lock);
+            continue;
+        }
+
+        w->queued--;
+
+        pthread_mutex_unlock(&w->lock);
+
+        stats_note_queue(stats_now_ns() - item->enqueued_ns);
+        handler_fn(item->msg);
+        finish_message(item);
+        release_cost(item->cost);
+
+        pthread_mutex_lock(&w->lock);
+        item->next = w->free_items;
+        w->free_items = item;
+        w->completed++;
+        w->class_completed[item->cls]++;
+    }
+
+    pthread_mutex_unlock(&w->lock);
+
+    if (thread_exit_fn) {
+        thread_exit_fn();
+    }
+
+    return NULL;
+}
+
+/**
+ * Start worker pool
+ */
+int dispatch_init(unsigned int num_workers,
+                  dispatch_handler_fn handler,
+                  dispatch_thread_init_fn thread_init,
+                  dispatch_thread_exit_fn thread_exit)
+{
+    if (workers) {
+        return -EALREADY;
+    }
+
+    if (!handler) {
+        return -EINVAL;
+    }
+
+    if (num_workers == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        num_workers = cpus > 0 ? (unsigned int)cpus : 1;
+    }
+    if (num_workers < group_count) {
+        num_workers = group_count;
+    }
+    if (num_workers > DISPATCH_MAX_WORKERS) {
+        num_workers = DISPATCH_MAX_WORKERS;
+    }
+
+    workers = calloc(num_workers, sizeof(*workers));
+    if (!workers) {
+        return -ENOMEM;
+    }
+
+    worker_count = num_workers;
+    handler_fn = handler;
+    thread_init_fn = thread_init;
+    thread_exit_fn = thread_exit;
+    workers_ready = 0;
+    workers_failed = 0;
+
+    for (unsigned int i = 0; i < num_workers; i++) {
+        pthread_mutex_init(&workers[i].lock, NULL);
+        pthread_cond_init(&workers[i].cond, NULL);
+    }
+
+    unsigned int started = 0;
+    for (unsigned int i = 0; i < num_workers; i++) {
+        struct worker *w = &workers[i];
+        if (pthread_create(&w->thread, NULL, worker_main, w) != 0) {
+            fprintf(stderr, "Failed to start worker %u\n", i);
+            break;
+        }
+        w->started = true;
+        started++;
+    }
+
+    /* Wait for every started worker to finish its setup */
+    pthread_mutex_lock(&startup_lock);
+    while (workers_ready < started) {
+        pthread_cond_wait(&startup_cond, &startup_lock);
+    }
+    unsigned int failed = workers_failed;
+    pthread_mutex_unlock(&startup_lock);
+
+    if (started < num_workers || failed > 0) {
+        dispatch_shutdown();
+        return -EAGAIN;
+    }
+
+    if (group_count > 1) {
+        printf("Dispatch: %u worker(s) in %u groups\n", worker_count, group_count);
+    } else {
+        printf("Dispatch: %u worker(s)\n", worker_count);
+    }
+
+    return 0;
+}
+
+/**
+ * Queue message on its zone's worker
+ */
+int dispatch_submit(struct idm_connection *conn, const struct idm_message *msg)
+{
+    if (!workers) {
+        return -ENOTCONN;
+    }
+
+    struct worker *w = worker_for_zone(msg->header.src_zone);
+
+    pthread_mutex_lock(&w->lock);
+
+    if (w->stopping) {
+        pthread_mutex_unlock(&w->lock);
+        return -ESHUTDOWN;
+    }
+
+    struct zone_queue *z = zone_queue_get(w, msg->header.src_zone);
+    if (!z) {
+        pthread_mutex_unlock(&w->lock);
+        return -ENOMEM;
+    }
+
+    struct work_item *item = w->free_items;
+    if (item) {
+        w->free_items = item->next;
+    } else {
+        item = malloc(sizeof(*item));
+        if (!item) {
+            pthread_mutex_unlock(&w->lock);
+            return -ENOMEM;
+        }
+    }
+
+    item->msg = msg;
+    item->conn = conn;
+    item->enqueued_ns = stats_now_ns();
+    item->cost = request_cost(msg->header.msg_type, msg->payload, msg->header.payload_len);
+    item->cls = z->cls;
+    item->next = NULL;
+
+    if (z->tail) {
+        z->tail->next = item;
+    } else {
+        z->head = item;
+    }
+    z->tail = item;
+    w->queued++;
+
+    if (!z->active) {
+        struct active_list *list = &w->active[z->cls];
+        if (list->tail) {
+            list->tail->next_active = z;
+        } else {
+            list->head = z;
+        }
+        list->tail = z;
+        z->active = true;
+    }
+
+    pthread_cond_signal(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+
+    return 0;
+}
+
+/**
+ * Get statistics
+ */
+void dispatch_stats(unsigned int *workers_out, uint64_t *queued, uint64_t *completed)
+{
+    uint64_t total_queued = 0;
+    uint64_t total_completed = retired_completed;
+
+    for (unsigned int i = 0; i < worker_count; i++) {
+        struct worker *w = &workers[i];
+        pthread_mutex_lock(&w->lock);
+        total_queued += w->queued;
+        total_completed += w->completed;
+        pthread_mutex_unlock(&w->lock);
+    }
+
+    if (workers_out) {
+        *workers_out = worker_count;
+    }
+    if (queued) {
+        *queued = total_queued;
+    }
+    if (completed) {
+        *completed = total_completed;
+    }
+}
+
+/**
+ * Get scheduling statistics
+ */
+void dispatch_class_stats(uint64_t *completed, uint64_t *held)
+{
+    uint64_t total_held = retired_held;
+
+    for (int c = 0; c < DISPATCH_CLASSES; c++) {
+        completed[c] = retired_class_completed[c];
+    }
+
+    for (unsigned int i = 0; i < worker_count; i++) {
+        struct worker *w = &workers[i];
+        pthread_mutex_lock(&w->lock);
+        for (int c = 0; c < DISPATCH_CLASSES; c++) {
+            completed[c] += w->class_completed[c];
+        }
+        total_held += w->held;
+        pthread_mutex_unlock(&w->lock);
+    }
+
+    if (held) {
+        *held = total_held;
+    }
+}
+
+/**
+ * Drain queues and join workers
+ */
+void dispatch_shutdown(void)
+{
+    if (!workers) {
+        return;
+    }
+
+    for (unsigned int i = 0; i < worker_count; i++) {
+        struct worker *w = &workers[i];
+        pthread_mutex_lock(&w->lock);
+        w->stopping = true;
+        pthread_cond_signal(&w->cond);
+        pthread_mutex_unlock(&w->lock);
+    }
+
+    for (unsigned int i = 0; i < worker_count; i++) {
+        struct worker *w = &workers[i];
+        if (w->started) {
+            pthread_join(w->thread, NULL);
+        }
+
+        /* Workers that failed setup never drained their queues */
+        while (w->zones) {
+            struct zone_queue *z = w->zones;
+            while (z->head) {
+                struct work_item *item = z->head;
+                z->head = item->next;
+                finish_message(item);
+                free(item);
+            }
+            w->zones = z->next;
+            free(z);
+        }
+
+        while (w->free_items) {
+            struct work_item *item = w->free_items;
+            w->free_items = item->next;
+            free(item);
+        }
+
+        retired_completed += w->completed;
+        retired_held += w->held;
+        for (int c = 0; c < DISPATCH_CLASSES; c++) {
+            retired_class_completed[c] += w->class_completed[c];
+        }
+        pthread_mutex_destroy(&w->lock);
+        pthread_cond_destroy(&w->cond);
+    }
+
+    free(workers);
+    workers = NULL;
+    worker_count = 0;
+}
@@ -0,0 +1,140 @@
+/*
+ * Request Dispatch
+ *
+ * Hands received messages to a pool of worker threads.
+ *
+ * Ordering rules:
+ * - All requests from one zone run on the same worker, in arrival order
+ *   (guests rely on e.g. a copy finishing before the free behind it)
+ * - Different zones may run in parallel on different workers
+ *
+ * Workers may be split into groups (one per GPU): worker i belongs to
+ * group i % groups, and a zone runs on a worker of its group.
+ *
+ * Scheduling between zones that share a worker:
+ * - LATENCY zones (inference) go before BATCH zones (training, bulk
+ *   uploads); after DISPATCH_LATENCY_BURST latency requests in a row a
+ *   waiting batch request gets a turn, so batch work is never starved
+ * - Within a class, deficit round robin: each turn a zone may spend
+ *   weight * DISPATCH_QUANTUM of cost, where cost is the host data a
+ *   request moves plus DISPATCH_BASE_COST
+ * - Admission control: a batch request only starts while the cost of
+ *   all running requests (every worker) stays within the admission limit,
+ *   so bulk copies next to inference never saturate the copy path; one
+ *   always runs when nothing else is
+ */
+
+#ifndef DISPATCH_H
+#define DISPATCH_H
+
+#include "../idm-protocol/idm.h"
+
+/* Upper bound on worker count */
+#define DISPATCH_MAX_WORKERS 64
+
+/* Zones with their own class or weight */
+#define DISPATCH_MAX_ZONES 64
+
+/* Scheduling classes, served in this order */
+enum dispatch_class {
+    DISPATCH_LATENCY = 0,   /* Latency-sensitive (inference) */
+    DISPATCH_BATCH,         /* Throughput (training, bulk copies; default) */
+    DISPATCH_CLASSES
+};
+
+#define DISPATCH_QUANTUM        (1u << 20)   /* Cost per turn at weight 1 */
+#define DISPATCH_BASE_COST      4096         /* Cost of a request moving no data */
+#define DISPATCH_LATENCY_BURST  16           /* Latency picks before batch gets one */
+#define DISPATCH_ADMIT_DEFAULT  (64ull << 20)
+
+/**
+ * Runs one request (called on a worker thread)
+ */
+typedef void (*dispatch_handler_fn)(const struct idm_message *msg);
+
+/**
+ * Per-worker setup/teardown (called on the worker thread itself)
+ *
+ * @param group Worker's group (setup only)
+ * @param index Worker's index within its group (setup only)
+ * @return 0 on success (setup only)
+ */
+typedef int (*dispatch_thread_init_fn)(unsigned int group, unsigned int index);
+typedef void (*dispatch_thread_exit_fn)(void);
+
+/**
+ * Set a zone's class and weight (before dispatch_init)
+ *
+ * @param weight Share relative to other zones of its class (>= 1)
+ * @return 0 on success, negative errno on failure
+ */
+int dispatch_set_zone_class(uint32_t zone_id, enum dispatch_class cls);
+int dispatch_set_zone_weight(uint32_t zone_id, unsigned int weight);
+
+/**
+ * Split workers into groups, and put a zone in one (before dispatch_init)
+ *
+ * Zones not given a group are in group 0.
+ *
+ * @return 0 on success, negative errno on failure
+ */
+int dispatch_set_groups(unsigned int groups);
+int dispatch_set_zone_group(uint32_t zone_id, unsigned int group);
+
+/**
+ * Limit the cost of running requests batch work may start into
+ *
+ * @param max_cost Bytes (0 = no limit; default DISPATCH_ADMIT_DEFAULT)
+ */
+void dispatch_set_admission(uint64_t max_cost);
+
+/**
+ * Start worker pool
+ *
+ * @param num_workers Worker count (0 = one per online CPU; at least one
+ *                    per group)
+ * @param handler Called for every submitted message
+ * @param thread_init Called once on each worker before any request (optional)
+ * @param thread_exit Called once on each worker after the last request (optional)
+ * @return 0 on success, negative errno on failure
+ */
+int dispatch_init(unsigned int num_workers,
+                  dispatch_handler_fn handler,
+                  dispatch_thread_init_fn thread_init,
+                  dispatch_thread_exit_fn thread_exit);
+
+/**
+ * Queue message on its zone's worker
+ *
+ * Takes ownership: after the handler returns, a message borrowed from
+ * conn's ring (idm_conn_peek) is released back to it, a heap message
+ * (conn = NULL) is freed.
+ *
+ * @param conn Connection msg is borrowed from, or NULL
+ * @return 0 on success, negative errno on failure (message not consumed)
+ */
+int dispatch_submit(struct idm_connection *conn, const struct idm_message *msg);
+
+/**
+ * Get statistics
+ *
+ * @param workers [out] Number of workers (optional)
+ * @param queued [out] Requests waiting in queues (optional)
+ * @param completed [out] Requests handled so far (optional)
+ */
+void dispatch_stats(unsigned int *workers, uint64_t *queued, uint64_t *completed);
+
+/**
+ * Get scheduling statistics
+ *
+ * @param completed [out] Requests handled per class (DISPATCH_CLASSES entries)
+ * @param held [out] Times a batch request waited for admission (optional)
+ */
+void dispatch_class_stats(uint64_t *completed, uint64_t *held);
+
+/**
+ * Drain all queues, then stop and join workers
+ */
+void dispatch_shutdown(void);
+
+#endif /* DISPATCH_H */
@@ -0,0 +1,619 @@
+/*
+ * Device Memory Eviction Implementation
+ *
+ * An evicted allocation is a record with the allocation's non-zero pages,
+ * packed in page order. The handle's pointer becomes the record's address
+ * with bit 0 set (records are malloc'd, device memory is at least 256
+ * byte aligned, so neither ever has it set). All records are on one list,
+ * so a zone can find its own.
+ *
+ * Copies in either direction go through the calling thread's pinned
+ * staging buffer one chunk at a time; synchronous copies from and to
+ * pinned memory are complete when they return, so the buffer can be
+ * reused right away.
+ */
+
+#include "evict.h"
+#include "handle_table.h"
+#include "mem_pool.h"
+#include "devices.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+/* Zones that may own memory */
+#define EVICT_MAX_ZONE 0xFFFFu
+
+/* Pinned staging buffer per thread */
+#define STAGING_SIZE (4u << 20)
+
+/* Victims considered per zone per call */
+#define EVICT_CANDIDATES 64
+
+extern bool proxy_verbose;
+#define LOG(...) do { if (proxy_verbose) printf(__VA_ARGS__); } while (0)
+
+/* An evicted allocation */
+struct evicted {
+    uint32_t zone_id;
+    uint64_t handle;
+    int device;                /* Device it came from and goes back to */
+    size_t size;
+    uint32_t page_count;       /* Pages kept */
+    uint32_t *pages;           /* Their indices, ascending */
+    uint8_t *data;             /* Their contents, packed (last may be short) */
+    uint64_t host_bytes;       /* Bytes in data */
+    struct evicted *prev;
+    struct evicted *next;
+};
+
+/* A victim candidate */
+struct candidate {
+    uint32_t zone_id;
+    struct handle_cold cold;
+};
+
+static bool enabled = false;
+static uint64_t host_limit = 0;
+
+static pthread_mutex_t *exec_locks = NULL;     /* [EVICT_MAX_ZONE + 1] */
+static uint32_t zone_graphs[EVICT_MAX_ZONE + 1];
+
+static pthread_mutex_t list_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct evicted *evicted_head = NULL;
+
+/* Statistics */
+static uint64_t host_used = 0;
+static uint64_t evicted_bytes = 0;
+static uint64_t total_evictions = 0;
+static uint64_t total_restores = 0;
+
+static __thread uint8_t *staging = NULL;
+static __thread bool staging_pinned = false;
+
+#define ADD(p, v) __atomic_add_fetch((p), (v), __ATOMIC_RELAXED)
+#define SUB(p, v) __atomic_sub_fetch((p), (v), __ATOMIC_RELAXED)
+#define LOAD(p)   __atomic_load_n((p), __ATOMIC_RELAXED)
+
+static inline struct evicted *untag(void *ptr)
+{
+    return (struct evicted *)((uintptr_t)ptr & ~(uintptr_t)1);
+}
+
+static inline void *tag(struct evicted *rec)
+{
+    return (void *)((uintptr_t)rec | 1);
+}
+
+/**
+ * Get calling thread's staging buffer
+ */
+static uint8_t *staging_get(void)
+{
+    if (staging) {
+        return staging;
+    }
+
+    staging = malloc(STAGING_SIZE);
+    if (!staging) {
+        return NULL;
+    }
+
+    /* Pageable still works, just slower */
+    staging_pinned = cuMemHostRegister(staging, STAGING_SIZE,
+                                       CU_MEMHOSTREGISTER_PORTABLE) == CUDA_SUCCESS;
+    return staging;
+}
+
+/**
+ * Make a GPU's context current, remembering the one that was
+ */
+static CUresult enter_device(int device, CUcontext *saved)
+{
+    const struct gpu_device *gpu = devices_get(device);
+    if (!gpu) {
+        return CUDA_ERROR_INVALID_DEVICE;
+    }
+
+    CUresult res = cuCtxGetCurrent(saved);
+    if (res == CUDA_SUCCESS && *saved != gpu->context) {
+        res = cuCtxSetCurrent(gpu->context);
+    }
+    return res;
+}
+
+static void leave_device(int device, CUcontext saved)
+{
+    const struct gpu_device *gpu = devices_get(device);
+    if (gpu && saved != gpu->context) {
+        cuCtxSetCurrent(saved);
+    }
+}
+
+static bool all_zero(const uint8_t *p, size_t len)
+{
+    return p[0] == 0 && memcmp(p, p + 1, len - 1) == 0;
+}
+
+static void record_free(struct evicted *rec)
+{
+    free(rec->pages);
+    free(rec->data);
+    free(rec);
+}
+
+static void list_add(struct evicted *rec)
+{
+    pthread_mutex_lock(&list_lock);
+    rec->prev = NULL;
+    rec->next = evicted_head;
+    if (evicted_head) {
+        evicted_head->prev = rec;
+    }
+    evicted_head = rec;
+    pthread_mutex_unlock(&list_lock);
+}
+
+static void list_remove(struct evicted *rec)
+{
+    pthread_mutex_lock(&list_lock);
+    if (rec->prev) {
+        rec->prev->next = rec->next;
+    } else {
+        evicted_head = rec->next;
+    }
+    if (rec->next) {
+        rec->next->prev = rec->prev;
+    }
+    pthread_mutex_unlock(&list_lock);
+}
+
+/**
+ * Copy an allocation's non-zero pages to the host
+ *
+ * @return 0 on success, -ENOMEM (host budget or memory), -EIO (copy)
+ */
+static int copy_out(struct evicted *rec, CUdeviceptr src)
+{
+    uint8_t *buf = staging_get();
+    size_t max_pages = (rec->size + EVICT_PAGE_SIZE - 1) / EVICT_PAGE_SIZE;
+    size_t data_cap = 0;
+
+    rec->pages = malloc(max_pages * sizeof(*rec->pages));
+    if (!buf || !rec->pages) {
+        return -ENOMEM;
+    }
+
+    for (size_t off = 0; off < rec->size; off += STAGING_SIZE) {
+        size_t n = rec->size - off < STAGING_SIZE ? rec->size - off : STAGING_SIZE;
+        if (cuMemcpyDtoH(buf, src + off, n) != CUDA_SUCCESS) {
+            return -EIO;
+        }
+
+        for (size_t p = 0; p < n; p += EVICT_PAGE_SIZE) {
+            size_t len = n - p < EVICT_PAGE_SIZE ? n - p : EVICT_PAGE_SIZE;
+            if (all_zero(buf + p, len)) {
+                continue;
+            }
+
+            if (ADD(&host_used, len) > host_limit) {
+                SUB(&host_used, len);
+                return -ENOMEM;
+            }
+            rec->host_bytes += len;
+
+            if (rec->host_bytes > data_cap) {
+                size_t cap = data_cap ? data_cap * 2 : 4 * EVICT_PAGE_SIZE;
+                if (cap > max_pages * EVICT_PAGE_SIZE) {
+                    cap = max_pages * EVICT_PAGE_SIZE;
+                }
+                uint8_t *data = realloc(rec->data, cap);
+                if (!data) {
+                    return -ENOMEM;
+                }
+                rec->data = data;
+                data_cap = cap;
+            }
+
+            memcpy(rec->data + rec->host_bytes - len, buf + p, len);
+            rec->pages[rec->page_count++] = (uint32_t)((off + p) / EVICT_PAGE_SIZE);
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Copy an evicted allocation back to the device
+ */
+static CUresult copy_in(const struct evicted *rec, CUdeviceptr dst)
+{
+    uint8_t *buf = staging_get();
+    if (!buf) {
+        return CUDA_ERROR_OUT_OF_MEMORY;
+    }
+
+    uint32_t next = 0;
+    for (size_t off = 0; off < rec->size; off += STAGING_SIZE) {
+        size_t n = rec->size - off < STAGING_SIZE ? rec->size - off : STAGING_SIZE;
+
+        memset(buf, 0, n);
+        while (next < rec->page_count &&
+               (uint64_t)rec->pages[next] * EVICT_PAGE_SIZE < off + n) {
+            size_t page_off = (size_t)rec->pages[next] * EVICT_PAGE_SIZE;
+            size_t len = rec->size - page_off < EVICT_PAGE_SIZE ?
+                         rec->size - page_off : EVICT_PAGE_SIZE;
+            memcpy(buf + (page_off - off), rec->data + (size_t)next * EVICT_PAGE_SIZE, len);
+            next++;
+        }
+
+        CUresult res = cuMemcpyHtoD(dst + off, buf, n);
+        if (res != CUDA_SUCCESS) {
+            return res;
+        }
+    }
+
+    return CUDA_SUCCESS;
+}
+
+/**
+ * Evict one allocation of a zone that can't run meanwhile
+ *
+ * @return 0 on success, negative errno if it stays where it is
+ */
+static int evict_one(uint32_t zone_id, int device, const struct handle_cold *cold)
+{
+    struct evicted *rec = calloc(1, sizeof(*rec));
+    if (!rec) {
+        return -ENOMEM;
+    }
+    rec->zone_id = zone_id;
+    rec->handle = cold->handle;
+    rec->device = device;
+    rec->size = cold->size;
+
+    CUcontext saved;
+    CUresult res = enter_device(device, &saved);
+    if (res != CUDA_SUCCESS) {
+        free(rec);
+        return -EIO;
+    }
+
+    /* Work queued earlier may still use it (on any of the GPU's streams) */
+    int ret = cuCtxSynchronize() == CUDA_SUCCESS ? copy_out(rec, (CUdeviceptr)cold->ptr) : -EIO;
+    leave_device(device, saved);
+
+    if (ret == 0) {
+        /* Fails if the handle was freed or moved since it was listed */
+        ret = handle_table_swap_ptr(zone_id, HANDLE_TYPE_MEMORY, cold->handle,
+                                    cold->ptr, tag(rec));
+    }
+    if (ret < 0) {
+        SUB(&host_used, rec->host_bytes);
+        record_free(rec);
+        return ret;
+    }
+
+    if (rec->data) {
+        uint8_t *data = realloc(rec->data, rec->host_bytes);   /* Drop the slack */
+        if (data) {
+            rec->data = data;
+        }
+    }
+
+    mem_pool_free(zone_id, (CUdeviceptr)cold->ptr);
+    list_add(rec);
+    ADD(&evicted_bytes, rec->size);
+    ADD(&total_evictions, 1);
+
+    LOG("  Evicted zone %u's handle 0x%lx (%zu bytes, %lu on host, idle %u ms)\n",
+        zone_id, cold->handle, rec->size, rec->host_bytes, cold->idle_ms);
+    return 0;
+}
+
+/**
+ * Coldest first
+ */
+static int compare_idle(const void *a, const void *b)
+{
+    const struct candidate *ca = a;
+    const struct candidate *cb = b;
+    return (ca->cold.idle_ms < cb->cold.idle_ms) - (ca->cold.idle_ms > cb->cold.idle_ms);
+}
+
+/**
+ * List one zone's evictable allocations on a device
+ */
+static uint32_t add_candidates(uint32_t zone_id, int device, struct candidate *out, uint32_t max)
+{
+    if (LOAD(&zone_graphs[zone_id]) > 0) {
+        return 0;
+    }
+
+    struct handle_cold cold[EVICT_CANDIDATES];
+    uint32_t found = handle_table_cold(zone_id, HANDLE_TYPE_MEMORY, MEM_POOL_MAX_BLOCK + 1,
+                                       EVICT_MIN_IDLE_MS, cold, EVICT_CANDIDATES);
+    uint32_t count = 0;
+
+    for (uint32_t i = 0; i < found && count < max; i++) {
+        if (evict_is_evicted(cold[i].ptr) ||
+            mem_pool_device(zone_id, (CUdeviceptr)cold[i].ptr) != device) {
+            continue;
+        }
+        out[count].zone_id = zone_id;
+        out[count].cold = cold[i];
+        count++;
+    }
+
+    return count;
+}
+
+/* ============================================================================
+ * API
+ * ============================================================================ */
+
+/**
+ * Enable eviction
+ */
+int evict_init(uint64_t limit)
+{
+    if (limit == 0) {
+        return 0;
+    }
+
+    exec_locks = malloc((EVICT_MAX_ZONE + 1) * sizeof(*exec_locks));
+    if (!exec_locks) {
+        return -ENOMEM;
+    }
+    for (uint32_t i = 0; i <= EVICT_MAX_ZONE; i++) {
+        pthread_mutex_init(&exec_locks[i], NULL);
+    }
+
+    host_limit = limit;
+    enabled = true;
+
+    printf("Eviction: up to %lu MB of idle device memory to host memory\n",
+           (unsigned long)(limit >> 20));
+    return 0;
+}
+
+bool evict_enabled(void)
+{
+    return enabled;
+}
+
+void evict_zone_enter(uint32_t zone_id)
+{
+    if (enabled && zone_id <= EVICT_MAX_ZONE) {
+        pthread_mutex_lock(&exec_locks[zone_id]);
+    }
+}
+
+void evict_zone_exit(uint32_t zone_id)
+{
+    if (enabled && zone_id <= EVICT_MAX_ZONE) {
+        pthread_mutex_unlock(&exec_locks[zone_id]);
+    }
+}
+
+/**
+ * Evict cold memory until bytes more fit on a device
+ */
+uint64_t evict_make_room(uint32_t zone_id, int device, uint64_t bytes)
+{
+    if (!enabled || zone_id > EVICT_MAX_ZONE || LOAD(&host_used) >= host_limit) {
+        return 0;
+    }
+
+    /* Over quota, only freeing the zone's own memory helps */
+    uint64_t quota = mem_pool_zone_quota();
+    uint64_t reserved = 0;
+    mem_pool_zone_stats(zone_id, &reserved, NULL);
+    bool own_only = quota && reserved + bytes > quota;
+
+    uint32_t zones[256];
+    uint32_t zone_count = 1;
+    zones[0] = zone_id;
+    if (!own_only) {
+        zone_count = mem_pool_zones(zones, 256);
+    }
+
+    struct candidate *cands = malloc(zone_count * EVICT_CANDIDATES * sizeof(*cands));
+    if (!cands) {
+        return 0;
+    }
+
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < zone_count; i++) {
+        count += add_candidates(zones[i], device, cands + count, EVICT_CANDIDATES);
+    }
+    qsort(cands, count, sizeof(*cands), compare_idle);
+
+    uint64_t freed = 0;
+    for (uint32_t i = 0; i < count && freed < bytes; i++) {
+        uint32_t victim = cands[i].zone_id;
+
+        /* A zone that is running a request keeps its memory for now */
+        if (victim != zone_id && pthread_mutex_trylock(&exec_locks[victim]) != 0) {
+            continue;
+        }
+
+        if (LOAD(&zone_graphs[victim]) == 0 && evict_one(victim, device, &cands[i].cold) == 0) {
+            freed += (cands[i].cold.size + MEM_POOL_SLAB_SIZE - 1) &
+                     ~(uint64_t)(MEM_POOL_SLAB_SIZE - 1);
+        }
+
+        if (victim != zone_id) {
+            pthread_mutex_unlock(&exec_locks[victim]);
+        }
+    }
+
+    free(cands);
+    return freed;
+}
+
+/**
+ * Bring an evicted allocation back
+ */
+CUdeviceptr evict_restore(uint32_t zone_id, uint64_t handle, void *ptr)
+{
+    struct evicted *rec = untag(ptr);
+    if (rec->zone_id != zone_id || rec->handle != handle) {
+        return 0;
+    }
+
+    CUcontext saved;
+    if (enter_device(rec->device, &saved) != CUDA_SUCCESS) {
+        return 0;
+    }
+
+    CUdeviceptr dptr = 0;
+    CUresult res = mem_pool_alloc(zone_id, rec->device, rec->size, &dptr);
+    if (res == CUDA_ERROR_OUT_OF_MEMORY && evict_make_room(zone_id, rec->device, rec->size) > 0) {
+        res = mem_pool_alloc(zone_id, rec->device, rec->size, &dptr);
+    }
+    if (res == CUDA_SUCCESS) {
+        res = copy_in(rec, dptr);
+        if (res != CUDA_SUCCESS) {
+            mem_pool_free(zone_id, dptr);
+        }
+    }
+    leave_device(rec->device, saved);
+
+    if (res != CUDA_SUCCESS) {
+        LOG("  Zone %u: no room to restore handle 0x%lx (%zu bytes)\n",
+            zone_id, handle, rec->size);
+        return 0;
+    }
+
+    if (handle_table_swap_ptr(zone_id, HANDLE_TYPE_MEMORY, handle, ptr, (void *)dptr) < 0) {
+        mem_pool_free(zone_id, dptr);
+        return 0;
+    }
+
+    LOG("  Restored zone %u's handle 0x%lx (%zu bytes)\n", zone_id, handle, rec->size);
+
+    list_remove(rec);
+    SUB(&host_used, rec->host_bytes);
+    SUB(&evicted_bytes, rec->size);
+    ADD(&total_restores, 1);
+    record_free(rec);
+
+    return dptr;
+}
+
+/**
+ * Bring back all of a zone's evicted allocations
+ */
+int evict_restore_zone(uint32_t zone_id)
+{
+    if (!enabled) {
+        return 0;
+    }
+
+    for (;;) {
+        /* Only the zone itself adds or removes its records right now */
+        pthread_mutex_lock(&list_lock);
+        struct evicted *rec = evicted_head;
+        while (rec && rec->zone_id != zone_id) {
+            rec = rec->next;
+        }
+        pthread_mutex_unlock(&list_lock);
+
+        if (!rec) {
+            return 0;
+        }
+        if (evict_restore(zone_id, rec->handle, tag(rec)) == 0) {
+            return -ENOMEM;
+        }
+    }
+}
+
+/**
+ * Drop an evicted host copy
+ */
+void evict_discard(void *ptr)
+{
+    struct evicted *rec = untag(ptr);
+
+    list_remove(rec);
+    SUB(&host_used, rec->host_bytes);
+    SUB(&evicted_bytes, rec->size);
+    record_free(rec);
+}
+
+void evict_zone_graphs(uint32_t zone_id, int delta)
+{
+    if (zone_id <= EVICT_MAX_ZONE) {
+        __atomic_add_fetch(&zone_graphs[zone_id], (uint32_t)delta, __ATOMIC_RELAXED);
+    }
+}
+
+void evict_release_zone(uint32_t zone_id)
+{
+    if (zone_id <= EVICT_MAX_ZONE) {
+        __atomic_store_n(&zone_graphs[zone_id], 0, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Get statistics
+ */
+void evict_stats(uint64_t *evictions, uint64_t *restores,
+                 uint64_t *evicted_out, uint64_t *host_out)
+{
+    if (evictions) {
+        *evictions = LOAD(&total_evictions);
+    }
+    if (restores) {
+        *restores = LOAD(&total_restores);
+    }
+    if (evicted_out) {
+        *evicted_out = LOAD(&evicted_bytes);
+    }
+    if (host_out) {
+        *host_out = LOAD(&host_used);
+    }
+}
+
+/**
+ * Release calling thread's staging buffer
+ */
+void evict_thread_cleanup(void)
+{
+    if (!staging) {
+        return;
+    }
+    if (staging_pinned) {
+        cuMemHostUnregister(staging);
+    }
+    free(staging);
+    staging = NULL;
+    staging_pinned = false;
+}
+
+/**
+ * Free everything
+ */
+void evict_cleanup(void)
+{
+    while (evicted_head) {
+        struct evicted *rec = evicted_head;
+        evicted_head = rec->next;
+        record_free(rec);
+    }
+
+    if (exec_locks) {
+        for (uint32_t i = 0; i <= EVICT_MAX_ZONE; i++) {
+            pthread_mutex_destroy(&exec_locks[i]);
+        }
+        free(exec_locks);
+        exec_locks = NULL;
+    }
+
+    memset(zone_graphs, 0, sizeof(zone_graphs));
+    host_used = evicted_bytes = total_evictions = total_restores = 0;
+    enabled = false;
+}
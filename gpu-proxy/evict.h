@@ -0,0 +1,141 @@
+/*
+ * Device Memory Eviction
+ *
+ * Lets zones together hold more device memory than the GPUs have. When an
+ * allocation finds its device full, allocations no request has touched
+ * for EVICT_MIN_IDLE_MS are copied out to host memory (coldest first) and
+ * their device memory goes back to the pool. The handle stays valid: its
+ * pointer is swapped for a tagged pointer to the host copy, and the
+ * owner's next request that resolves it (a copy, fill or kernel launch)
+ * brings the data back first, possibly evicting something else.
+ *
+ * Host copies keep only the pages that aren't all zeros, in pageable
+ * memory, staged through a pinned buffer per worker; -E caps what they
+ * may use in total.
+ *
+ * Only allocations that have a segment of their own (larger than
+ * MEM_POOL_MAX_BLOCK) are evicted, so device memory really comes free.
+ * Never evicted:
+ * - Allocations shared with other zones (they may use it any time)
+ * - Memory of zones that hold graphs (graphs captured its address)
+ *
+ * A zone's requests run with its exec lock held (evict_zone_enter), and
+ * victims in other zones are taken only if their lock is free, so a
+ * zone's memory never moves while one of its requests runs. The idle
+ * threshold keeps memory resolved earlier in the current request from
+ * being picked as well.
+ */
+
+#ifndef EVICT_H
+#define EVICT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifndef STUB_CUDA
+#include <cuda.h>
+#else
+#include "cuda_stub.h"
+#endif
+
+/* Allocations idle for less are never evicted */
+#define EVICT_MIN_IDLE_MS 250
+
+/* Zero pages of this size aren't kept on the host */
+#define EVICT_PAGE_SIZE   (64u << 10)
+
+/**
+ * Enable eviction
+ *
+ * @param host_limit Most host bytes evicted data may use (0 = disabled)
+ * @return 0 on success, negative errno on failure
+ */
+int evict_init(uint64_t host_limit);
+
+/**
+ * Whether eviction is enabled
+ */
+bool evict_enabled(void);
+
+/**
+ * Take/release a zone's exec lock around one of its requests (no-op when
+ * disabled)
+ */
+void evict_zone_enter(uint32_t zone_id);
+void evict_zone_exit(uint32_t zone_id);
+
+/**
+ * Whether a handle's pointer refers to an evicted host copy
+ */
+static inline bool evict_is_evicted(const void *ptr)
+{
+    return ((uintptr_t)ptr & 1) != 0;
+}
+
+/**
+ * Evict cold memory until bytes more can be allocated on a device
+ *
+ * When the zone is at its quota, only its own memory is evicted.
+ * Must run in one of zone_id's requests.
+ *
+ * @param device Device index as for mem_pool_alloc
+ * @return Device bytes freed (0 if nothing could be evicted)
+ */
+uint64_t evict_make_room(uint32_t zone_id, int device, uint64_t bytes);
+
+/**
+ * Bring an evicted allocation back to its device
+ *
+ * Must run in one of zone_id's requests. Leaves the calling thread's
+ * current context as it found it.
+ *
+ * @param ptr Evicted pointer of the handle
+ * @return Device pointer, or 0 if no device memory could be found
+ */
+CUdeviceptr evict_restore(uint32_t zone_id, uint64_t handle, void *ptr);
+
+/**
+ * Bring back all of a zone's evicted allocations
+ *
+ * @return 0 on success, -ENOMEM if one couldn't be restored
+ */
+int evict_restore_zone(uint32_t zone_id);
+
+/**
+ * Drop an evicted host copy (its handle was freed)
+ */
+void evict_discard(void *ptr);
+
+/**
+ * Count a zone's graphs (delta +1/-1); its memory stays put while it has
+ * any
+ */
+void evict_zone_graphs(uint32_t zone_id, int delta);
+
+/**
+ * Forget a zone (after its handles were released)
+ */
+void evict_release_zone(uint32_t zone_id);
+
+/**
+ * Get statistics
+ *
+ * @param evictions [out] Allocations evicted so far (optional)
+ * @param restores [out] Allocations brought back so far (optional)
+ * @param evicted_bytes [out] Device bytes currently evicted (optional)
+ * @param host_bytes [out] Host bytes holding them (optional)
+ */
+void evict_stats(uint64_t *evictions, uint64_t *restores,
+                 uint64_t *evicted_bytes, uint64_t *host_bytes);
+
+/**
+ * Release calling thread's staging buffer
+ */
+void evict_thread_cleanup(void);
+
+/**
+ * Free everything (no other thread may evict any more)
+ */
+void evict_cleanup(void);
+
+#endif /* EVICT_H */
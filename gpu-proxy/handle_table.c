@@ -1,40 +1,235 @@
 /*
  * Handle Table Implementation
+ *
+ * Entries live in one preallocated slab (virtual reservation, pages are
+ * touched on first use). A handle encodes where its entry is:
+ *
+ *   bits 63..48  owner zone
+ *   bits 47..32  generation (bumped whenever the slot is reused, never 0)
+ *   bits 31..0   slot index
+ *
+ * so lookup is a single slab access. An entry's handle word is written
+ * last on insert and cleared first on remove; lookups read it before and
+ * after copying the fields and only trust the copy if it didn't change,
+ * so they never take a lock. Free slots sit on a lock-free stack whose
+ * head carries an ABA tag.
+ *
+ * Each zone's live entries are also on an intrusive doubly linked list
+ * (guarded by one of ZONE_LOCKS striped mutexes), so a zone can be torn
+ * down without scanning the slab.
+ *
+ * Grants are zone IDs stored one atomic word each and cleared before a
+ * handle is published, so a lookup that validates its handle afterwards
+ * never sees another handle's grants.
  */
 
 #include "handle_table.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
 
 /* Handle entry */
 struct handle_entry {
-    uint64_t handle;       /* Opaque handle */
+    uint64_t handle;       /* Handle stored here (0 = free) */
     uint32_t zone_id;      /* Owner zone */
-    void *ptr;             /* Real GPU pointer */
+    enum handle_type type; /* What ptr refers to */
+    void *ptr;             /* Real GPU pointer or driver object */
     size_t size;           /* Allocation size */
-    struct handle_entry *next;  /* Hash chain */
+    uint32_t next_free;    /* Free stack link (slot + 1, 0 = end) */
+    uint32_t zone_prev;    /* Zone list links (slot + 1, 0 = none) */
+    uint32_t zone_next;
+    uint16_t generation;   /* Generation of the current/last handle */
+    uint32_t grants[HANDLE_TABLE_MAX_GRANTS]; /* Zones sharing it (0 = unused) */
+    uint32_t last_use;     /* use_clock() of the last lookup */
 };
 
-/* Hash table */
-#define HASH_TABLE_SIZE 1024
-static struct handle_entry *hash_table[HASH_TABLE_SIZE];
-static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Slab capacity (live handles at once; must fit IDM_VA_SLOT_MASK) */
+#define HANDLE_TABLE_MAX_SLOTS (1u << 20)
 
-/* Next handle to allocate */
-static uint64_t next_handle = 1;
+/* Handle layout */
+#define HANDLE_ZONE_SHIFT 48
+#define HANDLE_GEN_SHIFT  32
+#define HANDLE_MAX_ZONE   0xFFFFu
+
+static inline uint32_t handle_slot(uint64_t handle)
+{
+    return (uint32_t)handle;
+}
+
+static inline uint32_t handle_zone(uint64_t handle)
+{
+    return (uint32_t)(handle >> HANDLE_ZONE_SHIFT);
+}
+
+static inline uint64_t make_handle(uint32_t zone_id, uint16_t gen, uint32_t slot)
+{
+    return ((uint64_t)zone_id << HANDLE_ZONE_SHIFT) |
+           ((uint64_t)gen << HANDLE_GEN_SHIFT) | slot;
+}
+
+/* Entry slab */
+static struct handle_entry *slab = NULL;
+
+/* Slots below this have been handed out at least once */
+static uint32_t slab_used = 0;
+
+/* Free stack head: ABA tag (high 32 bits) | top slot + 1 (low 32 bits) */
+static uint64_t free_head = 0;
 
 /* Statistics */
 static uint64_t total_handles = 0;
 static uint64_t total_memory = 0;
 
+/* Per-zone lists and totals (zone_locks[zone % ZONE_LOCKS]) */
+#define ZONE_LOCKS 64
+static pthread_mutex_t zone_locks[ZONE_LOCKS];
+static uint32_t zone_head[HANDLE_MAX_ZONE + 1];
+static uint64_t zone_handles[HANDLE_MAX_ZONE + 1];
+static uint64_t zone_memory[HANDLE_MAX_ZONE + 1];
+
+/* Relaxed/acquire/release helpers */
+#define LOAD(p)        __atomic_load_n((p), __ATOMIC_RELAXED)
+#define LOAD_ACQ(p)    __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define STORE(p, v)    __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+#define STORE_REL(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+/**
+ * Clock for last_use (milliseconds, wraps after 49 days; compare by
+ * subtraction)
+ */
+static inline uint32_t use_clock(void)
+{
+    struct timespec ts;
+#ifdef CLOCK_MONOTONIC_COARSE
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);    /* Lookups are hot; ms is plenty */
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    return (uint32_t)((uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+/**
+ * Resolve slot of a handle
+ *
+ * @return Entry, or NULL if the slot was never handed out
+ */
+static struct handle_entry *entry_for(uint64_t handle)
+{
+    uint32_t slot = handle_slot(handle);
+    if (!slab || slot >= LOAD_ACQ(&slab_used)) {
+        return NULL;
+    }
+    return &slab[slot];
+}
+
+/**
+ * Pop a free slot (or take a fresh one from the slab)
+ *
+ * @return Slot index, or -1 if the table is full
+ */
+static int64_t slot_alloc(void)
+{
+    uint64_t head = LOAD_ACQ(&free_head);
+
+    for (;;) {
+        uint32_t top = (uint32_t)head;
+        if (top == 0) {
+            break;
+        }
+
+        /* A stale next is harmless: the tag makes the CAS fail */
+        uint32_t next = LOAD(&slab[top - 1].next_free);
+        uint64_t new_head = ((head >> 32) + 1) << 32 | next;
+
+        if (__atomic_compare_exchange_n(&free_head, &head, new_head, true,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            return top - 1;
+        }
+    }
+
+    /* Free stack empty: extend into untouched slab */
+    uint32_t used = LOAD(&slab_used);
+    while (used < HANDLE_TABLE_MAX_SLOTS) {
+        if (__atomic_compare_exchange_n(&slab_used, &used, used + 1, true,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            return used;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * Push a slot onto the free stack
+ */
+static void slot_free(uint32_t slot)
+{
+    uint64_t head = LOAD(&free_head);
+    uint64_t new_head;
+
+    do {
+        STORE(&slab[slot].next_free, (uint32_t)head);
+        new_head = ((head >> 32) + 1) << 32 | (slot + 1);
+    } while (!__atomic_compare_exchange_n(&free_head, &head, new_head, true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/**
+ * Link entry at the head of its zone's list (zone lock held)
+ */
+static void zone_link_locked(uint32_t zone_id, uint32_t slot)
+{
+    struct handle_entry *entry = &slab[slot];
+
+    entry->zone_prev = 0;
+    entry->zone_next = zone_head[zone_id];
+    if (entry->zone_next) {
+        slab[entry->zone_next - 1].zone_prev = slot + 1;
+    }
+    zone_head[zone_id] = slot + 1;
+}
+
 /**
- * Hash function
+ * Unlink entry from its zone's list (zone lock held)
  */
-static uint32_t hash_handle(uint64_t handle)
+static void zone_unlink_locked(uint32_t zone_id, uint32_t slot)
 {
-    return (uint32_t)(handle % HASH_TABLE_SIZE);
+    struct handle_entry *entry = &slab[slot];
+
+    if (entry->zone_prev) {
+        slab[entry->zone_prev - 1].zone_next = entry->zone_next;
+    } else {
+        zone_head[zone_id] = entry->zone_next;
+    }
+    if (entry->zone_next) {
+        slab[entry->zone_next - 1].zone_prev = entry->zone_prev;
+    }
+    entry->zone_prev = 0;
+    entry->zone_next = 0;
+}
+
+/**
+ * Adjust global and zone totals (zone lock held)
+ */
+static void account_locked(uint32_t zone_id, enum handle_type type, size_t size, bool add)
+{
+    uint64_t bytes = type == HANDLE_TYPE_MEMORY ? size : 0;
+
+    if (add) {
+        zone_handles[zone_id]++;
+        zone_memory[zone_id] += bytes;
+        __atomic_fetch_add(&total_handles, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&total_memory, bytes, __ATOMIC_RELAXED);
+    } else {
+        zone_handles[zone_id]--;
+        zone_memory[zone_id] -= bytes;
+        __atomic_fetch_sub(&total_handles, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_sub(&total_memory, bytes, __ATOMIC_RELAXED);
+    }
 }
 
 /**
@@ -42,8 +237,25 @@ static uint32_t hash_handle(uint64_t handle)
  */
 int handle_table_init(void)
 {
-    memset(hash_table, 0, sizeof(hash_table));
-    next_handle = 1;
+    if (slab) {
+        return 0;
+    }
+
+    for (int i = 0; i < ZONE_LOCKS; i++) {
+        pthread_mutex_init(&zone_locks[i], NULL);
+    }
+
+    size_t bytes = (size_t)HANDLE_TABLE_MAX_SLOTS * sizeof(struct handle_entry);
+    void *mem = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mem == MAP_FAILED) {
+        fprintf(stderr, "Failed to reserve handle table: %s\n", strerror(errno));
+        return -1;
+    }
+
+    slab = mem;
+    slab_used = 0;
+    free_head = 0;
     total_handles = 0;
     total_memory = 0;
     return 0;
@@ -52,115 +264,361 @@ int handle_table_init(void)
 /**
  * Insert
  */
-uint64_t handle_table_insert(uint32_t zone_id, void *ptr, size_t size)
+uint64_t handle_table_insert(uint32_t zone_id, enum handle_type type, void *ptr, size_t size)
 {
-    if (!ptr) {
+    if (!ptr || !slab || zone_id > HANDLE_MAX_ZONE) {
         return 0;
     }
 
-    struct handle_entry *entry = malloc(sizeof(*entry));
-    if (!entry) {
+    int64_t slot = slot_alloc();
+    if (slot < 0) {
+        fprintf(stderr, "Handle table full (%u entries)\n", HANDLE_TABLE_MAX_SLOTS);
         return 0;
     }
 
-    pthread_mutex_lock(&table_lock);
+    struct handle_entry *entry = &slab[slot];
 
-    /* Allocate handle */
-    entry->handle = next_handle++;
-    entry->zone_id = zone_id;
-    entry->ptr = ptr;
-    entry->size = size;
+    /* Generation 0 is never used, so no handle is ever 0 */
+    uint16_t gen = (uint16_t)(entry->generation + 1);
+    if (gen == 0) {
+        gen = 1;
+    }
+
+    /* Lookups copying this slot's old fields must see the change */
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    STORE(&entry->zone_id, zone_id);
+    STORE(&entry->type, type);
+    STORE(&entry->ptr, ptr);
+    STORE(&entry->size, size);
+    for (int i = 0; i < HANDLE_TABLE_MAX_GRANTS; i++) {
+        STORE(&entry->grants[i], 0);
+    }
+    STORE(&entry->last_use, use_clock());
+    entry->generation = gen;
 
-    /* Insert into hash table */
-    uint32_t idx = hash_handle(entry->handle);
-    entry->next = hash_table[idx];
-    hash_table[idx] = entry;
+    /* Link and publish together, so a zone teardown sees all or nothing.
+     * Fields are visible before the handle is. */
+    uint64_t handle = make_handle(zone_id, gen, (uint32_t)slot);
 
-    /* Update stats */
-    total_handles++;
-    total_memory += size;
+    pthread_mutex_lock(&zone_locks[zone_id % ZONE_LOCKS]);
+    zone_link_locked(zone_id, (uint32_t)slot);
+    STORE_REL(&entry->handle, handle);
+    account_locked(zone_id, type, size, true);
+    pthread_mutex_unlock(&zone_locks[zone_id % ZONE_LOCKS]);
 
-    pthread_mutex_unlock(&table_lock);
+    return handle;
+}
 
-    return entry->handle;
+/**
+ * Whether an entry's owner granted zone_id access
+ */
+static bool granted(const struct handle_entry *entry, uint32_t zone_id)
+{
+    for (int i = 0; i < HANDLE_TABLE_MAX_GRANTS; i++) {
+        if (LOAD(&entry->grants[i]) == zone_id) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Report a handle that exists but belongs to another zone
+ */
+static void check_foreign(const struct handle_entry *entry, uint32_t zone_id,
+                          uint64_t handle, const char *what)
+{
+    const uint64_t zone_mask = (uint64_t)HANDLE_MAX_ZONE << HANDLE_ZONE_SHIFT;
+    uint64_t stored = LOAD_ACQ(&entry->handle);
+
+    /* Same slot and generation, different owner */
+    if (stored != 0 && (stored & ~zone_mask) == (handle & ~zone_mask) &&
+        handle_zone(stored) != zone_id) {
+        fprintf(stderr, "SECURITY: Zone %u tried to %s zone %u's handle 0x%lx!\n",
+                zone_id, what, handle_zone(stored), handle);
+    }
 }
 
 /**
  * Lookup
  */
-void *handle_table_lookup(uint32_t zone_id, uint64_t handle, size_t *size_out)
+void *handle_table_lookup(uint32_t zone_id, enum handle_type type, uint64_t handle, size_t *size_out)
 {
-    pthread_mutex_lock(&table_lock);
+    struct handle_entry *entry = entry_for(handle);
+    if (!entry) {
+        return NULL;  /* Not found */
+    }
 
-    uint32_t idx = hash_handle(handle);
-    struct handle_entry *entry = hash_table[idx];
+    if (LOAD_ACQ(&entry->handle) != handle) {
+        check_foreign(entry, zone_id, handle, "access");
+        return NULL;  /* Stale or forged */
+    }
 
-    while (entry) {
-        if (entry->handle == handle) {
-            /* Found - check ownership */
-            if (entry->zone_id != zone_id) {
-                fprintf(stderr, "SECURITY: Zone %u tried to access zone %u's handle 0x%lx!\n",
-                        zone_id, entry->zone_id, handle);
-                pthread_mutex_unlock(&table_lock);
-                return NULL;
-            }
+    /* The zone is part of the handle: another zone's handle only matches
+     * if its owner shared it */
+    bool allowed = handle_zone(handle) == zone_id || granted(entry, zone_id);
 
-            void *ptr = entry->ptr;
-            if (size_out) {
-                *size_out = entry->size;
-            }
+    enum handle_type entry_type = LOAD(&entry->type);
+    void *ptr = LOAD(&entry->ptr);
+    size_t size = LOAD(&entry->size);
 
-            pthread_mutex_unlock(&table_lock);
-            return ptr;
+    /* Entry unchanged while we copied it? */
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (LOAD(&entry->handle) != handle || entry_type != type) {
+        return NULL;
+    }
+    if (!allowed) {
+        check_foreign(entry, zone_id, handle, "access");
+        return NULL;
+    }
+
+    /* Written only when it changes, so hot handles stay clean in cache */
+    uint32_t now = use_clock();
+    if (LOAD(&entry->last_use) != now) {
+        STORE(&entry->last_use, now);
+    }
+
+    if (size_out) {
+        *size_out = size;
+    }
+
+    return ptr;
+}
+
+/**
+ * Lookup by slot
+ */
+void *handle_table_lookup_slot(uint32_t zone_id, enum handle_type type, uint32_t slot,
+                               uint64_t *handle_out, size_t *size_out)
+{
+    if (!slab || slot >= LOAD_ACQ(&slab_used)) {
+        return NULL;
+    }
+
+    /* Whatever lives there now; lookup re-validates it */
+    uint64_t handle = LOAD_ACQ(&slab[slot].handle);
+    if (handle == 0 || (handle_zone(handle) != zone_id && !granted(&slab[slot], zone_id))) {
+        return NULL;
+    }
+
+    void *ptr = handle_table_lookup(zone_id, type, handle, size_out);
+    if (ptr && handle_out) {
+        *handle_out = handle;
+    }
+    return ptr;
+}
+
+/**
+ * Share a handle with other zones
+ */
+int handle_table_grant(uint32_t zone_id, enum handle_type type, uint64_t handle,
+                       const uint32_t *zones, uint32_t count)
+{
+    if (count > HANDLE_TABLE_MAX_GRANTS || (count && !zones)) {
+        return -EINVAL;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        if (zones[i] == 0 || zones[i] == zone_id || zones[i] > HANDLE_MAX_ZONE) {
+            return -EINVAL;
         }
-        entry = entry->next;
     }
 
-    pthread_mutex_unlock(&table_lock);
-    return NULL;  /* Not found */
+    struct handle_entry *entry = entry_for(handle);
+    if (!entry || handle_zone(handle) != zone_id || LOAD_ACQ(&entry->handle) != handle) {
+        if (entry) {
+            check_foreign(entry, zone_id, handle, "share");
+        }
+        return -ENOENT;
+    }
+    if (LOAD(&entry->type) != type) {
+        return -ENOENT;
+    }
+
+    /* Only the owner grants or removes, and a zone's requests run one at
+     * a time, so the handle stays live while we write */
+    for (uint32_t i = 0; i < HANDLE_TABLE_MAX_GRANTS; i++) {
+        STORE_REL(&entry->grants[i], i < count ? zones[i] : 0);
+    }
+
+    return 0;
+}
+
+/**
+ * Get the zone that owns a handle
+ */
+uint32_t handle_table_owner(uint64_t handle)
+{
+    return handle_zone(handle);
+}
+
+/**
+ * Point an owned handle at another object
+ */
+int handle_table_swap_ptr(uint32_t zone_id, enum handle_type type, uint64_t handle,
+                          void *old_ptr, void *new_ptr)
+{
+    struct handle_entry *entry = entry_for(handle);
+    if (!entry || !new_ptr || handle_zone(handle) != zone_id ||
+        LOAD_ACQ(&entry->handle) != handle || LOAD(&entry->type) != type) {
+        return -ENOENT;
+    }
+
+    if (!__atomic_compare_exchange_n(&entry->ptr, &old_ptr, new_ptr, false,
+                                     __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        return -EAGAIN;
+    }
+    return 0;
+}
+
+/**
+ * List a zone's idle, unshared handles
+ */
+uint32_t handle_table_cold(uint32_t zone_id, enum handle_type type, size_t min_size,
+                           uint32_t min_idle_ms, struct handle_cold *out, uint32_t max)
+{
+    if (!slab || zone_id > HANDLE_MAX_ZONE) {
+        return 0;
+    }
+
+    uint32_t now = use_clock();
+    uint32_t count = 0;
+
+    pthread_mutex_lock(&zone_locks[zone_id % ZONE_LOCKS]);
+
+    for (uint32_t cur = zone_head[zone_id]; cur && count < max; cur = slab[cur - 1].zone_next) {
+        struct handle_entry *entry = &slab[cur - 1];
+        uint64_t handle = LOAD_ACQ(&entry->handle);
+        uint32_t idle = now - LOAD(&entry->last_use);
+
+        if (handle == 0 || entry->type != type || entry->size < min_size ||
+            idle < min_idle_ms || LOAD(&entry->grants[0]) != 0) {
+            continue;
+        }
+
+        out[count++] = (struct handle_cold){
+            .handle = handle, .ptr = LOAD(&entry->ptr), .size = entry->size, .idle_ms = idle
+        };
+    }
+
+    pthread_mutex_unlock(&zone_locks[zone_id % ZONE_LOCKS]);
+
+    return count;
 }
 
 /**
  * Remove
  */
-void *handle_table_remove(uint32_t zone_id, uint64_t handle)
+void *handle_table_remove(uint32_t zone_id, enum handle_type type, uint64_t handle)
 {
-    pthread_mutex_lock(&table_lock);
+    struct handle_entry *entry = entry_for(handle);
+    if (!entry) {
+        return NULL;  /* Not found */
+    }
 
-    uint32_t idx = hash_handle(handle);
-    struct handle_entry **ptr = &hash_table[idx];
-    struct handle_entry *entry;
+    if (handle_zone(handle) != zone_id || LOAD_ACQ(&entry->handle) != handle) {
+        check_foreign(entry, zone_id, handle, "free");
+        return NULL;
+    }
+
+    if (LOAD(&entry->type) != type) {
+        return NULL;
+    }
 
-    while ((entry = *ptr) != NULL) {
-        if (entry->handle == handle) {
-            /* Found - check ownership */
-            if (entry->zone_id != zone_id) {
-                fprintf(stderr, "SECURITY: Zone %u tried to free zone %u's handle 0x%lx!\n",
-                        zone_id, entry->zone_id, handle);
-                pthread_mutex_unlock(&table_lock);
-                return NULL;
-            }
+    /* Claim the entry; only one remover can win */
+    uint64_t expected = handle;
+    if (!__atomic_compare_exchange_n(&entry->handle, &expected, 0, false,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        return NULL;
+    }
+
+    void *gpu_ptr = LOAD(&entry->ptr);
+    size_t size = LOAD(&entry->size);
 
-            /* Remove from chain */
-            *ptr = entry->next;
+    pthread_mutex_lock(&zone_locks[zone_id % ZONE_LOCKS]);
+    zone_unlink_locked(zone_id, handle_slot(handle));
+    account_locked(zone_id, type, size, false);
+    pthread_mutex_unlock(&zone_locks[zone_id % ZONE_LOCKS]);
 
-            void *gpu_ptr = entry->ptr;
-            size_t size = entry->size;
+    slot_free(handle_slot(handle));
 
-            /* Update stats */
-            total_handles--;
-            total_memory -= size;
+    return gpu_ptr;
+}
 
-            free(entry);
+/**
+ * Remove every handle a zone owns
+ */
+uint64_t handle_table_release_zone(uint32_t zone_id, handle_release_fn release)
+{
+    if (!slab || zone_id > HANDLE_MAX_ZONE) {
+        return 0;
+    }
 
-            pthread_mutex_unlock(&table_lock);
-            return gpu_ptr;
+    /* Claim everything under the lock, run callbacks after dropping it */
+    uint32_t claimed = 0;  /* Claimed slots, linked through next_free */
+    uint64_t count = 0;
+
+    pthread_mutex_lock(&zone_locks[zone_id % ZONE_LOCKS]);
+
+    uint32_t cur = zone_head[zone_id];
+    while (cur) {
+        uint32_t slot = cur - 1;
+        struct handle_entry *entry = &slab[slot];
+        cur = entry->zone_next;
+
+        /* A concurrent remove that already claimed it unlinks it itself */
+        uint64_t handle = LOAD_ACQ(&entry->handle);
+        if (handle == 0 ||
+            !__atomic_compare_exchange_n(&entry->handle, &handle, 0, false,
+                                         __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            continue;
         }
-        ptr = &entry->next;
+
+        zone_unlink_locked(zone_id, slot);
+        account_locked(zone_id, entry->type, entry->size, false);
+
+        entry->next_free = claimed;
+        claimed = slot + 1;
+        count++;
+    }
+
+    pthread_mutex_unlock(&zone_locks[zone_id % ZONE_LOCKS]);
+
+    while (claimed) {
+        uint32_t slot = claimed - 1;
+        struct handle_entry *entry = &slab[slot];
+        claimed = entry->next_free;
+
+        if (release) {
+            release(entry->type, entry->ptr, entry->size);
+        }
+        slot_free(slot);
+    }
+
+    return count;
+}
+
+/**
+ * Get one zone's statistics
+ */
+void handle_table_zone_stats(uint32_t zone_id, uint64_t *handles_out, uint64_t *memory_out)
+{
+    uint64_t handles = 0;
+    uint64_t memory = 0;
+
+    if (zone_id <= HANDLE_MAX_ZONE) {
+        pthread_mutex_lock(&zone_locks[zone_id % ZONE_LOCKS]);
+        handles = zone_handles[zone_id];
+        memory = zone_memory[zone_id];
+        pthread_mutex_unlock(&zone_locks[zone_id % ZONE_LOCKS]);
     }
 
-    pthread_mutex_unlock(&table_lock);
-    return NULL;  /* Not found */
+    if (handles_out) {
+        *handles_out = handles;
+    }
+    if (memory_out) {
+        *memory_out = memory;
+    }
 }
 
 /**
@@ -168,36 +626,29 @@ void *handle_table_remove(uint32_t zone_id, uint64_t handle)
  */
 void handle_table_stats(uint64_t *total_handles_out, uint64_t *total_memory_out)
 {
-    pthread_mutex_lock(&table_lock);
     if (total_handles_out) {
-        *total_handles_out = total_handles;
+        *total_handles_out = LOAD(&total_handles);
     }
     if (total_memory_out) {
-        *total_memory_out = total_memory;
+        *total_memory_out = LOAD(&total_memory);
     }
-    pthread_mutex_unlock(&table_lock);
 }
 
 /**
- * Cleanup
+ * Cleanup (no other thread may use the table any more)
  */
 void handle_table_cleanup(void)
 {
-    pthread_mutex_lock(&table_lock);
-
-    for (int i = 0; i < HASH_TABLE_SIZE; i++) {
-        struct handle_entry *entry = hash_table[i];
-        while (entry) {
-            struct handle_entry *next = entry->next;
-            free(entry);
-            entry = next;
-        }
-        hash_table[i] = NULL;
+    if (slab) {
+        munmap(slab, (size_t)HANDLE_TABLE_MAX_SLOTS * sizeof(struct handle_entry));
+        slab = NULL;
     }
 
-    next_handle = 1;
+    slab_used = 0;
+    free_head = 0;
     total_handles = 0;
     total_memory = 0;
-
-    pthread_mutex_unlock(&table_lock);
+    memset(zone_head, 0, sizeof(zone_head));
+    memset(zone_handles, 0, sizeof(zone_handles));
+    memset(zone_memory, 0, sizeof(zone_memory));
 }
@@ -8,6 +8,16 @@
  * - User zones never see real GPU pointers
  * - Prevents cross-zone memory access
  * - Prevents pointer forgery attacks
+ *
+ * Handles encode (zone, generation, slot), so a stale handle never finds a
+ * reused slot. All functions are thread-safe; lookups don't lock.
+ *
+ * Every lookup stamps the entry's last use (coarse milliseconds), so cold
+ * memory can be found for eviction.
+ *
+ * An owner can grant other zones access to a handle (cross-zone sharing):
+ * lookups from a granted zone succeed as for the owner, while remove and
+ * grant stay owner-only. Grants die with the handle.
  */
 
 #ifndef HANDLE_TABLE_H
@@ -17,6 +27,25 @@
 #include <stddef.h>
 #include <stdbool.h>
 
+/**
+ * Handle types
+ *
+ * Lookups are type-checked, so a zone can't pass a stream handle where a
+ * device pointer is expected (or vice versa).
+ */
+enum handle_type {
+    HANDLE_TYPE_MEMORY = 1,    /* CUdeviceptr */
+    HANDLE_TYPE_STREAM = 2,    /* CUstream */
+    HANDLE_TYPE_EVENT  = 3,    /* CUevent */
+    HANDLE_TYPE_MODULE = 4,    /* Loaded module (proxy-side object) */
+    HANDLE_TYPE_FUNCTION = 5,  /* Kernel and its parameter layout */
+    HANDLE_TYPE_GRAPH = 6,     /* CUgraphExec */
+    HANDLE_TYPE_HOST = 7,      /* Pinned guest host region (proxy-side object) */
+};
+
+/* Zones one handle can be shared with */
+#define HANDLE_TABLE_MAX_GRANTS 8
+
 /**
  * Initialize handle table
  */
@@ -26,36 +55,121 @@ int handle_table_init(void);
  * Insert new allocation
  *
  * @param zone_id Owner zone ID
- * @param ptr Real GPU pointer (CUdeviceptr)
- * @param size Size of allocation
+ * @param type Handle type
+ * @param ptr Real GPU pointer (CUdeviceptr) or driver object
+ * @param size Size of allocation (0 for non-memory objects)
  * @return Opaque handle (>0 on success, 0 on error)
  */
-uint64_t handle_table_insert(uint32_t zone_id, void *ptr, size_t size);
+uint64_t handle_table_insert(uint32_t zone_id, enum handle_type type, void *ptr, size_t size);
 
 /**
- * Lookup handle and validate ownership
+ * Lookup handle and validate ownership (or a grant)
  *
  * @param zone_id Requesting zone ID
+ * @param type Expected handle type
  * @param handle Opaque handle
  * @param size_out [out] Size of allocation (optional)
- * @return Real GPU pointer, or NULL if invalid/not owned
+ * @return Real GPU pointer, or NULL if invalid/not owned/wrong type
+ */
+void *handle_table_lookup(uint32_t zone_id, enum handle_type type, uint64_t handle, size_t *size_out);
+
+/**
+ * Lookup whatever handle currently occupies a slot (device addresses
+ * carry the slot, not the whole handle)
+ *
+ * @param handle_out [out] Handle found there (optional)
+ * @return As handle_table_lookup
+ */
+void *handle_table_lookup_slot(uint32_t zone_id, enum handle_type type, uint32_t slot,
+                               uint64_t *handle_out, size_t *size_out);
+
+/**
+ * Share a handle with other zones
+ *
+ * Replaces the handle's grants; count 0 revokes them all. Lookups running
+ * concurrently may still see the old list.
+ *
+ * @param zone_id Owner zone ID
+ * @param zones Zones to grant (the owner may not be listed)
+ * @param count Entries in zones (<= HANDLE_TABLE_MAX_GRANTS)
+ * @return 0 on success, -EINVAL for a bad list, -ENOENT if invalid/not
+ *         owned/wrong type
+ */
+int handle_table_grant(uint32_t zone_id, enum handle_type type, uint64_t handle,
+                       const uint32_t *zones, uint32_t count);
+
+/**
+ * Get the zone that owns a handle (which needn't be live)
  */
-void *handle_table_lookup(uint32_t zone_id, uint64_t handle, size_t *size_out);
+uint32_t handle_table_owner(uint64_t handle);
 
 /**
- * Remove handle (for cudaFree)
+ * Point an owned handle at another object, if it still refers to old
+ * (memory moved by eviction)
+ *
+ * Lookups running concurrently may still return the old pointer, so the
+ * caller must keep everyone who could look the handle up out meanwhile.
+ *
+ * @return 0 on success, -ENOENT if invalid/not owned/wrong type, -EAGAIN
+ *         if it refers to something else
+ */
+int handle_table_swap_ptr(uint32_t zone_id, enum handle_type type, uint64_t handle,
+                          void *old_ptr, void *new_ptr);
+
+/* A handle that hasn't been looked up for a while */
+struct handle_cold {
+    uint64_t handle;
+    void *ptr;
+    size_t size;
+    uint32_t idle_ms;      /* Since its last lookup */
+};
+
+/**
+ * List a zone's handles of a type that are idle and not shared
+ *
+ * @param min_size Skip smaller ones
+ * @param min_idle_ms Skip ones looked up more recently
+ * @return Entries written to out (at most max, in no particular order)
+ */
+uint32_t handle_table_cold(uint32_t zone_id, enum handle_type type, size_t min_size,
+                           uint32_t min_idle_ms, struct handle_cold *out, uint32_t max);
+
+/**
+ * Remove handle (for cudaFree, stream/event destroy)
  *
  * @param zone_id Requesting zone ID
+ * @param type Expected handle type
  * @param handle Opaque handle
- * @return Real GPU pointer, or NULL if invalid/not owned
+ * @return Real GPU pointer, or NULL if invalid/not owned/wrong type
  */
-void *handle_table_remove(uint32_t zone_id, uint64_t handle);
+void *handle_table_remove(uint32_t zone_id, enum handle_type type, uint64_t handle);
 
 /**
- * Get statistics
+ * Called for each handle released with its zone
+ */
+typedef void (*handle_release_fn)(enum handle_type type, void *ptr, size_t size);
+
+/**
+ * Remove every handle a zone owns (guest went away)
+ *
+ * Cost is proportional to the zone's handle count, not the table size.
+ *
+ * @param zone_id Zone to tear down
+ * @param release Frees the underlying object (optional)
+ * @return Number of handles released
+ */
+uint64_t handle_table_release_zone(uint32_t zone_id, handle_release_fn release);
+
+/**
+ * Get statistics (total_memory counts HANDLE_TYPE_MEMORY only)
  */
 void handle_table_stats(uint64_t *total_handles, uint64_t *total_memory);
 
+/**
+ * Get one zone's statistics (memory counts HANDLE_TYPE_MEMORY only)
+ */
+void handle_table_zone_stats(uint32_t zone_id, uint64_t *handles, uint64_t *memory);
+
 /**
  * Cleanup
  */
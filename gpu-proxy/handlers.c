@@ -6,56 +6,192 @@
 
 #include "../idm-protocol/idm.h"
 #include "handle_table.h"
+#include "mem_pool.h"
+#include "devices.h"
+#include "evict.h"
+#include "stats.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <time.h>
 
 #ifndef STUB_CUDA
 #include <cuda.h>
 #else
-/* Stub CUDA types and results */
-typedef unsigned long long CUdeviceptr;
-typedef int CUresult;
-#define CUDA_SUCCESS 0
+#include "cuda_stub.h"
+#endif
 
-static inline CUresult cuMemAlloc(CUdeviceptr *ptr, size_t size) {
-    *ptr = (CUdeviceptr)malloc(size);
-    return *ptr ? CUDA_SUCCESS : 1;
-}
+/* Forward declarations from transport.c */
+extern struct idm_connection *idm_conn_lookup(uint32_t remote_zone_id);
+extern struct idm_message *idm_conn_reserve(struct idm_connection *conn,
+                                            enum idm_msg_type msg_type, size_t payload_len);
+extern int idm_conn_commit(struct idm_connection *conn, struct idm_message *msg);
+extern void *idm_conn_bulk_region(struct idm_connection *conn, size_t *size_out);
+extern void *idm_conn_region_map(struct idm_connection *conn, uint32_t region_id, size_t size,
+                                 const uint32_t *grefs);
+extern void idm_conn_region_unmap(struct idm_connection *conn, uint32_t region_id, void *addr,
+                                  size_t size);
+
+/* Per-request logging, off unless the proxy runs with -v (from main.c) */
+extern bool proxy_verbose;
+#define LOG(...) do { if (proxy_verbose) printf(__VA_ARGS__); } while (0)
+
+/* A guest host region mapped here and pinned (HANDLE_TYPE_HOST) */
+struct proxy_host_region {
+    struct idm_connection *conn;
+    void *addr;
+    size_t size;
+    uint32_t region_id;
+};
 
-static inline CUresult cuMemFree(CUdeviceptr ptr) {
-    free((void *)ptr);
-    return CUDA_SUCCESS;
+/**
+ * Resolve a range of a zone's bulk region
+ *
+ * @return Pointer to size bytes at bulk_offset, or NULL if out of bounds
+ */
+static uint8_t *bulk_range(uint32_t zone_id, uint64_t bulk_offset, uint64_t size)
+{
+    size_t bulk_size = 0;
+    uint8_t *bulk = idm_conn_bulk_region(idm_conn_lookup(zone_id), &bulk_size);
+    if (!bulk || bulk_offset > bulk_size || size > bulk_size - bulk_offset) {
+        return NULL;
+    }
+    return bulk + bulk_offset;
 }
 
-static inline CUresult cuMemcpyHtoD(CUdeviceptr dst, const void *src, size_t size) {
-    memcpy((void *)dst, src, size);
-    return CUDA_SUCCESS;
-}
+/**
+ * Resolve a range of one of a zone's host regions
+ *
+ * @param addr idm_va_of_handle(region handle) + offset (IDM_COPY_HOST)
+ * @return Pointer to size bytes at addr, or NULL if out of bounds
+ */
+static uint8_t *host_range(uint32_t zone_id, uint64_t addr, uint64_t size)
+{
+    if (!idm_va_valid(addr)) {
+        return NULL;
+    }
 
-static inline CUresult cuMemcpyDtoH(void *dst, CUdeviceptr src, size_t size) {
-    memcpy(dst, (void *)src, size);
-    return CUDA_SUCCESS;
+    size_t region_size;
+    struct proxy_host_region *region = handle_table_lookup_slot(
+        zone_id, HANDLE_TYPE_HOST, idm_va_slot(addr), NULL, &region_size);
+    uint64_t offset = addr & IDM_VA_OFFSET_MASK;
+    if (!region || offset > region_size || size > region_size - offset) {
+        return NULL;
+    }
+    return (uint8_t *)region->addr + offset;
 }
 
-static inline CUresult cuCtxSynchronize(void) {
-    return CUDA_SUCCESS;
+/**
+ * Resolve host side of a copy (inline payload, bulk or host region)
+ *
+ * @return Pointer to req_size bytes of host data, or NULL if out of bounds
+ */
+static const uint8_t *copy_host_data(
+    const struct idm_message *msg,
+    size_t hdr_len,
+    uint32_t flags,
+    uint64_t bulk_offset,
+    uint64_t size)
+{
+    if (flags & IDM_COPY_BULK) {
+        return bulk_range(msg->header.src_zone, bulk_offset, size);
+    }
+    if (flags & IDM_COPY_HOST) {
+        return host_range(msg->header.src_zone, bulk_offset, size);
+    }
+
+    /* Inline: data follows the request struct (read the length once,
+     * the message may still be in the sender's ring slot) */
+    size_t payload_len = msg->header.payload_len;
+    if (payload_len > IDM_ENTRY_PAYLOAD_MAX || payload_len < hdr_len ||
+        size > payload_len - hdr_len) {
+        return NULL;
+    }
+    return (const uint8_t *)msg->payload + hdr_len;
 }
+/* ============================================================================
+ * Batch Response Capture
+ *
+ * While a BATCH runs, responses produced on the dispatching thread are
+ * collected here and go back as one RESPONSE_BATCH. Responses sent from
+ * other threads (stream completion callbacks) bypass it.
+ * ============================================================================ */
+
+struct batch_sink {
+    uint32_t count;
+    struct idm_batch_result results[IDM_BATCH_MAX_CMDS];
+};
+
+static __thread struct batch_sink *batch_sink;
+
+/**
+ * Record a response in the active batch
+ *
+ * @return true if captured (caller must not send it)
+ */
+static bool batch_capture(uint64_t request_seq, uint64_t result_handle,
+                          uint32_t result_value, uint32_t error_code,
+                          uint32_t cuda_error)
+{
+    struct batch_sink *sink = batch_sink;
+    if (!sink || sink->count >= IDM_BATCH_MAX_CMDS) {
+        return false;
+    }
 
-static inline CUresult cuGetErrorString(CUresult error, const char **pStr) {
-    *pStr = "stub error";
-    return CUDA_SUCCESS;
+    struct idm_batch_result *res = &sink->results[sink->count++];
+    res->request_seq = request_seq;
+    res->result_handle = result_handle;
+    res->result_value = result_value;
+    res->error_code = error_code;
+    res->cuda_error = cuda_error;
+    res->reserved = 0;
+
+    return true;
 }
-#endif
 
-/* Forward declarations from transport.c */
-extern struct idm_message *idm_build_message(uint32_t dst_zone, enum idm_msg_type msg_type,
-                                              const void *payload, size_t payload_len);
-extern int idm_send(struct idm_message *msg);
-extern void idm_free_message(struct idm_message *msg);
+/* ============================================================================
+ * Responses
+ *
+ * Responses are built in place in the zone's TX ring slot (reserve, fill,
+ * commit), so replying needs no allocation and no extra copy.
+ * ============================================================================ */
+
+/**
+ * Send a RESPONSE_OK (result handle or 32-bit value, optional data)
+ */
+static int send_ok(uint32_t dst_zone, uint64_t request_seq,
+                   uint64_t result_handle, uint32_t result_value,
+                   const void *data, size_t data_len)
+{
+    uint64_t t0 = stats_now_ns();
+    struct idm_connection *conn = idm_conn_lookup(dst_zone);
+    struct idm_message *msg = idm_conn_reserve(conn, IDM_RESPONSE_OK,
+                                               sizeof(struct idm_response_ok) + data_len);
+    if (!msg) {
+        return -1;
+    }
+
+    struct idm_response_ok *resp = (struct idm_response_ok *)msg->payload;
+    memset(resp, 0, sizeof(*resp));
+    resp->request_seq = request_seq;
+    resp->result_handle = result_handle;
+    resp->result_value = result_value;
+    resp->data_len = data_len;
+    if (data_len > 0) {
+        memcpy(resp + 1, data, data_len);
+    }
+
+    int ret = idm_conn_commit(conn, msg);
+    stats_add(STATS_SEND, stats_now_ns() - t0);
+    return ret;
+}
 
 /**
  * Send success response
+ *
+ * Responses with data don't fit a batch result and always go out on
+ * their own.
  */
 static int send_response_ok(
     uint32_t dst_zone,
@@ -64,65 +200,337 @@ static int send_response_ok(
     const void *data,
     size_t data_len)
 {
-    struct idm_response_ok resp;
-    memset(&resp, 0, sizeof(resp));
+    if (data_len == 0 &&
+        batch_capture(request_seq, result_handle, 0, IDM_ERROR_NONE, 0)) {
+        return 0;
+    }
+
+    return send_ok(dst_zone, request_seq, result_handle, 0, data, data_len);
+}
 
-    resp.request_seq = request_seq;
-    resp.result_handle = result_handle;
-    resp.result_value = 0;
-    resp.data_len = data_len;
+/**
+ * Send error response
+ */
+static int send_response_error(
+    uint32_t dst_zone,
+    uint64_t request_seq,
+    enum idm_error error_code,
+    uint32_t cuda_error,
+    const char *error_msg)
+{
+    stats_error();
 
-    /* For now, no additional data support */
-    struct idm_message *msg = idm_build_message(
-        dst_zone,
-        IDM_RESPONSE_OK,
-        &resp,
-        sizeof(resp)
-    );
+    if (batch_capture(request_seq, 0, 0, error_code, cuda_error)) {
+        return 0;
+    }
 
+    uint64_t t0 = stats_now_ns();
+    struct idm_connection *conn = idm_conn_lookup(dst_zone);
+    struct idm_message *msg = idm_conn_reserve(conn, IDM_RESPONSE_ERROR,
+                                               sizeof(struct idm_response_error));
     if (!msg) {
         return -1;
     }
 
-    int ret = idm_send(msg);
-    idm_free_message(msg);
+    struct idm_response_error *resp = (struct idm_response_error *)msg->payload;
+    memset(resp, 0, sizeof(*resp));
+    resp->request_seq = request_seq;
+    resp->error_code = error_code;
+    resp->cuda_error = cuda_error;
+    strncpy(resp->error_msg, error_msg, sizeof(resp->error_msg) - 1);
 
+    int ret = idm_conn_commit(conn, msg);
+    stats_add(STATS_SEND, stats_now_ns() - t0);
     return ret;
 }
 
 /**
- * Send error response
+ * Send success response carrying a 32-bit result value
  */
-static int send_response_error(
+static int send_response_value(
     uint32_t dst_zone,
     uint64_t request_seq,
-    enum idm_error error_code,
-    uint32_t cuda_error,
-    const char *error_msg)
+    uint32_t result_value)
+{
+    if (batch_capture(request_seq, 0, result_value, IDM_ERROR_NONE, 0)) {
+        return 0;
+    }
+
+    return send_ok(dst_zone, request_seq, 0, result_value, NULL, 0);
+}
+
+/**
+ * Send error response for a failed CUDA call
+ */
+static void send_cuda_error(uint32_t dst_zone, uint64_t request_seq,
+                            CUresult res, const char *what)
 {
-    struct idm_response_error resp;
-    memset(&resp, 0, sizeof(resp));
+    const char *err_str;
+    cuGetErrorString(res, &err_str);
+    fprintf(stderr, "  %s failed: %s\n", what, err_str);
+
+    char error_msg[128];
+    snprintf(error_msg, sizeof(error_msg), "%s failed", what);
+    send_response_error(dst_zone, request_seq, IDM_ERROR_CUDA_ERROR, res, error_msg);
+}
 
-    resp.request_seq = request_seq;
-    resp.error_code = error_code;
-    resp.cuda_error = cuda_error;
-    strncpy(resp.error_msg, error_msg, sizeof(resp.error_msg) - 1);
+/* ============================================================================
+ * Stream Completion
+ *
+ * Stream-ordered requests are answered from a host function enqueued
+ * behind the work, so the response means "done on the GPU".
+ * ============================================================================ */
 
-    struct idm_message *msg = idm_build_message(
-        dst_zone,
-        IDM_RESPONSE_ERROR,
-        &resp,
-        sizeof(resp)
-    );
+struct stream_completion {
+    uint32_t zone_id;
+    uint64_t seq;
+};
 
-    if (!msg) {
+static void CUDA_CB stream_completion_cb(void *arg)
+{
+    struct stream_completion *done = arg;
+    send_response_ok(done->zone_id, done->seq, 0, NULL, 0);
+    free(done);
+}
+
+/**
+ * Respond once all work currently queued on stream has finished
+ */
+static void respond_when_done(CUstream stream, uint32_t zone_id, uint64_t seq)
+{
+    struct stream_completion *done = malloc(sizeof(*done));
+    if (done) {
+        done->zone_id = zone_id;
+        done->seq = seq;
+        if (cuLaunchHostFunc(stream, stream_completion_cb, done) == CUDA_SUCCESS) {
+            return;
+        }
+        free(done);
+    }
+
+    /* Couldn't enqueue the callback: wait inline instead */
+    CUresult res = STATS_CUDA_CALL(cuStreamSynchronize(stream));
+    if (res != CUDA_SUCCESS) {
+        send_cuda_error(zone_id, seq, res, "cuStreamSynchronize");
+        return;
+    }
+    send_response_ok(zone_id, seq, 0, NULL, 0);
+}
+
+/* ============================================================================
+ * Worker Thread State
+ *
+ * Handlers run on dispatch workers. Each worker starts with its group's
+ * GPU context current and switches when a request names another of the
+ * zone's devices. Per GPU it has its own non-blocking stream, which stands
+ * in for a zone's default stream so zones on different workers never
+ * serialize on the legacy NULL stream. The streams are created when the
+ * worker starts, before any guest shows up.
+ * ============================================================================ */
+
+static __thread int worker_device = -1;    /* GPU whose context is current */
+static __thread CUstream worker_streams[DEVICES_MAX];
+
+/**
+ * Make a GPU's context current (creating this thread's stream for it)
+ */
+static CUresult use_device(int device)
+{
+    if (device == worker_device) {
+        return CUDA_SUCCESS;
+    }
+
+    const struct gpu_device *gpu = devices_get(device);
+    if (!gpu) {
+        return CUDA_ERROR_INVALID_DEVICE;
+    }
+
+    CUresult res = cuCtxSetCurrent(gpu->context);
+    if (res == CUDA_SUCCESS && !worker_streams[device]) {
+        res = cuStreamCreateWithPriority(&worker_streams[device], CU_STREAM_NON_BLOCKING, 0);
+    }
+    if (res == CUDA_SUCCESS) {
+        worker_device = device;
+    }
+
+    return res;
+}
+
+/**
+ * Prepare calling thread to run handlers
+ */
+int handlers_thread_init(int device)
+{
+    /* Another GPU failing here is retried on its first request */
+    for (int i = 0; i < devices_count(); i++) {
+        if (i != device) {
+            use_device(i);
+        }
+    }
+
+    CUresult res = use_device(device);
+
+    if (res != CUDA_SUCCESS) {
+        const char *err_str;
+        cuGetErrorString(res, &err_str);
+        fprintf(stderr, "Worker CUDA setup failed: %s\n", err_str);
         return -1;
     }
 
-    int ret = idm_send(msg);
-    idm_free_message(msg);
+    return 0;
+}
 
-    return ret;
+/**
+ * Release calling thread's handler state
+ */
+void handlers_thread_cleanup(void)
+{
+    for (int i = 0; i < DEVICES_MAX; i++) {
+        if (worker_streams[i]) {
+            cuStreamSynchronize(worker_streams[i]);
+            cuStreamDestroy(worker_streams[i]);
+            worker_streams[i] = NULL;
+        }
+    }
+    worker_device = -1;
+    evict_thread_cleanup();
+}
+
+/**
+ * Switch to the GPU behind the virtual device a request names
+ *
+ * @return true to run the request; false if it was answered with an error
+ */
+bool handlers_enter_device(const struct idm_message *msg)
+{
+    uint32_t zone_id = msg->header.src_zone;
+    uint32_t vdev = idm_header_device(&msg->header);
+
+    /* Teardown spans all of the zone's devices */
+    if (msg->header.msg_type == IDM_DISCONNECT) {
+        return true;
+    }
+
+    int device = devices_physical(zone_id, vdev);
+    CUresult res = device < 0 ? CUDA_ERROR_INVALID_DEVICE : use_device(device);
+    if (res != CUDA_SUCCESS) {
+        LOG("[%s] Zone %u: no device %u\n",
+            idm_msg_type_str(msg->header.msg_type), zone_id, vdev);
+        send_response_error(zone_id, msg->header.seq_num, IDM_ERROR_CUDA_ERROR, res,
+                            "Invalid device");
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Resolve stream handle (0 = this worker's default stream)
+ *
+ * @return true if stream_out is valid
+ */
+static bool lookup_stream(uint32_t zone_id, uint64_t handle, CUstream *stream_out)
+{
+    if (handle == 0) {
+        *stream_out = worker_streams[worker_device];
+        return true;
+    }
+
+    *stream_out = handle_table_lookup(zone_id, HANDLE_TYPE_STREAM, handle, NULL);
+    return *stream_out != NULL;
+}
+
+/**
+ * Finish resolving a memory handle: bring it back if it was evicted
+ */
+static void *memory_resident(uint32_t zone_id, uint64_t handle, void *ptr,
+                             enum idm_error *err_out, const char **what)
+{
+    if (ptr && evict_is_evicted(ptr)) {
+        ptr = (void *)evict_restore(zone_id, handle, ptr);
+        if (!ptr) {
+            *err_out = IDM_ERROR_OUT_OF_MEMORY;
+            *what = "Out of device memory";
+            return NULL;
+        }
+    }
+
+    if (!ptr) {
+        *err_out = IDM_ERROR_INVALID_HANDLE;
+        *what = "Invalid handle";
+    }
+    return ptr;
+}
+
+/**
+ * Resolve a memory handle to its device pointer
+ *
+ * @return Pointer, or NULL with *err_out and *what set
+ */
+static void *memory_lookup(uint32_t zone_id, uint64_t handle, size_t *size_out,
+                           enum idm_error *err_out, const char **what)
+{
+    void *ptr = handle_table_lookup(zone_id, HANDLE_TYPE_MEMORY, handle, size_out);
+    return memory_resident(zone_id, handle, ptr, err_out, what);
+}
+
+/**
+ * Resolve a memory handle by slot (guest device address)
+ */
+static void *memory_lookup_slot(uint32_t zone_id, uint32_t slot, size_t *size_out,
+                                enum idm_error *err_out, const char **what)
+{
+    uint64_t handle = 0;
+    void *ptr = handle_table_lookup_slot(zone_id, HANDLE_TYPE_MEMORY, slot, &handle, size_out);
+    return memory_resident(zone_id, handle, ptr, err_out, what);
+}
+
+/* Zones asked to give memory back at most this often */
+#define RECLAIM_INTERVAL_MS 1000
+
+/**
+ * Ask the other zones' guests to return memory they keep cached
+ *
+ * Only a hint: a guest with a full ring just misses it.
+ */
+static void request_reclaim(uint32_t short_zone, uint64_t bytes)
+{
+    static uint64_t last_ms;
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t now = (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+
+    uint64_t last = __atomic_load_n(&last_ms, __ATOMIC_RELAXED);
+    if (last && now - last < RECLAIM_INTERVAL_MS) {
+        return;
+    }
+    if (!__atomic_compare_exchange_n(&last_ms, &last, now, false,
+                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        return;
+    }
+
+    uint32_t zones[256];
+    uint32_t count = mem_pool_zones(zones, 256);
+
+    for (uint32_t i = 0; i < count; i++) {
+        if (zones[i] == short_zone) {
+            continue;  /* Gets the error and trims on its own */
+        }
+
+        struct idm_connection *conn = idm_conn_lookup(zones[i]);
+        struct idm_message *msg = idm_conn_reserve(conn, IDM_RECLAIM,
+                                                   sizeof(struct idm_reclaim));
+        if (!msg) {
+            continue;
+        }
+
+        struct idm_reclaim *req = (struct idm_reclaim *)msg->payload;
+        req->bytes = bytes;
+        idm_conn_commit(conn, msg);
+
+        LOG("  Asked zone %u to return cached memory\n", zones[i]);
+    }
 }
 
 /**
@@ -134,12 +542,41 @@ void handle_gpu_alloc(const struct idm_message *msg)
     uint32_t zone_id = msg->header.src_zone;
     uint64_t seq = msg->header.seq_num;
 
-    printf("[GPU_ALLOC] Zone %u requests %lu bytes\n", zone_id, req->size);
+    /* Read once: the guest can still write the ring slot */
+    uint64_t size = req->size;
+
+    LOG("[GPU_ALLOC] Zone %u requests %lu bytes\n", zone_id, size);
 
-    /* Call real CUDA */
+    /* Must fit the handle's device address range */
+    if (size == 0 || size > IDM_VA_RANGE_MAX) {
+        send_response_error(zone_id, seq, IDM_ERROR_INVALID_SIZE, 0,
+                            "Allocation size out of range");
+        return;
+    }
+
+    /* Carve from the zone's pool (only reaches cuMemAlloc on a miss) */
     CUdeviceptr device_ptr = 0;
-    CUresult res = cuMemAlloc(&device_ptr, req->size);
+    CUresult res = STATS_CUDA_CALL(mem_pool_alloc(zone_id, worker_device, size, &device_ptr));
+
+    /* Full: move idle memory out to the host and try again */
+    if (res == CUDA_ERROR_OUT_OF_MEMORY &&
+        evict_make_room(zone_id, worker_device, size) > 0) {
+        res = STATS_CUDA_CALL(mem_pool_alloc(zone_id, worker_device, size, &device_ptr));
+    }
+
+    if (res == CUDA_ERROR_OUT_OF_MEMORY) {
+        fprintf(stderr, "  Out of device memory (or zone quota)\n");
+        request_reclaim(zone_id, size);
 
+        send_response_error(
+            zone_id,
+            seq,
+            IDM_ERROR_OUT_OF_MEMORY,
+            res,
+            "Out of device memory"
+        );
+        return;
+    }
     if (res != CUDA_SUCCESS) {
         const char *err_str;
         cuGetErrorString(res, &err_str);
@@ -155,13 +592,13 @@ void handle_gpu_alloc(const struct idm_message *msg)
         return;
     }
 
-    printf("  CUDA allocated: 0x%lx\n", (unsigned long)device_ptr);
+    LOG("  Allocated: 0x%lx\n", (unsigned long)device_ptr);
 
     /* Create opaque handle */
-    uint64_t handle = handle_table_insert(zone_id, (void *)device_ptr, req->size);
+    uint64_t handle = handle_table_insert(zone_id, HANDLE_TYPE_MEMORY, (void *)device_ptr, size);
     if (handle == 0) {
         fprintf(stderr, "  Failed to create handle\n");
-        cuMemFree(device_ptr);
+        mem_pool_free(zone_id, device_ptr);
 
         send_response_error(
             zone_id,
@@ -173,7 +610,7 @@ void handle_gpu_alloc(const struct idm_message *msg)
         return;
     }
 
-    printf("  Assigned handle: 0x%lx\n", handle);
+    LOG("  Assigned handle: 0x%lx\n", handle);
 
     /* Send success */
     send_response_ok(zone_id, seq, handle, NULL, 0);
@@ -188,10 +625,10 @@ void handle_gpu_free(const struct idm_message *msg)
     uint32_t zone_id = msg->header.src_zone;
     uint64_t seq = msg->header.seq_num;
 
-    printf("[GPU_FREE] Zone %u frees handle 0x%lx\n", zone_id, req->handle);
+    LOG("[GPU_FREE] Zone %u frees handle 0x%lx\n", zone_id, req->handle);
 
     /* Lookup and remove handle */
-    void *device_ptr = handle_table_remove(zone_id, req->handle);
+    void *device_ptr = handle_table_remove(zone_id, HANDLE_TYPE_MEMORY, req->handle);
     if (!device_ptr) {
         fprintf(stderr, "  Invalid handle or permission denied\n");
 
@@ -205,129 +642,295 @@ void handle_gpu_free(const struct idm_message *msg)
         return;
     }
 
-    /* Call real CUDA */
-    CUresult res = cuMemFree((CUdeviceptr)device_ptr);
+    /* Evicted: only its host copy is left */
+    if (evict_is_evicted(device_ptr)) {
+        evict_discard(device_ptr);
+        send_response_ok(zone_id, seq, 0, NULL, 0);
+        return;
+    }
+
+    /* Back to the zone's cache; the driver sees it only on trim/teardown */
+    CUresult res = mem_pool_free(zone_id, (CUdeviceptr)device_ptr);
     if (res != CUDA_SUCCESS) {
-        const char *err_str;
-        cuGetErrorString(res, &err_str);
-        fprintf(stderr, "  cuMemFree failed: %s\n", err_str);
+        fprintf(stderr, "  Pointer 0x%lx not in zone %u's pool\n",
+                (unsigned long)device_ptr, zone_id);
 
         send_response_error(
             zone_id,
             seq,
             IDM_ERROR_CUDA_ERROR,
             res,
-            "cuMemFree failed"
+            "mem_pool_free failed"
         );
         return;
     }
 
-    printf("  Freed GPU pointer: 0x%lx\n", (unsigned long)device_ptr);
+    LOG("  Freed GPU pointer: 0x%lx\n", (unsigned long)device_ptr);
 
     /* Send success */
     send_response_ok(zone_id, seq, 0, NULL, 0);
 }
 
 /**
- * Handle GPU_COPY_H2D
+ * Handle GPU_MEM_EXPORT
+ *
+ * Sets who else may use one of the zone's allocations; the handle table
+ * enforces it on every lookup.
  */
-void handle_gpu_copy_h2d(const struct idm_message *msg)
+void handle_gpu_mem_export(const struct idm_message *msg)
 {
-    const struct idm_gpu_copy_h2d *req = (const struct idm_gpu_copy_h2d *)msg->payload;
+    const struct idm_gpu_mem_export *req = (const struct idm_gpu_mem_export *)msg->payload;
     uint32_t zone_id = msg->header.src_zone;
     uint64_t seq = msg->header.seq_num;
 
-    printf("[GPU_COPY_H2D] Zone %u copies %lu bytes to handle 0x%lx+%lu\n",
-           zone_id, req->size, req->dst_handle, req->dst_offset);
+    /* Snapshot: the request may still sit in the sender's ring slot */
+    struct idm_gpu_mem_export r = *req;
 
-    /* Lookup destination handle */
-    size_t alloc_size;
-    void *device_ptr = handle_table_lookup(zone_id, req->dst_handle, &alloc_size);
-    if (!device_ptr) {
-        fprintf(stderr, "  Invalid handle or permission denied\n");
+    LOG("[GPU_MEM_EXPORT] Zone %u shares handle 0x%lx with %u zone(s)\n",
+        zone_id, r.handle, r.zone_count);
 
-        send_response_error(
-            zone_id,
-            seq,
-            IDM_ERROR_INVALID_HANDLE,
-            0,
-            "Invalid handle"
-        );
+    if (r.zone_count > IDM_GRANT_MAX || r.zone_count > HANDLE_TABLE_MAX_GRANTS) {
+        send_response_error(zone_id, seq, IDM_ERROR_INVALID_SIZE, 0, "Too many zones");
         return;
     }
 
-    /* Validate bounds */
-    if (req->dst_offset + req->size > alloc_size) {
-        fprintf(stderr, "  Out of bounds access\n");
-
-        send_response_error(
-            zone_id,
-            seq,
-            IDM_ERROR_INVALID_SIZE,
-            0,
-            "Out of bounds"
-        );
+    /* Shared memory is never evicted: bring it back first */
+    enum idm_error err;
+    const char *what;
+    if (!memory_lookup(zone_id, r.handle, NULL, &err, &what)) {
+        send_response_error(zone_id, seq, err, 0, what);
         return;
     }
 
-    /* Get host data (follows struct in payload) */
-    const uint8_t *host_data = (const uint8_t *)msg->payload + sizeof(struct idm_gpu_copy_h2d);
-
-    /* Copy to GPU */
-    CUdeviceptr dst = (CUdeviceptr)device_ptr + req->dst_offset;
-    CUresult res = cuMemcpyHtoD(dst, host_data, req->size);
-
-    if (res != CUDA_SUCCESS) {
-        const char *err_str;
-        cuGetErrorString(res, &err_str);
-        fprintf(stderr, "  cuMemcpyHtoD failed: %s\n", err_str);
+    uint32_t zones[IDM_GRANT_MAX];
+    memcpy(zones, r.zones, r.zone_count * sizeof(zones[0]));
 
-        send_response_error(
-            zone_id,
-            seq,
-            IDM_ERROR_CUDA_ERROR,
-            res,
-            "cuMemcpyHtoD failed"
-        );
+    int ret = handle_table_grant(zone_id, HANDLE_TYPE_MEMORY, r.handle, zones, r.zone_count);
+    if (ret == -ENOENT) {
+        send_response_error(zone_id, seq, IDM_ERROR_INVALID_HANDLE, 0,
+                            "Invalid handle or permission denied");
+        return;
+    }
+    if (ret < 0) {
+        send_response_error(zone_id, seq, IDM_ERROR_INVALID_MESSAGE, 0, "Invalid zone list");
         return;
     }
 
-    printf("  Copied %lu bytes to GPU\n", req->size);
+    for (uint32_t i = 0; i < r.zone_count; i++) {
+        LOG("  Granted zone %u\n", zones[i]);
+    }
 
-    /* Send success */
     send_response_ok(zone_id, seq, 0, NULL, 0);
 }
 
 /**
- * Handle GPU_COPY_D2H
+ * Handle GPU_MEM_IMPORT
+ *
+ * Nothing to set up: the lookup itself checks the grant. The guest needs
+ * the size to bounds-check its own accesses.
  */
-void handle_gpu_copy_d2h(const struct idm_message *msg)
+void handle_gpu_mem_import(const struct idm_message *msg)
 {
-    const struct idm_gpu_copy_d2h *req = (const struct idm_gpu_copy_d2h *)msg->payload;
+    const struct idm_gpu_mem_import *req = (const struct idm_gpu_mem_import *)msg->payload;
     uint32_t zone_id = msg->header.src_zone;
     uint64_t seq = msg->header.seq_num;
+    uint64_t handle = req->handle;
 
-    printf("[GPU_COPY_D2H] Zone %u reads %lu bytes from handle 0x%lx+%lu\n",
-           zone_id, req->size, req->src_handle, req->src_offset);
+    LOG("[GPU_MEM_IMPORT] Zone %u opens zone %u's handle 0x%lx\n",
+        zone_id, handle_table_owner(handle), handle);
 
-    /* Lookup source handle */
-    size_t alloc_size;
-    void *device_ptr = handle_table_lookup(zone_id, req->src_handle, &alloc_size);
-    if (!device_ptr) {
-        fprintf(stderr, "  Invalid handle or permission denied\n");
+    size_t size;
+    if (!handle_table_lookup(zone_id, HANDLE_TYPE_MEMORY, handle, &size)) {
+        send_response_error(zone_id, seq, IDM_ERROR_INVALID_HANDLE, 0,
+                            "Invalid handle or not shared with this zone");
+        return;
+    }
 
-        send_response_error(
-            zone_id,
-            seq,
-            IDM_ERROR_INVALID_HANDLE,
+    uint64_t size_out = size;
+    send_response_ok(zone_id, seq, handle, &size_out, sizeof(size_out));
+}
+
+/**
+ * Unpin and unmap a host region (no handle refers to it any more)
+ */
+static void host_region_destroy(struct proxy_host_region *region)
+{
+    cuMemHostUnregister(region->addr);
+    idm_conn_region_unmap(region->conn, region->region_id, region->addr, region->size);
+    free(region);
+}
+
+/**
+ * Handle HOST_REGISTER
+ *
+ * Maps the guest's region once and pins it, so later IDM_COPY_HOST copies
+ * DMA straight between guest pages and the device.
+ */
+void handle_host_register(const struct idm_message *msg)
+{
+    const struct idm_host_register *req = (const struct idm_host_register *)msg->payload;
+    uint32_t zone_id = msg->header.src_zone;
+    uint64_t seq = msg->header.seq_num;
+
+    /* Snapshot: the request may still sit in the sender's ring slot */
+    struct idm_host_register r = *req;
+
+    LOG("[HOST_REGISTER] Zone %u registers region %u (%lu bytes)\n",
+        zone_id, r.region_id, r.size);
+
+    if (r.size == 0 || r.size > IDM_HOST_REGION_MAX || r.size % IDM_PAGE_SIZE != 0 ||
+        r.region_id >= IDM_HOST_REGION_IDS ||
+        (r.gref_count != 0 && r.gref_count != r.size / IDM_PAGE_SIZE)) {
+        send_response_error(zone_id, seq, IDM_ERROR_INVALID_SIZE, 0, "Invalid host region");
+        return;
+    }
+
+    const uint32_t *grefs = NULL;
+    if (r.gref_count) {
+        grefs = (const uint32_t *)bulk_range(zone_id, r.gref_offset,
+                                             (uint64_t)r.gref_count * sizeof(uint32_t));
+        if (!grefs) {
+            send_response_error(zone_id, seq, IDM_ERROR_INVALID_SIZE, 0,
+                                "Grant list out of bounds");
+            return;
+        }
+    }
+
+    struct proxy_host_region *region = calloc(1, sizeof(*region));
+    if (!region) {
+        send_response_error(zone_id, seq, IDM_ERROR_OUT_OF_MEMORY, 0, "Out of memory");
+        return;
+    }
+
+    region->conn = idm_conn_lookup(zone_id);
+    region->size = r.size;
+    region->region_id = r.region_id;
+    region->addr = idm_conn_region_map(region->conn, r.region_id, r.size, grefs);
+    if (!region->addr) {
+        free(region);
+        send_response_error(zone_id, seq, IDM_ERROR_INVALID_HANDLE, 0,
+                            "Host region not found");
+        return;
+    }
+
+    CUresult res = STATS_CUDA_CALL(cuMemHostRegister(region->addr, region->size,
+                                                     CU_MEMHOSTREGISTER_PORTABLE));
+    if (res != CUDA_SUCCESS) {
+        idm_conn_region_unmap(region->conn, region->region_id, region->addr, region->size);
+        free(region);
+        send_cuda_error(zone_id, seq, res, "cuMemHostRegister");
+        return;
+    }
+
+    uint64_t handle = handle_table_insert(zone_id, HANDLE_TYPE_HOST, region, region->size);
+    if (handle == 0) {
+        host_region_destroy(region);
+        send_response_error(zone_id, seq, IDM_ERROR_OUT_OF_MEMORY, 0, "Handle table full");
+        return;
+    }
+
+    LOG("  Pinned at %p, handle 0x%lx\n", region->addr, handle);
+
+    send_response_ok(zone_id, seq, handle, NULL, 0);
+}
+
+/**
+ * Wait for everything queued on each of a zone's GPUs (current one if unplaced)
+ *
+ * @return First failure, or CUDA_SUCCESS
+ */
+static CUresult sync_zone_devices(uint32_t zone_id)
+{
+    int home = worker_device;
+    int count = devices_zone_count(zone_id);
+    CUresult res = CUDA_SUCCESS;
+
+    if (count == 0) {
+        return STATS_CUDA_CALL(cuCtxSynchronize());
+    }
+
+    for (int vdev = 0; vdev < count; vdev++) {
+        int device = devices_physical(zone_id, (uint32_t)vdev);
+        CUresult r = device < 0 ? CUDA_ERROR_INVALID_DEVICE : use_device(device);
+        if (r == CUDA_SUCCESS) {
+            r = STATS_CUDA_CALL(cuCtxSynchronize());
+        }
+        if (res == CUDA_SUCCESS) {
+            res = r;
+        }
+    }
+
+    if (home >= 0) {
+        use_device(home);
+    }
+
+    return res;
+}
+
+/**
+ * Handle HOST_UNREGISTER
+ */
+void handle_host_unregister(const struct idm_message *msg)
+{
+    const struct idm_host_unregister *req = (const struct idm_host_unregister *)msg->payload;
+    uint32_t zone_id = msg->header.src_zone;
+    uint64_t seq = msg->header.seq_num;
+
+    LOG("[HOST_UNREGISTER] Zone %u unregisters 0x%lx\n", zone_id, req->region_handle);
+
+    struct proxy_host_region *region = handle_table_remove(zone_id, HANDLE_TYPE_HOST,
+                                                           req->region_handle);
+    if (!region) {
+        send_response_error(zone_id, seq, IDM_ERROR_INVALID_HANDLE, 0, "Invalid host region");
+        return;
+    }
+
+    /* Copies already queued on any of the zone's GPUs may still use it */
+    CUresult res = sync_zone_devices(zone_id);
+    host_region_destroy(region);
+    if (res != CUDA_SUCCESS) {
+        send_cuda_error(zone_id, seq, res, "cuCtxSynchronize");
+        return;
+    }
+
+    send_response_ok(zone_id, seq, 0, NULL, 0);
+}
+
+/**
+ * Handle GPU_COPY_H2D
+ */
+void handle_gpu_copy_h2d(const struct idm_message *msg)
+{
+    /* Snapshot: the request may still sit in the sender's ring slot */
+    struct idm_gpu_copy_h2d r = *(const struct idm_gpu_copy_h2d *)msg->payload;
+    uint32_t zone_id = msg->header.src_zone;
+    uint64_t seq = msg->header.seq_num;
+
+    LOG("[GPU_COPY_H2D] Zone %u copies %lu bytes to handle 0x%lx+%lu (%s)\n",
+        zone_id, r.size, r.dst_handle, r.dst_offset,
+        (r.flags & IDM_COPY_BULK) ? "bulk" :
+        (r.flags & IDM_COPY_HOST) ? "host region" : "inline");
+
+    /* Lookup destination handle */
+    size_t alloc_size;
+    enum idm_error err;
+    const char *what;
+    void *device_ptr = memory_lookup(zone_id, r.dst_handle, &alloc_size, &err, &what);
+    if (!device_ptr) {
+        fprintf(stderr, "  %s\n", what);
+
+        send_response_error(
+            zone_id,
+            seq,
+            err,
             0,
-            "Invalid handle"
+            what
         );
         return;
     }
 
     /* Validate bounds */
-    if (req->src_offset + req->size > alloc_size) {
+    if (r.dst_offset > alloc_size || r.size > alloc_size - r.dst_offset) {
         fprintf(stderr, "  Out of bounds access\n");
 
         send_response_error(
@@ -340,29 +943,165 @@ void handle_gpu_copy_d2h(const struct idm_message *msg)
         return;
     }
 
-    /* Allocate host buffer */
-    void *host_data = malloc(req->size);
+    /* Get host data (inline after struct, or in bulk region) */
+    const uint8_t *host_data = copy_host_data(msg, sizeof(r), r.flags,
+                                              r.bulk_offset, r.size);
     if (!host_data) {
+        fprintf(stderr, "  Host data out of bounds\n");
+
         send_response_error(
             zone_id,
             seq,
-            IDM_ERROR_OUT_OF_MEMORY,
+            IDM_ERROR_INVALID_SIZE,
             0,
-            "Out of memory"
+            "Host data out of bounds"
         );
         return;
     }
 
-    /* Copy from GPU */
-    CUdeviceptr src = (CUdeviceptr)device_ptr + req->src_offset;
-    CUresult res = cuMemcpyDtoH(host_data, src, req->size);
+    CUstream stream;
+    if (!lookup_stream(zone_id, r.stream_handle, &stream)) {
+        send_response_error(zone_id, seq, IDM_ERROR_INVALID_HANDLE, 0, "Invalid stream");
+        return;
+    }
+
+    CUdeviceptr dst = (CUdeviceptr)device_ptr + r.dst_offset;
+
+    /*
+     * Bulk or host region stream copy: answer when the DMA is done (sender
+     * holds the source). Inline data dies with the message, so copy it now.
+     */
+    if (r.stream_handle && (r.flags & (IDM_COPY_BULK | IDM_COPY_HOST))) {
+        CUresult res = STATS_CUDA_CALL(cuMemcpyHtoDAsync(dst, host_data, r.size, stream));
+        if (res != CUDA_SUCCESS) {
+            send_cuda_error(zone_id, seq, res, "cuMemcpyHtoDAsync");
+            return;
+        }
+        respond_when_done(stream, zone_id, seq);
+        return;
+    }
+
+    /* Copy to GPU and wait (never on the legacy stream: it serializes zones) */
+    CUresult res = STATS_CUDA_CALL(cuMemcpyHtoDAsync(dst, host_data, r.size, stream));
+    if (res == CUDA_SUCCESS) {
+        res = STATS_CUDA_CALL(cuStreamSynchronize(stream));
+    }
 
     if (res != CUDA_SUCCESS) {
         const char *err_str;
         cuGetErrorString(res, &err_str);
-        fprintf(stderr, "  cuMemcpyDtoH failed: %s\n", err_str);
+        fprintf(stderr, "  cuMemcpyHtoD failed: %s\n", err_str);
+
+        send_response_error(
+            zone_id,
+            seq,
+            IDM_ERROR_CUDA_ERROR,
+            res,
+            "cuMemcpyHtoD failed"
+        );
+        return;
+    }
+
+    LOG("  Copied %lu bytes to GPU\n", r.size);
+
+    /* Send success */
+    send_response_ok(zone_id, seq, 0, NULL, 0);
+}
+
+/**
+ * Handle GPU_COPY_D2H
+ */
+void handle_gpu_copy_d2h(const struct idm_message *msg)
+{
+    /* Snapshot: the request may still sit in the sender's ring slot */
+    struct idm_gpu_copy_d2h r = *(const struct idm_gpu_copy_d2h *)msg->payload;
+    uint32_t zone_id = msg->header.src_zone;
+    uint64_t seq = msg->header.seq_num;
+
+    LOG("[GPU_COPY_D2H] Zone %u reads %lu bytes from handle 0x%lx+%lu\n",
+        zone_id, r.size, r.src_handle, r.src_offset);
+
+    /* Lookup source handle */
+    size_t alloc_size;
+    enum idm_error err;
+    const char *what;
+    void *device_ptr = memory_lookup(zone_id, r.src_handle, &alloc_size, &err, &what);
+    if (!device_ptr) {
+        fprintf(stderr, "  %s\n", what);
+
+        send_response_error(
+            zone_id,
+            seq,
+            err,
+            0,
+            what
+        );
+        return;
+    }
+
+    /* Validate bounds */
+    if (r.src_offset > alloc_size || r.size > alloc_size - r.src_offset) {
+        fprintf(stderr, "  Out of bounds access\n");
+
+        send_response_error(
+            zone_id,
+            seq,
+            IDM_ERROR_INVALID_SIZE,
+            0,
+            "Out of bounds"
+        );
+        return;
+    }
+
+    /* Results are written straight into guest-mapped memory */
+    uint8_t *host_data = NULL;
+    if (r.flags & IDM_COPY_BULK) {
+        host_data = bulk_range(zone_id, r.bulk_offset, r.size);
+    } else if (r.flags & IDM_COPY_HOST) {
+        host_data = host_range(zone_id, r.bulk_offset, r.size);
+    }
+    if (!host_data) {
+        fprintf(stderr, "  Host buffer out of bounds\n");
+
+        send_response_error(
+            zone_id,
+            seq,
+            IDM_ERROR_INVALID_SIZE,
+            0,
+            "Host buffer out of bounds"
+        );
+        return;
+    }
+
+    CUstream stream;
+    if (!lookup_stream(zone_id, r.stream_handle, &stream)) {
+        send_response_error(zone_id, seq, IDM_ERROR_INVALID_HANDLE, 0, "Invalid stream");
+        return;
+    }
+
+    CUdeviceptr src = (CUdeviceptr)device_ptr + r.src_offset;
+
+    /* Stream copy: answer when the data has landed in guest memory */
+    if (r.stream_handle) {
+        CUresult res = STATS_CUDA_CALL(cuMemcpyDtoHAsync(host_data, src, r.size, stream));
+        if (res != CUDA_SUCCESS) {
+            send_cuda_error(zone_id, seq, res, "cuMemcpyDtoHAsync");
+            return;
+        }
+        respond_when_done(stream, zone_id, seq);
+        return;
+    }
+
+    /* Copy from GPU and wait */
+    CUresult res = STATS_CUDA_CALL(cuMemcpyDtoHAsync(host_data, src, r.size, stream));
+    if (res == CUDA_SUCCESS) {
+        res = STATS_CUDA_CALL(cuStreamSynchronize(stream));
+    }
 
-        free(host_data);
+    if (res != CUDA_SUCCESS) {
+        const char *err_str;
+        cuGetErrorString(res, &err_str);
+        fprintf(stderr, "  cuMemcpyDtoH failed: %s\n", err_str);
 
         send_response_error(
             zone_id,
@@ -374,12 +1113,204 @@ void handle_gpu_copy_d2h(const struct idm_message *msg)
         return;
     }
 
-    printf("  Read %lu bytes from GPU\n", req->size);
+    LOG("  Read %lu bytes from GPU into %s+0x%lx\n", r.size,
+        (r.flags & IDM_COPY_HOST) ? "host region" : "bulk", r.bulk_offset);
+
+    /* Data is already in place; response only reports completion */
+    send_response_ok(zone_id, seq, 0, NULL, 0);
+}
+
+/**
+ * Queue a device-to-device copy on stream
+ *
+ * @return IDM_ERROR_NONE, or an error with *what set (and *res_out for
+ *         IDM_ERROR_CUDA_ERROR)
+ */
+static enum idm_error copy_d2d_issue(uint32_t zone_id, const struct idm_gpu_copy_d2d *req,
+                                     CUstream stream, CUresult *res_out, const char **what)
+{
+    /* Snapshot: the request may still sit in the sender's ring slot */
+    struct idm_gpu_copy_d2d c = *req;
+
+    size_t dst_size, src_size;
+    enum idm_error err;
+    void *dst = memory_lookup(zone_id, c.dst_handle, &dst_size, &err, what);
+    if (!dst) {
+        return err;
+    }
+    void *src = memory_lookup(zone_id, c.src_handle, &src_size, &err, what);
+    if (!src) {
+        return err;
+    }
+
+    if (c.dst_offset > dst_size || c.size > dst_size - c.dst_offset ||
+        c.src_offset > src_size || c.size > src_size - c.src_offset) {
+        *what = "Out of bounds";
+        return IDM_ERROR_INVALID_SIZE;
+    }
+
+    /* Either side may live on another GPU (another virtual device, or
+     * memory a zone shared with us): then it's a peer copy */
+    int dst_dev = mem_pool_device(handle_table_owner(c.dst_handle), (CUdeviceptr)dst);
+    int src_dev = mem_pool_device(handle_table_owner(c.src_handle), (CUdeviceptr)src);
+    CUdeviceptr dst_ptr = (CUdeviceptr)dst + c.dst_offset;
+    CUdeviceptr src_ptr = (CUdeviceptr)src + c.src_offset;
+
+    if (dst_dev >= 0 && src_dev >= 0 && dst_dev != src_dev) {
+        LOG("  Peer copy GPU %d -> GPU %d (%s)\n", src_dev, dst_dev,
+            devices_peer(dst_dev, src_dev) ? "direct" : "staged by the driver");
+        *res_out = STATS_CUDA_CALL(cuMemcpyPeerAsync(dst_ptr, devices_get(dst_dev)->context,
+                                                     src_ptr, devices_get(src_dev)->context,
+                                                     c.size, stream));
+        *what = "cuMemcpyPeerAsync";
+    } else {
+        *res_out = STATS_CUDA_CALL(cuMemcpyDtoDAsync(dst_ptr, src_ptr, c.size, stream));
+        *what = "cuMemcpyDtoDAsync";
+    }
+
+    return *res_out == CUDA_SUCCESS ? IDM_ERROR_NONE : IDM_ERROR_CUDA_ERROR;
+}
+
+/**
+ * Handle GPU_COPY_D2D
+ *
+ * Runs on the device and is answered once queued, like a fill.
+ */
+void handle_gpu_copy_d2d(const struct idm_message *msg)
+{
+    const struct idm_gpu_copy_d2d *req = (const struct idm_gpu_copy_d2d *)msg->payload;
+    uint32_t zone_id = msg->header.src_zone;
+    uint64_t seq = msg->header.seq_num;
+
+    CUstream stream;
+    if (!lookup_stream(zone_id, req->stream_handle, &stream)) {
+        send_response_error(zone_id, seq, IDM_ERROR_INVALID_HANDLE, 0, "Invalid stream");
+        return;
+    }
+
+    CUresult res = CUDA_SUCCESS;
+    const char *what = NULL;
+    enum idm_error err = copy_d2d_issue(zone_id, req, stream, &res, &what);
+    if (err == IDM_ERROR_CUDA_ERROR) {
+        send_cuda_error(zone_id, seq, res, what);
+        return;
+    }
+    if (err != IDM_ERROR_NONE) {
+        send_response_error(zone_id, seq, err, 0, what);
+        return;
+    }
+
+    send_response_ok(zone_id, seq, 0, NULL, 0);
+}
+
+/**
+ * Queue a fill on stream
+ *
+ * @return IDM_ERROR_NONE, or an error with *what set (and *res_out for
+ *         IDM_ERROR_CUDA_ERROR)
+ */
+static enum idm_error memset_issue(uint32_t zone_id, const struct idm_gpu_memset *req,
+                                   CUstream stream, CUresult *res_out, const char **what)
+{
+    /* Snapshot: the request may still sit in the sender's ring slot */
+    struct idm_gpu_memset m = *req;
+
+    size_t alloc_size;
+    enum idm_error err;
+    void *device_ptr = memory_lookup(zone_id, m.handle, &alloc_size, &err, what);
+    if (!device_ptr) {
+        return err;
+    }
+
+    if (m.element_size != 1 && m.element_size != 2 && m.element_size != 4) {
+        *what = "Element size must be 1, 2 or 4";
+        return IDM_ERROR_INVALID_SIZE;
+    }
+
+    /* Rows may not overlap; the span runs from the first row's start to
+     * the last row's end */
+    if (m.width == 0 || m.width > alloc_size || m.height == 0 || m.height > alloc_size ||
+        (m.height > 1 && m.pitch < m.width * m.element_size) || m.pitch > alloc_size) {
+        *what = "Invalid fill geometry";
+        return IDM_ERROR_INVALID_SIZE;
+    }
+    uint64_t span;
+    if (__builtin_mul_overflow(m.height - 1, m.pitch, &span) ||
+        __builtin_add_overflow(span, m.width * m.element_size, &span) ||
+        m.offset > alloc_size || span > alloc_size - m.offset) {
+        *what = "Out of bounds";
+        return IDM_ERROR_INVALID_SIZE;
+    }
+
+    CUdeviceptr dst = (CUdeviceptr)device_ptr + m.offset;
+    CUresult res;
+    uint64_t t0 = stats_now_ns();
+
+    if (m.height > 1) {
+        switch (m.element_size) {
+            case 1:
+                res = cuMemsetD2D8Async(dst, m.pitch, (unsigned char)m.value,
+                                        m.width, m.height, stream);
+                break;
+            case 2:
+                res = cuMemsetD2D16Async(dst, m.pitch, (unsigned short)m.value,
+                                         m.width, m.height, stream);
+                break;
+            default:
+                res = cuMemsetD2D32Async(dst, m.pitch, m.value, m.width, m.height, stream);
+                break;
+        }
+        *what = "cuMemsetD2DAsync";
+    } else {
+        switch (m.element_size) {
+            case 1:
+                res = cuMemsetD8Async(dst, (unsigned char)m.value, m.width, stream);
+                break;
+            case 2:
+                res = cuMemsetD16Async(dst, (unsigned short)m.value, m.width, stream);
+                break;
+            default:
+                res = cuMemsetD32Async(dst, m.value, m.width, stream);
+                break;
+        }
+        *what = "cuMemsetDAsync";
+    }
+
+    stats_add(STATS_CUDA, stats_now_ns() - t0);
+    *res_out = res;
+    return res == CUDA_SUCCESS ? IDM_ERROR_NONE : IDM_ERROR_CUDA_ERROR;
+}
+
+/**
+ * Handle GPU_MEMSET
+ *
+ * Answered once queued; a later copy or sync on the same stream (or on
+ * the default stream, for stream 0) sees the filled memory.
+ */
+void handle_gpu_memset(const struct idm_message *msg)
+{
+    const struct idm_gpu_memset *req = (const struct idm_gpu_memset *)msg->payload;
+    uint32_t zone_id = msg->header.src_zone;
+    uint64_t seq = msg->header.seq_num;
+
+    CUstream stream;
+    if (!lookup_stream(zone_id, req->stream_handle, &stream)) {
+        send_response_error(zone_id, seq, IDM_ERROR_INVALID_HANDLE, 0, "Invalid stream");
+        return;
+    }
+
+    CUresult res = CUDA_SUCCESS;
+    const char *what = NULL;
+    enum idm_error err = memset_issue(zone_id, req, stream, &res, &what);
+    if (err == IDM_ERROR_CUDA_ERROR) {
+        send_cuda_error(zone_id, seq, res, what);
+        return;
+    }
+    if (err != IDM_ERROR_NONE) {
+        send_response_error(zone_id, seq, err, 0, what);
+        return;
+    }
 
-    /* Send success with data */
-    /* TODO: Actually send data back (need to extend send_response_ok) */
-    /* For now, just send success */
-    free(host_data);
     send_response_ok(zone_id, seq, 0, NULL, 0);
 }
 
@@ -391,10 +1322,10 @@ void handle_gpu_sync(const struct idm_message *msg)
     uint32_t zone_id = msg->header.src_zone;
     uint64_t seq = msg->header.seq_num;
 
-    printf("[GPU_SYNC] Zone %u synchronizes\n", zone_id);
+    LOG("[GPU_SYNC] Zone %u synchronizes\n", zone_id);
 
     /* Synchronize */
-    CUresult res = cuCtxSynchronize();
+    CUresult res = STATS_CUDA_CALL(cuCtxSynchronize());
 
     if (res != CUDA_SUCCESS) {
         const char *err_str;
@@ -411,8 +1342,1191 @@ void handle_gpu_sync(const struct idm_message *msg)
         return;
     }
 
-    printf("  Synchronized\n");
+    LOG("  Synchronized\n");
 
     /* Send success */
     send_response_ok(zone_id, seq, 0, NULL, 0);
 }
+
+/**
+ * Handle GPU_GET_INFO
+ */
+void handle_gpu_get_info(const struct idm_message *msg)
+{
+    const struct idm_gpu_get_info *req = (const struct idm_gpu_get_info *)msg->payload;
+    uint32_t zone_id = msg->header.src_zone;
+    uint64_t seq = msg->header.seq_num;
+
+    if (msg->header.payload_len < sizeof(*req)) {
+        send_response_error(zone_id, seq, IDM_ERROR_INVALID_MESSAGE, 0, "Truncated request");
+        return;
+    }
+
+    LOG("[GPU_GET_INFO] Zone %u asks for info %u\n", zone_id, req->info_type);
+
+    switch (req->info_type) {
+        case IDM_INFO_DEVICE_COUNT:
+            send_response_value(zone_id, seq, (uint32_t)devices_zone_count(zone_id));
+            break;
+
+        case IDM_INFO_DEVICE_MEMORY: {
+            /* Use the quota as the zone's memory when it's smaller */
+            const struct gpu_device *gpu = devices_get(worker_device);
+            uint64_t total = gpu ? gpu->total_mem : 0;
+            uint64_t quota = mem_pool_zone_quota();
+            send_response_ok(zone_id, seq, quota && quota < total ? quota : total, NULL, 0);
+            break;
+        }
+
+        default:
+            send_response_error(zone_id, seq, IDM_ERROR_INVALID_MESSAGE, 0, "Unknown info type");
+            break;
+    }
+}
+
+/**
+ * Handle GPU_GET_PROPS
+ *
+ * The guest asks once per device at startup and keeps the answer.
+ */
+void handle_gpu_get_props(const struct idm_message *msg)
+{
+    uint32_t zone_id = msg->header.src_zone;
+    uint64_t seq = msg->header.seq_num;
+
+    LOG("[GPU_GET_PROPS] Zone %u, device %u\n", zone_id, idm_header_device(&msg->header));
+
+    const struct gpu_device *gpu = devices_get(worker_device);
+    if (!gpu) {
+        send_response_error(zone_id, seq, IDM_ERROR_CUDA_ERROR, CUDA_ERROR_INVALID_DEVICE,
+                            "Invalid device");
+        return;
+    }
+
+    /* As for GET_INFO: the quota is the zone's memory when it's smaller */
+    struct idm_gpu_props props = gpu->props;
+    uint64_t quota = mem_pool_zone_quota();
+    if (quota && quota < props.total_mem) {
+        props.total_mem = quota;
+    }
+
+    send_ok(zone_id, seq, 0, (uint32_t)devices_zone_count(zone_id), &props, sizeof(props));
+}
+
+/**
+ * Handle GPU_STREAM_CREATE
+ */
+void handle_gpu_stream_create(const struct idm_message *msg)
+{
+    const struct idm_gpu_stream_create *req = (const struct idm_gpu_stream_create *)msg->payload;
+    uint32_t zone_id = msg->header.src_zone;
+    uint64_t seq = msg->header.seq_num;
+
+    LOG("[GPU_STREAM_CREATE] Zone %u (flags=0x%x, priority=%d)\n",
+        zone_id, req->flags, req->priority);
+
+    CUstream stream;
+    CUresult res = STATS_CUDA_CALL(cuStreamCreateWithPriority(&stream, req->flags, req->priority));
+    if (res != CUDA_SUCCESS) {
+        send_cuda_error(zone_id, seq, res, "cuStreamCreate");
+        return;
+    }
+
+    uint64_t handle = handle_table_insert(zone_id, HANDLE_TYPE_STREAM, stream, 0);
+    if (handle == 0) {
+        cuStreamDestroy(stream);
+        send_response_error(zone_id, seq, IDM_ERROR_OUT_OF_MEMORY, 0, "Failed to create handle");
+        return;
+    }
+
+    LOG("  Assigned stream handle: 0x%lx\n", handle);
+    send_response_ok(zone_id, seq, handle, NULL, 0);
+}
+
+/**
+ * Handle GPU_STREAM_DESTROY
+ */
+void handle_gpu_stream_destroy(const struct idm_message *msg)
+{
+    const struct idm_gpu_stream *req = (const struct idm_gpu_stream *)msg->payload;
+    uint32_t zone_id = msg->header.src_zone;
+    uint64_t seq = msg->header.seq_num;
+
+    LOG("[GPU_STREAM_DESTROY] Zone %u destroys stream 0x%lx\n", zone_id, req->stream_handle);
+
+    CUstream stream = handle_table_remove(zone_id, HANDLE_TYPE_STREAM, req->stream_handle);
+    if (!stream) {
+        send_response_error(zone_id, seq, IDM_ERROR_INVALID_HANDLE, 0, "Invalid stream");
+        return;
+    }
+
+    /* Pending work still completes; the driver releases the stream after */
+    CUresult res = STATS_CUDA_CALL(cuStreamDestroy(stream));
+    if (res != CUDA_SUCCESS) {
+        send_cuda_error(zone_id, seq, res, "cuStreamDestroy");
+        return;
+    }
+
+    send_response_ok(zone_id, seq, 0, NULL, 0);
+}
+
+/**
+ * Handle GPU_STREAM_SYNC
+ */
+void handle_gpu_stream_sync(const struct idm_message *msg)
+{
+    const struct idm_gpu_stream *req = (const struct idm_gpu_stream *)msg->payload;
+    uint32_t zone_id = msg->header.src_zone;
+    uint64_t seq = msg->header.seq_num;
+
+    LOG("[GPU_STREAM_SYNC] Zone %u synchronizes stream 0x%lx\n", zone_id, req->stream_handle);
+
+    CUstream stream;
+    if (!lookup_stream(zone_id, req->stream_handle, &stream)) {
+        send_response_error(zone_id, seq, IDM_ERROR_INVALID_HANDLE, 0, "Invalid stream");
+        return;
+    }
+
+    CUresult res = STATS_CUDA_CALL(cuStreamSynchronize(stream));
+    if (res != CUDA_SUCCESS) {
+        send_cuda_error(zone_id, seq, res, "cuStreamSynchronize");
+        return;
+    }
+
+    send_response_ok(zone_id, seq, 0, NULL, 0);
+}
+
+/**
+ * Handle GPU_STREAM_WAIT_EVENT
+ */
+void handle_gpu_stream_wait_event(const struct idm_message *msg)
+{
+    const struct idm_gpu_stream_wait_event *req =
+        (const struct idm_gpu_stream_wait_event *)msg->payload;
+    uint32_t zone_id = msg->header.src_zone;
+    uint64_t seq = msg->header.seq_num;
+
+    LOG("[GPU_STREAM_WAIT_EVENT] Zone %u: stream 0x%lx waits on event 0x%lx\n",
+        zone_id, req->stream_handle, req->event_handle);
+
+    CUstream stream;
+    CUevent event = handle_table_lookup(zone_id, HANDLE_TYPE_EVENT, req->event_handle, NULL);
+    if (!event || !lookup_stream(zone_id, req->stream_handle, &stream)) {
+        send_response_error(zone_id, seq, IDM_ERROR_INVALID_HANDLE, 0, "Invalid stream or event");
+        return;
+    }
+
+    CUresult res = STATS_CUDA_CALL(cuStreamWaitEvent(stream, event, req->flags));
+    if (res != CUDA_SUCCESS) {
+        send_cuda_error(zone_id, seq, res, "cuStreamWaitEvent");
+        return;
+    }
+
+    send_response_ok(zone_id, seq, 0, NULL, 0);
+}
+
+/**
+ * Handle GPU_EVENT_CREATE
+ */
+void handle_gpu_event_create(const struct idm_message *msg)
+{
+    const struct idm_gpu_event_create *req = (const struct idm_gpu_event_create *)msg->payload;
+    uint32_t zone_id = msg->header.src_zone;
+    uint64_t seq = msg->header.seq_num;
+
+    LOG("[GPU_EVENT_CREATE] Zone %u (flags=0x%x)\n", zone_id, req->flags);
+
+    CUevent event;
+    CUresult res = STATS_CUDA_CALL(cuEventCreate(&event, req->flags));
+    if (res != CUDA_SUCCESS) {
+        send_cuda_error(zone_id, seq, res, "cuEventCreate");
+        return;
+    }
+
+    uint64_t handle = handle_table_insert(zone_id, HANDLE_TYPE_EVENT, event, 0);
+    if (handle == 0) {
+        cuEventDestroy(event);
+        send_response_error(zone_id, seq, IDM_ERROR_OUT_OF_MEMORY, 0, "Failed to create handle");
+        return;
+    }
+
+    LOG("  Assigned event handle: 0x%lx\n", handle);
+    send_response_ok(zone_id, seq, handle, NULL, 0);
+}
+
+/**
+ * Handle GPU_EVENT_DESTROY
+ */
+void handle_gpu_event_destroy(const struct idm_message *msg)
+{
+    const struct idm_gpu_event *req = (const struct idm_gpu_event *)msg->payload;
+    uint32_t zone_id = msg->header.src_zone;
+    uint64_t seq = msg->header.seq_num;
+
+    LOG("[GPU_EVENT_DESTROY] Zone %u destroys event 0x%lx\n", zone_id, req->event_handle);
+
+    CUevent event = handle_table_remove(zone_id, HANDLE_TYPE_EVENT, req->event_handle);
+    if (!event) {
+        send_response_error(zone_id, seq, IDM_ERROR_INVALID_HANDLE, 0, "Invalid event");
+        return;
+    }
+
+    CUresult res = STATS_CUDA_CALL(cuEventDestroy(event));
+    if (res != CUDA_SUCCESS) {
+        send_cuda_error(zone_id, seq, res, "cuEventDestroy");
+        return;
+    }
+
+    send_response_ok(zone_id, seq, 0, NULL, 0);
+}
+
+/**
+ * Handle GPU_EVENT_RECORD
+ */
+void handle_gpu_event_record(const struct idm_message *msg)
+{
+    const struct idm_gpu_event_record *req = (const struct idm_gpu_event_record *)msg->payload;
+    uint32_t zone_id = msg->header.src_zone;
+    uint64_t seq = msg->header.seq_num;
+
+    LOG("[GPU_EVENT_RECORD] Zone %u records event 0x%lx on stream 0x%lx\n",
+        zone_id, req->event_handle, req->stream_handle);
+
+    CUstream stream;
+    CUevent event = handle_table_lookup(zone_id, HANDLE_TYPE_EVENT, req->event_handle, NULL);
+    if (!event || !lookup_stream(zone_id, req->stream_handle, &stream)) {
+        send_response_error(zone_id, seq, IDM_ERROR_INVALID_HANDLE, 0, "Invalid stream or event");
+        return;
+    }
+
+    CUresult res = STATS_CUDA_CALL(cuEventRecord(event, stream));
+    if (res != CUDA_SUCCESS) {
+        send_cuda_error(zone_id, seq, res, "cuEventRecord");
+        return;
+    }
+
+    send_response_ok(zone_id, seq, 0, NULL, 0);
+}
+
+/**
+ * Handle GPU_EVENT_SYNC
+ */
+void handle_gpu_event_sync(const struct idm_message *msg)
+{
+    const struct idm_gpu_event *req = (const struct idm_gpu_event *)msg->payload;
+    uint32_t zone_id = msg->header.src_zone;
+    uint64_t seq = msg->header.seq_num;
+
+    LOG("[GPU_EVENT_SYNC] Zone %u waits on event 0x%lx\n", zone_id, req->event_handle);
+
+    CUevent event = handle_table_lookup(zone_id, HANDLE_TYPE_EVENT, req->event_handle, NULL);
+    if (!event) {
+        send_response_error(zone_id, seq, IDM_ERROR_INVALID_HANDLE, 0, "Invalid event");
+        return;
+    }
+
+    CUresult res = STATS_CUDA_CALL(cuEventSynchronize(event));
+    if (res != CUDA_SUCCESS) {
+        send_cuda_error(zone_id, seq, res, "cuEventSynchronize");
+        return;
+    }
+
+    send_response_ok(zone_id, seq, 0, NULL, 0);
+}
+
+/**
+ * Handle GPU_EVENT_QUERY (CUresult in result_value: 0 or not-ready)
+ */
+void handle_gpu_event_query(const struct idm_message *msg)
+{
+    const struct idm_gpu_event *req = (const struct idm_gpu_event *)msg->payload;
+    uint32_t zone_id = msg->header.src_zone;
+    uint64_t seq = msg->header.seq_num;
+
+    CUevent event = handle_table_lookup(zone_id, HANDLE_TYPE_EVENT, req->event_handle, NULL);
+    if (!event) {
+        send_response_error(zone_id, seq, IDM_ERROR_INVALID_HANDLE, 0, "Invalid event");
+        return;
+    }
+
+    CUresult res = STATS_CUDA_CALL(cuEventQuery(event));
+    if (res != CUDA_SUCCESS && res != CUDA_ERROR_NOT_READY) {
+        send_cuda_error(zone_id, seq, res, "cuEventQuery");
+        return;
+    }
+
+    send_response_value(zone_id, seq, (uint32_t)res);
+}
+
+/**
+ * Handle GPU_EVENT_ELAPSED (float milliseconds in result_value)
+ */
+void handle_gpu_event_elapsed(const struct idm_message *msg)
+{
+    const struct idm_gpu_event_elapsed *req = (const struct idm_gpu_event_elapsed *)msg->payload;
+    uint32_t zone_id = msg->header.src_zone;
+    uint64_t seq = msg->header.seq_num;
+
+    CUevent start = handle_table_lookup(zone_id, HANDLE_TYPE_EVENT, req->start_handle, NULL);
+    CUevent end = handle_table_lookup(zone_id, HANDLE_TYPE_EVENT, req->end_handle, NULL);
+    if (!start || !end) {
+        send_response_error(zone_id, seq, IDM_ERROR_INVALID_HANDLE, 0, "Invalid event");
+        return;
+    }
+
+    float ms = 0.0f;
+    CUresult res = STATS_CUDA_CALL(cuEventElapsedTime(&ms, start, end));
+    if (res != CUDA_SUCCESS) {
+        send_cuda_error(zone_id, seq, res, "cuEventElapsedTime");
+        return;
+    }
+
+    uint32_t bits;
+    memcpy(&bits, &ms, sizeof(bits));
+    send_response_value(zone_id, seq, bits);
+}
+
+/* ============================================================================
+ * Modules and Kernel Launch
+ *
+ * A module handle owns the CUmodule and the handles of every function
+ * looked up in it, so unloading drops those too. A function handle
+ * carries the kernel's parameter layout, read once from the driver;
+ * launches just check the blob size and patch device addresses.
+ * ============================================================================ */
+
+struct proxy_module {
+    CUmodule module;
+    uint32_t func_count;
+    uint32_t func_cap;
+    uint64_t *funcs;       /* Function handles from this module */
+};
+
+struct proxy_function {
+    CUfunction func;
+    uint32_t num_params;
+    uint32_t arg_size;     /* Blob bytes (end of the last parameter) */
+    struct idm_kernel_param params[];
+};
+
+/**
+ * Read a kernel's parameter layout from the driver
+ *
+ * @return Function object, or NULL
+ */
+static struct proxy_function *function_create(CUfunction func, CUresult *res_out)
+{
+    struct proxy_function *pf = calloc(1, sizeof(*pf) +
+                                       IDM_KERNEL_PARAMS_MAX * sizeof(pf->params[0]));
+    if (!pf) {
+        *res_out = CUDA_ERROR_OUT_OF_MEMORY;
+        return NULL;
+    }
+    pf->func = func;
+
+#if CUDA_VERSION >= 12040
+    for (uint32_t i = 0; i < IDM_KERNEL_PARAMS_MAX; i++) {
+        size_t offset = 0, size = 0;
+        if (cuFuncGetParamInfo(func, i, &offset, &size) != CUDA_SUCCESS) {
+            break;  /* Past the last parameter */
+        }
+        if (offset + size > IDM_LAUNCH_ARGS_MAX) {
+            /* Too big for a launch request to carry */
+            free(pf);
+            *res_out = CUDA_ERROR_INVALID_VALUE;
+            return NULL;
+        }
+        pf->params[i].offset = (uint32_t)offset;
+        pf->params[i].size = (uint32_t)size;
+        pf->num_params = i + 1;
+        if (offset + size > pf->arg_size) {
+            pf->arg_size = (uint32_t)(offset + size);
+        }
+    }
+#else
+    /* Without cuFuncGetParamInfo the layout is unknown */
+    free(pf);
+    *res_out = CUDA_ERROR_NOT_SUPPORTED;
+    return NULL;
+#endif
+
+    /* Give back the unused part of the parameter array */
+    struct proxy_function *shrunk = realloc(pf, sizeof(*pf) +
+                                            pf->num_params * sizeof(pf->params[0]));
+    if (shrunk) {
+        pf = shrunk;
+    }
+
+    *res_out = CUDA_SUCCESS;
+    return pf;
+}
+
+/**
+ * Unload a module and everything looked up in it
+ */
+static void module_destroy(uint32_t zone_id, struct proxy_module *pm)
+{
+    for (uint32_t i = 0; i < pm->func_count; i++) {
+        /* May already be gone with the zone */
+        free(handle_table_remove(zone_id, HANDLE_TYPE_FUNCTION, pm->funcs[i]));
+    }
+    cuModuleUnload(pm->module);
+    free(pm->funcs);
+    free(pm);
+}
+
+/**
+ * Handle GPU_MODULE_LOAD
+ */
+void handle_gpu_module_load(const struct idm_message *msg)
+{
+    const struct idm_gpu_module_load *req = (const struct idm_gpu_module_load *)msg->payload;
+    uint32_t zone_id = msg->header.src_zone;
+    uint64_t seq = msg->header.seq_num;
+    uint64_t size = req->size;
+
+    LOG("[GPU_MODULE_LOAD] Zone %u loads %lu byte image (%s)\n",
+        zone_id, size, (req->flags & IDM_COPY_BULK) ? "bulk" : "inline");
+
+    const uint8_t *src = copy_host_data(msg, sizeof(*req), req->flags,
+                                        req->bulk_offset, size);
+    if (!src || size == 0) {
+        send_response_error(zone_id, seq, IDM_ERROR_INVALID_SIZE, 0,
+                            "Module image out of bounds");
+        return;
+    }
+
+    /* The driver parses the image in place: copy it out of guest-writable
+     * memory first, NUL-terminated in case it's PTX without one */
+    uint8_t *image = malloc(size + 1);
+    if (!image) {
+        send_response_error(zone_id, seq, IDM_ERROR_OUT_OF_MEMORY, 0,
+                            "Failed to copy image");
+        return;
+    }
+    memcpy(image, src, size);
+    image[size] = 0;
+
+    struct proxy_module *pm = calloc(1, sizeof(*pm));
+    CUresult res = pm ? STATS_CUDA_CALL(cuModuleLoadData(&pm->module, image))
+                      : CUDA_ERROR_OUT_OF_MEMORY;
+    free(image);
+
+    if (res != CUDA_SUCCESS) {
+        free(pm);
+        send_cuda_error(zone_id, seq, res, "cuModuleLoadData");
+        return;
+    }
+
+    uint64_t handle = handle_table_insert(zone_id, HANDLE_TYPE_MODULE, pm, 0);
+    if (handle == 0) {
+        cuModuleUnload(pm->module);
+        free(pm);
+        send_response_error(zone_id, seq, IDM_ERROR_OUT_OF_MEMORY, 0,
+                            "Failed to create handle");
+        return;
+    }
+
+    LOG("  Module handle: 0x%lx\n", handle);
+    send_response_ok(zone_id, seq, handle, NULL, 0);
+}
+
+/**
+ * Handle GPU_MODULE_UNLOAD
+ */
+void handle_gpu_module_unload(const struct idm_message *msg)
+{
+    const struct idm_gpu_module *req = (const struct idm_gpu_module *)msg->payload;
+    uint32_t zone_id = msg->header.src_zone;
+    uint64_t seq = msg->header.seq_num;
+
+    struct proxy_module *pm = handle_table_remove(zone_id, HANDLE_TYPE_MODULE,
+                                                  req->module_handle);
+    if (!pm) {
+        send_response_error(zone_id, seq, IDM_ERROR_INVALID_HANDLE, 0,
+                            "Invalid module handle");
+        return;
+    }
+
+    /* Launches already queued (on any of the zone's streams) may still
+     * use its code; unloading is rare enough to wait for the device */
+    cuCtxSynchronize();
+    module_destroy(zone_id, pm);
+
+    send_response_ok(zone_id, seq, 0, NULL, 0);
+}
+
+/**
+ * Handle GPU_MODULE_GET_FUNCTION
+ */
+void handle_gpu_module_get_function(const struct idm_message *msg)
+{
+    const struct idm_gpu_module_get_function *req =
+        (const struct idm_gpu_module_get_function *)msg->payload;
+    uint32_t zone_id = msg->header.src_zone;
+    uint64_t seq = msg->header.seq_num;
+    uint32_t payload_len = msg->header.payload_len;
+    uint32_t name_len = req->name_len;
+
+    char name[256];
+    if (payload_len < sizeof(*req) || name_len == 0 || name_len >= sizeof(name) ||
+        name_len > payload_len - sizeof(*req)) {
+        send_response_error(zone_id, seq, IDM_ERROR_INVALID_MESSAGE, 0,
+                            "Invalid kernel name");
+        return;
+    }
+    memcpy(name, req + 1, name_len);
+    name[name_len] = 0;
+
+    LOG("[GPU_MODULE_GET_FUNCTION] Zone %u looks up %s\n", zone_id, name);
+
+    struct proxy_module *pm = handle_table_lookup(zone_id, HANDLE_TYPE_MODULE,
+                                                  req->module_handle, NULL);
+    if (!pm) {
+        send_response_error(zone_id, seq, IDM_ERROR_INVALID_HANDLE, 0,
+                            "Invalid module handle");
+        return;
+    }
+
+    if (pm->func_count == pm->func_cap) {
+        uint32_t cap = pm->func_cap ? pm->func_cap * 2 : 8;
+        uint64_t *funcs = realloc(pm->funcs, cap * sizeof(*funcs));
+        if (!funcs) {
+            send_response_error(zone_id, seq, IDM_ERROR_OUT_OF_MEMORY, 0,
+                                "Out of memory");
+            return;
+        }
+        pm->funcs = funcs;
+        pm->func_cap = cap;
+    }
+
+    CUfunction func;
+    CUresult res = STATS_CUDA_CALL(cuModuleGetFunction(&func, pm->module, name));
+    if (res != CUDA_SUCCESS) {
+        send_cuda_error(zone_id, seq, res, "cuModuleGetFunction");
+        return;
+    }
+
+    struct proxy_function *pf = function_create(func, &res);
+    if (!pf) {
+        send_cuda_error(zone_id, seq, res, "cuFuncGetParamInfo");
+        return;
+    }
+
+    uint64_t handle = handle_table_insert(zone_id, HANDLE_TYPE_FUNCTION, pf, 0);
+    if (handle == 0) {
+        free(pf);
+        send_response_error(zone_id, seq, IDM_ERROR_OUT_OF_MEMORY, 0,
+                            "Failed to create handle");
+        return;
+    }
+    pm->funcs[pm->func_count++] = handle;
+
+    LOG("  Function handle: 0x%lx (%u params, %u arg bytes)\n",
+        handle, pf->num_params, pf->arg_size);
+
+    /* Layout goes back as response data (never batch-captured) */
+    send_ok(zone_id, seq, handle, pf->num_params,
+            pf->params, pf->num_params * sizeof(pf->params[0]));
+}
+
+/**
+ * Check a launch request and pack its arguments for the driver
+ *
+ * The blob is copied to args (it gets patched, and the ring slot is
+ * guest-writable) with device addresses in the zone's allocations turned
+ * into real pointers. An 8-byte parameter inside the guest VA range that
+ * doesn't resolve to one of them is refused; any other 8-byte value is
+ * taken for a scalar (int64, double, ...) and passed through unchanged.
+ *
+ * @param args [out] IDM_KERNEL_ARGS_MAX bytes
+ * @param err_out [out] Error code on failure
+ * @param what [out] Reason on failure
+ * @return Function to launch, or NULL with *err_out set
+ */
+static const struct proxy_function *launch_prepare(
+    uint32_t zone_id,
+    const struct idm_gpu_launch_kernel *req,
+    uint32_t payload_len,
+    uint8_t *args,
+    enum idm_error *err_out,
+    const char **what)
+{
+    uint32_t arg_size = req->arg_size;
+
+    *err_out = IDM_ERROR_INVALID_MESSAGE;
+    if (payload_len < sizeof(*req) || arg_size > payload_len - sizeof(*req)) {
+        *what = "Argument blob out of bounds";
+        return NULL;
+    }
+
+    const struct proxy_function *pf = handle_table_lookup(zone_id, HANDLE_TYPE_FUNCTION,
+                                                          req->function_handle, NULL);
+    if (!pf) {
+        *err_out = IDM_ERROR_INVALID_HANDLE;
+        *what = "Invalid function handle";
+        return NULL;
+    }
+
+    if (arg_size != pf->arg_size) {
+        *err_out = IDM_ERROR_INVALID_SIZE;
+        *what = "Argument blob doesn't match kernel signature";
+        return NULL;
+    }
+
+    memcpy(args, req + 1, arg_size);
+
+    for (uint32_t i = 0; i < pf->num_params; i++) {
+        if (pf->params[i].size != sizeof(uint64_t)) {
+            continue;
+        }
+
+        uint64_t value;
+        memcpy(&value, args + pf->params[i].offset, sizeof(value));
+        if (!idm_va_valid(value)) {
+            continue;
+        }
+
+        /* One past the end is still a valid pointer to form */
+        size_t alloc_size;
+        uint64_t offset = value & IDM_VA_OFFSET_MASK;
+        void *ptr = memory_lookup_slot(zone_id, idm_va_slot(value), &alloc_size, err_out, what);
+        if (!ptr && *err_out == IDM_ERROR_OUT_OF_MEMORY) {
+            return NULL;  /* Evicted and no room to bring it back */
+        }
+        if (!ptr || offset > alloc_size) {
+            *err_out = IDM_ERROR_INVALID_HANDLE;
+            *what = "Kernel argument points outside the zone's memory";
+            return NULL;
+        }
+
+        CUdeviceptr dptr = (CUdeviceptr)ptr + offset;
+        memcpy(args + pf->params[i].offset, &dptr, sizeof(dptr));
+    }
+
+    return pf;
+}
+
+/**
+ * Launch a prepared kernel on stream
+ */
+static CUresult launch_issue(const struct proxy_function *pf,
+                             const struct idm_gpu_launch_kernel *req,
+                             uint8_t *args, CUstream stream)
+{
+    size_t args_len = pf->arg_size;
+    void *extra[] = {
+        CU_LAUNCH_PARAM_BUFFER_POINTER, args,
+        CU_LAUNCH_PARAM_BUFFER_SIZE, &args_len,
+        CU_LAUNCH_PARAM_END
+    };
+
+    return STATS_CUDA_CALL(cuLaunchKernel(pf->func,
+                                          req->grid_dim_x, req->grid_dim_y, req->grid_dim_z,
+                                          req->block_dim_x, req->block_dim_y, req->block_dim_z,
+                                          req->shared_mem, stream, NULL, extra));
+}
+
+/**
+ * Handle GPU_LAUNCH_KERNEL
+ *
+ * Answered once the launch is queued; faults inside the kernel show up
+ * at the next synchronize, as with a local launch.
+ */
+void handle_gpu_launch_kernel(const struct idm_message *msg)
+{
+    const struct idm_gpu_launch_kernel *req = (const struct idm_gpu_launch_kernel *)msg->payload;
+    uint32_t zone_id = msg->header.src_zone;
+    uint64_t seq = msg->header.seq_num;
+
+    uint8_t args[IDM_KERNEL_ARGS_MAX];
+    enum idm_error err;
+    const char *what;
+    const struct proxy_function *pf = launch_prepare(zone_id, req, msg->header.payload_len,
+                                                     args, &err, &what);
+    if (!pf) {
+        send_response_error(zone_id, seq, err, 0, what);
+        return;
+    }
+
+    CUstream stream;
+    if (!lookup_stream(zone_id, req->stream_handle, &stream)) {
+        send_response_error(zone_id, seq, IDM_ERROR_INVALID_HANDLE, 0,
+                            "Invalid stream handle");
+        return;
+    }
+
+    CUresult res = launch_issue(pf, req, args, stream);
+    if (res != CUDA_SUCCESS) {
+        send_cuda_error(zone_id, seq, res, "cuLaunchKernel");
+        return;
+    }
+
+    send_response_ok(zone_id, seq, 0, NULL, 0);
+}
+
+/* ============================================================================
+ * Graphs
+ *
+ * The guest records a command list once and sends it whole; it is replayed
+ * into a capture on a private stream, so the driver builds the graph
+ * exactly as for a local capture. Each replay afterwards is one small
+ * GPU_GRAPH_LAUNCH.
+ * ============================================================================ */
+
+/**
+ * Replay recorded commands on a capturing stream
+ *
+ * @return IDM_ERROR_NONE, or an error with *what set (and *res_out for
+ *         IDM_ERROR_CUDA_ERROR)
+ */
+static enum idm_error graph_record(uint32_t zone_id, CUstream stream,
+                                   const uint8_t *records, uint64_t size, uint32_t count,
+                                   CUresult *res_out, const char **what)
+{
+    uint64_t off = 0;
+
+    for (uint32_t i = 0; i < count; i++) {
+        struct idm_batch_cmd cmd;
+        if (size - off < sizeof(cmd)) {
+            *what = "Truncated graph record";
+            return IDM_ERROR_INVALID_MESSAGE;
+        }
+        memcpy(&cmd, records + off, sizeof(cmd));
+        off += sizeof(cmd);
+
+        if (cmd.payload_len > size - off) {
+            *what = "Truncated graph record";
+            return IDM_ERROR_INVALID_MESSAGE;
+        }
+
+        if (cmd.msg_type == IDM_GPU_MEMSET) {
+            if (cmd.payload_len < sizeof(struct idm_gpu_memset)) {
+                *what = "Truncated graph record";
+                return IDM_ERROR_INVALID_MESSAGE;
+            }
+            enum idm_error err = memset_issue(zone_id, (const void *)(records + off),
+                                              stream, res_out, what);
+            if (err != IDM_ERROR_NONE) {
+                return err;
+            }
+        } else if (cmd.msg_type == IDM_GPU_COPY_D2D) {
+            if (cmd.payload_len < sizeof(struct idm_gpu_copy_d2d)) {
+                *what = "Truncated graph record";
+                return IDM_ERROR_INVALID_MESSAGE;
+            }
+            enum idm_error err = copy_d2d_issue(zone_id, (const void *)(records + off),
+                                                stream, res_out, what);
+            if (err != IDM_ERROR_NONE) {
+                return err;
+            }
+        } else if (cmd.msg_type == IDM_GPU_LAUNCH_KERNEL) {
+            const struct idm_gpu_launch_kernel *req = (const void *)(records + off);
+            uint8_t args[IDM_KERNEL_ARGS_MAX];
+            enum idm_error err;
+            const struct proxy_function *pf = launch_prepare(zone_id, req, cmd.payload_len,
+                                                             args, &err, what);
+            if (!pf) {
+                return err;
+            }
+
+            *res_out = launch_issue(pf, req, args, stream);
+            if (*res_out != CUDA_SUCCESS) {
+                *what = "cuLaunchKernel";
+                return IDM_ERROR_CUDA_ERROR;
+            }
+        } else {
+            *what = "Command can't be recorded in a graph";
+            return IDM_ERROR_INVALID_MESSAGE;
+        }
+
+        off += IDM_BATCH_CMD_SPACE(cmd.payload_len) - sizeof(cmd);
+        if (off > size) {
+            off = size;
+        }
+    }
+
+    return IDM_ERROR_NONE;
+}
+
+/**
+ * Handle GPU_GRAPH_INSTANTIATE
+ */
+void handle_gpu_graph_instantiate(const struct idm_message *msg)
+{
+    const struct idm_gpu_graph_instantiate *req =
+        (const struct idm_gpu_graph_instantiate *)msg->payload;
+    uint32_t zone_id = msg->header.src_zone;
+    uint64_t seq = msg->header.seq_num;
+    uint64_t size = req->size;
+    uint32_t flags = req->flags;
+    uint32_t count = req->count;
+
+    LOG("[GPU_GRAPH_INSTANTIATE] Zone %u: %u commands, %lu bytes (%s)\n",
+        zone_id, count, size, (flags & IDM_COPY_BULK) ? "bulk" : "inline");
+
+    const uint8_t *src = copy_host_data(msg, sizeof(*req), flags, req->bulk_offset, size);
+    if (!src) {
+        send_response_error(zone_id, seq, IDM_ERROR_INVALID_SIZE, 0,
+                            "Graph records out of bounds");
+        return;
+    }
+
+    /* Parsed more than once: take it out of guest-writable memory */
+    uint8_t *records = malloc(size ? size : 1);
+    if (!records) {
+        send_response_error(zone_id, seq, IDM_ERROR_OUT_OF_MEMORY, 0,
+                            "Failed to copy graph records");
+        return;
+    }
+    memcpy(records, src, size);
+
+    /* Copies can't run while capturing, and graphs keep raw addresses:
+     * everything the graph may touch has to be on the device from now on */
+    if (evict_restore_zone(zone_id) < 0) {
+        free(records);
+        send_response_error(zone_id, seq, IDM_ERROR_OUT_OF_MEMORY, 0,
+                            "Out of device memory");
+        return;
+    }
+
+    CUstream stream = NULL;
+    CUgraph graph = NULL;
+    CUgraphExec exec = NULL;
+    CUresult res = STATS_CUDA_CALL(cuStreamCreateWithPriority(&stream, CU_STREAM_NON_BLOCKING, 0));
+    if (res == CUDA_SUCCESS) {
+        res = STATS_CUDA_CALL(cuStreamBeginCapture(stream, CU_STREAM_CAPTURE_MODE_THREAD_LOCAL));
+    }
+    if (res != CUDA_SUCCESS) {
+        if (stream) {
+            cuStreamDestroy(stream);
+        }
+        free(records);
+        send_cuda_error(zone_id, seq, res, "cuStreamBeginCapture");
+        return;
+    }
+
+    const char *what = NULL;
+    CUresult rec_res = CUDA_SUCCESS;
+    enum idm_error err = graph_record(zone_id, stream, records, size, count, &rec_res, &what);
+    free(records);
+
+    /* Always end the capture, even after a failed record */
+    res = STATS_CUDA_CALL(cuStreamEndCapture(stream, &graph));
+    cuStreamDestroy(stream);
+
+    if (err == IDM_ERROR_NONE && res == CUDA_SUCCESS) {
+        res = STATS_CUDA_CALL(cuGraphInstantiate(&exec, graph, 0));
+        what = "cuGraphInstantiate";
+    } else if (err == IDM_ERROR_NONE) {
+        what = "cuStreamEndCapture";
+    }
+    if (graph) {
+        cuGraphDestroy(graph);
+    }
+
+    if (err == IDM_ERROR_CUDA_ERROR) {
+        send_cuda_error(zone_id, seq, rec_res, what);
+        return;
+    }
+    if (err != IDM_ERROR_NONE) {
+        send_response_error(zone_id, seq, err, 0, what);
+        return;
+    }
+    if (res != CUDA_SUCCESS) {
+        send_cuda_error(zone_id, seq, res, what);
+        return;
+    }
+
+    uint64_t handle = handle_table_insert(zone_id, HANDLE_TYPE_GRAPH, exec, 0);
+    if (handle == 0) {
+        cuGraphExecDestroy(exec);
+        send_response_error(zone_id, seq, IDM_ERROR_OUT_OF_MEMORY, 0,
+                            "Failed to create handle");
+        return;
+    }
+    evict_zone_graphs(zone_id, 1);
+
+    LOG("  Graph handle: 0x%lx\n", handle);
+    send_response_ok(zone_id, seq, handle, NULL, 0);
+}
+
+/**
+ * Handle GPU_GRAPH_LAUNCH (answered once queued, like a kernel launch)
+ */
+void handle_gpu_graph_launch(const struct idm_message *msg)
+{
+    const struct idm_gpu_graph_launch *req = (const struct idm_gpu_graph_launch *)msg->payload;
+    uint32_t zone_id = msg->header.src_zone;
+    uint64_t seq = msg->header.seq_num;
+
+    CUgraphExec exec = handle_table_lookup(zone_id, HANDLE_TYPE_GRAPH, req->graph_handle, NULL);
+    if (!exec) {
+        send_response_error(zone_id, seq, IDM_ERROR_INVALID_HANDLE, 0, "Invalid graph handle");
+        return;
+    }
+
+    CUstream stream;
+    if (!lookup_stream(zone_id, req->stream_handle, &stream)) {
+        send_response_error(zone_id, seq, IDM_ERROR_INVALID_HANDLE, 0,
+                            "Invalid stream handle");
+        return;
+    }
+
+    CUresult res = STATS_CUDA_CALL(cuGraphLaunch(exec, stream));
+    if (res != CUDA_SUCCESS) {
+        send_cuda_error(zone_id, seq, res, "cuGraphLaunch");
+        return;
+    }
+
+    send_response_ok(zone_id, seq, 0, NULL, 0);
+}
+
+/**
+ * Handle GPU_GRAPH_DESTROY
+ */
+void handle_gpu_graph_destroy(const struct idm_message *msg)
+{
+    const struct idm_gpu_graph *req = (const struct idm_gpu_graph *)msg->payload;
+    uint32_t zone_id = msg->header.src_zone;
+    uint64_t seq = msg->header.seq_num;
+
+    CUgraphExec exec = handle_table_remove(zone_id, HANDLE_TYPE_GRAPH, req->graph_handle);
+    if (!exec) {
+        send_response_error(zone_id, seq, IDM_ERROR_INVALID_HANDLE, 0, "Invalid graph handle");
+        return;
+    }
+    evict_zone_graphs(zone_id, -1);
+
+    CUresult res = STATS_CUDA_CALL(cuGraphExecDestroy(exec));
+    if (res != CUDA_SUCCESS) {
+        send_cuda_error(zone_id, seq, res, "cuGraphExecDestroy");
+        return;
+    }
+
+    send_response_ok(zone_id, seq, 0, NULL, 0);
+}
+
+/**
+ * Free one object of a zone being torn down
+ */
+static void release_object(enum handle_type type, void *ptr, size_t size)
+{
+    (void)size;
+
+    switch (type) {
+        case HANDLE_TYPE_MEMORY:
+            if (evict_is_evicted(ptr)) {
+                evict_discard(ptr);
+            }
+            break;  /* Goes back with the zone's whole pool */
+        case HANDLE_TYPE_STREAM:
+            cuStreamDestroy((CUstream)ptr);
+            break;
+        case HANDLE_TYPE_EVENT:
+            cuEventDestroy((CUevent)ptr);
+            break;
+        case HANDLE_TYPE_MODULE: {
+            /* Its function handles are released with the zone as well */
+            struct proxy_module *pm = ptr;
+            cuModuleUnload(pm->module);
+            free(pm->funcs);
+            free(pm);
+            break;
+        }
+        case HANDLE_TYPE_FUNCTION:
+            free(ptr);
+            break;
+        case HANDLE_TYPE_GRAPH:
+            cuGraphExecDestroy((CUgraphExec)ptr);
+            break;
+        case HANDLE_TYPE_HOST:
+            host_region_destroy(ptr);
+            break;
+    }
+}
+
+/**
+ * Release everything a zone holds (on its worker)
+ *
+ * @param memory_out [out] Bytes of device memory its handles held
+ * @return Handles released
+ */
+static uint64_t release_zone(uint32_t zone_id, uint64_t *memory_out)
+{
+    handle_table_zone_stats(zone_id, NULL, memory_out);
+
+    /* Nothing may still be using what we're about to free */
+    for (int i = 0; i < DEVICES_MAX; i++) {
+        if (worker_streams[i]) {
+            cuStreamSynchronize(worker_streams[i]);
+        }
+    }
+
+    uint64_t released = handle_table_release_zone(zone_id, release_object);
+    mem_pool_release_zone(zone_id);
+    evict_release_zone(zone_id);
+
+    return released;
+}
+
+/**
+ * Handle DISCONNECT
+ *
+ * Runs on the zone's worker after everything it sent earlier, and tears
+ * down all of the zone's handles. There is nobody left to answer.
+ */
+void handle_disconnect(const struct idm_message *msg)
+{
+    uint32_t zone_id = msg->header.src_zone;
+
+    uint64_t memory = 0;
+    uint64_t released = release_zone(zone_id, &memory);
+
+    printf("[DISCONNECT] Zone %u: released %lu handle(s), %lu bytes\n",
+           zone_id, released, memory);
+}
+
+/* Sessions started so far (over all zones); each gets its own seq range */
+static uint64_t session_count = 0;
+
+/**
+ * Handle HELLO
+ *
+ * A new guest process took over the zone's rings. Whatever an earlier one
+ * left is released first: if it went away between two liveness checks, no
+ * DISCONNECT was ever queued for it.
+ */
+void handle_hello(const struct idm_message *msg)
+{
+    uint32_t zone_id = msg->header.src_zone;
+    uint64_t seq = msg->header.seq_num;
+
+    if (msg->header.payload_len < sizeof(struct idm_hello)) {
+        send_response_error(zone_id, seq, IDM_ERROR_INVALID_MESSAGE, 0, "Invalid payload size");
+        return;
+    }
+
+    const struct idm_hello *hello = (const struct idm_hello *)msg->payload;
+
+    uint64_t memory = 0;
+    uint64_t released = release_zone(zone_id, &memory);
+    if (released > 0) {
+        printf("[HELLO] Zone %u: released %lu handle(s), %lu bytes of the previous session\n",
+               zone_id, released, memory);
+    }
+
+    uint64_t session = __atomic_add_fetch(&session_count, 1, __ATOMIC_RELAXED);
+    uint64_t first_seq = session << IDM_SESSION_SHIFT;
+
+    LOG("[HELLO] Zone %u: session %lu (pid %u)\n", zone_id, session, hello->pid);
+
+    send_ok(zone_id, seq, first_seq, (uint32_t)devices_zone_count(zone_id), NULL, 0);
+}
+
+/**
+ * Answer a request of a type this proxy doesn't know
+ */
+void handle_unknown(const struct idm_message *msg)
+{
+    fprintf(stderr, "Unknown message type: 0x%x\n", msg->header.msg_type);
+    send_response_error(msg->header.src_zone, msg->header.seq_num,
+                        IDM_ERROR_INVALID_MESSAGE, 0, "Unknown message type");
+}
+
+/**
+ * Handle BATCH
+ *
+ * Runs each sub-command through dispatch in order, then answers all of
+ * them with one RESPONSE_BATCH.
+ */
+void handle_batch(const struct idm_message *msg,
+                  void (*dispatch)(const struct idm_message *msg))
+{
+    const struct idm_batch *batch = (const struct idm_batch *)msg->payload;
+    uint32_t zone_id = msg->header.src_zone;
+    uint64_t seq = msg->header.seq_num;
+
+    /* Snapshot sizes: the batch may still sit in the sender's ring slot */
+    uint32_t payload_len = msg->header.payload_len;
+    uint32_t count = batch->count;
+
+    if (payload_len < sizeof(*batch) || payload_len > IDM_ENTRY_PAYLOAD_MAX ||
+        count > IDM_BATCH_MAX_CMDS || batch_sink != NULL) {
+        send_response_error(zone_id, seq, IDM_ERROR_INVALID_MESSAGE, 0, "Malformed batch");
+        return;
+    }
+
+    LOG("[BATCH] Zone %u: %u commands\n", zone_id, count);
+
+    /* Sub-messages are rebuilt here so handlers see an ordinary message */
+    static __thread uint64_t sub_buf[sizeof(struct idm_ring_entry) / sizeof(uint64_t)];
+    struct idm_message *sub = (struct idm_message *)sub_buf;
+
+    struct batch_sink sink;
+    sink.count = 0;
+    batch_sink = &sink;
+
+    size_t off = sizeof(*batch);
+    uint32_t i;
+    for (i = 0; i < count; i++) {
+        struct idm_batch_cmd cmd;
+        if (payload_len - off < sizeof(cmd)) {
+            break;
+        }
+        memcpy(&cmd, msg->payload + off, sizeof(cmd));
+
+        if (cmd.payload_len > payload_len - off - sizeof(cmd) ||
+            cmd.payload_len > IDM_ENTRY_PAYLOAD_MAX) {
+            break;
+        }
+
+        if (cmd.msg_type == IDM_BATCH) {
+            send_response_error(zone_id, cmd.seq_num, IDM_ERROR_INVALID_MESSAGE, 0,
+                                "Nested batch");
+        } else {
+            sub->header = msg->header;
+            sub->header.msg_type = cmd.msg_type;
+            sub->header.seq_num = cmd.seq_num;
+            sub->header.payload_len = cmd.payload_len;
+            memcpy(sub->payload, msg->payload + off + sizeof(cmd), cmd.payload_len);
+
+            dispatch(sub);
+        }
+
+        off += IDM_BATCH_CMD_SPACE(cmd.payload_len);
+        if (off > payload_len) {
+            off = payload_len;
+        }
+    }
+
+    batch_sink = NULL;
+
+    if (i < count) {
+        fprintf(stderr, "[BATCH] Zone %u: truncated sub-command %u of %u\n",
+                zone_id, i, count);
+        send_response_error(zone_id, seq, IDM_ERROR_INVALID_MESSAGE, 0, "Malformed batch");
+    }
+
+    if (sink.count == 0) {
+        return;
+    }
+
+    /* One combined response for everything answered inline */
+    uint64_t t0 = stats_now_ns();
+    size_t resp_len = sizeof(struct idm_batch) + sink.count * sizeof(sink.results[0]);
+    struct idm_connection *conn = idm_conn_lookup(zone_id);
+    struct idm_message *out = idm_conn_reserve(conn, IDM_RESPONSE_BATCH, resp_len);
+    if (!out) {
+        fprintf(stderr, "[BATCH] Zone %u: failed to send response\n", zone_id);
+        return;
+    }
+
+    struct idm_batch *resp = (struct idm_batch *)out->payload;
+    resp->count = sink.count;
+    resp->reserved = 0;
+    memcpy(out->payload + sizeof(*resp), sink.results, sink.count * sizeof(sink.results[0]));
+
+    idm_conn_commit(conn, out);
+    stats_add(STATS_SEND, stats_now_ns() - t0);
+}
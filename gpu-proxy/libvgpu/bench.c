@@ -0,0 +1,831 @@
+/*
+ * CUDA Driver API Microbenchmarks
+ *
+ * Only uses the driver API, so the same binary runs on libvgpu (stub or
+ * Xen transport) and on the real libcuda, and the results compare side
+ * by side:
+ *
+ *   ./bench                                       # libvgpu via ./libcuda.so.1
+ *   LD_LIBRARY_PATH=/usr/lib/x86_64-linux-gnu ./bench -l baremetal
+ *
+ * Benchmarks (-b, comma separated; default all):
+ *   latency     Round-trip latency distribution of synchronous calls
+ *   throughput  Async operations per second with N requests in flight
+ *   bandwidth   H2D/D2H GB/s by transfer size, pageable and pinned
+ *   scaling     Round trips per second with 1..N client processes
+ *   threads     Round trips per second with 1..N threads of this process
+ *   spin        Round-trip latency with spin vs block receive (libvgpu)
+ *
+ * Client processes of the scaling benchmark use the zones after this
+ * process's (IDM_ZONE_ID + 1 ...), so the proxy must serve them, e.g.
+ * `gpu_proxy -z 2-6` for `-c 4`.
+ *
+ * Every result is also written as one JSON object per line to -o FILE.
+ */
+
+#define _GNU_SOURCE
+#include "cuda.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <sys/wait.h>
+
+#define CHECK_CUDA(call) do { \
+    CUresult result = (call); \
+    if (result != CUDA_SUCCESS) { \
+        const char *errstr; \
+        cuGetErrorString(result, &errstr); \
+        fprintf(stderr, "CUDA error at %s:%d: %s\n", __FILE__, __LINE__, errstr); \
+        exit(1); \
+    } \
+} while(0)
+
+#define MAX_CLIENTS 32
+
+/* Options */
+static int iterations = 10000;
+static int warmup = 1000;
+static size_t max_transfer = 64 << 20;
+static int max_clients = 4;
+static int duration_ms = 1000;
+static const char *label = NULL;
+static FILE *json_out = NULL;
+
+static CUcontext context;
+static CUstream stream;
+
+/* libvgpu's transport knob (absent on the real driver) */
+static void (*set_spin_us)(unsigned int spin_us);
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/* ============================================================================
+ * Results
+ * ============================================================================ */
+
+struct latency {
+    double mean_us;
+    double p50_us;
+    double p90_us;
+    double p99_us;
+    double p999_us;
+    double max_us;
+};
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Summarize samples (sorts them)
+ */
+static struct latency summarize(uint64_t *samples, int n)
+{
+    struct latency l = {0};
+    if (n <= 0) {
+        return l;
+    }
+
+    qsort(samples, n, sizeof(samples[0]), cmp_u64);
+
+    double sum = 0;
+    for (int i = 0; i < n; i++) {
+        sum += samples[i];
+    }
+
+    l.mean_us = sum / n / 1000.0;
+    l.p50_us = samples[(int)(0.50 * (n - 1))] / 1000.0;
+    l.p90_us = samples[(int)(0.90 * (n - 1))] / 1000.0;
+    l.p99_us = samples[(int)(0.99 * (n - 1))] / 1000.0;
+    l.p999_us = samples[(int)(0.999 * (n - 1))] / 1000.0;
+    l.max_us = samples[n - 1] / 1000.0;
+    return l;
+}
+
+/**
+ * Start a JSON result line; add fields with json_num, finish with json_end
+ */
+static void json_begin(const char *bench, const char *op)
+{
+    if (json_out) {
+        fprintf(json_out, "{\"backend\":\"%s\",\"bench\":\"%s\",\"op\":\"%s\"",
+                label, bench, op);
+    }
+}
+
+static void json_num(const char *key, double value)
+{
+    if (json_out) {
+        if (value == (double)(int64_t)value) {
+            fprintf(json_out, ",\"%s\":%lld", key, (long long)value);
+        } else {
+            fprintf(json_out, ",\"%s\":%.3f", key, value);
+        }
+    }
+}
+
+static void json_end(void)
+{
+    if (json_out) {
+        fprintf(json_out, "}\n");
+        fflush(json_out);
+    }
+}
+
+static void json_latency(const struct latency *l)
+{
+    json_num("mean_us", l->mean_us);
+    json_num("p50_us", l->p50_us);
+    json_num("p90_us", l->p90_us);
+    json_num("p99_us", l->p99_us);
+    json_num("p999_us", l->p999_us);
+    json_num("max_us", l->max_us);
+}
+
+static void print_latency_header(const char *what)
+{
+    printf("  %-18s %9s %9s %9s %9s %9s %9s %11s\n",
+           what, "mean(us)", "p50", "p90", "p99", "p99.9", "max", "ops/s");
+}
+
+static void print_latency(const char *name, const struct latency *l)
+{
+    printf("  %-18s %9.2f %9.2f %9.2f %9.2f %9.2f %9.2f %11.0f\n",
+           name, l->mean_us, l->p50_us, l->p90_us, l->p99_us, l->p999_us, l->max_us,
+           l->mean_us > 0 ? 1e6 / l->mean_us : 0);
+}
+
+/* ============================================================================
+ * Latency
+ * ============================================================================ */
+
+/* One synchronous call; returns its duration in ns */
+typedef uint64_t (*timed_op_fn)(void *arg);
+
+struct op_buffers {
+    CUdeviceptr dptr;
+    void *host;
+};
+
+static uint64_t op_sync(void *arg)
+{
+    (void)arg;
+    uint64_t t0 = now_ns();
+    CHECK_CUDA(cuCtxSynchronize());
+    return now_ns() - t0;
+}
+
+static uint64_t op_alloc(void *arg)
+{
+    (void)arg;
+    CUdeviceptr ptr;
+    uint64_t t0 = now_ns();
+    CHECK_CUDA(cuMemAlloc(&ptr, 4096));
+    uint64_t ns = now_ns() - t0;
+    CHECK_CUDA(cuMemFree(ptr));
+    return ns;
+}
+
+static uint64_t op_d2h_4k(void *arg)
+{
+    struct op_buffers *b = arg;
+    uint64_t t0 = now_ns();
+    CHECK_CUDA(cuMemcpyDtoH(b->host, b->dptr, 4096));
+    return now_ns() - t0;
+}
+
+/**
+ * Time an operation (after warmup)
+ */
+static struct latency measure(timed_op_fn op, void *arg, int n)
+{
+    uint64_t *samples = malloc(n * sizeof(*samples));
+    if (!samples) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+
+    for (int i = 0; i < warmup; i++) {
+        op(arg);
+    }
+    for (int i = 0; i < n; i++) {
+        samples[i] = op(arg);
+    }
+
+    struct latency l = summarize(samples, n);
+    free(samples);
+    return l;
+}
+
+static void bench_latency(void)
+{
+    printf("\n=== Round-trip latency (%d iterations, %d warmup) ===\n", iterations, warmup);
+
+    struct op_buffers b;
+    CHECK_CUDA(cuMemAlloc(&b.dptr, 4096));
+    b.host = calloc(1, 4096);
+
+    static const struct {
+        const char *name;
+        timed_op_fn fn;
+    } ops[] = {
+        { "sync", op_sync },
+        { "alloc", op_alloc },
+        { "d2h_4k", op_d2h_4k },
+    };
+
+    print_latency_header("call");
+    for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+        struct latency l = measure(ops[i].fn, &b, iterations);
+        print_latency(ops[i].name, &l);
+
+        json_begin("latency", ops[i].name);
+        json_num("iterations", iterations);
+        json_latency(&l);
+        json_end();
+    }
+
+    free(b.host);
+    CHECK_CUDA(cuMemFree(b.dptr));
+}
+
+/* ============================================================================
+ * Throughput
+ * ============================================================================ */
+
+static void bench_throughput(void)
+{
+    printf("\n=== Async throughput (cuMemsetD8Async, N in flight before each sync) ===\n");
+    printf("  %-8s %12s %12s\n", "in flight", "ops/s", "us/op");
+
+    CUdeviceptr dptr;
+    CHECK_CUDA(cuMemAlloc(&dptr, 4096));
+
+    for (int window = 1; window <= 32; window *= 2) {
+        int rounds = iterations / window;
+        if (rounds < 1) {
+            rounds = 1;
+        }
+
+        for (int i = 0; i < warmup / window; i++) {
+            CHECK_CUDA(cuMemsetD8Async(dptr, 0, 64, stream));
+            CHECK_CUDA(cuStreamSynchronize(stream));
+        }
+
+        uint64_t t0 = now_ns();
+        for (int r = 0; r < rounds; r++) {
+            for (int i = 0; i < window; i++) {
+                CHECK_CUDA(cuMemsetD8Async(dptr, (unsigned char)i, 64, stream));
+            }
+            CHECK_CUDA(cuStreamSynchronize(stream));
+        }
+        double secs = (now_ns() - t0) / 1e9;
+        double ops = (double)rounds * window;
+
+        printf("  %-8d %12.0f %12.2f\n", window, ops / secs, secs * 1e6 / ops);
+
+        json_begin("throughput", "memset_async");
+        json_num("in_flight", window);
+        json_num("ops", ops);
+        json_num("ops_per_sec", ops / secs);
+        json_end();
+    }
+
+    CHECK_CUDA(cuMemFree(dptr));
+}
+
+/* ============================================================================
+ * Bandwidth
+ * ============================================================================ */
+
+/**
+ * Time reps copies of size bytes; returns GB/s
+ */
+static double copy_rate(CUdeviceptr dptr, void *host, size_t size, bool h2d, int reps)
+{
+    uint64_t t0 = now_ns();
+    for (int i = 0; i < reps; i++) {
+        if (h2d) {
+            CHECK_CUDA(cuMemcpyHtoD(dptr, host, size));
+        } else {
+            CHECK_CUDA(cuMemcpyDtoH(host, dptr, size));
+        }
+    }
+    CHECK_CUDA(cuCtxSynchronize());
+    double secs = (now_ns() - t0) / 1e9;
+
+    return (double)size * reps / secs / 1e9;
+}
+
+static void bench_bandwidth(void)
+{
+    printf("\n=== Copy bandwidth (GB/s, 4 KB to %zu MB) ===\n", max_transfer >> 20);
+    printf("  %-10s %12s %12s %12s %12s\n", "size", "h2d", "d2h", "h2d pinned", "d2h pinned");
+
+    CUdeviceptr dptr;
+    CHECK_CUDA(cuMemAlloc(&dptr, max_transfer));
+
+    void *pageable = malloc(max_transfer);
+    void *pinned = NULL;
+    if (!pageable) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    memset(pageable, 0x5A, max_transfer);
+    if (cuMemAllocHost(&pinned, max_transfer) != CUDA_SUCCESS) {
+        pinned = NULL;
+        printf("  (no pinned memory of that size; pinned columns skipped)\n");
+    } else {
+        memset(pinned, 0x5A, max_transfer);
+    }
+
+    for (size_t size = 4096; size <= max_transfer; size *= 4) {
+        /* Enough repetitions for ~256 MB per measurement */
+        int reps = (int)((256u << 20) / size);
+        if (reps < 3) {
+            reps = 3;
+        }
+        if (reps > 1000) {
+            reps = 1000;
+        }
+
+        double rate[4] = {0};
+        for (int mode = 0; mode < 4; mode++) {
+            void *host = mode < 2 ? pageable : pinned;
+            bool h2d = (mode % 2) == 0;
+            if (!host) {
+                continue;
+            }
+            copy_rate(dptr, host, size, h2d, 1);
+            rate[mode] = copy_rate(dptr, host, size, h2d, reps);
+
+            json_begin("bandwidth", h2d ? "h2d" : "d2h");
+            json_num("bytes", (double)size);
+            json_num("pinned", mode >= 2);
+            json_num("reps", reps);
+            json_num("gb_per_sec", rate[mode]);
+            json_end();
+        }
+
+        char name[32];
+        if (size >= (1u << 20)) {
+            snprintf(name, sizeof(name), "%zu MB", size >> 20);
+        } else {
+            snprintf(name, sizeof(name), "%zu KB", size >> 10);
+        }
+        printf("  %-10s %12.3f %12.3f %12.3f %12.3f\n", name, rate[0], rate[1], rate[2], rate[3]);
+
+        if (size > max_transfer / 4 && size != max_transfer) {
+            size = max_transfer / 4;   /* End the sweep on max_transfer itself */
+        }
+    }
+
+    if (pinned) {
+        cuMemFreeHost(pinned);
+    }
+    free(pageable);
+    CHECK_CUDA(cuMemFree(dptr));
+}
+
+/* ============================================================================
+ * Scaling
+ *
+ * Clients are fresh processes (this binary with -C), each on its own zone.
+ * They report ready, wait for the start byte, run round trips for the
+ * duration and report "ops elapsed_ns p50_ns p99_ns".
+ * ============================================================================ */
+
+struct client {
+    pid_t pid;
+    FILE *results;     /* Client's stdout */
+    int start_fd;      /* Client's stdin */
+};
+
+static int client_main(void)
+{
+    CUdevice device;
+    CHECK_CUDA(cuInit(0));
+    CHECK_CUDA(cuDeviceGet(&device, 0));
+    CHECK_CUDA(cuCtxCreate(&context, 0, device));
+
+    for (int i = 0; i < warmup; i++) {
+        op_sync(NULL);
+    }
+
+    printf("ready\n");
+    fflush(stdout);
+
+    char go;
+    if (read(STDIN_FILENO, &go, 1) != 1) {
+        return 1;
+    }
+
+    size_t cap = 1 << 16;
+    uint64_t *samples = malloc(cap * sizeof(*samples));
+    uint64_t ops = 0;
+    uint64_t t0 = now_ns();
+    uint64_t end = t0 + (uint64_t)duration_ms * 1000000;
+    uint64_t now = t0;
+
+    while (now < end) {
+        uint64_t ns = op_sync(NULL);
+        if (samples && ops < cap) {
+            samples[ops] = ns;
+        }
+        ops++;
+        now = now_ns();
+    }
+
+    int n = ops < cap ? (int)ops : (int)cap;
+    struct latency l = samples ? summarize(samples, n) : (struct latency){0};
+    printf("%lu %lu %.3f %.3f\n", (unsigned long)ops, (unsigned long)(now - t0),
+           l.p50_us, l.p99_us);
+    fflush(stdout);
+
+    free(samples);
+    cuCtxDestroy(context);
+    return 0;
+}
+
+/**
+ * Start a client process on a zone
+ */
+static int client_spawn(struct client *c, const char *self, uint32_t zone)
+{
+    int to_child[2], from_child[2];
+    if (pipe(to_child) < 0) {
+        return -1;
+    }
+    if (pipe(from_child) < 0) {
+        close(to_child[0]);
+        close(to_child[1]);
+        return -1;
+    }
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(to_child[0]);
+        close(to_child[1]);
+        close(from_child[0]);
+        close(from_child[1]);
+        return -1;
+    }
+
+    if (pid == 0) {
+        char zone_str[16], dur_str[16], warm_str[16];
+        snprintf(zone_str, sizeof(zone_str), "%u", zone);
+        snprintf(dur_str, sizeof(dur_str), "%d", duration_ms);
+        snprintf(warm_str, sizeof(warm_str), "%d", warmup);
+        setenv("IDM_ZONE_ID", zone_str, 1);
+
+        dup2(to_child[0], STDIN_FILENO);
+        dup2(from_child[1], STDOUT_FILENO);
+        close(to_child[0]);
+        close(to_child[1]);
+        close(from_child[0]);
+        close(from_child[1]);
+
+        execl(self, self, "-C", "-d", dur_str, "-w", warm_str, (char *)NULL);
+        _exit(127);
+    }
+
+    close(to_child[0]);
+    close(from_child[1]);
+    c->pid = pid;
+    c->start_fd = to_child[1];
+    c->results = fdopen(from_child[0], "r");
+    return c->results ? 0 : -1;
+}
+
+static void bench_scaling(const char *self)
+{
+    printf("\n=== Multi-client scaling (cuCtxSynchronize round trips, %d ms) ===\n",
+           duration_ms);
+    printf("  %-8s %12s %12s %12s\n", "clients", "total ops/s", "p50 (us)", "p99 (us)");
+
+    uint32_t base = 2;
+    const char *zone_env = getenv("IDM_ZONE_ID");
+    if (zone_env && *zone_env) {
+        base = (uint32_t)strtoul(zone_env, NULL, 10);
+    }
+
+    for (int n = 1; n <= max_clients; n *= 2) {
+        struct client clients[MAX_CLIENTS];
+        int started = 0;
+        bool ok = true;
+
+        for (int i = 0; i < n; i++) {
+            if (client_spawn(&clients[i], self, base + 1 + i) < 0) {
+                ok = false;
+                break;
+            }
+            started++;
+        }
+
+        /* Everyone set up before anyone starts */
+        char line[128];
+        for (int i = 0; i < started && ok; i++) {
+            if (!fgets(line, sizeof(line), clients[i].results) ||
+                strncmp(line, "ready", 5) != 0) {
+                ok = false;
+            }
+        }
+        for (int i = 0; i < started; i++) {
+            if (ok && write(clients[i].start_fd, "g", 1) != 1) {
+                ok = false;
+            }
+            close(clients[i].start_fd);
+        }
+
+        double total_rate = 0, worst_p50 = 0, worst_p99 = 0;
+        for (int i = 0; i < started; i++) {
+            unsigned long ops, ns;
+            double p50, p99;
+            if (ok && fgets(line, sizeof(line), clients[i].results) &&
+                sscanf(line, "%lu %lu %lf %lf", &ops, &ns, &p50, &p99) == 4 && ns > 0) {
+                total_rate += ops / (ns / 1e9);
+                worst_p50 = p50 > worst_p50 ? p50 : worst_p50;
+                worst_p99 = p99 > worst_p99 ? p99 : worst_p99;
+            } else {
+                ok = false;
+            }
+            fclose(clients[i].results);
+            waitpid(clients[i].pid, NULL, 0);
+        }
+
+        if (!ok) {
+            printf("  %-8d (clients failed; does the proxy serve zones %u-%u?)\n",
+                   n, base + 1, base + n);
+            break;
+        }
+
+        printf("  %-8d %12.0f %12.2f %12.2f\n", n, total_rate, worst_p50, worst_p99);
+
+        json_begin("scaling", "sync");
+        json_num("clients", n);
+        json_num("ops_per_sec", total_rate);
+        json_num("worst_p50_us", worst_p50);
+        json_num("worst_p99_us", worst_p99);
+        json_end();
+    }
+}
+
+/* ============================================================================
+ * Threads
+ *
+ * Like scaling, but the clients are threads sharing this process's
+ * context and connection, each making it current first as the driver
+ * requires. Each thread allocates and frees (one round trip per op).
+ * ============================================================================ */
+
+struct thread_client {
+    pthread_t thread;
+    uint64_t end_ns;
+    uint64_t ops;
+    uint64_t elapsed_ns;
+    struct latency l;
+};
+
+static void *thread_client_main(void *arg)
+{
+    struct thread_client *c = arg;
+    CHECK_CUDA(cuCtxSetCurrent(context));
+
+    size_t cap = 1 << 16;
+    uint64_t *samples = malloc(cap * sizeof(*samples));
+    uint64_t t0 = now_ns();
+    uint64_t now = t0;
+
+    while (now < c->end_ns) {
+        uint64_t ns = op_alloc(NULL);
+        if (samples && c->ops < cap) {
+            samples[c->ops] = ns;
+        }
+        c->ops++;
+        now = now_ns();
+    }
+
+    c->elapsed_ns = now - t0;
+    if (samples) {
+        c->l = summarize(samples, c->ops < cap ? (int)c->ops : (int)cap);
+    }
+    free(samples);
+    return NULL;
+}
+
+static void bench_threads(void)
+{
+    printf("\n=== Multi-thread scaling (cuMemAlloc round trips, %d ms) ===\n", duration_ms);
+    printf("  %-8s %12s %12s %12s\n", "threads", "total ops/s", "p50 (us)", "p99 (us)");
+
+    for (int i = 0; i < warmup; i++) {
+        op_alloc(NULL);
+    }
+
+    for (int n = 1; n <= max_clients; n *= 2) {
+        struct thread_client clients[MAX_CLIENTS];
+        uint64_t end = now_ns() + (uint64_t)duration_ms * 1000000;
+        int started = 0;
+
+        for (int i = 0; i < n; i++) {
+            clients[i] = (struct thread_client){ .end_ns = end };
+            if (pthread_create(&clients[i].thread, NULL, thread_client_main, &clients[i]) != 0) {
+                break;
+            }
+            started++;
+        }
+
+        double total_rate = 0, worst_p50 = 0, worst_p99 = 0;
+        for (int i = 0; i < started; i++) {
+            pthread_join(clients[i].thread, NULL);
+            if (clients[i].elapsed_ns > 0) {
+                total_rate += clients[i].ops / (clients[i].elapsed_ns / 1e9);
+            }
+            worst_p50 = clients[i].l.p50_us > worst_p50 ? clients[i].l.p50_us : worst_p50;
+            worst_p99 = clients[i].l.p99_us > worst_p99 ? clients[i].l.p99_us : worst_p99;
+        }
+
+        if (started < n) {
+            printf("  %-8d (failed to start threads)\n", n);
+            break;
+        }
+
+        printf("  %-8d %12.0f %12.2f %12.2f\n", n, total_rate, worst_p50, worst_p99);
+
+        json_begin("threads", "alloc");
+        json_num("threads", n);
+        json_num("ops_per_sec", total_rate);
+        json_num("worst_p50_us", worst_p50);
+        json_num("worst_p99_us", worst_p99);
+        json_end();
+    }
+}
+
+/* ============================================================================
+ * Spin vs Block
+ * ============================================================================ */
+
+static void bench_spin(void)
+{
+    printf("\n=== Receive mode (cuCtxSynchronize round trips) ===\n");
+
+    if (!set_spin_us) {
+        printf("  (not libvgpu: no receive modes to compare)\n");
+        return;
+    }
+
+    static const unsigned int budgets[] = { 0, 20, 100 };
+
+    print_latency_header("spin budget");
+    for (size_t i = 0; i < sizeof(budgets) / sizeof(budgets[0]); i++) {
+        set_spin_us(budgets[i]);
+        struct latency l = measure(op_sync, NULL, iterations);
+
+        char name[32];
+        snprintf(name, sizeof(name), budgets[i] ? "spin %u us" : "block", budgets[i]);
+        print_latency(name, &l);
+
+        json_begin("spin", "sync");
+        json_num("spin_us", budgets[i]);
+        json_latency(&l);
+        json_end();
+    }
+
+    /* Back to what IDM_SPIN_US asked for */
+    const char *env = getenv("IDM_SPIN_US");
+    set_spin_us(env ? (unsigned int)atoi(env) : 0);
+}
+
+/* ============================================================================
+ * Main
+ * ============================================================================ */
+
+static size_t parse_size(const char *arg)
+{
+    char *end;
+    size_t v = strtoull(arg, &end, 10);
+    switch (*end) {
+        case 'G': case 'g': v <<= 30; break;
+        case 'M': case 'm': v <<= 20; break;
+        case 'K': case 'k': v <<= 10; break;
+        default: break;
+    }
+    return v;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-b LIST] [-n N] [-w N] [-m SIZE] [-c N] [-d MS] "
+            "[-l LABEL] [-o FILE]\n", prog);
+    fprintf(stderr, "  -b LIST   latency,throughput,bandwidth,scaling,threads,spin (default: all)\n");
+    fprintf(stderr, "  -n N      Samples per latency measurement (default: 10000)\n");
+    fprintf(stderr, "  -w N      Warmup calls before measuring (default: 1000)\n");
+    fprintf(stderr, "  -m SIZE   Largest copy, e.g. 1G (default: 64M)\n");
+    fprintf(stderr, "  -c N      Most client processes (scaling) or threads (threads) (default: 4)\n");
+    fprintf(stderr, "  -d MS     Run length per client or thread count (default: 1000)\n");
+    fprintf(stderr, "  -l LABEL  Backend name in results (default: vgpu or libcuda)\n");
+    fprintf(stderr, "  -o FILE   Append results as JSON lines\n");
+}
+
+int main(int argc, char **argv)
+{
+    const char *benches = "latency,throughput,bandwidth,scaling,threads,spin";
+    const char *json_path = NULL;
+    bool client = false;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "b:n:w:m:c:d:l:o:Ch")) != -1) {
+        switch (opt) {
+            case 'b': benches = optarg; break;
+            case 'n': iterations = atoi(optarg); break;
+            case 'w': warmup = atoi(optarg); break;
+            case 'm': max_transfer = parse_size(optarg); break;
+            case 'c': max_clients = atoi(optarg); break;
+            case 'd': duration_ms = atoi(optarg); break;
+            case 'l': label = optarg; break;
+            case 'o': json_path = optarg; break;
+            case 'C': client = true; break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (iterations < 1 || warmup < 0 || max_transfer < 4096 ||
+        max_clients < 1 || max_clients > MAX_CLIENTS || duration_ms < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (client) {
+        return client_main();
+    }
+
+    *(void **)&set_spin_us = dlsym(RTLD_DEFAULT, "idm_set_spin_us");
+    if (!label) {
+        label = set_spin_us ? "vgpu" : "libcuda";
+    }
+
+    if (json_path) {
+        json_out = fopen(json_path, "a");
+        if (!json_out) {
+            perror(json_path);
+            return 1;
+        }
+    }
+
+    printf("=== CUDA Microbenchmarks (%s) ===\n", label);
+
+    CUdevice device;
+    char name[256];
+    CHECK_CUDA(cuInit(0));
+    CHECK_CUDA(cuDeviceGet(&device, 0));
+    CHECK_CUDA(cuDeviceGetName(name, sizeof(name), device));
+    CHECK_CUDA(cuCtxCreate(&context, 0, device));
+    CHECK_CUDA(cuStreamCreate(&stream, 0));
+    printf("Device: %s\n", name);
+
+    char list[256];
+    snprintf(list, sizeof(list), "%s", benches);
+    for (char *save, *b = strtok_r(list, ",", &save); b; b = strtok_r(NULL, ",", &save)) {
+        if (strcmp(b, "latency") == 0) {
+            bench_latency();
+        } else if (strcmp(b, "throughput") == 0) {
+            bench_throughput();
+        } else if (strcmp(b, "bandwidth") == 0) {
+            bench_bandwidth();
+        } else if (strcmp(b, "scaling") == 0) {
+            bench_scaling(argv[0]);
+        } else if (strcmp(b, "threads") == 0) {
+            bench_threads();
+        } else if (strcmp(b, "spin") == 0) {
+            bench_spin();
+        } else {
+            fprintf(stderr, "Unknown benchmark: %s\n", b);
+            return 1;
+        }
+    }
+
+    CHECK_CUDA(cuStreamDestroy(stream));
+    CHECK_CUDA(cuCtxDestroy(context));
+    if (json_out) {
+        fclose(json_out);
+    }
+
+    return 0;
+}
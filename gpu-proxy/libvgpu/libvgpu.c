@@ -11,6 +11,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
+#include <time.h>
+#include <unistd.h>
 
 /* Forward declarations from IDM transport */
 extern int idm_init(uint32_t local_zone_id, uint32_t remote_zone_id, bool is_server);
@@ -19,17 +21,28 @@ extern int idm_recv(struct idm_message **msg_out, int timeout_ms);
 extern struct idm_message *idm_build_message(uint32_t dst_zone, enum idm_msg_type msg_type,
                                               const void *payload, size_t payload_len);
 extern void idm_free_message(struct idm_message *msg);
+extern void idm_set_next_seq(uint64_t seq);
 extern void idm_cleanup(void);
+extern void *idm_bulk_region(size_t *size_out);
+extern void *idm_region_create(uint32_t region_id, size_t size, uint32_t *grefs,
+                               uint32_t *gref_count);
+extern void idm_region_destroy(uint32_t region_id, void *addr, size_t size);
+extern void idm_trace_enable(void);
+extern void idm_trace(const struct idm_trace_span *span);
+extern int idm_trace_dump(const char *path);
 
 /* Zone IDs */
-#define USER_ZONE_ID    2
+#define USER_ZONE_ID    2   /* Default; IDM_ZONE_ID overrides */
 #define DRIVER_ZONE_ID  1
 
 /* Global state */
 static bool initialized = false;
 static pthread_mutex_t init_lock = PTHREAD_MUTEX_INITIALIZER;
-static int device_count = 1;  /* Virtual device count */
-static CUcontext current_context = NULL;
+static int device_count = 1;  /* Virtual device count (from the proxy) */
+static struct idm_gpu_props device_props[IDM_MAX_DEVICES];   /* Fetched at cuInit */
+static __thread CUcontext current_context = NULL;   /* Per thread, as in the driver */
+static __thread int current_device = 0;   /* Device of current_context; requests run there */
+static uint32_t local_zone = USER_ZONE_ID;   /* Our zone (IDM_ZONE_ID) */
 
 /* Error string table */
 static const char *error_strings[] = {
@@ -38,8 +51,14 @@ static const char *error_strings[] = {
     [CUDA_ERROR_OUT_OF_MEMORY] = "out of memory",
     [CUDA_ERROR_NOT_INITIALIZED] = "not initialized",
     [CUDA_ERROR_DEINITIALIZED] = "deinitialized",
+    [CUDA_ERROR_INVALID_DEVICE] = "invalid device ordinal",
     [CUDA_ERROR_INVALID_CONTEXT] = "invalid context",
+    [CUDA_ERROR_FILE_NOT_FOUND] = "file not found",
     [CUDA_ERROR_INVALID_HANDLE] = "invalid handle",
+    [CUDA_ERROR_NOT_FOUND] = "named symbol not found",
+    [CUDA_ERROR_NOT_READY] = "device not ready",
+    [CUDA_ERROR_STREAM_CAPTURE_UNSUPPORTED] = "operation not permitted when stream is capturing",
+    [CUDA_ERROR_STREAM_CAPTURE_INVALIDATED] = "operation failed due to a previous error during capture",
 };
 
 static const char *error_names[] = {
@@ -48,511 +67,3803 @@ static const char *error_names[] = {
     [CUDA_ERROR_OUT_OF_MEMORY] = "CUDA_ERROR_OUT_OF_MEMORY",
     [CUDA_ERROR_NOT_INITIALIZED] = "CUDA_ERROR_NOT_INITIALIZED",
     [CUDA_ERROR_DEINITIALIZED] = "CUDA_ERROR_DEINITIALIZED",
+    [CUDA_ERROR_INVALID_DEVICE] = "CUDA_ERROR_INVALID_DEVICE",
     [CUDA_ERROR_INVALID_CONTEXT] = "CUDA_ERROR_INVALID_CONTEXT",
+    [CUDA_ERROR_FILE_NOT_FOUND] = "CUDA_ERROR_FILE_NOT_FOUND",
     [CUDA_ERROR_INVALID_HANDLE] = "CUDA_ERROR_INVALID_HANDLE",
+    [CUDA_ERROR_NOT_FOUND] = "CUDA_ERROR_NOT_FOUND",
+    [CUDA_ERROR_NOT_READY] = "CUDA_ERROR_NOT_READY",
+    [CUDA_ERROR_STREAM_CAPTURE_UNSUPPORTED] = "CUDA_ERROR_STREAM_CAPTURE_UNSUPPORTED",
+    [CUDA_ERROR_STREAM_CAPTURE_INVALIDATED] = "CUDA_ERROR_STREAM_CAPTURE_INVALIDATED",
 };
 
+/* ============================================================================
+ * Request Submission and Completion
+ *
+ * Requests are submitted without waiting. Each one parks in a pending slot
+ * keyed by its seq_num; whichever thread waits first becomes the receiver
+ * and completes every response it sees, in whatever order they arrive.
+ * At most IDM_RING_SIZE requests are in flight, so the proxy can never
+ * overflow our RX ring with responses.
+ *
+ * Any number of application threads may call in at once. Each waiter
+ * sleeps on its own slot's condition and is woken only when that slot
+ * changes, or to take over receiving when the receiver is done; sequence
+ * numbers come from an atomic counter in the transport.
+ *
+ * Requests nobody waits for (frees, copies) are coalesced into one
+ * IDM_BATCH message. The batch goes out when a request that must be
+ * waited for is appended, when it is full or old, or when anyone needs
+ * to wait for a response; everything is sent in submission order.
+ * ============================================================================ */
+
+#define MAX_INFLIGHT IDM_RING_SIZE
+
+/* Response wait limit (same budget as the old 10 x 1s polling loop) */
+#define RESPONSE_TIMEOUT_MS 10000
+
+/* How long the receiver blocks in idm_recv before rechecking */
+#define RECV_SLICE_MS 100
+
+/* Flush a batch whose oldest command has waited this long */
+#define BATCH_FLUSH_US 200
+
+/* The bulk region is carved into fixed-size staging chunks */
+#define STAGE_CHUNK_SIZE (1024 * 1024)
+#define STAGE_CHUNKS     (IDM_BULK_SIZE / STAGE_CHUNK_SIZE)
+
+struct pending_req {
+    uint64_t seq;          /* Owning request (0 = slot free) */
+    bool done;             /* Response arrived */
+    bool detached;         /* Nobody waits; errors are deferred */
+    CUresult result;
+    uint64_t handle;       /* result_handle from IDM_RESPONSE_OK */
+    uint32_t value;        /* result_value from IDM_RESPONSE_OK */
+
+    /* Completion actions */
+    void *copy_dst;        /* On success, copy bulk data here (D2H) */
+    bool copying;          /* Receiver is copying into copy_dst (unlocked) */
+    size_t copy_len;
+    uint64_t bulk_offset;
+    void *data_dst;        /* On success, copy response data here */
+    size_t data_cap;
+    size_t data_len;       /* Response data bytes copied */
+    int stage_first;       /* Staging chunks to release */
+    int stage_count;
+
+    uint64_t trace_start_ns;   /* Submitted (traced requests only, else 0) */
+    uint16_t msg_type;
+};
+
+static struct pending_req pending[MAX_INFLIGHT];
+static pthread_mutex_t pending_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t slot_cond[MAX_INFLIGHT] = {
+    [0 ... MAX_INFLIGHT - 1] = PTHREAD_COND_INITIALIZER
+};
+static uint32_t slot_waiters[MAX_INFLIGHT];      /* Threads asleep on slot_cond */
+static pthread_cond_t stage_cond = PTHREAD_COND_INITIALIZER;   /* stage_map changed */
+static uint32_t stage_waiters = 0;
+static bool receiver_active = false;
+static uint64_t stage_map = 0;                   /* Bit per busy chunk */
+static CUresult deferred_error = CUDA_SUCCESS;   /* From detached requests */
+static bool reclaim_requested = false;           /* IDM_RECLAIM arrived */
+
+/* Unsent batch (pending_lock); flush_lock keeps flushes in order */
+static pthread_mutex_t flush_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t batch_buf[IDM_ENTRY_PAYLOAD_MAX / sizeof(uint64_t)];
+static size_t batch_len = sizeof(struct idm_batch);
+static uint32_t batch_count = 0;
+static uint64_t batch_seqs[IDM_BATCH_MAX_CMDS];
+static uint64_t batch_start_us = 0;
+static uint32_t batch_device = 0;                /* Device all of it runs on */
+
+static void batch_flush(void);
+
+/* Chrome trace file to write at exit (VGPU_TRACE; NULL = tracing off) */
+static const char *trace_path = NULL;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t now_us(void)
+{
+    return now_ns() / 1000;
+}
+
+static uint64_t now_ms(void)
+{
+    return now_us() / 1000;
+}
+
+/**
+ * Map IDM error code to CUDA error
+ */
+static CUresult map_idm_error(uint32_t error_code)
+{
+    switch (error_code) {
+        case IDM_ERROR_OUT_OF_MEMORY:
+            return CUDA_ERROR_OUT_OF_MEMORY;
+        case IDM_ERROR_INVALID_HANDLE:
+            return CUDA_ERROR_INVALID_HANDLE;
+        default:
+            return CUDA_ERROR_INVALID_VALUE;
+    }
+}
+
+/**
+ * Record a span of a traced request
+ */
+static void trace_span(enum idm_trace_stage stage, uint64_t start_ns, uint64_t seq,
+                       uint16_t msg_type)
+{
+    struct idm_trace_span span = {
+        .start_ns = start_ns,
+        .end_ns = now_ns(),
+        .seq_num = seq,
+        .zone = local_zone,
+        .msg_type = msg_type,
+        .stage = stage,
+    };
+    idm_trace(&span);
+}
+
+/**
+ * Wake the threads waiting on a pending slot (pending_lock held)
+ */
+static void wake_slot_locked(const struct pending_req *req)
+{
+    size_t slot = (size_t)(req - pending);
+    if (slot_waiters[slot] > 0) {
+        pthread_cond_broadcast(&slot_cond[slot]);
+    }
+}
+
+/**
+ * Mark request complete and run its release actions (pending_lock held)
+ */
+static void complete_locked(struct pending_req *req, CUresult result, uint64_t handle)
+{
+    req->result = result;
+    req->handle = handle;
+    req->done = true;
+
+    if (req->trace_start_ns) {
+        trace_span(IDM_TRACE_CALL, req->trace_start_ns, req->seq, req->msg_type);
+        req->trace_start_ns = 0;
+    }
+
+    if (req->stage_count > 0) {
+        uint64_t mask = ((1ULL << req->stage_count) - 1) << req->stage_first;
+        stage_map &= ~mask;
+        req->stage_count = 0;
+        if (stage_waiters > 0) {
+            pthread_cond_broadcast(&stage_cond);
+        }
+    }
+
+    if (req->detached) {
+        if (result != CUDA_SUCCESS && deferred_error == CUDA_SUCCESS) {
+            deferred_error = result;
+        }
+        req->seq = 0;
+    }
+
+    wake_slot_locked(req);
+}
+
+/**
+ * Before a waiter leaves: if nobody is receiving, wake a sleeping waiter
+ * to take over (pending_lock held)
+ *
+ * The receiver steps down after every message and, if its own request
+ * isn't done yet, simply receives again; so it's only when a waiter
+ * leaves that the others may be left without one.
+ */
+static void leave_locked(void)
+{
+    if (receiver_active) {
+        return;
+    }
+
+    for (size_t i = 0; i < MAX_INFLIGHT; i++) {
+        if (slot_waiters[i] > 0) {
+            pthread_cond_broadcast(&slot_cond[i]);
+            return;
+        }
+    }
+    if (stage_waiters > 0) {
+        pthread_cond_broadcast(&stage_cond);
+    }
+}
+
+/**
+ * Deliver one response to its pending slot (pending_lock held)
+ */
+static void deliver_locked(uint64_t seq, CUresult result, uint64_t handle, uint32_t value,
+                           const void *data, size_t data_len)
+{
+    struct pending_req *req = &pending[seq % MAX_INFLIGHT];
+    if (seq == 0 || req->seq != seq || req->done) {
+        return;
+    }
+
+    if (result == CUDA_SUCCESS && req->data_dst) {
+        req->data_len = data_len < req->data_cap ? data_len : req->data_cap;
+        memcpy(req->data_dst, data, req->data_len);
+    }
+
+    if (result == CUDA_SUCCESS && req->copy_dst) {
+        /* Slot can't be reused until done is set, and the waiter can't
+         * give up on copy_dst while copying is set; copy unlocked */
+        size_t bulk_size = 0;
+        uint8_t *bulk = idm_bulk_region(&bulk_size);
+        void *dst = req->copy_dst;
+
+        req->copying = true;
+        pthread_mutex_unlock(&pending_lock);
+        memcpy(dst, bulk + req->bulk_offset, req->copy_len);
+        pthread_mutex_lock(&pending_lock);
+        req->copying = false;
+    }
+
+    req->value = value;
+    complete_locked(req, result, handle);
+}
+
+/**
+ * Make progress on outstanding requests (pending_lock held)
+ *
+ * Sends the unsent batch if there is one (its responses may be what the
+ * caller waits for). Otherwise either receives one response message and
+ * dispatches it to its owner(s), or, if another thread is already
+ * receiving, sleeps until the slot the caller waits on changes or the
+ * receiver hands over.
+ *
+ * @param req Slot the caller waits on, or NULL when waiting for staging
+ */
+static void progress_locked(struct pending_req *req)
+{
+    if (batch_count > 0) {
+        pthread_mutex_unlock(&pending_lock);
+        batch_flush();
+        pthread_mutex_lock(&pending_lock);
+        return;
+    }
+
+    if (receiver_active) {
+        if (req) {
+            size_t slot = (size_t)(req - pending);
+            slot_waiters[slot]++;
+            pthread_cond_wait(&slot_cond[slot], &pending_lock);
+            slot_waiters[slot]--;
+        } else {
+            stage_waiters++;
+            pthread_cond_wait(&stage_cond, &pending_lock);
+            stage_waiters--;
+        }
+        return;
+    }
+
+    receiver_active = true;
+    pthread_mutex_unlock(&pending_lock);
+
+    struct idm_message *resp = NULL;
+    if (idm_recv(&resp, RECV_SLICE_MS) != 0) {
+        resp = NULL;
+    }
+
+    pthread_mutex_lock(&pending_lock);
+
+    if (resp && resp->header.msg_type == IDM_RECLAIM) {
+        /* Can't send from here; the next allocation call trims */
+        __atomic_store_n(&reclaim_requested, true, __ATOMIC_RELAXED);
+    } else if (resp && resp->header.msg_type == IDM_RESPONSE_OK &&
+               resp->header.payload_len >= sizeof(struct idm_response_ok)) {
+        const struct idm_response_ok *ok = (const struct idm_response_ok *)resp->payload;
+        size_t data_len = resp->header.payload_len - sizeof(*ok);
+        if (data_len > ok->data_len) {
+            data_len = ok->data_len;
+        }
+        deliver_locked(ok->request_seq, CUDA_SUCCESS, ok->result_handle, ok->result_value,
+                       ok + 1, data_len);
+    } else if (resp && resp->header.msg_type == IDM_RESPONSE_ERROR &&
+               resp->header.payload_len >= sizeof(struct idm_response_error)) {
+        const struct idm_response_error *err = (const struct idm_response_error *)resp->payload;
+        fprintf(stderr, "[libvgpu] Error: %.*s\n",
+                (int)strnlen(err->error_msg, sizeof(err->error_msg)), err->error_msg);
+        deliver_locked(err->request_seq, map_idm_error(err->error_code), 0, 0, NULL, 0);
+    } else if (resp && resp->header.msg_type == IDM_RESPONSE_BATCH &&
+               resp->header.payload_len >= sizeof(struct idm_batch)) {
+        const struct idm_batch *batch = (const struct idm_batch *)resp->payload;
+        const struct idm_batch_result *results =
+            (const struct idm_batch_result *)(resp->payload + sizeof(*batch));
+        uint32_t count = (resp->header.payload_len - sizeof(*batch)) / sizeof(*results);
+        if (count > batch->count) {
+            count = batch->count;
+        }
+
+        for (uint32_t i = 0; i < count; i++) {
+            CUresult result = CUDA_SUCCESS;
+            if (results[i].error_code != IDM_ERROR_NONE) {
+                fprintf(stderr, "[libvgpu] Error: batched request %lu failed (IDM error %u)\n",
+                        (unsigned long)results[i].request_seq, results[i].error_code);
+                result = map_idm_error(results[i].error_code);
+            }
+            deliver_locked(results[i].request_seq, result,
+                           results[i].result_handle, results[i].result_value, NULL, 0);
+        }
+    }
+
+    if (resp) {
+        idm_free_message(resp);
+    }
+
+    receiver_active = false;
+}
+
+/**
+ * Fail requests that never made it to the proxy (pending_lock held)
+ */
+static void fail_unsent_locked(const uint64_t *seqs, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; i++) {
+        struct pending_req *req = &pending[seqs[i] % MAX_INFLIGHT];
+        if (req->seq == seqs[i] && !req->done) {
+            complete_locked(req, CUDA_ERROR_INVALID_VALUE, 0);
+        }
+    }
+}
+
+/**
+ * Send the unsent batch
+ *
+ * A batch of one goes out as the plain request it wraps.
+ */
+static void batch_flush(void)
+{
+    pthread_mutex_lock(&flush_lock);
+    pthread_mutex_lock(&pending_lock);
+
+    uint32_t count = batch_count;
+    uint64_t seqs[IDM_BATCH_MAX_CMDS];
+    memcpy(seqs, batch_seqs, count * sizeof(seqs[0]));
+
+    struct idm_message *msg = NULL;
+    if (count == 1) {
+        const uint8_t *rec = (const uint8_t *)batch_buf + sizeof(struct idm_batch);
+        struct idm_batch_cmd cmd;
+        memcpy(&cmd, rec, sizeof(cmd));
+
+        msg = idm_build_message(DRIVER_ZONE_ID, cmd.msg_type, rec + sizeof(cmd), cmd.payload_len);
+        if (msg) {
+            msg->header.seq_num = cmd.seq_num;
+        }
+    } else if (count > 1) {
+        struct idm_batch *batch = (struct idm_batch *)batch_buf;
+        batch->count = count;
+        batch->reserved = 0;
+        msg = idm_build_message(DRIVER_ZONE_ID, IDM_BATCH, batch_buf, batch_len);
+    }
+    if (msg) {
+        idm_header_set_device(&msg->header, batch_device);
+    }
+    if (msg && trace_path) {
+        msg->header.reserved |= IDM_TRACE_SAMPLED;
+    }
+
+    batch_len = sizeof(struct idm_batch);
+    batch_count = 0;
+
+    if (count == 0) {
+        pthread_mutex_unlock(&pending_lock);
+        pthread_mutex_unlock(&flush_lock);
+        return;
+    }
+
+    pthread_mutex_unlock(&pending_lock);
+
+    if (!msg || idm_send(msg) < 0) {
+        fprintf(stderr, "[libvgpu] Failed to send message\n");
+
+        pthread_mutex_lock(&pending_lock);
+        fail_unsent_locked(seqs, count);
+        pthread_mutex_unlock(&pending_lock);
+    }
+    if (msg) {
+        idm_free_message(msg);
+    }
+
+    pthread_mutex_unlock(&flush_lock);
+}
+
+/**
+ * Submit request without waiting for its response
+ *
+ * @param actions Completion actions to attach (copy_dst, staging), or NULL
+ * @param detached true if no one will wait; failures become deferred errors
+ */
+static CUresult submit_request(struct idm_message *msg,
+                               const struct pending_req *actions,
+                               bool detached)
+{
+    uint64_t seq = msg->header.seq_num;
+    struct pending_req *req = &pending[seq % MAX_INFLIGHT];
+    uint64_t deadline = now_ms() + RESPONSE_TIMEOUT_MS;
+
+    uint64_t trace_ns = trace_path ? now_ns() : 0;
+    if (trace_ns) {
+        msg->header.reserved |= IDM_TRACE_SAMPLED;
+    }
+
+    /* Runs in the current context, like the real driver call would */
+    uint32_t device = (uint32_t)current_device;
+    idm_header_set_device(&msg->header, device);
+
+    pthread_mutex_lock(&pending_lock);
+
+    /* Slot still owned by an older request: complete some first */
+    while (req->seq != 0) {
+        if (now_ms() > deadline) {
+            leave_locked();
+            pthread_mutex_unlock(&pending_lock);
+            fprintf(stderr, "[libvgpu] Timeout waiting for a free request slot\n");
+            return CUDA_ERROR_INVALID_VALUE;
+        }
+        progress_locked(req);
+    }
+    leave_locked();
+
+    if (actions) {
+        *req = *actions;
+    } else {
+        memset(req, 0, sizeof(*req));
+    }
+    req->seq = seq;
+    req->done = false;
+    req->detached = detached;
+    req->trace_start_ns = trace_ns;
+    req->msg_type = msg->header.msg_type;
+
+    /* Make room in the batch (flushing in order); a batch runs on one device */
+    size_t space = IDM_BATCH_CMD_SPACE(msg->header.payload_len);
+    while (batch_count > 0 &&
+           (batch_count == IDM_BATCH_MAX_CMDS || batch_len + space > sizeof(batch_buf) ||
+            batch_device != device)) {
+        pthread_mutex_unlock(&pending_lock);
+        batch_flush();
+        pthread_mutex_lock(&pending_lock);
+    }
+
+    if (batch_len + space > sizeof(batch_buf)) {
+        /* Too big to wrap (batch is empty now): send it on its own */
+        pthread_mutex_unlock(&pending_lock);
+        pthread_mutex_lock(&flush_lock);
+        if (idm_send(msg) < 0) {
+            fprintf(stderr, "[libvgpu] Failed to send message\n");
+            pthread_mutex_lock(&pending_lock);
+            fail_unsent_locked(&seq, 1);
+            pthread_mutex_unlock(&pending_lock);
+        }
+        pthread_mutex_unlock(&flush_lock);
+        if (trace_ns) {
+            trace_span(IDM_TRACE_SUBMIT, trace_ns, seq, msg->header.msg_type);
+        }
+        return CUDA_SUCCESS;
+    }
+
+    struct idm_batch_cmd cmd = {
+        .seq_num = seq,
+        .msg_type = msg->header.msg_type,
+        .payload_len = msg->header.payload_len
+    };
+    uint8_t *rec = (uint8_t *)batch_buf + batch_len;
+    memcpy(rec, &cmd, sizeof(cmd));
+    memcpy(rec + sizeof(cmd), msg->payload, cmd.payload_len);
+
+    if (batch_count == 0) {
+        batch_start_us = now_us();
+        batch_device = device;
+    }
+    batch_seqs[batch_count++] = seq;
+    batch_len += space;
+
+    /* Someone waits for this one, or the batch has sat long enough */
+    bool flush = !detached || now_us() - batch_start_us >= BATCH_FLUSH_US;
+
+    pthread_mutex_unlock(&pending_lock);
+
+    /* Send failures complete the slot (or become deferred errors) */
+    if (flush) {
+        batch_flush();
+    }
+
+    if (trace_ns) {
+        trace_span(IDM_TRACE_SUBMIT, trace_ns, seq, cmd.msg_type);
+    }
+
+    return CUDA_SUCCESS;
+}
+
+/**
+ * Wait for a submitted request to complete
+ *
+ * @param handle_out result_handle of the response, or NULL
+ * @param value_out result_value of the response, or NULL
+ * @param data_len_out Response data bytes copied to data_dst, or NULL
+ */
+static CUresult wait_request_data(uint64_t seq, uint64_t *handle_out, uint32_t *value_out,
+                                  size_t *data_len_out)
+{
+    struct pending_req *req = &pending[seq % MAX_INFLIGHT];
+    uint64_t deadline = now_ms() + RESPONSE_TIMEOUT_MS;
+
+    pthread_mutex_lock(&pending_lock);
+
+    while (!req->done) {
+        /* A copy into the caller's buffer may not outlive this call */
+        if (now_ms() > deadline && !req->copying) {
+            /* Let a late response clean the slot up */
+            req->detached = true;
+            req->copy_dst = NULL;
+            req->data_dst = NULL;
+            leave_locked();
+            pthread_mutex_unlock(&pending_lock);
+            fprintf(stderr, "[libvgpu] Timeout waiting for response\n");
+            return CUDA_ERROR_INVALID_VALUE;
+        }
+        progress_locked(req);
+    }
+    leave_locked();
+
+    CUresult result = req->result;
+    if (handle_out) {
+        *handle_out = req->handle;
+    }
+    if (value_out) {
+        *value_out = req->value;
+    }
+    if (data_len_out) {
+        *data_len_out = req->data_len;
+    }
+
+    req->seq = 0;
+    wake_slot_locked(req);
+    pthread_mutex_unlock(&pending_lock);
+
+    return result;
+}
+
+static CUresult wait_request(uint64_t seq, uint64_t *handle_out, uint32_t *value_out)
+{
+    return wait_request_data(seq, handle_out, value_out, NULL);
+}
+
+/**
+ * Send request and wait for response
+ */
+static CUresult send_and_wait(struct idm_message *msg, uint64_t *handle_out)
+{
+    CUresult result = submit_request(msg, NULL, false);
+    if (result != CUDA_SUCCESS) {
+        return result;
+    }
+
+    return wait_request(msg->header.seq_num, handle_out, NULL);
+}
+
+/**
+ * Build, send and wait for a request with a fixed-size payload
+ */
+static CUresult call_proxy(enum idm_msg_type type, const void *payload, size_t len,
+                           uint64_t *handle_out, uint32_t *value_out)
+{
+    struct idm_message *msg = idm_build_message(DRIVER_ZONE_ID, type, payload, len);
+    if (!msg) {
+        return CUDA_ERROR_OUT_OF_MEMORY;
+    }
+
+    CUresult result = submit_request(msg, NULL, false);
+    if (result == CUDA_SUCCESS) {
+        result = wait_request(msg->header.seq_num, handle_out, value_out);
+    }
+    idm_free_message(msg);
+
+    return result;
+}
+
+/**
+ * Take (and clear) the first error reported by a detached request
+ */
+static CUresult take_deferred_error(void)
+{
+    pthread_mutex_lock(&pending_lock);
+    CUresult result = deferred_error;
+    deferred_error = CUDA_SUCCESS;
+    pthread_mutex_unlock(&pending_lock);
+
+    return result;
+}
+
+/**
+ * Reserve contiguous staging chunks in the bulk region
+ *
+ * Blocks (making progress on completions) until enough chunks free up.
+ *
+ * @param count Chunks needed (1..STAGE_CHUNKS)
+ * @return First chunk index, or -1 on timeout
+ */
+static int stage_acquire(int count)
+{
+    uint64_t deadline = now_ms() + RESPONSE_TIMEOUT_MS;
+    uint64_t run = count >= 64 ? ~0ULL : (1ULL << count) - 1;
+
+    pthread_mutex_lock(&pending_lock);
+
+    for (;;) {
+        for (int i = 0; i + count <= STAGE_CHUNKS; i++) {
+            if (!(stage_map & (run << i))) {
+                stage_map |= run << i;
+                leave_locked();
+                pthread_mutex_unlock(&pending_lock);
+                return i;
+            }
+        }
+
+        if (now_ms() > deadline) {
+            leave_locked();
+            pthread_mutex_unlock(&pending_lock);
+            fprintf(stderr, "[libvgpu] Timeout waiting for staging space\n");
+            return -1;
+        }
+        progress_locked(NULL);
+    }
+}
+
+/**
+ * Return a staging chunk that was never attached to a request
+ */
+static void stage_release(int chunk)
+{
+    pthread_mutex_lock(&pending_lock);
+    stage_map &= ~(1ULL << chunk);
+    if (stage_waiters > 0) {
+        pthread_cond_broadcast(&stage_cond);
+    }
+    pthread_mutex_unlock(&pending_lock);
+}
+
+/**
+ * Give back staging chunks that never reached a request
+ */
+static void stage_release_run(int first, int count)
+{
+    for (int i = 0; i < count; i++) {
+        stage_release(first + i);
+    }
+}
+
+/* ============================================================================
+ * Device Memory
+ *
+ * A CUdeviceptr is a device address (IDM_VA_* in idm.h): the base of the
+ * allocation's range plus an offset, so guests can do pointer arithmetic
+ * as with the real driver. Every allocation we hold is tracked in
+ * live_map (open addressing on the handle's slot, backward-shift
+ * deletion); live_resolve turns any address back into handle and offset
+ * and checks that an access stays inside the allocation.
+ *
+ * With VGPU_ALLOC_CACHE_MB set, cuMemFree also keeps the handle here
+ * instead of telling the proxy, and the next cuMemAlloc of the same size
+ * class takes it back without a round trip. Allocations are rounded up to
+ * their class (powers of two from 512 bytes to 1 MB, then multiples of
+ * 2 MB, as in the proxy's pool), so any cached handle of a class fits any
+ * request in it. Frees that would take the cache over its limit go
+ * straight to the proxy. The whole cache is returned as one batch of
+ * IDM_GPU_FREE when an allocation runs out of memory, when the proxy
+ * sends IDM_RECLAIM, and on cuCtxDestroy.
+ * ============================================================================ */
+
+#define CACHE_MIN_BLOCK   512u
+#define CACHE_MAX_SMALL   (1u << 20)
+#define CACHE_LARGE_GRAIN (2u << 20)
+#define CACHE_BUCKETS     64
+
+struct cache_bucket {
+    size_t size;           /* Class size (0 = unused) */
+    uint64_t *handles;     /* Stack of cached handles */
+    uint32_t count;
+    uint32_t cap;
+};
+
+struct live_entry {
+    uint64_t handle;       /* 0 = empty */
+    size_t size;           /* Bytes allocated (the class size with the cache on) */
+    bool cached;           /* Sitting in a bucket */
+    bool exported;         /* Shared with other zones: never cached */
+    bool imported;         /* Another zone's (cuIpcOpenMemHandle) */
+};
+
+static pthread_mutex_t mem_lock = PTHREAD_MUTEX_INITIALIZER;    /* live_map and cache */
+static size_t cache_limit = 0;                   /* Bytes (0 = cache off) */
+static size_t cache_bytes = 0;
+static struct cache_bucket cache_buckets[CACHE_BUCKETS];
+static struct live_entry *live_map = NULL;
+static size_t live_cap = 0;                      /* Power of two */
+static size_t live_count = 0;
+
+/**
+ * Size class of a request (0 = too large to round)
+ */
+static size_t cache_class(size_t size)
+{
+    if (size <= CACHE_MAX_SMALL) {
+        size_t cls = CACHE_MIN_BLOCK;
+        while (cls < size) {
+            cls <<= 1;
+        }
+        return cls;
+    }
+
+    if (size > SIZE_MAX - CACHE_LARGE_GRAIN) {
+        return 0;
+    }
+    return (size + CACHE_LARGE_GRAIN - 1) & ~(size_t)(CACHE_LARGE_GRAIN - 1);
+}
+
+/* Keyed on the slot alone: it is unique among a zone's live handles and
+ * the only part of the handle an address carries */
+static size_t live_slot(uint64_t handle, size_t cap)
+{
+    return (size_t)(handle & IDM_VA_SLOT_MASK) & (cap - 1);
+}
+
+/**
+ * Find a handle's entry (mem_lock held)
+ */
+static struct live_entry *live_find_locked(uint64_t handle)
+{
+    if (!live_map) {
+        return NULL;
+    }
+
+    for (size_t i = live_slot(handle, live_cap); live_map[i].handle; i = (i + 1) & (live_cap - 1)) {
+        if (live_map[i].handle == handle) {
+            return &live_map[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Find the entry an address points into (mem_lock held)
+ */
+static struct live_entry *live_find_addr_locked(CUdeviceptr addr)
+{
+    if (!live_map || !idm_va_valid(addr)) {
+        return NULL;
+    }
+
+    uint64_t slot = idm_va_slot(addr);
+    for (size_t i = live_slot(slot, live_cap); live_map[i].handle; i = (i + 1) & (live_cap - 1)) {
+        if ((live_map[i].handle & IDM_VA_SLOT_MASK) == slot) {
+            return &live_map[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Track a new handle (mem_lock held)
+ *
+ * @return false if the map couldn't grow (handle stays untracked)
+ */
+static bool live_insert_locked(uint64_t handle, size_t size)
+{
+    if ((live_count + 1) * 2 > live_cap) {
+        size_t cap = live_cap ? live_cap * 2 : 256;
+        struct live_entry *map = calloc(cap, sizeof(*map));
+        if (!map) {
+            return false;
+        }
+
+        for (size_t i = 0; i < live_cap; i++) {
+            if (live_map[i].handle) {
+                size_t j = live_slot(live_map[i].handle, cap);
+                while (map[j].handle) {
+                    j = (j + 1) & (cap - 1);
+                }
+                map[j] = live_map[i];
+            }
+        }
+
+        free(live_map);
+        live_map = map;
+        live_cap = cap;
+    }
+
+    size_t i = live_slot(handle, live_cap);
+    while (live_map[i].handle) {
+        i = (i + 1) & (live_cap - 1);
+    }
+    live_map[i] = (struct live_entry){ .handle = handle, .size = size };
+    live_count++;
+
+    return true;
+}
+
+/**
+ * Stop tracking an entry (mem_lock held)
+ */
+static void live_remove_locked(struct live_entry *entry)
+{
+    size_t hole = (size_t)(entry - live_map);
+    size_t i = hole;
+
+    /* Pull later entries of the probe run back into the hole */
+    for (;;) {
+        i = (i + 1) & (live_cap - 1);
+        if (!live_map[i].handle) {
+            break;
+        }
+        size_t home = live_slot(live_map[i].handle, live_cap);
+        if (((i - home) & (live_cap - 1)) >= ((i - hole) & (live_cap - 1))) {
+            live_map[hole] = live_map[i];
+            hole = i;
+        }
+    }
+
+    live_map[hole].handle = 0;
+    live_count--;
+}
+
+/**
+ * Remember a handle we just got from the proxy
+ *
+ * @return false if the map couldn't grow
+ */
+static bool live_track(uint64_t handle, size_t size)
+{
+    pthread_mutex_lock(&mem_lock);
+    bool ok = live_insert_locked(handle, size);
+    pthread_mutex_unlock(&mem_lock);
+    return ok;
+}
+
+/**
+ * Split a device address into handle and offset
+ *
+ * @param size Bytes the access covers from addr
+ * @return CUDA_SUCCESS, or CUDA_ERROR_INVALID_VALUE if addr isn't inside
+ *         a live allocation or the access runs past its end
+ */
+static CUresult live_resolve(CUdeviceptr addr, size_t size,
+                             uint64_t *handle_out, uint64_t *offset_out)
+{
+    CUresult result = CUDA_ERROR_INVALID_VALUE;
+    uint64_t offset = addr & IDM_VA_OFFSET_MASK;
+
+    pthread_mutex_lock(&mem_lock);
+
+    struct live_entry *entry = live_find_addr_locked(addr);
+    if (entry && !entry->cached && offset <= entry->size && size <= entry->size - offset) {
+        *handle_out = entry->handle;
+        *offset_out = offset;
+        result = CUDA_SUCCESS;
+    }
+
+    pthread_mutex_unlock(&mem_lock);
+
+    return result;
+}
+
+/**
+ * Get the bucket for a class (mem_lock held)
+ *
+ * @param create Claim an unused bucket if there is none yet
+ */
+static struct cache_bucket *bucket_for_locked(size_t size, bool create)
+{
+    struct cache_bucket *unused = NULL;
+
+    for (int i = 0; i < CACHE_BUCKETS; i++) {
+        if (cache_buckets[i].size == size) {
+            return &cache_buckets[i];
+        }
+        if (!unused && cache_buckets[i].count == 0) {
+            unused = &cache_buckets[i];
+        }
+    }
+
+    if (!create || !unused) {
+        return NULL;
+    }
+    unused->size = size;
+    return unused;
+}
+
+/**
+ * Take a cached handle of a class
+ *
+ * @return Handle, or 0 if none is cached
+ */
+static uint64_t cache_take(size_t size)
+{
+    uint64_t handle = 0;
+
+    pthread_mutex_lock(&mem_lock);
+
+    struct cache_bucket *bucket = bucket_for_locked(size, false);
+    if (bucket && bucket->count > 0) {
+        handle = bucket->handles[--bucket->count];
+        cache_bytes -= size;
+
+        struct live_entry *entry = live_find_locked(handle);
+        if (entry) {
+            entry->cached = false;
+        }
+    }
+
+    pthread_mutex_unlock(&mem_lock);
+
+    return handle;
+}
+
+/**
+ * Stop using an allocation (cuMemFree)
+ *
+ * With the cache on the handle is kept if it fits; otherwise it is
+ * untracked and must go back to the proxy.
+ *
+ * @param handle_out [out] Handle to free, or 0 if it was cached
+ * @return CUDA_SUCCESS, or CUDA_ERROR_INVALID_VALUE if dptr isn't the
+ *         start of a live allocation (double free included)
+ */
+static CUresult live_release(CUdeviceptr dptr, uint64_t *handle_out)
+{
+    CUresult result = CUDA_ERROR_INVALID_VALUE;
+
+    pthread_mutex_lock(&mem_lock);
+
+    struct live_entry *entry = live_find_addr_locked(dptr);
+    if (!entry || entry->cached || entry->imported || (dptr & IDM_VA_OFFSET_MASK) != 0) {
+        goto out;
+    }
+
+    /* Shared memory is reused only once the proxy has ended its grants */
+    uint64_t handle = entry->handle;
+    size_t size = entry->size;
+    struct cache_bucket *bucket = NULL;
+    if (cache_limit && !entry->exported && cache_bytes + size <= cache_limit) {
+        bucket = bucket_for_locked(size, true);
+    }
+    if (bucket && bucket->count == bucket->cap) {
+        uint32_t cap = bucket->cap ? bucket->cap * 2 : 16;
+        uint64_t *handles = realloc(bucket->handles, cap * sizeof(*handles));
+        if (handles) {
+            bucket->handles = handles;
+            bucket->cap = cap;
+        } else {
+            bucket = NULL;
+        }
+    }
+
+    if (bucket) {
+        bucket->handles[bucket->count++] = handle;
+        cache_bytes += size;
+        entry->cached = true;
+        *handle_out = 0;
+    } else {
+        live_remove_locked(entry);
+        *handle_out = handle;
+    }
+    result = CUDA_SUCCESS;
+
+out:
+    pthread_mutex_unlock(&mem_lock);
+    return result;
+}
+
+static CUresult submit_free(uint64_t handle);
+
+/**
+ * Return every cached handle to the proxy (one batched round of frees)
+ *
+ * @return Bytes released
+ */
+static size_t cache_trim(void)
+{
+    pthread_mutex_lock(&mem_lock);
+
+    __atomic_store_n(&reclaim_requested, false, __ATOMIC_RELAXED);
+
+    size_t released = cache_bytes;
+    size_t count = 0;
+    for (int i = 0; i < CACHE_BUCKETS; i++) {
+        count += cache_buckets[i].count;
+    }
+
+    uint64_t *handles = count ? malloc(count * sizeof(*handles)) : NULL;
+    if (!handles) {
+        pthread_mutex_unlock(&mem_lock);
+        return 0;
+    }
+
+    size_t n = 0;
+    for (int i = 0; i < CACHE_BUCKETS; i++) {
+        struct cache_bucket *bucket = &cache_buckets[i];
+        while (bucket->count > 0) {
+            uint64_t handle = bucket->handles[--bucket->count];
+            struct live_entry *entry = live_find_locked(handle);
+            if (entry) {
+                live_remove_locked(entry);
+            }
+            handles[n++] = handle;
+        }
+        bucket->size = 0;
+    }
+    cache_bytes = 0;
+
+    pthread_mutex_unlock(&mem_lock);
+
+    /* Detached frees coalesce into as few IDM_BATCH messages as fit */
+    for (size_t i = 0; i < n; i++) {
+        submit_free(handles[i]);
+    }
+    batch_flush();
+    free(handles);
+
+    return released;
+}
+
+/**
+ * Trim if the proxy asked for memory since we last looked
+ */
+static void cache_check_reclaim(void)
+{
+    if (__atomic_load_n(&reclaim_requested, __ATOMIC_RELAXED)) {
+        cache_trim();
+    }
+}
+
+/* ============================================================================
+ * Host Memory
+ *
+ * cuMemAllocHost memory is a region shared with the proxy, which maps and
+ * pins it once (IDM_HOST_REGISTER). Copies whose host side lies inside one
+ * skip the bulk staging: they go out as a single IDM_COPY_HOST request
+ * and the device reads or writes guest pages directly. A region's ID is
+ * its index in host_regions.
+ * ============================================================================ */
+
+#define MAX_HOST_REGIONS 64
+
+struct host_region {
+    uint8_t *base;         /* Our mapping (NULL = unused) */
+    size_t size;           /* Whole pages */
+    uint64_t handle;       /* Proxy's region handle */
+};
+
+static pthread_mutex_t host_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct host_region host_regions[MAX_HOST_REGIONS];
+static int host_region_count = 0;                /* Read without host_lock */
+
+/**
+ * Find the region holding a host range
+ *
+ * @param addr_out [out] bulk_offset for an IDM_COPY_HOST copy
+ * @return true if [ptr, ptr + size) lies inside one region
+ */
+static bool host_resolve(const void *ptr, size_t size, uint64_t *addr_out)
+{
+    /* Most programs never pin: stay off the lock */
+    if (__atomic_load_n(&host_region_count, __ATOMIC_RELAXED) == 0) {
+        return false;
+    }
+
+    const uint8_t *p = ptr;
+    bool found = false;
+
+    pthread_mutex_lock(&host_lock);
+    for (int i = 0; i < MAX_HOST_REGIONS && !found; i++) {
+        struct host_region *r = &host_regions[i];
+        if (r->base && p >= r->base && size <= r->size &&
+            (size_t)(p - r->base) <= r->size - size) {
+            *addr_out = idm_va_of_handle(r->handle) + (uint64_t)(p - r->base);
+            found = true;
+        }
+    }
+    pthread_mutex_unlock(&host_lock);
+
+    return found;
+}
+
+/**
+ * Create a region and have the proxy pin it
+ *
+ * @return Mapping, or NULL if no region could be set up
+ */
+static void *host_region_create(size_t size)
+{
+    pthread_mutex_lock(&host_lock);
+    int id = -1;
+    for (int i = 0; i < MAX_HOST_REGIONS && id < 0; i++) {
+        if (!host_regions[i].base && !host_regions[i].size) {
+            id = i;
+        }
+    }
+    if (id >= 0) {
+        host_regions[id].size = size;    /* Claimed; base stays NULL until pinned */
+    }
+    pthread_mutex_unlock(&host_lock);
+
+    if (id < 0) {
+        return NULL;
+    }
+
+    uint32_t gref_count = 0;
+    uint32_t *grefs = malloc((size / IDM_PAGE_SIZE) * sizeof(*grefs));
+    uint8_t *base = grefs ? idm_region_create((uint32_t)id, size, grefs, &gref_count) : NULL;
+
+    struct idm_host_register req = {
+        .size = size,
+        .gref_count = gref_count,
+        .region_id = (uint32_t)id
+    };
+
+    /* Xen: the grant list travels through the bulk region */
+    int chunks = (int)(((size_t)gref_count * sizeof(*grefs) + STAGE_CHUNK_SIZE - 1) /
+                       STAGE_CHUNK_SIZE);
+    int stage = -1;
+    if (base && chunks > 0) {
+        stage = stage_acquire(chunks);
+        if (stage >= 0) {
+            uint8_t *bulk = idm_bulk_region(NULL);
+            req.gref_offset = (uint64_t)stage * STAGE_CHUNK_SIZE;
+            memcpy(bulk + req.gref_offset, grefs, (size_t)gref_count * sizeof(*grefs));
+        }
+    }
+    free(grefs);
+
+    uint64_t handle = 0;
+    CUresult result = CUDA_ERROR_OUT_OF_MEMORY;
+    if (base && (chunks == 0 || stage >= 0)) {
+        result = call_proxy(IDM_HOST_REGISTER, &req, sizeof(req), &handle, NULL);
+    }
+    if (stage >= 0) {
+        stage_release_run(stage, chunks);
+    }
+
+    pthread_mutex_lock(&host_lock);
+    if (result == CUDA_SUCCESS) {
+        host_regions[id].base = base;
+        host_regions[id].handle = handle;
+        __atomic_add_fetch(&host_region_count, 1, __ATOMIC_RELAXED);
+    } else {
+        host_regions[id].size = 0;
+    }
+    pthread_mutex_unlock(&host_lock);
+
+    if (result != CUDA_SUCCESS) {
+        if (base) {
+            idm_region_destroy((uint32_t)id, base, size);
+        }
+        return NULL;
+    }
+
+    return base;
+}
+
+/**
+ * Unpin and unmap the region starting at ptr
+ *
+ * @return CUDA_SUCCESS, or CUDA_ERROR_INVALID_VALUE if ptr doesn't start one
+ */
+static CUresult host_region_destroy(void *ptr)
+{
+    pthread_mutex_lock(&host_lock);
+    int id = -1;
+    for (int i = 0; i < MAX_HOST_REGIONS && id < 0; i++) {
+        if (host_regions[i].base && host_regions[i].base == ptr) {
+            id = i;
+        }
+    }
+    struct host_region region = { 0 };
+    if (id >= 0) {
+        region = host_regions[id];
+        host_regions[id].base = NULL;    /* No new copies; slot stays claimed */
+        __atomic_sub_fetch(&host_region_count, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&host_lock);
+
+    if (id < 0) {
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+
+    /* The proxy waits for copies still using it before it lets go */
+    struct idm_host_unregister req = { .region_handle = region.handle };
+    CUresult result = call_proxy(IDM_HOST_UNREGISTER, &req, sizeof(req), NULL, NULL);
+    idm_region_destroy((uint32_t)id, region.base, region.size);
+
+    pthread_mutex_lock(&host_lock);
+    host_regions[id].size = 0;
+    pthread_mutex_unlock(&host_lock);
+
+    return result;
+}
+
+/* ============================================================================
+ * Stream Capture
+ *
+ * Between cuStreamBeginCapture and cuStreamEndCapture, kernel launches,
+ * fills and device copies on the stream are recorded here instead of sent.
+ * cuGraphInstantiate ships the recording once (GPU_GRAPH_INSTANTIATE) and
+ * the proxy builds a real graph from it; every cuGraphLaunch after that is
+ * one small message.
+ * CUgraphExec values are the proxy's graph handles.
+ *
+ * Anything else queued on a capturing stream (copies from or to guest
+ * memory, events, synchronization) can't be replayed by the proxy on its
+ * own, so it fails and invalidates the capture, as unsupported operations
+ * do with the real driver.
+ * ============================================================================ */
+
+/* Most streams capturing at once */
+#define MAX_CAPTURES 8
+
+struct CUgraph_st {
+    CUstream stream;       /* Stream it was captured from */
+    bool invalidated;      /* Something unrecordable was queued */
+    uint32_t count;        /* Recorded commands */
+    size_t len;
+    size_t cap;
+    uint8_t *records;      /* idm_batch_cmd + payload each, as in a BATCH */
+};
+
+static pthread_mutex_t capture_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct CUgraph_st *captures[MAX_CAPTURES];
+static int capture_count = 0;  /* Read without the lock on hot paths */
+
+/**
+ * Find the capture on a stream (capture_lock held)
+ */
+static struct CUgraph_st **capture_find_locked(CUstream stream)
+{
+    for (int i = 0; i < MAX_CAPTURES; i++) {
+        if (captures[i] && captures[i]->stream == stream) {
+            return &captures[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Record a command if its stream is capturing
+ *
+ * @param result [out] Outcome when recorded
+ * @return true if the command was taken by a capture (don't send it)
+ */
+static bool capture_record(CUstream stream, enum idm_msg_type type,
+                           const void *payload, uint32_t payload_len, CUresult *result)
+{
+    if (__atomic_load_n(&capture_count, __ATOMIC_ACQUIRE) == 0 || !stream) {
+        return false;
+    }
+
+    pthread_mutex_lock(&capture_lock);
+
+    struct CUgraph_st **slot = capture_find_locked(stream);
+    if (!slot) {
+        pthread_mutex_unlock(&capture_lock);
+        return false;
+    }
+
+    struct CUgraph_st *graph = *slot;
+    size_t space = IDM_BATCH_CMD_SPACE(payload_len);
+
+    if (graph->len + space > graph->cap) {
+        size_t cap = graph->cap ? graph->cap * 2 : 4096;
+        while (cap < graph->len + space) {
+            cap *= 2;
+        }
+        uint8_t *records = realloc(graph->records, cap);
+        if (!records) {
+            graph->invalidated = true;
+            pthread_mutex_unlock(&capture_lock);
+            *result = CUDA_ERROR_OUT_OF_MEMORY;
+            return true;
+        }
+        graph->records = records;
+        graph->cap = cap;
+    }
+
+    struct idm_batch_cmd cmd = { .msg_type = type, .payload_len = payload_len };
+    memcpy(graph->records + graph->len, &cmd, sizeof(cmd));
+    memcpy(graph->records + graph->len + sizeof(cmd), payload, payload_len);
+    memset(graph->records + graph->len + sizeof(cmd) + payload_len, 0,
+           space - sizeof(cmd) - payload_len);
+    graph->len += space;
+    graph->count++;
+
+    pthread_mutex_unlock(&capture_lock);
+
+    *result = CUDA_SUCCESS;
+    return true;
+}
+
+/**
+ * Refuse an operation that can't be recorded if its stream is capturing
+ *
+ * @return CUDA_SUCCESS if the stream isn't capturing, otherwise
+ *         CUDA_ERROR_STREAM_CAPTURE_UNSUPPORTED (capture invalidated)
+ */
+static CUresult capture_refuse(CUstream stream)
+{
+    if (__atomic_load_n(&capture_count, __ATOMIC_ACQUIRE) == 0 || !stream) {
+        return CUDA_SUCCESS;
+    }
+
+    pthread_mutex_lock(&capture_lock);
+    struct CUgraph_st **slot = capture_find_locked(stream);
+    if (slot) {
+        (*slot)->invalidated = true;
+    }
+    pthread_mutex_unlock(&capture_lock);
+
+    return slot ? CUDA_ERROR_STREAM_CAPTURE_UNSUPPORTED : CUDA_SUCCESS;
+}
+
+/* ============================================================================
+ * CUDA Driver API Implementation
+ * ============================================================================ */
+
+/**
+ * Write the trace at exit (VGPU_TRACE)
+ */
+static void trace_write(void)
+{
+    int ret = idm_trace_dump(trace_path);
+    if (ret < 0) {
+        fprintf(stderr, "[libvgpu] Failed to write trace %s: %s\n", trace_path, strerror(-ret));
+    } else {
+        fprintf(stderr, "[libvgpu] Trace written to %s\n", trace_path);
+    }
+}
+
+/**
+ * Fetch the properties of devices first..last-1 into device_props
+ *
+ * All requests go out before the first answer is waited for, so every
+ * device costs one round trip together.
+ *
+ * @param count_out [out] Device count the proxy reports
+ */
+static CUresult fetch_props(int first, int last, uint32_t *count_out)
+{
+    uint64_t seqs[IDM_MAX_DEVICES];
+    CUresult result = CUDA_SUCCESS;
+    int sent = 0;
+
+    for (int dev = first; dev < last; dev++) {
+        struct idm_message *msg = idm_build_message(DRIVER_ZONE_ID, IDM_GPU_GET_PROPS, NULL, 0);
+        if (!msg) {
+            result = CUDA_ERROR_OUT_OF_MEMORY;
+            break;
+        }
+
+        struct pending_req actions = {
+            .stage_first = -1,
+            .data_dst = &device_props[dev],
+            .data_cap = sizeof(device_props[dev])
+        };
+
+        current_device = dev;
+        result = submit_request(msg, &actions, false);
+        seqs[sent] = msg->header.seq_num;
+        idm_free_message(msg);
+        if (result != CUDA_SUCCESS) {
+            break;
+        }
+        sent++;
+    }
+    current_device = 0;
+
+    for (int i = 0; i < sent; i++) {
+        size_t data_len = 0;
+        CUresult res = wait_request_data(seqs[i], NULL, count_out, &data_len);
+        if (res == CUDA_SUCCESS && data_len != sizeof(struct idm_gpu_props)) {
+            res = CUDA_ERROR_INVALID_VALUE;
+        }
+        if (result == CUDA_SUCCESS) {
+            result = res;
+        }
+    }
+
+    return result;
+}
+
+/**
+ * Start a session on the zone's rings (IDM_HELLO)
+ *
+ * The rings may have served an earlier process; its leftovers are
+ * released by the proxy, and our seq_nums move past anything it sent.
+ * A proxy that doesn't know HELLO rejects it, and we go on as before.
+ */
+static CUresult say_hello(void)
+{
+    struct idm_hello hello = { .pid = (uint32_t)getpid() };
+
+    struct idm_message *msg = idm_build_message(DRIVER_ZONE_ID, IDM_HELLO, &hello, sizeof(hello));
+    if (!msg) {
+        return CUDA_ERROR_OUT_OF_MEMORY;
+    }
+    msg->header.seq_num = IDM_HELLO_SEQ_BIT | (now_ns() & (IDM_HELLO_SEQ_BIT - 1));
+
+    uint64_t first_seq = 0;
+    CUresult result = submit_request(msg, NULL, false);
+    if (result == CUDA_SUCCESS) {
+        result = wait_request(msg->header.seq_num, &first_seq, NULL);
+    }
+    idm_free_message(msg);
+
+    if (result == CUDA_SUCCESS && first_seq != 0) {
+        idm_set_next_seq(first_seq);
+    }
+
+    return result;
+}
+
+/**
+ * cuInit - Initialize CUDA driver
+ */
+CUresult cuInit(unsigned int Flags)
+{
+    (void)Flags;
+
+    pthread_mutex_lock(&init_lock);
+
+    if (initialized) {
+        pthread_mutex_unlock(&init_lock);
+        return CUDA_SUCCESS;
+    }
+
+    /* Initialize IDM connection to GPU proxy */
+    /* Each guest (or test process) talks from its own zone */
+    const char *zone_env = getenv("IDM_ZONE_ID");
+    if (zone_env && *zone_env) {
+        local_zone = (uint32_t)strtoul(zone_env, NULL, 10);
+    }
+
+    const char *trace_env = getenv("VGPU_TRACE");
+    if (trace_env && *trace_env) {
+        trace_path = trace_env;
+        idm_trace_enable();
+        atexit(trace_write);
+    }
+
+    if (idm_init(local_zone, DRIVER_ZONE_ID, false) < 0) {
+        fprintf(stderr, "[libvgpu] Failed to initialize IDM\n");
+        pthread_mutex_unlock(&init_lock);
+        return CUDA_ERROR_NOT_INITIALIZED;
+    }
+
+    if (say_hello() != CUDA_SUCCESS) {
+        fprintf(stderr, "[libvgpu] Proxy has no sessions; sequence numbers not resynced\n");
+    }
+
+    /* The devices the proxy placed us on; device 0's answer says how many */
+    uint32_t count = 0;
+    if (fetch_props(0, 1, &count) == CUDA_SUCCESS && count > 0) {
+        device_count = count < IDM_MAX_DEVICES ? (int)count : IDM_MAX_DEVICES;
+        fetch_props(1, device_count, &count);
+    }
+
+    const char *cache_env = getenv("VGPU_ALLOC_CACHE_MB");
+    if (cache_env && *cache_env) {
+        cache_limit = (size_t)strtoull(cache_env, NULL, 10) << 20;
+        if (cache_limit) {
+            fprintf(stderr, "[libvgpu] Allocation cache: %zu MB\n", cache_limit >> 20);
+        }
+    }
+
+    initialized = true;
+    pthread_mutex_unlock(&init_lock);
+
+    fprintf(stderr, "[libvgpu] Initialized (%d virtual GPU(s) via IDM)\n", device_count);
+    return CUDA_SUCCESS;
+}
+
+/**
+ * cuDriverGetVersion - Get driver version
+ */
+CUresult cuDriverGetVersion(int *driverVersion)
+{
+    if (!initialized) {
+        return CUDA_ERROR_NOT_INITIALIZED;
+    }
+
+    if (!driverVersion) {
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+
+    /* The proxy's driver, or a 12.0 one if it didn't say */
+    *driverVersion = device_props[0].driver_version ? device_props[0].driver_version : 12000;
+    return CUDA_SUCCESS;
+}
+
+/**
+ * cuDeviceGet - Get device handle
+ */
+CUresult cuDeviceGet(CUdevice *device, int ordinal)
+{
+    if (!initialized) {
+        return CUDA_ERROR_NOT_INITIALIZED;
+    }
+
+    if (!device || ordinal < 0 || ordinal >= device_count) {
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+
+    *device = ordinal;
+    return CUDA_SUCCESS;
+}
+
+/**
+ * cuDeviceGetCount - Get device count
+ */
+CUresult cuDeviceGetCount(int *count)
+{
+    if (!initialized) {
+        return CUDA_ERROR_NOT_INITIALIZED;
+    }
+
+    if (!count) {
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+
+    *count = device_count;
+    return CUDA_SUCCESS;
+}
+
+/**
+ * cuDeviceGetName - Get device name
+ */
+CUresult cuDeviceGetName(char *name, int len, CUdevice dev)
+{
+    if (!initialized) {
+        return CUDA_ERROR_NOT_INITIALIZED;
+    }
+
+    if (!name || len <= 0 || dev < 0 || dev >= device_count) {
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+
+    if (device_props[dev].name[0]) {
+        snprintf(name, len, "%.*s", IDM_PROPS_NAME_MAX - 1, device_props[dev].name);
+    } else {
+        snprintf(name, len, "Virtual GPU %d (via Xen)", dev);
+    }
+    return CUDA_SUCCESS;
+}
+
+/**
+ * cuDeviceTotalMem - Get device memory size
+ */
+CUresult cuDeviceTotalMem(size_t *bytes, CUdevice dev)
+{
+    if (!initialized) {
+        return CUDA_ERROR_NOT_INITIALIZED;
+    }
+
+    if (!bytes || dev < 0 || dev >= device_count) {
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+
+    *bytes = (size_t)device_props[dev].total_mem;
+    return CUDA_SUCCESS;
+}
+
+/**
+ * cuDeviceGetAttribute - Get device attribute
+ *
+ * Answered from the table fetched at cuInit; IDs the proxy's driver
+ * didn't know are rejected like the driver would.
+ */
+CUresult cuDeviceGetAttribute(int *pi, CUdevice_attribute attrib, CUdevice dev)
+{
+    if (!initialized) {
+        return CUDA_ERROR_NOT_INITIALIZED;
+    }
+
+    if (!pi || dev < 0 || dev >= device_count) {
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+
+    int32_t value;
+    if (!idm_props_attr(&device_props[dev], (uint32_t)attrib, &value)) {
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+
+    *pi = value;
+    return CUDA_SUCCESS;
+}
+
+/**
+ * cuDeviceComputeCapability - Get compute capability (deprecated API)
+ */
+CUresult cuDeviceComputeCapability(int *major, int *minor, CUdevice dev)
+{
+    if (!major || !minor) {
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+
+    CUresult result = cuDeviceGetAttribute(major, CU_DEVICE_ATTRIBUTE_COMPUTE_CAPABILITY_MAJOR, dev);
+    if (result == CUDA_SUCCESS) {
+        result = cuDeviceGetAttribute(minor, CU_DEVICE_ATTRIBUTE_COMPUTE_CAPABILITY_MINOR, dev);
+    }
+    return result;
+}
+
+/**
+ * cuDeviceGetUuid - Get device UUID
+ */
+CUresult cuDeviceGetUuid(CUuuid *uuid, CUdevice dev)
+{
+    if (!initialized) {
+        return CUDA_ERROR_NOT_INITIALIZED;
+    }
+
+    if (!uuid || dev < 0 || dev >= device_count) {
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+
+    memcpy(uuid->bytes, device_props[dev].uuid, sizeof(uuid->bytes));
+    return CUDA_SUCCESS;
+}
+
+/**
+ * cuCtxCreate - Create context
+ */
+CUresult cuCtxCreate(CUcontext *pctx, unsigned int flags, CUdevice dev)
+{
+    if (!initialized) {
+        return CUDA_ERROR_NOT_INITIALIZED;
+    }
+
+    if (!pctx || dev < 0 || dev >= device_count) {
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+
+    (void)flags;
+
+    /* Create a fake context handle (one per device) */
+    batch_flush();
+    current_context = (CUcontext)(uintptr_t)(0x1000 + dev);
+    current_device = dev;
+    *pctx = current_context;
+
+    fprintf(stderr, "[libvgpu] Created context %p\n", current_context);
+    return CUDA_SUCCESS;
+}
+
+/**
+ * cuCtxDestroy - Destroy context
+ */
+CUresult cuCtxDestroy(CUcontext ctx)
+{
+    if (!initialized) {
+        return CUDA_ERROR_NOT_INITIALIZED;
+    }
+
+    /* Any thread may destroy it, not only one it's current on */
+    int dev = (int)((uintptr_t)ctx - 0x1000);
+    if (!ctx || dev < 0 || dev >= device_count) {
+        return CUDA_ERROR_INVALID_CONTEXT;
+    }
+
+    /* Don't leave cached or queued frees behind */
+    if (cache_limit) {
+        cache_trim();
+    }
+    batch_flush();
+
+    if (ctx == current_context) {
+        current_context = NULL;
+        current_device = 0;
+    }
+    return CUDA_SUCCESS;
+}
+
+/**
+ * cuCtxSynchronize - Synchronize context
+ */
+CUresult cuCtxSynchronize(void)
+{
+    if (!initialized) {
+        return CUDA_ERROR_NOT_INITIALIZED;
+    }
+
+    struct idm_gpu_sync sync_req = { .flags = 0 };
+
+    struct idm_message *msg = idm_build_message(
+        DRIVER_ZONE_ID,
+        IDM_GPU_SYNC,
+        &sync_req,
+        sizeof(sync_req)
+    );
+
+    if (!msg) {
+        return CUDA_ERROR_OUT_OF_MEMORY;
+    }
+
+    CUresult result = send_and_wait(msg, NULL);
+    idm_free_message(msg);
+
+    /* Everything submitted before the sync has completed by now */
+    CUresult deferred = take_deferred_error();
+    if (result == CUDA_SUCCESS) {
+        result = deferred;
+    }
+
+    return result;
+}
+
+/**
+ * cuCtxGetCurrent - Get the calling thread's current context
+ */
+CUresult cuCtxGetCurrent(CUcontext *pctx)
+{
+    if (!initialized) {
+        return CUDA_ERROR_NOT_INITIALIZED;
+    }
+
+    if (!pctx) {
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+
+    *pctx = current_context;
+    return CUDA_SUCCESS;
+}
+
+/**
+ * cuCtxSetCurrent - Set the calling thread's current context
+ */
+CUresult cuCtxSetCurrent(CUcontext ctx)
+{
+    if (!initialized) {
+        return CUDA_ERROR_NOT_INITIALIZED;
+    }
+
+    int dev = ctx ? (int)((uintptr_t)ctx - 0x1000) : 0;
+    if (dev < 0 || dev >= device_count) {
+        return CUDA_ERROR_INVALID_CONTEXT;
+    }
+
+    current_context = ctx;
+    current_device = dev;
+    return CUDA_SUCCESS;
+}
+
+/**
+ * cuMemAlloc - Allocate GPU memory
+ */
+CUresult cuMemAlloc(CUdeviceptr *dptr, size_t bytesize)
+{
+    if (!initialized) {
+        return CUDA_ERROR_NOT_INITIALIZED;
+    }
+
+    if (!dptr || bytesize == 0) {
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+
+    size_t cls = 0;
+    if (cache_limit) {
+        cache_check_reclaim();
+
+        cls = cache_class(bytesize);
+        uint64_t cached = cls ? cache_take(cls) : 0;
+        if (cached) {
+            *dptr = idm_va_of_handle(cached);
+            return CUDA_SUCCESS;
+        }
+        if (cls) {
+            bytesize = cls;
+        }
+    }
+
+    struct idm_gpu_alloc alloc_req = {
+        .size = bytesize,
+        .flags = 0
+    };
+
+    struct idm_message *msg = idm_build_message(
+        DRIVER_ZONE_ID,
+        IDM_GPU_ALLOC,
+        &alloc_req,
+        sizeof(alloc_req)
+    );
+
+    if (!msg) {
+        return CUDA_ERROR_OUT_OF_MEMORY;
+    }
+
+    uint64_t handle = 0;
+    CUresult result = send_and_wait(msg, &handle);
+    idm_free_message(msg);
+
+    /* Our own cache may be what's filling the device (or our quota) */
+    if (result == CUDA_ERROR_OUT_OF_MEMORY && cache_limit && cache_trim() > 0) {
+        msg = idm_build_message(DRIVER_ZONE_ID, IDM_GPU_ALLOC, &alloc_req, sizeof(alloc_req));
+        if (!msg) {
+            return CUDA_ERROR_OUT_OF_MEMORY;
+        }
+        result = send_and_wait(msg, &handle);
+        idm_free_message(msg);
+    }
+
+    if (result != CUDA_SUCCESS) {
+        return result;
+    }
+
+    if (!live_track(handle, bytesize)) {
+        submit_free(handle);
+        return CUDA_ERROR_OUT_OF_MEMORY;
+    }
+    *dptr = idm_va_of_handle(handle);
+
+    return CUDA_SUCCESS;
+}
+
+/**
+ * Queue a GPU_FREE without waiting (failures surface at the next synchronize)
+ */
+static CUresult submit_free(uint64_t handle)
+{
+    struct idm_gpu_free free_req = {
+        .handle = handle
+    };
+
+    struct idm_message *msg = idm_build_message(
+        DRIVER_ZONE_ID,
+        IDM_GPU_FREE,
+        &free_req,
+        sizeof(free_req)
+    );
+
+    if (!msg) {
+        return CUDA_ERROR_OUT_OF_MEMORY;
+    }
+
+    CUresult result = submit_request(msg, NULL, true);
+    idm_free_message(msg);
+
+    return result;
+}
+
+/**
+ * cuMemFree - Free GPU memory
+ *
+ * Returns as soon as the request is queued (or the handle is cached).
+ */
+CUresult cuMemFree(CUdeviceptr dptr)
+{
+    if (!initialized) {
+        return CUDA_ERROR_NOT_INITIALIZED;
+    }
+
+    if (cache_limit) {
+        cache_check_reclaim();
+    }
+
+    uint64_t handle;
+    CUresult result = live_release(dptr, &handle);
+    if (result != CUDA_SUCCESS || handle == 0) {
+        return result;
+    }
+
+    return submit_free(handle);
+}
+
+/* ============================================================================
+ * Sharing Memory Between Zones
+ *
+ * cuIpcGetMemHandle wraps an allocation's handle for another zone (a
+ * tokenizer VM handing tensors to a model VM, say). That zone can open it
+ * only after vgpuMemShare granted it access; the proxy checks the grant on
+ * every use, and freeing the memory ends all grants. Opened memory stays
+ * in the owner's pool on the owner's GPU; copies with our own memory run
+ * on the device (peer to peer across GPUs), never through host memory.
+ * ============================================================================ */
+
+/* What a CUipcMemHandle carries */
+struct ipc_handle {
+    uint64_t handle;       /* Owner's handle */
+};
+
+_Static_assert(sizeof(struct ipc_handle) <= sizeof(CUipcMemHandle), "IPC handle too small");
+
+/**
+ * Find one of our own allocations by its base address
+ *
+ * @return Handle, or 0 if dptr isn't the start of a live allocation of ours
+ */
+static uint64_t own_allocation(CUdeviceptr dptr, bool mark_exported)
+{
+    uint64_t handle = 0;
+
+    pthread_mutex_lock(&mem_lock);
+
+    struct live_entry *entry = live_find_addr_locked(dptr);
+    if (entry && !entry->cached && !entry->imported && (dptr & IDM_VA_OFFSET_MASK) == 0) {
+        handle = entry->handle;
+        if (mark_exported) {
+            entry->exported = true;
+        }
+    }
+
+    pthread_mutex_unlock(&mem_lock);
+
+    return handle;
+}
+
+/**
+ * vgpuMemShare - Let other zones open an allocation
+ *
+ * Replaces the allocation's grant list (count 0 revokes every grant).
+ */
+CUresult vgpuMemShare(CUdeviceptr dptr, const unsigned int *zones, unsigned int count)
+{
+    if (!initialized) {
+        return CUDA_ERROR_NOT_INITIALIZED;
+    }
+
+    if (count > IDM_GRANT_MAX || (count && !zones)) {
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+
+    uint64_t handle = own_allocation(dptr, true);
+    if (handle == 0) {
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+
+    struct idm_gpu_mem_export req = { .handle = handle, .zone_count = count };
+    for (unsigned int i = 0; i < count; i++) {
+        req.zones[i] = zones[i];
+    }
+
+    return call_proxy(IDM_GPU_MEM_EXPORT, &req, sizeof(req), NULL, NULL);
+}
+
+/**
+ * cuIpcGetMemHandle - Get a handle other zones can open
+ */
+CUresult cuIpcGetMemHandle(CUipcMemHandle *pHandle, CUdeviceptr dptr)
+{
+    if (!initialized) {
+        return CUDA_ERROR_NOT_INITIALIZED;
+    }
+
+    uint64_t handle = pHandle ? own_allocation(dptr, true) : 0;
+    if (handle == 0) {
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+
+    memset(pHandle, 0, sizeof(*pHandle));
+    struct ipc_handle ipc = { .handle = handle };
+    memcpy(pHandle->reserved, &ipc, sizeof(ipc));
+    return CUDA_SUCCESS;
+}
+
+/**
+ * cuIpcOpenMemHandle - Map memory another zone shared with us
+ *
+ * Opening the same handle again returns the same address.
+ */
+CUresult cuIpcOpenMemHandle(CUdeviceptr *pdptr, CUipcMemHandle handle, unsigned int Flags)
+{
+    (void)Flags;    /* Peer access between our GPUs is always on */
+
+    if (!initialized) {
+        return CUDA_ERROR_NOT_INITIALIZED;
+    }
+
+    struct ipc_handle ipc;
+    memcpy(&ipc, handle.reserved, sizeof(ipc));
+    if (!pdptr || ipc.handle == 0) {
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+
+    pthread_mutex_lock(&mem_lock);
+    struct live_entry *entry = live_find_locked(ipc.handle);
+    bool own = entry && !entry->imported;
+    bool open = entry && entry->imported;
+    pthread_mutex_unlock(&mem_lock);
+
+    /* As with the real driver, not in the process that exported it */
+    if (own) {
+        return CUDA_ERROR_INVALID_CONTEXT;
+    }
+    if (open) {
+        *pdptr = idm_va_of_handle(ipc.handle);
+        return CUDA_SUCCESS;
+    }
+
+    struct idm_gpu_mem_import req = { .handle = ipc.handle };
+    struct idm_message *msg = idm_build_message(DRIVER_ZONE_ID, IDM_GPU_MEM_IMPORT,
+                                                &req, sizeof(req));
+    if (!msg) {
+        return CUDA_ERROR_OUT_OF_MEMORY;
+    }
+
+    uint64_t size = 0;
+    size_t data_len = 0;
+    struct pending_req actions = {
+        .stage_first = -1,
+        .data_dst = &size,
+        .data_cap = sizeof(size)
+    };
+
+    CUresult result = submit_request(msg, &actions, false);
+    if (result == CUDA_SUCCESS) {
+        result = wait_request_data(msg->header.seq_num, NULL, NULL, &data_len);
+    }
+    idm_free_message(msg);
+
+    if (result == CUDA_SUCCESS && data_len != sizeof(size)) {
+        result = CUDA_ERROR_INVALID_VALUE;
+    }
+    if (result != CUDA_SUCCESS) {
+        return result;
+    }
+
+    pthread_mutex_lock(&mem_lock);
+    bool tracked = live_insert_locked(ipc.handle, (size_t)size);
+    if (tracked) {
+        live_find_locked(ipc.handle)->imported = true;
+    }
+    pthread_mutex_unlock(&mem_lock);
+
+    if (!tracked) {
+        return CUDA_ERROR_OUT_OF_MEMORY;
+    }
+
+    *pdptr = idm_va_of_handle(ipc.handle);
+    return CUDA_SUCCESS;
+}
+
+/**
+ * cuIpcCloseMemHandle - Stop using memory opened with cuIpcOpenMemHandle
+ */
+CUresult cuIpcCloseMemHandle(CUdeviceptr dptr)
+{
+    if (!initialized) {
+        return CUDA_ERROR_NOT_INITIALIZED;
+    }
+
+    CUresult result = CUDA_ERROR_INVALID_VALUE;
+
+    pthread_mutex_lock(&mem_lock);
+    struct live_entry *entry = live_find_addr_locked(dptr);
+    if (entry && entry->imported && (dptr & IDM_VA_OFFSET_MASK) == 0) {
+        live_remove_locked(entry);
+        result = CUDA_SUCCESS;
+    }
+    pthread_mutex_unlock(&mem_lock);
+
+    return result;
+}
+
+/**
+ * cuMemHostAlloc - Allocate page-locked host memory
+ *
+ * The memory is shared with the proxy and pinned there, so copies to and
+ * from it run without staging. When no region can be set up (more than
+ * IDM_HOST_REGION_MAX bytes, or MAX_HOST_REGIONS in use) it falls back to
+ * ordinary memory whose copies are staged as usual.
+ */
+CUresult cuMemHostAlloc(void **pp, size_t bytesize, unsigned int Flags)
+{
+    (void)Flags;    /* Portable and mapped are implied; write-combined doesn't apply */
+
+    if (!initialized) {
+        return CUDA_ERROR_NOT_INITIALIZED;
+    }
+
+    if (!pp || bytesize == 0) {
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+
+    size_t size = (bytesize + IDM_PAGE_SIZE - 1) & ~(size_t)(IDM_PAGE_SIZE - 1);
+    void *ptr = NULL;
+    if (size >= bytesize && size <= IDM_HOST_REGION_MAX) {
+        ptr = host_region_create(size);
+    }
+
+    if (!ptr) {
+        fprintf(stderr, "[libvgpu] No host region for %zu bytes, using unpinned memory\n",
+                bytesize);
+        if (posix_memalign(&ptr, IDM_PAGE_SIZE, bytesize) != 0) {
+            return CUDA_ERROR_OUT_OF_MEMORY;
+        }
+    }
+
+    *pp = ptr;
+    return CUDA_SUCCESS;
+}
+
+/**
+ * cuMemAllocHost - Allocate page-locked host memory
+ */
+CUresult cuMemAllocHost(void **pp, size_t bytesize)
+{
+    return cuMemHostAlloc(pp, bytesize, 0);
+}
+
+/**
+ * cuMemFreeHost - Free memory from cuMemAllocHost/cuMemHostAlloc
+ *
+ * Waits for copies still using it, as with the real driver.
+ */
+CUresult cuMemFreeHost(void *p)
+{
+    if (!initialized) {
+        return CUDA_ERROR_NOT_INITIALIZED;
+    }
+
+    if (!p) {
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+
+    CUresult result = host_region_destroy(p);
+    if (result == CUDA_ERROR_INVALID_VALUE) {
+        /* Fallback allocation */
+        free(p);
+        return CUDA_SUCCESS;
+    }
+
+    return result;
+}
+
+/**
+ * cuMemHostRegister - Page-lock existing host memory
+ *
+ * Pages a guest already owns can't be granted to the proxy after the
+ * fact, so registered memory is still copied through the bulk staging;
+ * only cuMemHostAlloc memory is zero-copy. Accepted so that
+ * register-then-copy code keeps working.
+ */
+CUresult cuMemHostRegister(void *p, size_t bytesize, unsigned int Flags)
+{
+    (void)Flags;
+
+    if (!initialized) {
+        return CUDA_ERROR_NOT_INITIALIZED;
+    }
+
+    if (!p || bytesize == 0) {
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+
+    return CUDA_SUCCESS;
+}
+
+/**
+ * cuMemHostUnregister - Undo cuMemHostRegister
+ */
+CUresult cuMemHostUnregister(void *p)
+{
+    if (!initialized) {
+        return CUDA_ERROR_NOT_INITIALIZED;
+    }
+
+    return p ? CUDA_SUCCESS : CUDA_ERROR_INVALID_VALUE;
+}
+
+/**
+ * Submit one H2D copy request (inline data, bulk or host region reference)
+ *
+ * The request is detached; its staging chunk (if any) is released when
+ * the proxy has consumed the data.
+ */
+static CUresult submit_copy_h2d(uint64_t handle, uint64_t offset,
+                                const void *inline_data, uint64_t size,
+                                uint32_t flags, uint64_t bulk_offset,
+                                uint64_t stream, int stage_chunk)
+{
+    bool inline_copy = (flags == IDM_COPY_INLINE);
+    size_t payload_len = sizeof(struct idm_gpu_copy_h2d) + (inline_copy ? size : 0);
+    struct idm_gpu_copy_h2d *copy_req = malloc(payload_len);
+    if (!copy_req) {
+        if (stage_chunk >= 0) {
+            stage_release(stage_chunk);
+        }
+        return CUDA_ERROR_OUT_OF_MEMORY;
+    }
+
+    copy_req->dst_handle = handle;
+    copy_req->dst_offset = offset;
+    copy_req->size = size;
+    copy_req->bulk_offset = bulk_offset;
+    copy_req->stream_handle = stream;
+    copy_req->flags = flags;
+    copy_req->reserved = 0;
+
+    if (inline_copy) {
+        memcpy(copy_req + 1, inline_data, size);
+    }
+
+    struct idm_message *msg = idm_build_message(
+        DRIVER_ZONE_ID,
+        IDM_GPU_COPY_H2D,
+        copy_req,
+        payload_len
+    );
+    free(copy_req);
+
+    if (!msg) {
+        if (stage_chunk >= 0) {
+            stage_release(stage_chunk);
+        }
+        return CUDA_ERROR_OUT_OF_MEMORY;
+    }
+
+    struct pending_req actions = {
+        .stage_first = stage_chunk,
+        .stage_count = stage_chunk >= 0 ? 1 : 0
+    };
+
+    CUresult result = submit_request(msg, &actions, true);
+    idm_free_message(msg);
+
+    return result;
+}
+
+/**
+ * cuMemcpyHtoD - Copy from host to device
+ *
+ * Small copies go inline in the ring entry. Anything larger is staged
+ * through the bulk region chunk by chunk, with every chunk in flight at
+ * once (or sent without staging if srcHost already lives in the region).
+ * Like a pageable copy on real CUDA, this returns once the source has been
+ * staged; failures are reported by the next synchronize. A source in
+ * cuMemHostAlloc memory is read in place, and then the copy is complete
+ * when this returns, as from pinned memory on real CUDA.
+ */
+CUresult cuMemcpyHtoD(CUdeviceptr dstDevice, const void *srcHost, size_t ByteCount)
+{
+    return cuMemcpyHtoDAsync(dstDevice, srcHost, ByteCount, NULL);
+}
+
+/**
+ * cuMemcpyHtoDAsync - Copy from host to device on a stream
+ *
+ * Same staging as cuMemcpyHtoD; the proxy orders the copy on hStream.
+ */
+CUresult cuMemcpyHtoDAsync(CUdeviceptr dstDevice, const void *srcHost, size_t ByteCount,
+                           CUstream hStream)
+{
+    if (!initialized) {
+        return CUDA_ERROR_NOT_INITIALIZED;
+    }
+
+    if (dstDevice == 0 || !srcHost || ByteCount == 0) {
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+
+    CUresult captured = capture_refuse(hStream);
+    if (captured != CUDA_SUCCESS) {
+        return captured;
+    }
+
+    uint64_t handle, base;
+    CUresult result = live_resolve(dstDevice, ByteCount, &handle, &base);
+    if (result != CUDA_SUCCESS) {
+        return result;
+    }
+
+    uint64_t stream = (uint64_t)(uintptr_t)hStream;
+
+    if (ByteCount <= IDM_INLINE_DATA_MAX) {
+        return submit_copy_h2d(handle, base, srcHost, ByteCount,
+                               IDM_COPY_INLINE, 0, stream, -1);
+    }
+
+    size_t bulk_size = 0;
+    uint8_t *bulk = idm_bulk_region(&bulk_size);
+    if (!bulk) {
+        return CUDA_ERROR_NOT_INITIALIZED;
+    }
+
+    const uint8_t *src = srcHost;
+
+    /* Source already in the shared region: just point the proxy at it */
+    if (src >= bulk && ByteCount <= bulk_size &&
+        (size_t)(src - bulk) <= bulk_size - ByteCount) {
+        return submit_copy_h2d(handle, base, NULL, ByteCount,
+                               IDM_COPY_BULK, (uint64_t)(src - bulk), stream, -1);
+    }
+
+    /* Source in a pinned host region: the device reads it in place */
+    uint64_t host_addr;
+    if (host_resolve(src, ByteCount, &host_addr)) {
+        if (stream) {
+            return submit_copy_h2d(handle, base, NULL, ByteCount,
+                                   IDM_COPY_HOST, host_addr, stream, -1);
+        }
+
+        /* Synchronous from pinned memory: done when we return */
+        struct idm_gpu_copy_h2d req = {
+            .dst_handle = handle,
+            .dst_offset = base,
+            .size = ByteCount,
+            .bulk_offset = host_addr,
+            .flags = IDM_COPY_HOST
+        };
+        return call_proxy(IDM_GPU_COPY_H2D, &req, sizeof(req), NULL, NULL);
+    }
+
+    size_t done = 0;
+    while (done < ByteCount) {
+        size_t chunk = ByteCount - done;
+        if (chunk > STAGE_CHUNK_SIZE) {
+            chunk = STAGE_CHUNK_SIZE;
+        }
+
+        int stage = stage_acquire(1);
+        if (stage < 0) {
+            return CUDA_ERROR_INVALID_VALUE;
+        }
+
+        uint64_t bulk_offset = (uint64_t)stage * STAGE_CHUNK_SIZE;
+        memcpy(bulk + bulk_offset, src + done, chunk);
+
+        result = submit_copy_h2d(handle, base + done, NULL, chunk,
+                                 IDM_COPY_BULK, bulk_offset, stream, stage);
+        if (result != CUDA_SUCCESS) {
+            return result;
+        }
+
+        done += chunk;
+    }
+
+    return CUDA_SUCCESS;
+}
+
+/**
+ * Submit one D2H chunk; its data lands in dst when the response arrives
+ */
+static CUresult submit_copy_d2h(uint64_t handle, uint64_t offset, uint64_t size,
+                                uint32_t flags, uint64_t bulk_offset, void *copy_dst,
+                                uint64_t stream, int stage_chunk, uint64_t *seq_out)
+{
+    struct idm_gpu_copy_d2h copy_req = {
+        .src_handle = handle,
+        .src_offset = offset,
+        .size = size,
+        .bulk_offset = bulk_offset,
+        .stream_handle = stream,
+        .flags = flags
+    };
+
+    struct idm_message *msg = idm_build_message(
+        DRIVER_ZONE_ID,
+        IDM_GPU_COPY_D2H,
+        &copy_req,
+        sizeof(copy_req)
+    );
+
+    if (!msg) {
+        if (stage_chunk >= 0) {
+            stage_release(stage_chunk);
+        }
+        return CUDA_ERROR_OUT_OF_MEMORY;
+    }
+
+    struct pending_req actions = {
+        .copy_dst = copy_dst,
+        .copy_len = size,
+        .bulk_offset = bulk_offset,
+        .stage_first = stage_chunk,
+        .stage_count = stage_chunk >= 0 ? 1 : 0
+    };
+
+    /* No seq_out: stream copy, nobody waits for this chunk */
+    bool detached = (seq_out == NULL);
+    if (seq_out) {
+        *seq_out = msg->header.seq_num;
+    }
+    CUresult result = submit_request(msg, &actions, detached);
+    idm_free_message(msg);
+
+    return result;
+}
+
+/**
+ * cuMemcpyDtoH - Copy from device to host
+ *
+ * The proxy writes into bulk staging chunks and we copy each one out as
+ * its response arrives (up to STAGE_CHUNKS in flight). If dstHost already
+ * lies inside the shared region or in cuMemHostAlloc memory, the proxy
+ * writes there directly and no copy happens at all.
+ */
+CUresult cuMemcpyDtoH(void *dstHost, CUdeviceptr srcDevice, size_t ByteCount)
+{
+    if (!initialized) {
+        return CUDA_ERROR_NOT_INITIALIZED;
+    }
+
+    if (!dstHost || srcDevice == 0 || ByteCount == 0) {
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+
+    size_t bulk_size = 0;
+    uint8_t *bulk = idm_bulk_region(&bulk_size);
+    if (!bulk) {
+        return CUDA_ERROR_NOT_INITIALIZED;
+    }
+
+    uint64_t handle, base;
+    CUresult result = live_resolve(srcDevice, ByteCount, &handle, &base);
+    if (result != CUDA_SUCCESS) {
+        return result;
+    }
+
+    uint8_t *dst = dstHost;
+    uint64_t seq = 0;
+
+    if (dst >= bulk && ByteCount <= bulk_size &&
+        (size_t)(dst - bulk) <= bulk_size - ByteCount) {
+        result = submit_copy_d2h(handle, base, ByteCount, IDM_COPY_BULK,
+                                 (uint64_t)(dst - bulk), NULL, 0, -1, &seq);
+        return result == CUDA_SUCCESS ? wait_request(seq, NULL, NULL) : result;
+    }
+
+    /* Pinned host region: the device writes it in place */
+    uint64_t host_addr;
+    if (host_resolve(dst, ByteCount, &host_addr)) {
+        result = submit_copy_d2h(handle, base, ByteCount, IDM_COPY_HOST,
+                                 host_addr, NULL, 0, -1, &seq);
+        return result == CUDA_SUCCESS ? wait_request(seq, NULL, NULL) : result;
+    }
+
+    /* Outstanding chunk requests, oldest first */
+    uint64_t seqs[STAGE_CHUNKS];
+    int head = 0, count = 0;
+
+    size_t done = 0;
+    while (done < ByteCount && result == CUDA_SUCCESS) {
+        if (count == STAGE_CHUNKS) {
+            result = wait_request(seqs[head], NULL, NULL);
+            head = (head + 1) % STAGE_CHUNKS;
+            count--;
+            continue;
+        }
+
+        size_t chunk = ByteCount - done;
+        if (chunk > STAGE_CHUNK_SIZE) {
+            chunk = STAGE_CHUNK_SIZE;
+        }
+
+        int stage = stage_acquire(1);
+        if (stage < 0) {
+            result = CUDA_ERROR_INVALID_VALUE;
+            break;
+        }
+
+        result = submit_copy_d2h(handle, base + done, chunk, IDM_COPY_BULK,
+                                 (uint64_t)stage * STAGE_CHUNK_SIZE,
+                                 dst + done, 0, stage, &seq);
+        if (result != CUDA_SUCCESS) {
+            break;
+        }
+
+        seqs[(head + count) % STAGE_CHUNKS] = seq;
+        count++;
+        done += chunk;
+    }
+
+    /* Drain the rest even after a failure; chunks target our dst */
+    while (count > 0) {
+        CUresult r = wait_request(seqs[head], NULL, NULL);
+        if (result == CUDA_SUCCESS) {
+            result = r;
+        }
+        head = (head + 1) % STAGE_CHUNKS;
+        count--;
+    }
+
+    return result;
+}
+
+/**
+ * cuMemcpyDtoHAsync - Copy from device to host on a stream
+ *
+ * Every chunk is detached: its data is copied into dstHost when the
+ * proxy reports the stream work done, which is guaranteed by the time
+ * cuStreamSynchronize (or an event recorded after it) completes.
+ */
+CUresult cuMemcpyDtoHAsync(void *dstHost, CUdeviceptr srcDevice, size_t ByteCount,
+                           CUstream hStream)
+{
+    if (hStream == NULL) {
+        return cuMemcpyDtoH(dstHost, srcDevice, ByteCount);
+    }
+
+    if (!initialized) {
+        return CUDA_ERROR_NOT_INITIALIZED;
+    }
+
+    if (!dstHost || srcDevice == 0 || ByteCount == 0) {
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+
+    CUresult captured = capture_refuse(hStream);
+    if (captured != CUDA_SUCCESS) {
+        return captured;
+    }
+
+    size_t bulk_size = 0;
+    uint8_t *bulk = idm_bulk_region(&bulk_size);
+    if (!bulk) {
+        return CUDA_ERROR_NOT_INITIALIZED;
+    }
+
+    uint64_t handle, base;
+    CUresult result = live_resolve(srcDevice, ByteCount, &handle, &base);
+    if (result != CUDA_SUCCESS) {
+        return result;
+    }
+
+    uint8_t *dst = dstHost;
+    uint64_t stream = (uint64_t)(uintptr_t)hStream;
+
+    if (dst >= bulk && ByteCount <= bulk_size &&
+        (size_t)(dst - bulk) <= bulk_size - ByteCount) {
+        return submit_copy_d2h(handle, base, ByteCount, IDM_COPY_BULK,
+                               (uint64_t)(dst - bulk), NULL, stream, -1, NULL);
+    }
+
+    uint64_t host_addr;
+    if (host_resolve(dst, ByteCount, &host_addr)) {
+        return submit_copy_d2h(handle, base, ByteCount, IDM_COPY_HOST,
+                               host_addr, NULL, stream, -1, NULL);
+    }
+
+    size_t done = 0;
+    while (done < ByteCount) {
+        size_t chunk = ByteCount - done;
+        if (chunk > STAGE_CHUNK_SIZE) {
+            chunk = STAGE_CHUNK_SIZE;
+        }
+
+        int stage = stage_acquire(1);
+        if (stage < 0) {
+            return CUDA_ERROR_INVALID_VALUE;
+        }
+
+        result = submit_copy_d2h(handle, base + done, chunk, IDM_COPY_BULK,
+                                 (uint64_t)stage * STAGE_CHUNK_SIZE,
+                                 dst + done, stream, stage, NULL);
+        if (result != CUDA_SUCCESS) {
+            return result;
+        }
+
+        done += chunk;
+    }
+
+    return CUDA_SUCCESS;
+}
+
+/**
+ * Queue a device-to-device copy (detached: errors surface at the next
+ * synchronize)
+ */
+static CUresult submit_copy_d2d(CUdeviceptr dst, CUdeviceptr src, size_t size,
+                                CUstream stream)
+{
+    if (!initialized) {
+        return CUDA_ERROR_NOT_INITIALIZED;
+    }
+
+    if (dst == 0 || src == 0 || size == 0) {
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+
+    uint64_t dst_handle, dst_offset, src_handle, src_offset;
+    CUresult result = live_resolve(dst, size, &dst_handle, &dst_offset);
+    if (result == CUDA_SUCCESS) {
+        result = live_resolve(src, size, &src_handle, &src_offset);
+    }
+    if (result != CUDA_SUCCESS) {
+        return result;
+    }
+
+    struct idm_gpu_copy_d2d req = {
+        .dst_handle = dst_handle,
+        .dst_offset = dst_offset,
+        .src_handle = src_handle,
+        .src_offset = src_offset,
+        .size = size,
+        .stream_handle = (uint64_t)(uintptr_t)stream
+    };
+
+    if (capture_record(stream, IDM_GPU_COPY_D2D, &req, sizeof(req), &result)) {
+        return result;
+    }
+
+    struct idm_message *msg = idm_build_message(DRIVER_ZONE_ID, IDM_GPU_COPY_D2D,
+                                                &req, sizeof(req));
+    if (!msg) {
+        return CUDA_ERROR_OUT_OF_MEMORY;
+    }
+
+    result = submit_request(msg, NULL, true);
+    idm_free_message(msg);
+
+    return result;
+}
+
+/**
+ * cuMemcpyDtoD - Copy from device to device
+ *
+ * Runs on the device; like the real driver's, returns once queued.
+ */
+CUresult cuMemcpyDtoD(CUdeviceptr dstDevice, CUdeviceptr srcDevice, size_t ByteCount)
+{
+    return submit_copy_d2d(dstDevice, srcDevice, ByteCount, NULL);
+}
+
+/**
+ * cuMemcpyDtoDAsync - Copy from device to device on a stream
+ */
+CUresult cuMemcpyDtoDAsync(CUdeviceptr dstDevice, CUdeviceptr srcDevice, size_t ByteCount,
+                           CUstream hStream)
+{
+    return submit_copy_d2d(dstDevice, srcDevice, ByteCount, hStream);
+}
+
+/**
+ * cuMemcpyPeer - Copy between memory on two devices
+ *
+ * Addresses tell the proxy which GPU each side lives on, so this is a
+ * device-to-device copy (peer to peer there); the contexts aren't needed.
+ */
+CUresult cuMemcpyPeer(CUdeviceptr dstDevice, CUcontext dstContext, CUdeviceptr srcDevice,
+                      CUcontext srcContext, size_t ByteCount)
+{
+    (void)dstContext;
+    (void)srcContext;
+    return submit_copy_d2d(dstDevice, srcDevice, ByteCount, NULL);
+}
+
+/**
+ * cuMemcpyPeerAsync - Copy between memory on two devices on a stream
+ */
+CUresult cuMemcpyPeerAsync(CUdeviceptr dstDevice, CUcontext dstContext, CUdeviceptr srcDevice,
+                           CUcontext srcContext, size_t ByteCount, CUstream hStream)
+{
+    (void)dstContext;
+    (void)srcContext;
+    return submit_copy_d2d(dstDevice, srcDevice, ByteCount, hStream);
+}
+
+/**
+ * Queue a fill (detached: errors surface at the next synchronize)
+ *
+ * @param width Elements per row
+ * @param height Rows, pitch bytes apart (1 = plain range)
+ */
+static CUresult submit_memset(CUdeviceptr dst, size_t pitch, uint32_t value,
+                              uint32_t element_size, size_t width, size_t height,
+                              CUstream stream)
+{
+    if (!initialized) {
+        return CUDA_ERROR_NOT_INITIALIZED;
+    }
+
+    if (dst == 0) {
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+
+    if (width == 0 || height == 0) {
+        return CUDA_SUCCESS;
+    }
+
+    /* Bytes from the first element to the end of the last row */
+    size_t row_bytes, span;
+    if (__builtin_mul_overflow(width, (size_t)element_size, &row_bytes) ||
+        (height > 1 && (__builtin_mul_overflow(pitch, height - 1, &span) ||
+                        __builtin_add_overflow(span, row_bytes, &span)))) {
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+    if (height == 1) {
+        span = row_bytes;
+    }
+
+    uint64_t handle, offset;
+    CUresult result = live_resolve(dst, span, &handle, &offset);
+    if (result != CUDA_SUCCESS) {
+        return result;
+    }
+
+    struct idm_gpu_memset req = {
+        .handle = handle,
+        .offset = offset,
+        .pitch = pitch,
+        .width = width,
+        .height = height,
+        .stream_handle = (uint64_t)(uintptr_t)stream,
+        .value = value,
+        .element_size = element_size
+    };
+
+    if (capture_record(stream, IDM_GPU_MEMSET, &req, sizeof(req), &result)) {
+        return result;
+    }
+
+    struct idm_message *msg = idm_build_message(DRIVER_ZONE_ID, IDM_GPU_MEMSET,
+                                                &req, sizeof(req));
+    if (!msg) {
+        return CUDA_ERROR_OUT_OF_MEMORY;
+    }
+
+    result = submit_request(msg, NULL, true);
+    idm_free_message(msg);
+
+    return result;
+}
+
 /**
- * Send request and wait for response
+ * cuMemsetD8 - Set memory to byte value
  */
-static CUresult send_and_wait(struct idm_message *msg, uint64_t *handle_out)
+CUresult cuMemsetD8(CUdeviceptr dstDevice, unsigned char uc, size_t N)
 {
-    uint64_t req_seq = msg->header.seq_num;
+    return submit_memset(dstDevice, 0, uc, 1, N, 1, NULL);
+}
 
-    if (idm_send(msg) < 0) {
-        fprintf(stderr, "[libvgpu] Failed to send message\n");
-        return CUDA_ERROR_INVALID_VALUE;
-    }
+/**
+ * cuMemsetD16 - Set memory to short value
+ */
+CUresult cuMemsetD16(CUdeviceptr dstDevice, unsigned short us, size_t N)
+{
+    return submit_memset(dstDevice, 0, us, 2, N, 1, NULL);
+}
 
-    /* Wait for response */
-    for (int i = 0; i < 10; i++) {
-        struct idm_message *resp = NULL;
+/**
+ * cuMemsetD32 - Set memory to int value
+ */
+CUresult cuMemsetD32(CUdeviceptr dstDevice, unsigned int ui, size_t N)
+{
+    return submit_memset(dstDevice, 0, ui, 4, N, 1, NULL);
+}
 
-        if (idm_recv(&resp, 1000) < 0) {
-            continue;
-        }
+/**
+ * cuMemsetD8Async - Set memory to byte value, ordered on a stream
+ */
+CUresult cuMemsetD8Async(CUdeviceptr dstDevice, unsigned char uc, size_t N, CUstream hStream)
+{
+    return submit_memset(dstDevice, 0, uc, 1, N, 1, hStream);
+}
 
-        if (resp->header.msg_type == IDM_RESPONSE_OK) {
-            const struct idm_response_ok *ok = (const struct idm_response_ok *)resp->payload;
+/**
+ * cuMemsetD16Async - Set memory to short value, ordered on a stream
+ */
+CUresult cuMemsetD16Async(CUdeviceptr dstDevice, unsigned short us, size_t N, CUstream hStream)
+{
+    return submit_memset(dstDevice, 0, us, 2, N, 1, hStream);
+}
 
-            if (ok->request_seq == req_seq) {
-                if (handle_out) {
-                    *handle_out = ok->result_handle;
-                }
-                idm_free_message(resp);
-                return CUDA_SUCCESS;
-            }
-        } else if (resp->header.msg_type == IDM_RESPONSE_ERROR) {
-            const struct idm_response_error *err = (const struct idm_response_error *)resp->payload;
-
-            if (err->request_seq == req_seq) {
-                fprintf(stderr, "[libvgpu] Error: %s\n", err->error_msg);
-                idm_free_message(resp);
-
-                /* Map IDM error to CUDA error */
-                switch (err->error_code) {
-                    case IDM_ERROR_OUT_OF_MEMORY:
-                        return CUDA_ERROR_OUT_OF_MEMORY;
-                    case IDM_ERROR_INVALID_HANDLE:
-                        return CUDA_ERROR_INVALID_HANDLE;
-                    default:
-                        return CUDA_ERROR_INVALID_VALUE;
-                }
-            }
-        }
+/**
+ * cuMemsetD32Async - Set memory to int value, ordered on a stream
+ */
+CUresult cuMemsetD32Async(CUdeviceptr dstDevice, unsigned int ui, size_t N, CUstream hStream)
+{
+    return submit_memset(dstDevice, 0, ui, 4, N, 1, hStream);
+}
 
-        idm_free_message(resp);
-    }
+/**
+ * cuMemsetD2D8 - Set a 2D range to byte value
+ */
+CUresult cuMemsetD2D8(CUdeviceptr dstDevice, size_t dstPitch, unsigned char uc,
+                      size_t Width, size_t Height)
+{
+    return submit_memset(dstDevice, dstPitch, uc, 1, Width, Height, NULL);
+}
 
-    fprintf(stderr, "[libvgpu] Timeout waiting for response\n");
-    return CUDA_ERROR_INVALID_VALUE;
+/**
+ * cuMemsetD2D16 - Set a 2D range to short value
+ */
+CUresult cuMemsetD2D16(CUdeviceptr dstDevice, size_t dstPitch, unsigned short us,
+                       size_t Width, size_t Height)
+{
+    return submit_memset(dstDevice, dstPitch, us, 2, Width, Height, NULL);
+}
+
+/**
+ * cuMemsetD2D32 - Set a 2D range to int value
+ */
+CUresult cuMemsetD2D32(CUdeviceptr dstDevice, size_t dstPitch, unsigned int ui,
+                       size_t Width, size_t Height)
+{
+    return submit_memset(dstDevice, dstPitch, ui, 4, Width, Height, NULL);
+}
+
+/**
+ * cuMemsetD2D8Async - Set a 2D range to byte value, ordered on a stream
+ */
+CUresult cuMemsetD2D8Async(CUdeviceptr dstDevice, size_t dstPitch, unsigned char uc,
+                           size_t Width, size_t Height, CUstream hStream)
+{
+    return submit_memset(dstDevice, dstPitch, uc, 1, Width, Height, hStream);
+}
+
+/**
+ * cuMemsetD2D16Async - Set a 2D range to short value, ordered on a stream
+ */
+CUresult cuMemsetD2D16Async(CUdeviceptr dstDevice, size_t dstPitch, unsigned short us,
+                            size_t Width, size_t Height, CUstream hStream)
+{
+    return submit_memset(dstDevice, dstPitch, us, 2, Width, Height, hStream);
+}
+
+/**
+ * cuMemsetD2D32Async - Set a 2D range to int value, ordered on a stream
+ */
+CUresult cuMemsetD2D32Async(CUdeviceptr dstDevice, size_t dstPitch, unsigned int ui,
+                            size_t Width, size_t Height, CUstream hStream)
+{
+    return submit_memset(dstDevice, dstPitch, ui, 4, Width, Height, hStream);
 }
 
 /* ============================================================================
- * CUDA Driver API Implementation
+ * Streams and Events
+ *
+ * CUstream and CUevent values are the proxy's handles. Work queued on a
+ * stream is ordered by the proxy; we only wait where the API says so.
  * ============================================================================ */
 
 /**
- * cuInit - Initialize CUDA driver
+ * cuStreamCreate - Create a stream
  */
-CUresult cuInit(unsigned int Flags)
+CUresult cuStreamCreate(CUstream *phStream, unsigned int Flags)
 {
-    (void)Flags;
+    return cuStreamCreateWithPriority(phStream, Flags, 0);
+}
 
-    pthread_mutex_lock(&init_lock);
+/**
+ * cuStreamCreateWithPriority - Create a stream with the given priority
+ */
+CUresult cuStreamCreateWithPriority(CUstream *phStream, unsigned int flags, int priority)
+{
+    if (!initialized) {
+        return CUDA_ERROR_NOT_INITIALIZED;
+    }
 
-    if (initialized) {
-        pthread_mutex_unlock(&init_lock);
-        return CUDA_SUCCESS;
+    if (!phStream) {
+        return CUDA_ERROR_INVALID_VALUE;
     }
 
-    /* Initialize IDM connection to GPU proxy */
-    if (idm_init(USER_ZONE_ID, DRIVER_ZONE_ID, false) < 0) {
-        fprintf(stderr, "[libvgpu] Failed to initialize IDM\n");
-        pthread_mutex_unlock(&init_lock);
+    struct idm_gpu_stream_create req = {
+        .flags = flags,
+        .priority = priority
+    };
+
+    uint64_t handle = 0;
+    CUresult result = call_proxy(IDM_GPU_STREAM_CREATE, &req, sizeof(req), &handle, NULL);
+    if (result == CUDA_SUCCESS) {
+        *phStream = (CUstream)(uintptr_t)handle;
+    }
+
+    return result;
+}
+
+/**
+ * cuStreamDestroy - Destroy a stream (queued work still completes)
+ */
+CUresult cuStreamDestroy(CUstream hStream)
+{
+    if (!initialized) {
         return CUDA_ERROR_NOT_INITIALIZED;
     }
 
-    initialized = true;
-    pthread_mutex_unlock(&init_lock);
+    if (!hStream) {
+        return CUDA_ERROR_INVALID_HANDLE;
+    }
 
-    fprintf(stderr, "[libvgpu] Initialized (virtual GPU via IDM)\n");
-    return CUDA_SUCCESS;
+    struct idm_gpu_stream req = { .stream_handle = (uint64_t)(uintptr_t)hStream };
+
+    return call_proxy(IDM_GPU_STREAM_DESTROY, &req, sizeof(req), NULL, NULL);
 }
 
 /**
- * cuDriverGetVersion - Get driver version
+ * cuStreamSynchronize - Wait for all work queued on a stream
+ *
+ * Also reports failures of detached requests that completed meanwhile.
  */
-CUresult cuDriverGetVersion(int *driverVersion)
+CUresult cuStreamSynchronize(CUstream hStream)
 {
     if (!initialized) {
         return CUDA_ERROR_NOT_INITIALIZED;
     }
 
-    if (!driverVersion) {
+    CUresult captured = capture_refuse(hStream);
+    if (captured != CUDA_SUCCESS) {
+        return captured;
+    }
+
+    struct idm_gpu_stream req = { .stream_handle = (uint64_t)(uintptr_t)hStream };
+
+    CUresult result = call_proxy(IDM_GPU_STREAM_SYNC, &req, sizeof(req), NULL, NULL);
+
+    CUresult deferred = take_deferred_error();
+    if (result == CUDA_SUCCESS) {
+        result = deferred;
+    }
+
+    return result;
+}
+
+/**
+ * cuStreamWaitEvent - Make future work on a stream wait for an event
+ */
+CUresult cuStreamWaitEvent(CUstream hStream, CUevent hEvent, unsigned int Flags)
+{
+    if (!initialized) {
+        return CUDA_ERROR_NOT_INITIALIZED;
+    }
+
+    if (!hEvent) {
+        return CUDA_ERROR_INVALID_HANDLE;
+    }
+
+    CUresult captured = capture_refuse(hStream);
+    if (captured != CUDA_SUCCESS) {
+        return captured;
+    }
+
+    struct idm_gpu_stream_wait_event req = {
+        .stream_handle = (uint64_t)(uintptr_t)hStream,
+        .event_handle = (uint64_t)(uintptr_t)hEvent,
+        .flags = Flags
+    };
+
+    return call_proxy(IDM_GPU_STREAM_WAIT_EVENT, &req, sizeof(req), NULL, NULL);
+}
+
+/**
+ * cuEventCreate - Create an event
+ */
+CUresult cuEventCreate(CUevent *phEvent, unsigned int Flags)
+{
+    if (!initialized) {
+        return CUDA_ERROR_NOT_INITIALIZED;
+    }
+
+    if (!phEvent) {
         return CUDA_ERROR_INVALID_VALUE;
     }
 
-    /* Report a fake CUDA 12.0 driver */
-    *driverVersion = 12000;
-    return CUDA_SUCCESS;
+    struct idm_gpu_event_create req = { .flags = Flags };
+
+    uint64_t handle = 0;
+    CUresult result = call_proxy(IDM_GPU_EVENT_CREATE, &req, sizeof(req), &handle, NULL);
+    if (result == CUDA_SUCCESS) {
+        *phEvent = (CUevent)(uintptr_t)handle;
+    }
+
+    return result;
 }
 
 /**
- * cuDeviceGet - Get device handle
+ * cuEventDestroy - Destroy an event
  */
-CUresult cuDeviceGet(CUdevice *device, int ordinal)
+CUresult cuEventDestroy(CUevent hEvent)
+{
+    if (!initialized) {
+        return CUDA_ERROR_NOT_INITIALIZED;
+    }
+
+    if (!hEvent) {
+        return CUDA_ERROR_INVALID_HANDLE;
+    }
+
+    struct idm_gpu_event req = { .event_handle = (uint64_t)(uintptr_t)hEvent };
+
+    return call_proxy(IDM_GPU_EVENT_DESTROY, &req, sizeof(req), NULL, NULL);
+}
+
+/**
+ * cuEventRecord - Record an event on a stream
+ */
+CUresult cuEventRecord(CUevent hEvent, CUstream hStream)
+{
+    if (!initialized) {
+        return CUDA_ERROR_NOT_INITIALIZED;
+    }
+
+    if (!hEvent) {
+        return CUDA_ERROR_INVALID_HANDLE;
+    }
+
+    CUresult captured = capture_refuse(hStream);
+    if (captured != CUDA_SUCCESS) {
+        return captured;
+    }
+
+    struct idm_gpu_event_record req = {
+        .event_handle = (uint64_t)(uintptr_t)hEvent,
+        .stream_handle = (uint64_t)(uintptr_t)hStream
+    };
+
+    return call_proxy(IDM_GPU_EVENT_RECORD, &req, sizeof(req), NULL, NULL);
+}
+
+/**
+ * cuEventSynchronize - Wait for an event to complete
+ */
+CUresult cuEventSynchronize(CUevent hEvent)
+{
+    if (!initialized) {
+        return CUDA_ERROR_NOT_INITIALIZED;
+    }
+
+    if (!hEvent) {
+        return CUDA_ERROR_INVALID_HANDLE;
+    }
+
+    struct idm_gpu_event req = { .event_handle = (uint64_t)(uintptr_t)hEvent };
+
+    return call_proxy(IDM_GPU_EVENT_SYNC, &req, sizeof(req), NULL, NULL);
+}
+
+/**
+ * cuEventQuery - Check whether an event has completed
+ *
+ * @return CUDA_SUCCESS if complete, CUDA_ERROR_NOT_READY if not
+ */
+CUresult cuEventQuery(CUevent hEvent)
+{
+    if (!initialized) {
+        return CUDA_ERROR_NOT_INITIALIZED;
+    }
+
+    if (!hEvent) {
+        return CUDA_ERROR_INVALID_HANDLE;
+    }
+
+    struct idm_gpu_event req = { .event_handle = (uint64_t)(uintptr_t)hEvent };
+
+    uint32_t status = 0;
+    CUresult result = call_proxy(IDM_GPU_EVENT_QUERY, &req, sizeof(req), NULL, &status);
+    if (result != CUDA_SUCCESS) {
+        return result;
+    }
+
+    return status == CUDA_SUCCESS ? CUDA_SUCCESS : CUDA_ERROR_NOT_READY;
+}
+
+/**
+ * cuEventElapsedTime - Milliseconds between two recorded events
+ */
+CUresult cuEventElapsedTime(float *pMilliseconds, CUevent hStart, CUevent hEnd)
 {
     if (!initialized) {
         return CUDA_ERROR_NOT_INITIALIZED;
     }
 
-    if (!device || ordinal < 0 || ordinal >= device_count) {
-        return CUDA_ERROR_INVALID_VALUE;
+    if (!pMilliseconds) {
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+
+    if (!hStart || !hEnd) {
+        return CUDA_ERROR_INVALID_HANDLE;
+    }
+
+    struct idm_gpu_event_elapsed req = {
+        .start_handle = (uint64_t)(uintptr_t)hStart,
+        .end_handle = (uint64_t)(uintptr_t)hEnd
+    };
+
+    uint32_t bits = 0;
+    CUresult result = call_proxy(IDM_GPU_EVENT_ELAPSED, &req, sizeof(req), NULL, &bits);
+    if (result == CUDA_SUCCESS) {
+        memcpy(pMilliseconds, &bits, sizeof(*pMilliseconds));
+    }
+
+    return result;
+}
+
+/* ============================================================================
+ * Modules and Kernel Launch
+ *
+ * A module image crosses over once (inline if small, otherwise through
+ * the bulk region). Each kernel is looked up once per module; its
+ * function object keeps the handle and parameter layout, so a launch is
+ * a fixed header plus the packed argument blob, sent without waiting.
+ * ============================================================================ */
+
+struct CUfunc_st {
+    uint64_t handle;       /* Function handle in the proxy */
+    struct CUfunc_st *next;/* Module's lookup cache */
+    char *name;
+    uint32_t num_params;
+    uint32_t arg_size;     /* Blob bytes (end of the last parameter) */
+    struct idm_kernel_param params[];
+};
+
+struct CUmod_st {
+    uint64_t handle;       /* Module handle in the proxy */
+    struct CUfunc_st *funcs;
+};
+
+/* Guards every module's function list */
+static pthread_mutex_t module_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* ELF and fatbin headers (enough to find where the image ends) */
+#define FATBIN_MAGIC 0xBA55ED50u
+
+struct fatbin_header {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t header_size;
+    uint64_t size;         /* Bytes after the header */
+};
+
+struct elf64_header {
+    uint8_t ident[16];
+    uint16_t type, machine;
+    uint32_t version;
+    uint64_t entry, phoff, shoff;
+    uint32_t flags;
+    uint16_t ehsize, phentsize, phnum, shentsize, shnum, shstrndx;
+};
+
+/**
+ * Size of a module image (cuModuleLoadData gets no length)
+ *
+ * Fatbins and cubins (ELF) say how long they are; anything else is PTX
+ * text, sent with its NUL.
+ */
+static size_t image_size(const void *image)
+{
+    uint32_t magic;
+    memcpy(&magic, image, sizeof(magic));
+
+    if (magic == FATBIN_MAGIC) {
+        struct fatbin_header fh;
+        memcpy(&fh, image, sizeof(fh));
+        return fh.header_size + fh.size;
+    }
+
+    if (memcmp(image, "\x7f" "ELF", 4) == 0) {
+        struct elf64_header eh;
+        memcpy(&eh, image, sizeof(eh));
+        size_t end = (size_t)eh.shoff + (size_t)eh.shnum * eh.shentsize;
+        size_t ph_end = (size_t)eh.phoff + (size_t)eh.phnum * eh.phentsize;
+        return end > ph_end ? end : ph_end;
     }
 
-    *device = ordinal;
-    return CUDA_SUCCESS;
+    return strlen(image) + 1;
 }
 
 /**
- * cuDeviceGetCount - Get device count
+ * cuModuleLoadData - Load a module from memory
  */
-CUresult cuDeviceGetCount(int *count)
+CUresult cuModuleLoadData(CUmodule *module, const void *image)
 {
     if (!initialized) {
         return CUDA_ERROR_NOT_INITIALIZED;
     }
 
-    if (!count) {
+    if (!module || !image) {
         return CUDA_ERROR_INVALID_VALUE;
     }
 
-    *count = device_count;
-    return CUDA_SUCCESS;
-}
+    size_t size = image_size(image);
+    size_t inline_max = IDM_ENTRY_PAYLOAD_MAX - sizeof(struct idm_gpu_module_load);
+    struct pending_req actions = { .stage_first = -1 };
+    struct idm_message *msg;
 
-/**
- * cuDeviceGetName - Get device name
- */
-CUresult cuDeviceGetName(char *name, int len, CUdevice dev)
-{
-    if (!initialized) {
-        return CUDA_ERROR_NOT_INITIALIZED;
+    if (size <= inline_max) {
+        uint64_t buf[IDM_ENTRY_PAYLOAD_MAX / sizeof(uint64_t)];
+        struct idm_gpu_module_load *req = (struct idm_gpu_module_load *)buf;
+        *req = (struct idm_gpu_module_load){ .size = size, .flags = IDM_COPY_INLINE };
+        memcpy(req + 1, image, size);
+
+        msg = idm_build_message(DRIVER_ZONE_ID, IDM_GPU_MODULE_LOAD, buf, sizeof(*req) + size);
+    } else {
+        int chunks = (int)((size + STAGE_CHUNK_SIZE - 1) / STAGE_CHUNK_SIZE);
+        if (chunks > STAGE_CHUNKS) {
+            fprintf(stderr, "[libvgpu] Module image too large (%zu bytes)\n", size);
+            return CUDA_ERROR_INVALID_VALUE;
+        }
+
+        int stage = stage_acquire(chunks);
+        if (stage < 0) {
+            return CUDA_ERROR_INVALID_VALUE;
+        }
+
+        size_t bulk_size = 0;
+        uint8_t *bulk = idm_bulk_region(&bulk_size);
+        uint64_t bulk_offset = (uint64_t)stage * STAGE_CHUNK_SIZE;
+        memcpy(bulk + bulk_offset, image, size);
+
+        struct idm_gpu_module_load req = {
+            .size = size,
+            .bulk_offset = bulk_offset,
+            .flags = IDM_COPY_BULK
+        };
+        msg = idm_build_message(DRIVER_ZONE_ID, IDM_GPU_MODULE_LOAD, &req, sizeof(req));
+        if (!msg) {
+            stage_release_run(stage, chunks);
+            return CUDA_ERROR_OUT_OF_MEMORY;
+        }
+
+        /* Staging goes back once the proxy has taken the image */
+        actions.stage_first = stage;
+        actions.stage_count = chunks;
     }
 
-    if (!name || len <= 0 || dev < 0 || dev >= device_count) {
-        return CUDA_ERROR_INVALID_VALUE;
+    if (!msg) {
+        return CUDA_ERROR_OUT_OF_MEMORY;
     }
 
-    snprintf(name, len, "Virtual GPU %d (via Xen)", dev);
-    return CUDA_SUCCESS;
-}
+    uint64_t handle = 0;
+    CUresult result = submit_request(msg, &actions, false);
+    if (result == CUDA_SUCCESS) {
+        result = wait_request(msg->header.seq_num, &handle, NULL);
+    } else if (actions.stage_count > 0) {
+        stage_release_run(actions.stage_first, actions.stage_count);
+    }
+    idm_free_message(msg);
 
-/**
- * cuDeviceGetAttribute - Get device attribute
- */
-CUresult cuDeviceGetAttribute(int *pi, int attrib, CUdevice dev)
-{
-    if (!initialized) {
-        return CUDA_ERROR_NOT_INITIALIZED;
+    if (result != CUDA_SUCCESS) {
+        return result;
     }
 
-    if (!pi || dev < 0 || dev >= device_count) {
-        return CUDA_ERROR_INVALID_VALUE;
+    struct CUmod_st *mod = calloc(1, sizeof(*mod));
+    if (!mod) {
+        struct idm_gpu_module unload = { .module_handle = handle };
+        call_proxy(IDM_GPU_MODULE_UNLOAD, &unload, sizeof(unload), NULL, NULL);
+        return CUDA_ERROR_OUT_OF_MEMORY;
     }
+    mod->handle = handle;
+    *module = mod;
 
-    /* Return fake values for common attributes */
-    (void)attrib;
-    *pi = 1024;  /* Generic fake value */
     return CUDA_SUCCESS;
 }
 
 /**
- * cuCtxCreate - Create context
+ * cuModuleLoad - Load a module from a file
  */
-CUresult cuCtxCreate(CUcontext *pctx, unsigned int flags, CUdevice dev)
+CUresult cuModuleLoad(CUmodule *module, const char *fname)
 {
     if (!initialized) {
         return CUDA_ERROR_NOT_INITIALIZED;
     }
 
-    if (!pctx || dev < 0 || dev >= device_count) {
+    if (!module || !fname) {
         return CUDA_ERROR_INVALID_VALUE;
     }
 
-    (void)flags;
+    FILE *f = fopen(fname, "rb");
+    if (!f) {
+        return CUDA_ERROR_FILE_NOT_FOUND;
+    }
 
-    /* Create a fake context handle */
-    current_context = (CUcontext)(uintptr_t)(0x1000 + dev);
-    *pctx = current_context;
+    fseek(f, 0, SEEK_END);
+    long len = ftell(f);
+    fseek(f, 0, SEEK_SET);
 
-    fprintf(stderr, "[libvgpu] Created context %p\n", current_context);
-    return CUDA_SUCCESS;
+    /* Extra NUL so a PTX file reads as one string */
+    char *image = len >= 0 ? malloc((size_t)len + 1) : NULL;
+    if (!image) {
+        fclose(f);
+        return CUDA_ERROR_OUT_OF_MEMORY;
+    }
+
+    size_t got = fread(image, 1, (size_t)len, f);
+    fclose(f);
+    image[got] = 0;
+
+    CUresult result = got == (size_t)len ? cuModuleLoadData(module, image)
+                                         : CUDA_ERROR_FILE_NOT_FOUND;
+    free(image);
+
+    return result;
 }
 
 /**
- * cuCtxDestroy - Destroy context
+ * cuModuleUnload - Unload a module (its functions become invalid)
  */
-CUresult cuCtxDestroy(CUcontext ctx)
+CUresult cuModuleUnload(CUmodule hmod)
 {
     if (!initialized) {
         return CUDA_ERROR_NOT_INITIALIZED;
     }
 
-    if (ctx != current_context) {
-        return CUDA_ERROR_INVALID_CONTEXT;
+    if (!hmod) {
+        return CUDA_ERROR_INVALID_HANDLE;
     }
 
-    current_context = NULL;
-    return CUDA_SUCCESS;
+    struct idm_gpu_module req = { .module_handle = hmod->handle };
+    CUresult result = call_proxy(IDM_GPU_MODULE_UNLOAD, &req, sizeof(req), NULL, NULL);
+
+    pthread_mutex_lock(&module_lock);
+    struct CUfunc_st *func = hmod->funcs;
+    hmod->funcs = NULL;
+    pthread_mutex_unlock(&module_lock);
+
+    while (func) {
+        struct CUfunc_st *next = func->next;
+        free(func->name);
+        free(func);
+        func = next;
+    }
+    free(hmod);
+
+    return result;
 }
 
 /**
- * cuCtxSynchronize - Synchronize context
+ * cuModuleGetFunction - Look up a kernel (once per module and name)
  */
-CUresult cuCtxSynchronize(void)
+CUresult cuModuleGetFunction(CUfunction *hfunc, CUmodule hmod, const char *name)
 {
     if (!initialized) {
         return CUDA_ERROR_NOT_INITIALIZED;
     }
 
-    struct idm_gpu_sync sync_req = { .flags = 0 };
+    if (!hfunc || !hmod || !name) {
+        return CUDA_ERROR_INVALID_VALUE;
+    }
 
-    struct idm_message *msg = idm_build_message(
-        DRIVER_ZONE_ID,
-        IDM_GPU_SYNC,
-        &sync_req,
-        sizeof(sync_req)
-    );
+    pthread_mutex_lock(&module_lock);
+    for (struct CUfunc_st *func = hmod->funcs; func; func = func->next) {
+        if (strcmp(func->name, name) == 0) {
+            *hfunc = func;
+            pthread_mutex_unlock(&module_lock);
+            return CUDA_SUCCESS;
+        }
+    }
+    pthread_mutex_unlock(&module_lock);
 
-    if (!msg) {
+    size_t name_len = strlen(name);
+    if (name_len == 0 || name_len >= 256) {
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+
+    uint64_t buf[(sizeof(struct idm_gpu_module_get_function) + 256) / sizeof(uint64_t)];
+    struct idm_gpu_module_get_function *req = (struct idm_gpu_module_get_function *)buf;
+    *req = (struct idm_gpu_module_get_function){
+        .module_handle = hmod->handle,
+        .name_len = (uint32_t)name_len
+    };
+    memcpy(req + 1, name, name_len);
+
+    struct CUfunc_st *func = calloc(1, sizeof(*func) +
+                                    IDM_KERNEL_PARAMS_MAX * sizeof(func->params[0]));
+    char *name_copy = strdup(name);
+    struct idm_message *msg = idm_build_message(DRIVER_ZONE_ID, IDM_GPU_MODULE_GET_FUNCTION,
+                                                buf, sizeof(*req) + name_len);
+    if (!func || !name_copy || !msg) {
+        free(func);
+        free(name_copy);
+        if (msg) {
+            idm_free_message(msg);
+        }
         return CUDA_ERROR_OUT_OF_MEMORY;
     }
 
-    CUresult result = send_and_wait(msg, NULL);
-    idm_free_message(msg);
+    struct pending_req actions = {
+        .stage_first = -1,
+        .data_dst = func->params,
+        .data_cap = IDM_KERNEL_PARAMS_MAX * sizeof(func->params[0])
+    };
 
-    return result;
-}
+    uint32_t num_params = 0;
+    size_t data_len = 0;
+    CUresult result = submit_request(msg, &actions, false);
+    if (result == CUDA_SUCCESS) {
+        result = wait_request_data(msg->header.seq_num, &func->handle, &num_params, &data_len);
+    }
+    idm_free_message(msg);
 
-/**
- * cuCtxGetCurrent - Get current context
- */
-CUresult cuCtxGetCurrent(CUcontext *pctx)
-{
-    if (!initialized) {
-        return CUDA_ERROR_NOT_INITIALIZED;
+    if (result == CUDA_SUCCESS && num_params * sizeof(func->params[0]) != data_len) {
+        fprintf(stderr, "[libvgpu] Malformed parameter layout for %s\n", name);
+        result = CUDA_ERROR_INVALID_VALUE;
+    }
+    if (result != CUDA_SUCCESS) {
+        free(func);
+        free(name_copy);
+        return result;
     }
 
-    if (!pctx) {
-        return CUDA_ERROR_INVALID_VALUE;
+    func->name = name_copy;
+    func->num_params = num_params;
+    for (uint32_t i = 0; i < num_params; i++) {
+        uint32_t end = func->params[i].offset + func->params[i].size;
+        if (end > func->arg_size) {
+            func->arg_size = end;
+        }
     }
 
-    *pctx = current_context;
+    pthread_mutex_lock(&module_lock);
+    func->next = hmod->funcs;
+    hmod->funcs = func;
+    pthread_mutex_unlock(&module_lock);
+
+    *hfunc = func;
     return CUDA_SUCCESS;
 }
 
 /**
- * cuCtxSetCurrent - Set current context
+ * cuFuncGetParamInfo - Offset and size of a kernel parameter (local)
  */
-CUresult cuCtxSetCurrent(CUcontext ctx)
+CUresult cuFuncGetParamInfo(CUfunction func, size_t paramIndex, size_t *paramOffset,
+                            size_t *paramSize)
 {
-    if (!initialized) {
-        return CUDA_ERROR_NOT_INITIALIZED;
+    if (!func || paramIndex >= func->num_params) {
+        return CUDA_ERROR_INVALID_VALUE;
     }
 
-    current_context = ctx;
+    if (paramOffset) {
+        *paramOffset = func->params[paramIndex].offset;
+    }
+    if (paramSize) {
+        *paramSize = func->params[paramIndex].size;
+    }
     return CUDA_SUCCESS;
 }
 
 /**
- * cuMemAlloc - Allocate GPU memory
+ * cuLaunchKernel - Launch a kernel
+ *
+ * Returns once the launch is queued; launch errors surface at the next
+ * synchronize. Arguments come either as kernelParams (packed here using
+ * the function's layout) or as one CU_LAUNCH_PARAM_BUFFER_POINTER blob.
  */
-CUresult cuMemAlloc(CUdeviceptr *dptr, size_t bytesize)
+CUresult cuLaunchKernel(CUfunction f,
+                        unsigned int gridDimX, unsigned int gridDimY, unsigned int gridDimZ,
+                        unsigned int blockDimX, unsigned int blockDimY, unsigned int blockDimZ,
+                        unsigned int sharedMemBytes, CUstream hStream,
+                        void **kernelParams, void **extra)
 {
     if (!initialized) {
         return CUDA_ERROR_NOT_INITIALIZED;
     }
 
-    if (!dptr || bytesize == 0) {
+    if (!f) {
+        return CUDA_ERROR_INVALID_HANDLE;
+    }
+
+    if (f->arg_size > IDM_LAUNCH_ARGS_MAX) {
         return CUDA_ERROR_INVALID_VALUE;
     }
 
-    struct idm_gpu_alloc alloc_req = {
-        .size = bytesize,
-        .flags = 0
+    uint64_t buf[(sizeof(struct idm_gpu_launch_kernel) + IDM_LAUNCH_ARGS_MAX +
+                  sizeof(uint64_t) - 1) / sizeof(uint64_t)];
+    struct idm_gpu_launch_kernel *req = (struct idm_gpu_launch_kernel *)buf;
+    uint8_t *args = (uint8_t *)(req + 1);
+
+    *req = (struct idm_gpu_launch_kernel){
+        .function_handle = f->handle,
+        .stream_handle = (uint64_t)(uintptr_t)hStream,
+        .grid_dim_x = gridDimX,
+        .grid_dim_y = gridDimY,
+        .grid_dim_z = gridDimZ,
+        .block_dim_x = blockDimX,
+        .block_dim_y = blockDimY,
+        .block_dim_z = blockDimZ,
+        .shared_mem = sharedMemBytes,
+        .arg_size = f->arg_size
     };
 
-    struct idm_message *msg = idm_build_message(
-        DRIVER_ZONE_ID,
-        IDM_GPU_ALLOC,
-        &alloc_req,
-        sizeof(alloc_req)
-    );
+    if (kernelParams) {
+        memset(args, 0, f->arg_size);
+        for (uint32_t i = 0; i < f->num_params; i++) {
+            memcpy(args + f->params[i].offset, kernelParams[i], f->params[i].size);
+        }
+    } else if (extra) {
+        const void *blob = NULL;
+        size_t blob_size = 0;
+        for (int i = 0; extra[i] != CU_LAUNCH_PARAM_END; i += 2) {
+            if (extra[i] == CU_LAUNCH_PARAM_BUFFER_POINTER) {
+                blob = extra[i + 1];
+            } else if (extra[i] == CU_LAUNCH_PARAM_BUFFER_SIZE) {
+                blob_size = *(const size_t *)extra[i + 1];
+            } else {
+                return CUDA_ERROR_INVALID_VALUE;
+            }
+        }
+        if (!blob || blob_size < f->arg_size) {
+            return CUDA_ERROR_INVALID_VALUE;
+        }
+        memcpy(args, blob, f->arg_size);
+    } else if (f->num_params > 0) {
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+
+    CUresult result;
+    if (capture_record(hStream, IDM_GPU_LAUNCH_KERNEL, buf, sizeof(*req) + f->arg_size,
+                       &result)) {
+        return result;
+    }
 
+    struct idm_message *msg = idm_build_message(DRIVER_ZONE_ID, IDM_GPU_LAUNCH_KERNEL,
+                                                buf, sizeof(*req) + f->arg_size);
     if (!msg) {
         return CUDA_ERROR_OUT_OF_MEMORY;
     }
 
-    uint64_t handle = 0;
-    CUresult result = send_and_wait(msg, &handle);
+    result = submit_request(msg, NULL, true);
     idm_free_message(msg);
 
-    if (result == CUDA_SUCCESS) {
-        *dptr = (CUdeviceptr)handle;
-    }
-
     return result;
 }
 
+/* ============================================================================
+ * Graphs
+ * ============================================================================ */
+
 /**
- * cuMemFree - Free GPU memory
+ * cuStreamBeginCapture - Start recording work queued on a stream
+ *
+ * The legacy default stream can't be captured.
  */
-CUresult cuMemFree(CUdeviceptr dptr)
+CUresult cuStreamBeginCapture(CUstream hStream, CUstreamCaptureMode mode)
 {
+    (void)mode;
+
     if (!initialized) {
         return CUDA_ERROR_NOT_INITIALIZED;
     }
 
-    if (dptr == 0) {
-        return CUDA_ERROR_INVALID_VALUE;
+    if (!hStream) {
+        return CUDA_ERROR_STREAM_CAPTURE_UNSUPPORTED;
     }
 
-    struct idm_gpu_free free_req = {
-        .handle = (uint64_t)dptr
-    };
+    struct CUgraph_st *graph = calloc(1, sizeof(*graph));
+    if (!graph) {
+        return CUDA_ERROR_OUT_OF_MEMORY;
+    }
+    graph->stream = hStream;
 
-    struct idm_message *msg = idm_build_message(
-        DRIVER_ZONE_ID,
-        IDM_GPU_FREE,
-        &free_req,
-        sizeof(free_req)
-    );
+    pthread_mutex_lock(&capture_lock);
 
-    if (!msg) {
-        return CUDA_ERROR_OUT_OF_MEMORY;
+    CUresult result = CUDA_ERROR_OUT_OF_MEMORY;
+    if (capture_find_locked(hStream)) {
+        result = CUDA_ERROR_STREAM_CAPTURE_UNSUPPORTED;
+    } else {
+        for (int i = 0; i < MAX_CAPTURES; i++) {
+            if (!captures[i]) {
+                captures[i] = graph;
+                __atomic_add_fetch(&capture_count, 1, __ATOMIC_RELEASE);
+                result = CUDA_SUCCESS;
+                break;
+            }
+        }
     }
 
-    CUresult result = send_and_wait(msg, NULL);
-    idm_free_message(msg);
+    pthread_mutex_unlock(&capture_lock);
 
+    if (result != CUDA_SUCCESS) {
+        free(graph);
+    }
     return result;
 }
 
 /**
- * cuMemcpyHtoD - Copy from host to device
+ * cuStreamEndCapture - Stop recording and return the graph
  */
-CUresult cuMemcpyHtoD(CUdeviceptr dstDevice, const void *srcHost, size_t ByteCount)
+CUresult cuStreamEndCapture(CUstream hStream, CUgraph *phGraph)
 {
     if (!initialized) {
         return CUDA_ERROR_NOT_INITIALIZED;
     }
 
-    if (dstDevice == 0 || !srcHost || ByteCount == 0) {
+    if (!phGraph) {
         return CUDA_ERROR_INVALID_VALUE;
     }
 
-    /* Build message with embedded data */
-    size_t msg_size = sizeof(struct idm_header) + sizeof(struct idm_gpu_copy_h2d) + ByteCount;
-    struct idm_message *msg = malloc(msg_size);
-    if (!msg) {
-        return CUDA_ERROR_OUT_OF_MEMORY;
+    pthread_mutex_lock(&capture_lock);
+    struct CUgraph_st **slot = capture_find_locked(hStream);
+    struct CUgraph_st *graph = slot ? *slot : NULL;
+    if (slot) {
+        *slot = NULL;
+        __atomic_sub_fetch(&capture_count, 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&capture_lock);
+
+    if (!graph) {
+        return CUDA_ERROR_INVALID_VALUE;
     }
 
-    msg->header.magic = IDM_MAGIC;
-    msg->header.version = IDM_VERSION;
-    msg->header.msg_type = IDM_GPU_COPY_H2D;
-    msg->header.src_zone = USER_ZONE_ID;
-    msg->header.dst_zone = DRIVER_ZONE_ID;
-    msg->header.seq_num = 1;  /* Will be set by transport */
-    msg->header.payload_len = sizeof(struct idm_gpu_copy_h2d) + ByteCount;
+    if (graph->invalidated) {
+        cuGraphDestroy(graph);
+        *phGraph = NULL;
+        return CUDA_ERROR_STREAM_CAPTURE_INVALIDATED;
+    }
 
-    struct idm_gpu_copy_h2d *copy_req = (struct idm_gpu_copy_h2d *)msg->payload;
-    copy_req->dst_handle = (uint64_t)dstDevice;
-    copy_req->dst_offset = 0;
-    copy_req->size = ByteCount;
+    *phGraph = graph;
+    return CUDA_SUCCESS;
+}
 
-    memcpy(msg->payload + sizeof(struct idm_gpu_copy_h2d), srcHost, ByteCount);
+/**
+ * cuStreamIsCapturing - Query a stream's capture status
+ */
+CUresult cuStreamIsCapturing(CUstream hStream, CUstreamCaptureStatus *captureStatus)
+{
+    if (!captureStatus) {
+        return CUDA_ERROR_INVALID_VALUE;
+    }
 
-    CUresult result = send_and_wait(msg, NULL);
-    free(msg);
+    pthread_mutex_lock(&capture_lock);
+    struct CUgraph_st **slot = capture_find_locked(hStream);
+    *captureStatus = !slot ? CU_STREAM_CAPTURE_STATUS_NONE :
+                     (*slot)->invalidated ? CU_STREAM_CAPTURE_STATUS_INVALIDATED :
+                     CU_STREAM_CAPTURE_STATUS_ACTIVE;
+    pthread_mutex_unlock(&capture_lock);
 
-    return result;
+    return CUDA_SUCCESS;
 }
 
 /**
- * cuMemcpyDtoH - Copy from device to host
+ * cuGraphDestroy - Free a captured graph (instantiated copies stay valid)
  */
-CUresult cuMemcpyDtoH(void *dstHost, CUdeviceptr srcDevice, size_t ByteCount)
+CUresult cuGraphDestroy(CUgraph hGraph)
+{
+    if (!hGraph) {
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+
+    free(hGraph->records);
+    free(hGraph);
+    return CUDA_SUCCESS;
+}
+
+/**
+ * cuGraphInstantiate - Send a captured graph to the proxy
+ */
+CUresult cuGraphInstantiate(CUgraphExec *phGraphExec, CUgraph hGraph, unsigned long long flags)
 {
+    (void)flags;
+
     if (!initialized) {
         return CUDA_ERROR_NOT_INITIALIZED;
     }
 
-    if (!dstHost || srcDevice == 0 || ByteCount == 0) {
+    if (!phGraphExec || !hGraph) {
         return CUDA_ERROR_INVALID_VALUE;
     }
 
-    struct idm_gpu_copy_d2h copy_req = {
-        .src_handle = (uint64_t)srcDevice,
-        .src_offset = 0,
-        .size = ByteCount
-    };
+    size_t size = hGraph->len;
+    size_t inline_max = IDM_ENTRY_PAYLOAD_MAX - sizeof(struct idm_gpu_graph_instantiate);
+    struct pending_req actions = { .stage_first = -1 };
+    struct idm_message *msg;
+
+    if (size <= inline_max) {
+        uint64_t buf[IDM_ENTRY_PAYLOAD_MAX / sizeof(uint64_t)];
+        struct idm_gpu_graph_instantiate *req = (struct idm_gpu_graph_instantiate *)buf;
+        *req = (struct idm_gpu_graph_instantiate){
+            .size = size,
+            .flags = IDM_COPY_INLINE,
+            .count = hGraph->count
+        };
+        memcpy(req + 1, hGraph->records, size);
+
+        msg = idm_build_message(DRIVER_ZONE_ID, IDM_GPU_GRAPH_INSTANTIATE, buf,
+                                sizeof(*req) + size);
+    } else {
+        int chunks = (int)((size + STAGE_CHUNK_SIZE - 1) / STAGE_CHUNK_SIZE);
+        if (chunks > STAGE_CHUNKS) {
+            fprintf(stderr, "[libvgpu] Graph too large (%zu bytes)\n", size);
+            return CUDA_ERROR_INVALID_VALUE;
+        }
 
-    struct idm_message *msg = idm_build_message(
-        DRIVER_ZONE_ID,
-        IDM_GPU_COPY_D2H,
-        &copy_req,
-        sizeof(copy_req)
-    );
+        int stage = stage_acquire(chunks);
+        if (stage < 0) {
+            return CUDA_ERROR_INVALID_VALUE;
+        }
+
+        size_t bulk_size = 0;
+        uint8_t *bulk = idm_bulk_region(&bulk_size);
+        uint64_t bulk_offset = (uint64_t)stage * STAGE_CHUNK_SIZE;
+        memcpy(bulk + bulk_offset, hGraph->records, size);
+
+        struct idm_gpu_graph_instantiate req = {
+            .size = size,
+            .bulk_offset = bulk_offset,
+            .flags = IDM_COPY_BULK,
+            .count = hGraph->count
+        };
+        msg = idm_build_message(DRIVER_ZONE_ID, IDM_GPU_GRAPH_INSTANTIATE, &req, sizeof(req));
+        if (!msg) {
+            stage_release_run(stage, chunks);
+            return CUDA_ERROR_OUT_OF_MEMORY;
+        }
+
+        actions.stage_first = stage;
+        actions.stage_count = chunks;
+    }
 
     if (!msg) {
         return CUDA_ERROR_OUT_OF_MEMORY;
     }
 
-    CUresult result = send_and_wait(msg, NULL);
+    uint64_t handle = 0;
+    CUresult result = submit_request(msg, &actions, false);
+    if (result == CUDA_SUCCESS) {
+        result = wait_request(msg->header.seq_num, &handle, NULL);
+    } else if (actions.stage_count > 0) {
+        stage_release_run(actions.stage_first, actions.stage_count);
+    }
     idm_free_message(msg);
 
-    /* TODO: Actually receive the data back */
-    /* For now, just zero the buffer */
     if (result == CUDA_SUCCESS) {
-        memset(dstHost, 0, ByteCount);
+        *phGraphExec = (CUgraphExec)(uintptr_t)handle;
     }
 
     return result;
 }
 
 /**
- * cuMemcpyDtoD - Copy from device to device
+ * cuGraphLaunch - Replay a graph on a stream
+ *
+ * Detached like a kernel launch: errors surface at the next synchronize.
  */
-CUresult cuMemcpyDtoD(CUdeviceptr dstDevice, CUdeviceptr srcDevice, size_t ByteCount)
+CUresult cuGraphLaunch(CUgraphExec hGraphExec, CUstream hStream)
 {
     if (!initialized) {
         return CUDA_ERROR_NOT_INITIALIZED;
     }
 
-    if (dstDevice == 0 || srcDevice == 0 || ByteCount == 0) {
-        return CUDA_ERROR_INVALID_VALUE;
+    if (!hGraphExec) {
+        return CUDA_ERROR_INVALID_HANDLE;
     }
 
-    struct idm_gpu_copy_d2d copy_req = {
-        .dst_handle = (uint64_t)dstDevice,
-        .dst_offset = 0,
-        .src_handle = (uint64_t)srcDevice,
-        .src_offset = 0,
-        .size = ByteCount
-    };
+    CUresult result = capture_refuse(hStream);
+    if (result != CUDA_SUCCESS) {
+        return result;
+    }
 
-    struct idm_message *msg = idm_build_message(
-        DRIVER_ZONE_ID,
-        IDM_GPU_COPY_D2D,
-        &copy_req,
-        sizeof(copy_req)
-    );
+    struct idm_gpu_graph_launch req = {
+        .graph_handle = (uint64_t)(uintptr_t)hGraphExec,
+        .stream_handle = (uint64_t)(uintptr_t)hStream
+    };
 
+    struct idm_message *msg = idm_build_message(DRIVER_ZONE_ID, IDM_GPU_GRAPH_LAUNCH,
+                                                &req, sizeof(req));
     if (!msg) {
         return CUDA_ERROR_OUT_OF_MEMORY;
     }
 
-    CUresult result = send_and_wait(msg, NULL);
+    result = submit_request(msg, NULL, true);
     idm_free_message(msg);
 
     return result;
 }
 
 /**
- * cuMemsetD8 - Set memory to byte value
+ * cuGraphExecDestroy - Destroy an instantiated graph
  */
-CUresult cuMemsetD8(CUdeviceptr dstDevice, unsigned char uc, size_t N)
+CUresult cuGraphExecDestroy(CUgraphExec hGraphExec)
 {
-    /* Not implemented - would need new IDM message type */
-    (void)dstDevice;
-    (void)uc;
-    (void)N;
-    return CUDA_SUCCESS;  /* Pretend it worked */
-}
+    if (!initialized) {
+        return CUDA_ERROR_NOT_INITIALIZED;
+    }
 
-/**
- * cuMemsetD16 - Set memory to short value
- */
-CUresult cuMemsetD16(CUdeviceptr dstDevice, unsigned short us, size_t N)
-{
-    (void)dstDevice;
-    (void)us;
-    (void)N;
-    return CUDA_SUCCESS;
-}
+    if (!hGraphExec) {
+        return CUDA_ERROR_INVALID_HANDLE;
+    }
 
-/**
- * cuMemsetD32 - Set memory to int value
- */
-CUresult cuMemsetD32(CUdeviceptr dstDevice, unsigned int ui, size_t N)
-{
-    (void)dstDevice;
-    (void)ui;
-    (void)N;
-    return CUDA_SUCCESS;
+    struct idm_gpu_graph req = { .graph_handle = (uint64_t)(uintptr_t)hGraphExec };
+
+    return call_proxy(IDM_GPU_GRAPH_DESTROY, &req, sizeof(req), NULL, NULL);
 }
 
 /**
@@ -9,6 +9,38 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/wait.h>
+
+/* out[i] = value for i < n */
+static const char fill_ptx[] =
+    ".version 7.0\n"
+    ".target sm_50\n"
+    ".address_size 64\n"
+    "\n"
+    ".visible .entry fill_u32(.param .u64 p_data, .param .u32 p_value, .param .u32 p_n)\n"
+    "{\n"
+    "    .reg .pred %p<2>;\n"
+    "    .reg .b32 %r<7>;\n"
+    "    .reg .b64 %rd<5>;\n"
+    "\n"
+    "    ld.param.u64 %rd1, [p_data];\n"
+    "    ld.param.u32 %r1, [p_value];\n"
+    "    ld.param.u32 %r2, [p_n];\n"
+    "    mov.u32 %r3, %ctaid.x;\n"
+    "    mov.u32 %r4, %ntid.x;\n"
+    "    mov.u32 %r5, %tid.x;\n"
+    "    mad.lo.s32 %r6, %r3, %r4, %r5;\n"
+    "    setp.ge.u32 %p1, %r6, %r2;\n"
+    "    @%p1 bra DONE;\n"
+    "    cvta.to.global.u64 %rd2, %rd1;\n"
+    "    mul.wide.u32 %rd3, %r6, 4;\n"
+    "    add.s64 %rd4, %rd2, %rd3;\n"
+    "    st.global.u32 [%rd4], %r1;\n"
+    "DONE:\n"
+    "    ret;\n"
+    "}\n";
 
 #define CHECK_CUDA(call) do { \
     CUresult result = (call); \
@@ -20,8 +52,153 @@
     } \
 } while(0)
 
-int main(void)
+/* Shared buffer: what the owner writes, and what the other zone writes back */
+#define SHARE_SIZE     1024
+#define SHARE_PATTERN(i) ((unsigned char)((i) * 13 + 1))
+#define SHARE_REPLY    0x5A
+
+/* Oversubscription: most buffers, and waits for the proxy to find idle
+ * ones (it evicts nothing touched in the last 250 ms) */
+#define OVERSUB_MAX     64
+#define OVERSUB_TRIES   10
+#define OVERSUB_IDLE_US 300000
+
+/* Threads calling in at once, and round trips each makes */
+#define THREADS         4
+#define THREAD_ROUNDS   200
+
+/* Importer exit codes */
+#define IMPORT_OK      0
+#define IMPORT_DENIED  2
+
+struct thread_arg {
+    CUcontext context;
+    int id;
+};
+
+/**
+ * One of the concurrent threads: its own buffer, tagged with its id
+ *
+ * Every round trip must come back with this thread's own data; a response
+ * delivered to the wrong thread shows up as another thread's tag.
+ */
+static void *thread_main(void *p)
+{
+    struct thread_arg *arg = p;
+    unsigned int tag[64], back[64];
+
+    /* The context is current per thread, as with the real driver */
+    CHECK_CUDA(cuCtxSetCurrent(arg->context));
+
+    CUdeviceptr d_buf;
+    CHECK_CUDA(cuMemAlloc(&d_buf, sizeof(tag)));
+
+    for (int round = 0; round < THREAD_ROUNDS; round++) {
+        for (int i = 0; i < 64; i++) {
+            tag[i] = (unsigned int)(arg->id << 16 | round);
+        }
+        CHECK_CUDA(cuMemcpyHtoD(d_buf, tag, sizeof(tag)));
+        CHECK_CUDA(cuMemcpyDtoH(back, d_buf, sizeof(back)));
+        if (memcmp(tag, back, sizeof(tag)) != 0) {
+            fprintf(stderr, "    ✗ Thread %d round %d got %#x\n", arg->id, round, back[0]);
+            exit(1);
+        }
+    }
+
+    CHECK_CUDA(cuMemFree(d_buf));
+    return NULL;
+}
+
+/**
+ * Other zone's side of the sharing test (test_app --import HEX)
+ *
+ * Opens the shared buffer, checks it, copies it device to device into its
+ * own memory and fills the original with SHARE_REPLY.
+ */
+static int run_importer(const char *hex)
 {
+    CUipcMemHandle ipc;
+    if (strlen(hex) != 2 * sizeof(ipc.reserved)) {
+        return 1;
+    }
+    for (size_t i = 0; i < sizeof(ipc.reserved); i++) {
+        unsigned int byte;
+        sscanf(hex + 2 * i, "%2x", &byte);
+        ipc.reserved[i] = (char)byte;
+    }
+
+    CUdevice device;
+    CUcontext context;
+    CHECK_CUDA(cuInit(0));
+    CHECK_CUDA(cuDeviceGet(&device, 0));
+    CHECK_CUDA(cuCtxCreate(&context, 0, device));
+
+    CUdeviceptr shared;
+    if (cuIpcOpenMemHandle(&shared, ipc, CU_IPC_MEM_LAZY_ENABLE_PEER_ACCESS) != CUDA_SUCCESS) {
+        return IMPORT_DENIED;
+    }
+
+    unsigned char buf[SHARE_SIZE];
+    CUdeviceptr own;
+    CHECK_CUDA(cuMemAlloc(&own, SHARE_SIZE));
+    CHECK_CUDA(cuMemcpyDtoD(own, shared, SHARE_SIZE));
+    CHECK_CUDA(cuMemcpyDtoH(buf, own, SHARE_SIZE));
+    for (size_t i = 0; i < SHARE_SIZE; i++) {
+        if (buf[i] != SHARE_PATTERN(i)) {
+            return 1;
+        }
+    }
+
+    /* Can use it, but it isn't ours to free */
+    if (cuMemFree(shared) == CUDA_SUCCESS) {
+        return 1;
+    }
+
+    CHECK_CUDA(cuMemsetD8(shared, SHARE_REPLY, SHARE_SIZE));
+    CHECK_CUDA(cuCtxSynchronize());
+    CHECK_CUDA(cuIpcCloseMemHandle(shared));
+    CHECK_CUDA(cuMemFree(own));
+    CHECK_CUDA(cuCtxDestroy(context));
+    return IMPORT_OK;
+}
+
+/**
+ * Run run_importer in another zone
+ *
+ * @return Its exit code, or -1 if it didn't exit normally
+ */
+static int spawn_importer(const char *self, const char *zone, const CUipcMemHandle *ipc)
+{
+    char hex[2 * sizeof(ipc->reserved) + 1];
+    for (size_t i = 0; i < sizeof(ipc->reserved); i++) {
+        snprintf(hex + 2 * i, 3, "%02x", (unsigned char)ipc->reserved[i]);
+    }
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        return -1;
+    }
+    if (pid == 0) {
+        setenv("IDM_ZONE_ID", zone, 1);
+        freopen("/dev/null", "w", stdout);
+        execl(self, self, "--import", hex, (char *)NULL);
+        _exit(127);
+    }
+
+    int status;
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status)) {
+        return -1;
+    }
+    return WEXITSTATUS(status);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc == 3 && strcmp(argv[1], "--import") == 0) {
+        return run_importer(argv[2]);
+    }
+
     printf("=== CUDA Test Application ===\n\n");
 
     /* Initialize CUDA */
@@ -53,7 +230,29 @@ int main(void)
     /* Get device name */
     char device_name[256];
     CHECK_CUDA(cuDeviceGetName(device_name, sizeof(device_name), device));
-    printf("4. Using device 0: %s\n\n", device_name);
+    printf("4. Using device 0: %s\n", device_name);
+
+    /* Attributes come from the table fetched at cuInit */
+    int cc_major = 0, cc_minor = 0, sm_count = 0, warp_size = 0, bogus = 0;
+    CHECK_CUDA(cuDeviceComputeCapability(&cc_major, &cc_minor, device));
+    CHECK_CUDA(cuDeviceGetAttribute(&sm_count, CU_DEVICE_ATTRIBUTE_MULTIPROCESSOR_COUNT, device));
+    CHECK_CUDA(cuDeviceGetAttribute(&warp_size, CU_DEVICE_ATTRIBUTE_WARP_SIZE, device));
+    printf("   Compute capability %d.%d, %d SMs, warp size %d\n",
+           cc_major, cc_minor, sm_count, warp_size);
+    if (cc_major < 1 || sm_count < 1 || warp_size != 32) {
+        fprintf(stderr, "   ✗ Implausible device attributes\n");
+        return 1;
+    }
+    if (cuDeviceGetAttribute(&bogus, (CUdevice_attribute)1000, device) != CUDA_ERROR_INVALID_VALUE) {
+        fprintf(stderr, "   ✗ Unknown attribute was not rejected\n");
+        return 1;
+    }
+
+    CUuuid uuid;
+    CHECK_CUDA(cuDeviceGetUuid(&uuid, device));
+    printf("   UUID %02x%02x%02x%02x-...\n\n",
+           (unsigned char)uuid.bytes[0], (unsigned char)uuid.bytes[1],
+           (unsigned char)uuid.bytes[2], (unsigned char)uuid.bytes[3]);
 
     /* Create context */
     CUcontext context;
@@ -86,7 +285,7 @@ int main(void)
     CHECK_CUDA(cuMemcpyDtoH(h_result, d_ptr, 1024));
     printf("   ✓ Copied 1024 bytes from GPU\n\n");
 
-    /* Verify data (for now, libvgpu returns zeros) */
+    /* Verify data */
     printf("9. Verifying data...\n");
     int errors = 0;
     for (int i = 0; i < 1024; i++) {
@@ -95,24 +294,406 @@ int main(void)
         }
     }
     if (errors > 0) {
-        printf("   ⚠ Data mismatch: %d errors (expected with stub GPU)\n\n", errors);
-    } else {
-        printf("   ✓ Data matches!\n\n");
+        fprintf(stderr, "   ✗ Data mismatch: %d errors\n", errors);
+        return 1;
     }
+    printf("   ✓ Data matches!\n\n");
+
+    /* Round trip larger than the bulk region (multiple chunks) */
+    printf("10. Large transfer round trip...\n");
+    size_t big_size = 40 * 1024 * 1024;
+    CUdeviceptr d_big;
+    CHECK_CUDA(cuMemAlloc(&d_big, big_size));
+
+    unsigned char *h_big = malloc(big_size);
+    unsigned char *h_big_result = malloc(big_size);
+    for (size_t i = 0; i < big_size; i++) {
+        h_big[i] = (unsigned char)((i * 31) >> 3);
+    }
+    memset(h_big_result, 0, big_size);
+
+    CHECK_CUDA(cuMemcpyHtoD(d_big, h_big, big_size));
+    CHECK_CUDA(cuMemcpyDtoH(h_big_result, d_big, big_size));
+
+    if (memcmp(h_big, h_big_result, big_size) != 0) {
+        fprintf(stderr, "    ✗ Large transfer mismatch\n");
+        return 1;
+    }
+    printf("    ✓ %zu bytes round-tripped intact\n\n", big_size);
+
+    CHECK_CUDA(cuMemFree(d_big));
+    free(h_big);
+    free(h_big_result);
+
+    /* Stream-ordered copies bracketed by events */
+    printf("11. Stream copies with events...\n");
+    CUstream stream;
+    CUevent ev_start, ev_end;
+    CHECK_CUDA(cuStreamCreate(&stream, 0));
+    CHECK_CUDA(cuEventCreate(&ev_start, 0));
+    CHECK_CUDA(cuEventCreate(&ev_end, 0));
+
+    memset(h_result, 0, 1024);
+    CHECK_CUDA(cuEventRecord(ev_start, stream));
+    CHECK_CUDA(cuMemcpyHtoDAsync(d_ptr, h_data, 1024, stream));
+    CHECK_CUDA(cuMemcpyDtoHAsync(h_result, d_ptr, 1024, stream));
+    CHECK_CUDA(cuEventRecord(ev_end, stream));
+    CHECK_CUDA(cuStreamSynchronize(stream));
+    CHECK_CUDA(cuEventQuery(ev_end));
+
+    float elapsed_ms = -1.0f;
+    CHECK_CUDA(cuEventElapsedTime(&elapsed_ms, ev_start, ev_end));
+
+    if (memcmp(h_data, h_result, 1024) != 0 || elapsed_ms < 0.0f) {
+        fprintf(stderr, "    ✗ Stream copy mismatch\n");
+        return 1;
+    }
+    printf("    ✓ Stream round trip intact (%.3f ms)\n\n", elapsed_ms);
+
+    CHECK_CUDA(cuEventDestroy(ev_start));
+    CHECK_CUDA(cuEventDestroy(ev_end));
+    CHECK_CUDA(cuStreamDestroy(stream));
 
     /* Synchronize */
-    printf("10. Synchronizing...\n");
+    printf("12. Synchronizing...\n");
     CHECK_CUDA(cuCtxSynchronize());
     printf("    ✓ Synchronized\n\n");
 
+    /* Same-size alloc/free churn (served from VGPU_ALLOC_CACHE_MB if set) */
+    printf("13. Alloc/free churn...\n");
+    for (int i = 0; i < 100; i++) {
+        CUdeviceptr d_tmp;
+        CHECK_CUDA(cuMemAlloc(&d_tmp, 1000 + (i % 3) * 8));
+        CHECK_CUDA(cuMemcpyHtoD(d_tmp, h_data, 1000));
+        CHECK_CUDA(cuMemFree(d_tmp));
+    }
+    CUdeviceptr d_reuse;
+    CHECK_CUDA(cuMemAlloc(&d_reuse, 1000));
+    CHECK_CUDA(cuMemcpyHtoD(d_reuse, h_data + 24, 1000));
+    memset(h_result, 0, 1024);
+    CHECK_CUDA(cuMemcpyDtoH(h_result, d_reuse, 1000));
+    CHECK_CUDA(cuMemFree(d_reuse));
+    if (cuMemFree(d_reuse) == CUDA_SUCCESS) {
+        fprintf(stderr, "    ✗ Double free not caught\n");
+        return 1;
+    }
+    CHECK_CUDA(cuCtxSynchronize());
+    if (memcmp(h_data + 24, h_result, 1000) != 0) {
+        fprintf(stderr, "    ✗ Reused allocation mismatch\n");
+        return 1;
+    }
+    printf("    ✓ 100 alloc/free cycles, reused block intact\n\n");
+
+    /* Module load, cached function lookup, kernel launch */
+    printf("14. Launching a kernel...\n");
+    CUmodule module;
+    CUfunction fill, fill_again;
+    CHECK_CUDA(cuModuleLoadData(&module, fill_ptx));
+    CHECK_CUDA(cuModuleGetFunction(&fill, module, "fill_u32"));
+    CHECK_CUDA(cuModuleGetFunction(&fill_again, module, "fill_u32"));
+    if (fill != fill_again) {
+        fprintf(stderr, "    ✗ Function lookup not cached\n");
+        return 1;
+    }
+
+    unsigned int count = 256;
+    unsigned int value = 0xC0FFEE;
+    CUdeviceptr d_out;
+    CHECK_CUDA(cuMemAlloc(&d_out, count * sizeof(unsigned int)));
+    void *params[] = { &d_out, &value, &count };
+    CHECK_CUDA(cuLaunchKernel(fill, 2, 1, 1, 128, 1, 1, 0, NULL, params, NULL));
+
+    unsigned int *h_out = calloc(count, sizeof(unsigned int));
+    CHECK_CUDA(cuMemcpyDtoH(h_out, d_out, count * sizeof(unsigned int)));
+    for (unsigned int i = 0; i < count; i++) {
+        if (h_out[i] != value) {
+            fprintf(stderr, "    ✗ Kernel output mismatch at %u\n", i);
+            return 1;
+        }
+    }
+    printf("    ✓ fill_u32 wrote %u elements\n\n", count);
+
+    /* Fills run on the device: 1D, then 2D with a pitch */
+    printf("15. Device memory fills...\n");
+    CHECK_CUDA(cuMemsetD32(d_out, 0x11223344, count));
+    CHECK_CUDA(cuMemsetD2D16(d_out, 64, 0xBEEF, 8, 4));
+    CHECK_CUDA(cuMemcpyDtoH(h_out, d_out, count * sizeof(unsigned int)));
+    for (unsigned int i = 0; i < count; i++) {
+        /* Rows of 64 bytes = 16 words, the first 4 words of 4 rows hit */
+        unsigned int expect = (i < 4 * 16 && i % 16 < 4) ? 0xBEEFBEEF : 0x11223344;
+        if (h_out[i] != expect) {
+            fprintf(stderr, "    ✗ Fill mismatch at %u: 0x%x\n", i, h_out[i]);
+            return 1;
+        }
+    }
+    printf("    ✓ 1D and 2D fills match\n\n");
+
+    /* Addresses inside an allocation: launch, copies and bounds */
+    printf("16. Device pointer arithmetic...\n");
+    unsigned int quarter = count / 4, value_mid = 0xABCD;
+    CUdeviceptr d_mid = d_out + quarter * sizeof(unsigned int);
+    void *params_mid[] = { &d_mid, &value_mid, &quarter };
+    CHECK_CUDA(cuLaunchKernel(fill, 1, 1, 1, 64, 1, 1, 0, NULL, params_mid, NULL));
+    CHECK_CUDA(cuMemcpyDtoD(d_out + 3 * quarter * sizeof(unsigned int), d_mid,
+                            quarter * sizeof(unsigned int)));
+    CHECK_CUDA(cuMemcpyHtoD(d_out + 2 * quarter * sizeof(unsigned int), h_out,
+                            quarter * sizeof(unsigned int)));
+    memset(h_out, 0, count * sizeof(unsigned int));
+    CHECK_CUDA(cuMemcpyDtoH(h_out + quarter, d_mid, 3 * quarter * sizeof(unsigned int)));
+    for (unsigned int i = quarter; i < count; i++) {
+        /* The HtoD quarter came from the fill check: its first 4 words are 0xBEEF */
+        unsigned int expect = (i / quarter == 2) ? (i % 16 < 4 ? 0xBEEFBEEF : 0x11223344)
+                                                 : value_mid;
+        if (h_out[i] != expect) {
+            fprintf(stderr, "    ✗ Slice mismatch at %u: 0x%x\n", i, h_out[i]);
+            return 1;
+        }
+    }
+    if (cuMemcpyDtoH(h_out, d_mid, count * sizeof(unsigned int)) != CUDA_ERROR_INVALID_VALUE ||
+        cuMemFree(d_mid) != CUDA_ERROR_INVALID_VALUE) {
+        fprintf(stderr, "    ✗ Out-of-range access or interior free not refused\n");
+        return 1;
+    }
+    printf("    ✓ Launch, DtoD, HtoD and DtoH on offsets, bounds enforced\n\n");
+
+    /* Capture a fill, a launch and a copy once, replay them as one graph */
+    printf("17. Graph capture and replay...\n");
+    CUstream capture_stream;
+    CHECK_CUDA(cuStreamCreate(&capture_stream, 0));
+
+    CHECK_CUDA(cuStreamBeginCapture(capture_stream, CU_STREAM_CAPTURE_MODE_GLOBAL));
+    if (cuMemcpyHtoDAsync(d_out, h_data, 4, capture_stream) !=
+        CUDA_ERROR_STREAM_CAPTURE_UNSUPPORTED) {
+        fprintf(stderr, "    ✗ Copy on a capturing stream not refused\n");
+        return 1;
+    }
+    CUgraph graph;
+    if (cuStreamEndCapture(capture_stream, &graph) != CUDA_ERROR_STREAM_CAPTURE_INVALIDATED) {
+        fprintf(stderr, "    ✗ Invalidated capture not reported\n");
+        return 1;
+    }
+
+    unsigned int value_all = 5, value_head = 9, count_head = 128;
+    void *params_head[] = { &d_out, &value_head, &count_head };
+    CHECK_CUDA(cuStreamBeginCapture(capture_stream, CU_STREAM_CAPTURE_MODE_GLOBAL));
+    CHECK_CUDA(cuMemsetD32Async(d_out, value_all, count, capture_stream));
+    CHECK_CUDA(cuLaunchKernel(fill, 1, 1, 1, 128, 1, 1, 0, capture_stream, params_head, NULL));
+    CHECK_CUDA(cuMemcpyDtoDAsync(d_out + 3 * quarter * sizeof(unsigned int), d_out,
+                                 quarter * sizeof(unsigned int), capture_stream));
+    CHECK_CUDA(cuStreamEndCapture(capture_stream, &graph));
+
+    CUgraphExec graph_exec;
+    CHECK_CUDA(cuGraphInstantiate(&graph_exec, graph, 0));
+    CHECK_CUDA(cuGraphDestroy(graph));
+
+    for (int i = 0; i < 3; i++) {
+        memset(h_out, 0, count * sizeof(unsigned int));
+        CHECK_CUDA(cuMemcpyHtoD(d_out, h_out, count * sizeof(unsigned int)));
+        CHECK_CUDA(cuGraphLaunch(graph_exec, capture_stream));
+        CHECK_CUDA(cuStreamSynchronize(capture_stream));
+    }
+
+    CHECK_CUDA(cuMemcpyDtoH(h_out, d_out, count * sizeof(unsigned int)));
+    for (unsigned int i = 0; i < count; i++) {
+        int head = i < count_head || i >= 3 * quarter;
+        if (h_out[i] != (head ? value_head : value_all)) {
+            fprintf(stderr, "    ✗ Graph output mismatch at %u\n", i);
+            return 1;
+        }
+    }
+    printf("    ✓ Fill + launch + copy graph replayed 3 times\n\n");
+
+    CHECK_CUDA(cuGraphExecDestroy(graph_exec));
+    CHECK_CUDA(cuStreamDestroy(capture_stream));
+    free(h_out);
+    CHECK_CUDA(cuMemFree(d_out));
+    CHECK_CUDA(cuModuleUnload(module));
+
+    /* Pinned host memory: copies read and write it in place */
+    printf("18. Pinned host memory...\n");
+    unsigned char *h_pinned_src, *h_pinned_dst;
+    CHECK_CUDA(cuMemAllocHost((void **)&h_pinned_src, size));
+    CHECK_CUDA(cuMemHostAlloc((void **)&h_pinned_dst, size, CU_MEMHOSTALLOC_PORTABLE));
+    for (size_t i = 0; i < size; i++) {
+        h_pinned_src[i] = (unsigned char)(i * 7);
+    }
+    memset(h_pinned_dst, 0, size);
+    CHECK_CUDA(cuMemcpyHtoD(d_ptr, h_pinned_src, size));
+    CHECK_CUDA(cuMemcpyDtoH(h_pinned_dst, d_ptr, size));
+    if (memcmp(h_pinned_src, h_pinned_dst, size) != 0) {
+        fprintf(stderr, "    ✗ Pinned round trip mismatch\n");
+        return 1;
+    }
+
+    CUstream pinned_stream;
+    CHECK_CUDA(cuStreamCreate(&pinned_stream, 0));
+    memset(h_pinned_dst, 0, size);
+    CHECK_CUDA(cuMemcpyHtoDAsync(d_ptr + 4096, h_pinned_src, size / 2, pinned_stream));
+    CHECK_CUDA(cuMemcpyDtoHAsync(h_pinned_dst, d_ptr + 4096, size / 2, pinned_stream));
+    CHECK_CUDA(cuStreamSynchronize(pinned_stream));
+    CHECK_CUDA(cuStreamDestroy(pinned_stream));
+    if (memcmp(h_pinned_src, h_pinned_dst, size / 2) != 0) {
+        fprintf(stderr, "    ✗ Pinned stream round trip mismatch\n");
+        return 1;
+    }
+
+    CHECK_CUDA(cuMemHostRegister(h_data, 1024, 0));
+    CHECK_CUDA(cuMemcpyHtoD(d_ptr, h_data, 1024));
+    CHECK_CUDA(cuMemHostUnregister(h_data));
+    CHECK_CUDA(cuMemFreeHost(h_pinned_src));
+    CHECK_CUDA(cuMemFreeHost(h_pinned_dst));
+    printf("    ✓ %zu bytes each way from pinned buffers, sync and on a stream\n\n", size);
+
+    /* Every other device: its own context and memory */
+    printf("19. Other devices...\n");
+    for (int dev = 1; dev < device_count; dev++) {
+        CUdevice other;
+        CUcontext other_ctx;
+        CUdeviceptr d_other;
+        size_t total_mem = 0;
+        CHECK_CUDA(cuDeviceGet(&other, dev));
+        CHECK_CUDA(cuDeviceTotalMem(&total_mem, other));
+        CHECK_CUDA(cuCtxCreate(&other_ctx, 0, other));
+        CHECK_CUDA(cuMemAlloc(&d_other, 1024));
+        CHECK_CUDA(cuMemcpyHtoD(d_other, h_data, 1024));
+        CHECK_CUDA(cuCtxSetCurrent(context));
+
+        /* Back to device 0 without passing through the host */
+        CHECK_CUDA(cuMemsetD8(d_ptr, 0, 1024));
+        CHECK_CUDA(cuMemcpyPeer(d_ptr, context, d_other, other_ctx, 1024));
+        memset(h_result, 0, 1024);
+        CHECK_CUDA(cuMemcpyDtoH(h_result, d_ptr, 1024));
+        CHECK_CUDA(cuMemFree(d_other));
+        if (memcmp(h_data, h_result, 1024) != 0) {
+            fprintf(stderr, "    ✗ Device %d round trip mismatch\n", dev);
+            return 1;
+        }
+        printf("    ✓ Device %d (%zu MB) round trip, peer copy back\n", dev, total_mem >> 20);
+    }
+    printf("    ✓ %d device(s) checked\n\n", device_count);
+
+    /* Another zone (TEST_PEER_ZONE, which the proxy must serve) opens our
+     * memory, but only once we shared it */
+    printf("20. Sharing memory with another zone...\n");
+    const char *peer_zone = getenv("TEST_PEER_ZONE");
+    if (peer_zone && *peer_zone) {
+        CUdeviceptr d_shared;
+        CUipcMemHandle ipc;
+        unsigned char shared_data[SHARE_SIZE];
+        unsigned int peer = (unsigned int)atoi(peer_zone);
+        for (size_t i = 0; i < SHARE_SIZE; i++) {
+            shared_data[i] = SHARE_PATTERN(i);
+        }
+        CHECK_CUDA(cuMemAlloc(&d_shared, SHARE_SIZE));
+        CHECK_CUDA(cuMemcpyHtoD(d_shared, shared_data, SHARE_SIZE));
+        CHECK_CUDA(cuIpcGetMemHandle(&ipc, d_shared));
+
+        int status = spawn_importer(argv[0], peer_zone, &ipc);
+        if (status != IMPORT_DENIED) {
+            fprintf(stderr, "    ✗ Zone %s opened memory it wasn't granted (%d)\n",
+                    peer_zone, status);
+            return 1;
+        }
+
+        CHECK_CUDA(vgpuMemShare(d_shared, &peer, 1));
+        status = spawn_importer(argv[0], peer_zone, &ipc);
+        CHECK_CUDA(cuMemcpyDtoH(shared_data, d_shared, SHARE_SIZE));
+        if (status != IMPORT_OK || shared_data[0] != SHARE_REPLY ||
+            shared_data[SHARE_SIZE - 1] != SHARE_REPLY) {
+            fprintf(stderr, "    ✗ Zone %s couldn't use shared memory (%d)\n",
+                    peer_zone, status);
+            return 1;
+        }
+
+        CHECK_CUDA(vgpuMemShare(d_shared, NULL, 0));
+        CHECK_CUDA(cuMemFree(d_shared));
+        printf("    ✓ Zone %s was refused, then read and wrote it once granted\n\n", peer_zone);
+    } else {
+        printf("    - Skipped (set TEST_PEER_ZONE)\n\n");
+    }
+
+    /* More memory than device 0 has (start the proxy with -E and a small
+     * STUB_GPU_MEMORY_MB): idle buffers move to the host and come back */
+    printf("21. Oversubscribing device memory...\n");
+    if (getenv("TEST_OVERSUBSCRIBE")) {
+        size_t total_mem = 0;
+        CHECK_CUDA(cuDeviceTotalMem(&total_mem, device));
+        size_t chunk = 16 << 20;
+        int count = (int)(total_mem / chunk) + 2;
+        if (count > OVERSUB_MAX) {
+            fprintf(stderr, "    ✗ Device has %zu MB, too much to oversubscribe\n",
+                    total_mem >> 20);
+            return 1;
+        }
+
+        CUdeviceptr d_over[OVERSUB_MAX];
+        for (int i = 0; i < count; i++) {
+            CUresult res;
+            for (int tries = 0; (res = cuMemAlloc(&d_over[i], chunk)) == CUDA_ERROR_OUT_OF_MEMORY &&
+                                tries < OVERSUB_TRIES; tries++) {
+                usleep(OVERSUB_IDLE_US);   /* Until something is idle enough to evict */
+            }
+            CHECK_CUDA(res);
+
+            /* First half patterned, second half zero */
+            CHECK_CUDA(cuMemsetD8(d_over[i], 0, chunk));
+            CHECK_CUDA(cuMemsetD8(d_over[i], (unsigned char)(i + 1), chunk / 2));
+        }
+
+        /* Let the ones still on the device go idle, so they can make room */
+        usleep(OVERSUB_IDLE_US);
+
+        unsigned char *h_over = malloc(chunk);
+        for (int i = 0; i < count; i++) {
+            CUresult res;
+            for (int tries = 0; (res = cuMemcpyDtoH(h_over, d_over[i], chunk)) ==
+                                CUDA_ERROR_OUT_OF_MEMORY && tries < OVERSUB_TRIES; tries++) {
+                usleep(OVERSUB_IDLE_US);
+            }
+            CHECK_CUDA(res);
+
+            if (h_over[0] != (unsigned char)(i + 1) || h_over[chunk / 2 - 1] != (unsigned char)(i + 1) ||
+                h_over[chunk / 2] != 0 || h_over[chunk - 1] != 0) {
+                fprintf(stderr, "    ✗ Buffer %d lost its data\n", i);
+                return 1;
+            }
+        }
+        free(h_over);
+
+        for (int i = 0; i < count; i++) {
+            CHECK_CUDA(cuMemFree(d_over[i]));
+        }
+        printf("    ✓ %d x %zu MB on a %zu MB device, all intact\n\n",
+               count, chunk >> 20, total_mem >> 20);
+    } else {
+        printf("    - Skipped (set TEST_OVERSUBSCRIBE)\n\n");
+    }
+
+    /* Several threads at once, each with the context made current */
+    printf("22. Calls from %d threads...\n", THREADS);
+    pthread_t threads[THREADS];
+    struct thread_arg thread_args[THREADS];
+    for (int i = 0; i < THREADS; i++) {
+        thread_args[i] = (struct thread_arg){ .context = context, .id = i + 1 };
+        if (pthread_create(&threads[i], NULL, thread_main, &thread_args[i]) != 0) {
+            fprintf(stderr, "    ✗ Failed to start thread %d\n", i);
+            return 1;
+        }
+    }
+    for (int i = 0; i < THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    printf("    ✓ %d x %d round trips, each thread got its own data back\n\n",
+           THREADS, THREAD_ROUNDS);
+
     /* Free GPU memory */
-    printf("11. Freeing GPU memory...\n");
+    printf("23. Freeing GPU memory...\n");
     CHECK_CUDA(cuMemFree(d_ptr));
     printf("    ✓ Freed device memory\n\n");
 
     /* Destroy context */
     CHECK_CUDA(cuCtxDestroy(context));
-    printf("12. Destroyed context\n\n");
+    printf("24. Destroyed context\n\n");
 
     /* Cleanup */
     free(h_data);
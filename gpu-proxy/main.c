@@ -7,78 +7,112 @@
 
 #include "../idm-protocol/idm.h"
 #include "handle_table.h"
+#include "mem_pool.h"
+#include "dispatch.h"
+#include "devices.h"
+#include "evict.h"
+#include "stats.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <signal.h>
 #include <unistd.h>
 #include <errno.h>
+#include <time.h>
 
 #ifndef STUB_CUDA
 #include <cuda.h>
 #else
-/* Stub CUDA types */
-typedef int CUdevice;
-typedef void *CUcontext;
-typedef int CUresult;
-#define CUDA_SUCCESS 0
-
-static inline CUresult cuInit(unsigned int flags) {
-    (void)flags;
-    printf("[STUB] cuInit called\n");
-    return CUDA_SUCCESS;
-}
-
-static inline CUresult cuDeviceGetCount(int *count) {
-    *count = 1;
-    printf("[STUB] cuDeviceGetCount: 1 device\n");
-    return CUDA_SUCCESS;
-}
-
-static inline CUresult cuDeviceGet(CUdevice *device, int ordinal) {
-    *device = ordinal;
-    printf("[STUB] cuDeviceGet: device %d\n", ordinal);
-    return CUDA_SUCCESS;
-}
-
-static inline CUresult cuDeviceGetName(char *name, int len, CUdevice dev) {
-    snprintf(name, len, "STUB GPU Device %d", dev);
-    printf("[STUB] cuDeviceGetName: %s\n", name);
-    return CUDA_SUCCESS;
-}
-
-static inline CUresult cuCtxCreate(CUcontext *pctx, unsigned int flags, CUdevice dev) {
-    (void)flags;
-    (void)dev;
-    *pctx = (void *)0x12345678;
-    printf("[STUB] cuCtxCreate: context created\n");
-    return CUDA_SUCCESS;
-}
-
-static inline CUresult cuGetErrorString(CUresult error, const char **pStr) {
-    *pStr = "stub error";
-    return CUDA_SUCCESS;
-}
+#include "cuda_stub.h"
 #endif
 
 /* Forward declarations */
-extern int idm_init(uint32_t local_zone_id, uint32_t remote_zone_id, bool is_server);
-extern int idm_recv(struct idm_message **msg_out, int timeout_ms);
+extern struct idm_connection *idm_conn_open(uint32_t local_zone_id, uint32_t remote_zone_id,
+                                            bool is_server);
+extern int idm_conn_peek(struct idm_connection *conn, const struct idm_message **msg_out,
+                         int timeout_ms);
+extern int idm_conn_unpeek(struct idm_connection *conn, const struct idm_message *msg);
+extern int idm_poll(struct idm_connection **ready, int max_ready, int timeout_ms);
+extern bool idm_conn_peer_alive(struct idm_connection *conn);
+extern struct idm_message *idm_conn_build_message(struct idm_connection *conn,
+                                                  enum idm_msg_type msg_type,
+                                                  const void *payload, size_t payload_len);
 extern void idm_free_message(struct idm_message *msg);
+extern void *idm_conn_bulk_region(struct idm_connection *conn, size_t *size_out);
+extern uint32_t idm_conn_remote_zone(const struct idm_connection *conn);
 extern void idm_cleanup(void);
+extern void idm_trace_enable(void);
+extern int idm_trace_dump(const char *path);
 
 extern void handle_gpu_alloc(const struct idm_message *msg);
 extern void handle_gpu_free(const struct idm_message *msg);
+extern void handle_host_register(const struct idm_message *msg);
+extern void handle_host_unregister(const struct idm_message *msg);
+extern void handle_gpu_mem_export(const struct idm_message *msg);
+extern void handle_gpu_mem_import(const struct idm_message *msg);
 extern void handle_gpu_copy_h2d(const struct idm_message *msg);
 extern void handle_gpu_copy_d2h(const struct idm_message *msg);
+extern void handle_gpu_copy_d2d(const struct idm_message *msg);
+extern void handle_gpu_memset(const struct idm_message *msg);
 extern void handle_gpu_sync(const struct idm_message *msg);
+extern void handle_gpu_get_info(const struct idm_message *msg);
+extern void handle_gpu_get_props(const struct idm_message *msg);
+extern void handle_gpu_stream_create(const struct idm_message *msg);
+extern void handle_gpu_stream_destroy(const struct idm_message *msg);
+extern void handle_gpu_stream_sync(const struct idm_message *msg);
+extern void handle_gpu_stream_wait_event(const struct idm_message *msg);
+extern void handle_gpu_event_create(const struct idm_message *msg);
+extern void handle_gpu_event_destroy(const struct idm_message *msg);
+extern void handle_gpu_event_record(const struct idm_message *msg);
+extern void handle_gpu_event_sync(const struct idm_message *msg);
+extern void handle_gpu_event_query(const struct idm_message *msg);
+extern void handle_gpu_event_elapsed(const struct idm_message *msg);
+extern void handle_gpu_module_load(const struct idm_message *msg);
+extern void handle_gpu_module_unload(const struct idm_message *msg);
+extern void handle_gpu_module_get_function(const struct idm_message *msg);
+extern void handle_gpu_launch_kernel(const struct idm_message *msg);
+extern void handle_gpu_graph_instantiate(const struct idm_message *msg);
+extern void handle_gpu_graph_launch(const struct idm_message *msg);
+extern void handle_gpu_graph_destroy(const struct idm_message *msg);
+extern void handle_disconnect(const struct idm_message *msg);
+extern void handle_hello(const struct idm_message *msg);
+extern void handle_unknown(const struct idm_message *msg);
+extern void handle_batch(const struct idm_message *msg,
+                         void (*dispatch)(const struct idm_message *msg));
+extern int handlers_thread_init(int device);
+extern void handlers_thread_cleanup(void);
+extern bool handlers_enter_device(const struct idm_message *msg);
 
 /* Zone IDs */
 #define DRIVER_ZONE_ID 1
-#define USER_ZONE_ID 2
+#define USER_ZONE_ID 2      /* Served when no -z is given */
+
+/* Most user zones one proxy serves */
+#define MAX_ZONES 64
+
+/* Messages taken from one connection before moving to the next */
+#define RECV_BUDGET IDM_RING_SIZE
+
+/* How often to check whether guests are still attached */
+#define LIVENESS_INTERVAL_SEC 1
 
 /* Global state */
 static volatile sig_atomic_t running = 1;
+static unsigned int num_workers = 0;   /* 0 = one per CPU */
+static int gpu_ordinals[DEVICES_MAX];  /* GPUs to serve (-g) */
+static int gpu_ordinal_count = 0;      /* 0 = all */
+static int devices_per_zone = 1;       /* Virtual devices per zone (-G) */
+static enum placement_policy placement = PLACE_SPREAD;
+static uint64_t zone_quota = 0;        /* Device bytes per zone (0 = unlimited) */
+static uint64_t evict_limit = 0;       /* Host bytes for evicted memory (-E, 0 = off) */
+static uint64_t warm_bytes = 0;        /* Device bytes kept ready per zone (-M) */
+static bool pin_threads = false;       /* Pin threads and ring memory near GPUs (-a) */
+static uint32_t zones[MAX_ZONES];
+static int zone_count = 0;
+static struct idm_connection *conns[MAX_ZONES];
+static bool peer_seen[MAX_ZONES];      /* Guest attached since last teardown */
+bool proxy_verbose = false;            /* Log every request (-v) */
+static const char *trace_path = NULL;  /* Write traced requests here (-t) */
 
 /**
  * Signal handler
@@ -89,6 +123,19 @@ static void signal_handler(int sig)
     running = 0;
 }
 
+/**
+ * Pin the calling thread next to a zone's home GPU (-a)
+ *
+ * Shared memory is placed on the node of the thread that touches it
+ * first, so a zone's rings and bulk region are set up from there.
+ */
+static void bind_near_zone(uint32_t zone_id)
+{
+    if (pin_threads) {
+        devices_bind_thread(devices_physical(zone_id, 0), -1);
+    }
+}
+
 /**
  * Initialize CUDA
  */
@@ -104,48 +151,46 @@ static int init_cuda(void)
         return -1;
     }
 
-    /* Get device count */
-    int device_count = 0;
-    res = cuDeviceGetCount(&device_count);
-    if (res != CUDA_SUCCESS) {
-        const char *err_str;
-        cuGetErrorString(res, &err_str);
-        fprintf(stderr, "cuDeviceGetCount failed: %s\n", err_str);
-        return -1;
-    }
-
-    if (device_count == 0) {
-        fprintf(stderr, "No CUDA devices found!\n");
+    /* One context per GPU */
+    int gpus = devices_init(gpu_ordinal_count ? gpu_ordinals : NULL, gpu_ordinal_count);
+    if (gpus < 0) {
         return -1;
     }
 
-    printf("Found %d CUDA device(s)\n", device_count);
+    /* Place zones; each runs on its first GPU's workers */
+    dispatch_set_groups((unsigned int)gpus);
+    printf("Placement (%s, %d device(s) per zone):\n",
+           devices_policy_name(placement), devices_per_zone);
+    for (int i = 0; i < zone_count; i++) {
+        int placed = devices_place(zones[i], devices_per_zone, placement, zone_quota);
+        if (placed < 0) {
+            fprintf(stderr, "Failed to place zone %u: %s\n", zones[i], strerror(-placed));
+            return -1;
+        }
+        dispatch_set_zone_group(zones[i], (unsigned int)devices_physical(zones[i], 0));
 
-    /* Get first device */
-    CUdevice device;
-    res = cuDeviceGet(&device, 0);
-    if (res != CUDA_SUCCESS) {
-        const char *err_str;
-        cuGetErrorString(res, &err_str);
-        fprintf(stderr, "cuDeviceGet failed: %s\n", err_str);
-        return -1;
+        printf("  Zone %u:", zones[i]);
+        for (int v = 0; v < placed; v++) {
+            printf(" GPU %d", devices_get(devices_physical(zones[i], (uint32_t)v))->ordinal);
+        }
+        printf("\n");
     }
 
-    /* Get device name */
-    char device_name[256];
-    res = cuDeviceGetName(device_name, sizeof(device_name), device);
-    if (res == CUDA_SUCCESS) {
-        printf("Using device: %s\n", device_name);
+    /* Reserve warm slabs on each zone's home GPU (-M) */
+    for (int i = 0; i < zone_count && warm_bytes > 0; i++) {
+        int home = devices_physical(zones[i], 0);
+        cuCtxSetCurrent(devices_get(home)->context);
+
+        res = mem_pool_warm(zones[i], home, warm_bytes);
+        if (res != CUDA_SUCCESS) {
+            const char *err_str;
+            cuGetErrorString(res, &err_str);
+            fprintf(stderr, "Failed to warm pool of zone %u: %s (continuing)\n",
+                    zones[i], err_str);
+        }
     }
-
-    /* Create context */
-    CUcontext context;
-    res = cuCtxCreate(&context, 0, device);
-    if (res != CUDA_SUCCESS) {
-        const char *err_str;
-        cuGetErrorString(res, &err_str);
-        fprintf(stderr, "cuCtxCreate failed: %s\n", err_str);
-        return -1;
+    if (warm_bytes > 0) {
+        printf("Warm pools: %lu MB per zone\n", warm_bytes >> 20);
     }
 
     printf("CUDA initialized successfully\n\n");
@@ -153,6 +198,52 @@ static int init_cuda(void)
     return 0;
 }
 
+/**
+ * Pin bulk regions so stream copies through them are truly async
+ */
+static void pin_bulk_regions(void)
+{
+    for (int i = 0; i < zone_count; i++) {
+        bind_near_zone(zones[i]);
+
+        size_t bulk_size = 0;
+        void *bulk = idm_conn_bulk_region(conns[i], &bulk_size);
+        if (!bulk) {
+            continue;
+        }
+        CUresult res = cuMemHostRegister(bulk, bulk_size, CU_MEMHOSTREGISTER_PORTABLE);
+        if (res != CUDA_SUCCESS) {
+            const char *err_str;
+            cuGetErrorString(res, &err_str);
+            fprintf(stderr, "cuMemHostRegister(bulk, zone %u) failed: %s (continuing unpinned)\n",
+                    zones[i], err_str);
+        }
+    }
+}
+
+/**
+ * Worker setup: make its group's GPU context current on this thread
+ *
+ * With -a, each worker of a group gets its own CPU next to that GPU.
+ */
+static int worker_thread_init(unsigned int group, unsigned int index)
+{
+    if (pin_threads) {
+        int cpu = devices_bind_thread((int)group, (int)index);
+        if (cpu < 0) {
+            fprintf(stderr, "Failed to pin worker %u of GPU %u: %s\n",
+                    index, group, strerror(-cpu));
+        } else {
+            if (proxy_verbose) {
+                printf("Worker %u of GPU %u on CPU %d\n", index, group, cpu);
+            }
+        }
+    }
+
+    stats_thread_init();
+    return handlers_thread_init((int)group);
+}
+
 /**
  * Print statistics
  */
@@ -166,9 +257,314 @@ static void print_stats(void)
     printf("Total GPU memory: %lu bytes (%.2f MB)\n",
            total_memory,
            total_memory / (1024.0 * 1024.0));
+
+    uint64_t pool_reserved, pool_cached;
+    mem_pool_stats(&pool_reserved, &pool_cached);
+    printf("Pool reserved: %lu bytes (%.2f MB, %.2f MB cached)\n",
+           pool_reserved,
+           pool_reserved / (1024.0 * 1024.0),
+           pool_cached / (1024.0 * 1024.0));
+
+    if (devices_count() > 1) {
+        for (int i = 0; i < devices_count(); i++) {
+            const struct gpu_device *gpu = devices_get(i);
+            mem_pool_device_stats(i, &pool_reserved, &pool_cached);
+            printf("  GPU %d: %u zone(s), %.2f MB reserved (%.2f MB cached)\n",
+                   gpu->ordinal, gpu->zone_count,
+                   pool_reserved / (1024.0 * 1024.0),
+                   pool_cached / (1024.0 * 1024.0));
+        }
+    }
+
+    unsigned int workers;
+    uint64_t queued, completed;
+    dispatch_stats(&workers, &queued, &completed);
+    if (evict_enabled()) {
+        uint64_t evictions, restores, evicted, host;
+        evict_stats(&evictions, &restores, &evicted, &host);
+        printf("Evicted: %.2f MB in host memory (%.2f MB used; %lu evictions, %lu restores)\n",
+               evicted / (1024.0 * 1024.0), host / (1024.0 * 1024.0), evictions, restores);
+    }
+
+    printf("Workers: %u (queued: %lu, completed: %lu)\n", workers, queued, completed);
+
+    uint64_t class_completed[DISPATCH_CLASSES], held;
+    dispatch_class_stats(class_completed, &held);
+    printf("Scheduled: %lu latency, %lu batch (%lu admission waits)\n",
+           class_completed[DISPATCH_LATENCY], class_completed[DISPATCH_BATCH], held);
     printf("==================\n\n");
 }
 
+/**
+ * Print statistics and request latencies
+ */
+static void print_full_stats(void)
+{
+    print_stats();
+    stats_print(stdout, stats_page());
+    printf("\n");
+}
+
+/**
+ * Dispatch one request to its handler
+ */
+static void dispatch_message(const struct idm_message *msg)
+{
+    struct stats_op op;
+    stats_op_begin(&op, msg);
+
+    if (!handlers_enter_device(msg)) {
+        stats_op_end(&op);
+        return;
+    }
+
+    switch (msg->header.msg_type) {
+        case IDM_GPU_ALLOC:
+            handle_gpu_alloc(msg);
+            break;
+
+        case IDM_GPU_FREE:
+            handle_gpu_free(msg);
+            break;
+
+        case IDM_HOST_REGISTER:
+            handle_host_register(msg);
+            break;
+
+        case IDM_HOST_UNREGISTER:
+            handle_host_unregister(msg);
+            break;
+
+        case IDM_GPU_MEM_EXPORT:
+            handle_gpu_mem_export(msg);
+            break;
+
+        case IDM_GPU_MEM_IMPORT:
+            handle_gpu_mem_import(msg);
+            break;
+
+        case IDM_GPU_COPY_H2D:
+            handle_gpu_copy_h2d(msg);
+            break;
+
+        case IDM_GPU_COPY_D2H:
+            handle_gpu_copy_d2h(msg);
+            break;
+
+        case IDM_GPU_COPY_D2D:
+            handle_gpu_copy_d2d(msg);
+            break;
+
+        case IDM_GPU_MEMSET:
+            handle_gpu_memset(msg);
+            break;
+
+        case IDM_GPU_SYNC:
+            handle_gpu_sync(msg);
+            break;
+
+        case IDM_GPU_GET_INFO:
+            handle_gpu_get_info(msg);
+            break;
+
+        case IDM_GPU_GET_PROPS:
+            handle_gpu_get_props(msg);
+            break;
+
+        case IDM_GPU_STREAM_CREATE:
+            handle_gpu_stream_create(msg);
+            break;
+
+        case IDM_GPU_STREAM_DESTROY:
+            handle_gpu_stream_destroy(msg);
+            break;
+
+        case IDM_GPU_STREAM_SYNC:
+            handle_gpu_stream_sync(msg);
+            break;
+
+        case IDM_GPU_STREAM_WAIT_EVENT:
+            handle_gpu_stream_wait_event(msg);
+            break;
+
+        case IDM_GPU_EVENT_CREATE:
+            handle_gpu_event_create(msg);
+            break;
+
+        case IDM_GPU_EVENT_DESTROY:
+            handle_gpu_event_destroy(msg);
+            break;
+
+        case IDM_GPU_EVENT_RECORD:
+            handle_gpu_event_record(msg);
+            break;
+
+        case IDM_GPU_EVENT_SYNC:
+            handle_gpu_event_sync(msg);
+            break;
+
+        case IDM_GPU_EVENT_QUERY:
+            handle_gpu_event_query(msg);
+            break;
+
+        case IDM_GPU_EVENT_ELAPSED:
+            handle_gpu_event_elapsed(msg);
+            break;
+
+        case IDM_GPU_MODULE_LOAD:
+            handle_gpu_module_load(msg);
+            break;
+
+        case IDM_GPU_MODULE_UNLOAD:
+            handle_gpu_module_unload(msg);
+            break;
+
+        case IDM_GPU_MODULE_GET_FUNCTION:
+            handle_gpu_module_get_function(msg);
+            break;
+
+        case IDM_GPU_LAUNCH_KERNEL:
+            handle_gpu_launch_kernel(msg);
+            break;
+
+        case IDM_GPU_GRAPH_INSTANTIATE:
+            handle_gpu_graph_instantiate(msg);
+            break;
+
+        case IDM_GPU_GRAPH_LAUNCH:
+            handle_gpu_graph_launch(msg);
+            break;
+
+        case IDM_GPU_GRAPH_DESTROY:
+            handle_gpu_graph_destroy(msg);
+            break;
+
+        case IDM_BATCH:
+            handle_batch(msg, dispatch_message);
+            break;
+
+        case IDM_DISCONNECT:
+            handle_disconnect(msg);
+            break;
+
+        case IDM_HELLO:
+            handle_hello(msg);
+            break;
+
+        default:
+            handle_unknown(msg);
+            break;
+    }
+
+    stats_op_end(&op);
+}
+
+/**
+ * Run one request from a zone's queue
+ *
+ * (Batch sub-commands go through dispatch_message directly, under the
+ * lock their batch already holds.)
+ */
+static void run_message(const struct idm_message *msg)
+{
+    evict_zone_enter(msg->header.src_zone);
+    dispatch_message(msg);
+    evict_zone_exit(msg->header.src_zone);
+}
+
+/**
+ * Queue everything waiting on a connection for its worker
+ *
+ * @param budget Most messages to take (< 0 = until the ring is empty)
+ * @return Messages queued
+ */
+static int drain_connection(struct idm_connection *conn, int budget)
+{
+    int queued = 0;
+
+    for (; budget != 0; budget--) {
+        const struct idm_message *msg = NULL;
+        int ret = idm_conn_peek(conn, &msg, 0);
+        if (ret == -EAGAIN || ret == -ENOBUFS) {
+            /* Empty, or every borrow slot is held until the worker catches up */
+            break;
+        }
+        if (ret == -EINVAL || ret == -EPERM) {
+            /* Bad record, already consumed; what follows it is still good */
+            continue;
+        }
+        if (ret < 0) {
+            fprintf(stderr, "idm_conn_peek(zone %u) failed: %d\n",
+                    idm_conn_remote_zone(conn), ret);
+            break;
+        }
+
+        /* Hand off to the zone's worker (msg stays in the ring until it's done) */
+        if (dispatch_submit(conn, msg) < 0) {
+            /* Releasing it here would jump ahead of the worker; retry next round */
+            fprintf(stderr, "Failed to queue %s from zone %u\n",
+                    idm_msg_type_str(msg->header.msg_type), msg->header.src_zone);
+            idm_conn_unpeek(conn, msg);
+            break;
+        }
+
+        queued++;
+    }
+
+    return queued;
+}
+
+/**
+ * Remember that a connection's guest has been active
+ */
+static void mark_seen(struct idm_connection *conn)
+{
+    for (int i = 0; i < zone_count; i++) {
+        if (conns[i] == conn) {
+            peer_seen[i] = true;
+            return;
+        }
+    }
+}
+
+/**
+ * Tear down zones whose guest went away
+ *
+ * Whatever the guest left in its ring is queued first, then a DISCONNECT
+ * behind it, so the teardown runs on the zone's worker after all of it.
+ */
+static void check_zones(void)
+{
+    for (int i = 0; i < zone_count; i++) {
+        if (idm_conn_peer_alive(conns[i])) {
+            peer_seen[i] = true;
+            continue;
+        }
+
+        if (!peer_seen[i]) {
+            continue;
+        }
+        peer_seen[i] = false;
+
+        printf("Zone %u disconnected\n", zones[i]);
+        drain_connection(conns[i], -1);
+
+        struct idm_message *msg = idm_conn_build_message(conns[i], IDM_DISCONNECT, NULL, 0);
+        if (!msg) {
+            continue;
+        }
+
+        /* Generated locally on the guest's behalf */
+        msg->header.src_zone = zones[i];
+        msg->header.dst_zone = DRIVER_ZONE_ID;
+
+        if (dispatch_submit(NULL, msg) < 0) {
+            fprintf(stderr, "Failed to queue teardown of zone %u\n", zones[i]);
+            idm_free_message(msg);
+        }
+    }
+}
+
 /**
  * Main loop
  */
@@ -176,25 +572,78 @@ static int run_server(void)
 {
     printf("=== GPU Proxy Daemon ===\n");
     printf("Driver Zone ID: %d\n", DRIVER_ZONE_ID);
-    printf("User Zone ID: %d\n\n", USER_ZONE_ID);
-
-    /* Initialize IDM */
-    printf("Initializing IDM...\n");
-    if (idm_init(DRIVER_ZONE_ID, USER_ZONE_ID, true) < 0) {
-        fprintf(stderr, "Failed to initialize IDM\n");
-        return 1;
+    printf("User Zone IDs:");
+    for (int i = 0; i < zone_count; i++) {
+        printf(" %u", zones[i]);
     }
-    printf("IDM initialized\n\n");
+    printf("\n\n");
 
     /* Initialize handle table */
     if (handle_table_init() < 0) {
         fprintf(stderr, "Failed to initialize handle table\n");
-        idm_cleanup();
         return 1;
     }
 
-    /* Initialize CUDA */
+    mem_pool_init(zone_quota);
+
+    if (evict_init(evict_limit) < 0) {
+        fprintf(stderr, "Failed to enable eviction\n");
+        handle_table_cleanup();
+        return 1;
+    }
+
+    /* Contexts and warm pools first: they are what takes seconds, and a
+     * guest may start using its rings as soon as they exist */
     if (init_cuda() < 0) {
+        handle_table_cleanup();
+        return 1;
+    }
+
+    /* Initialize IDM (one connection per user zone) */
+    printf("Initializing IDM...\n");
+    if (trace_path) {
+        idm_trace_enable();
+    }
+    for (int i = 0; i < zone_count; i++) {
+        bind_near_zone(zones[i]);
+        conns[i] = idm_conn_open(DRIVER_ZONE_ID, zones[i], true);
+        if (!conns[i]) {
+            fprintf(stderr, "Failed to initialize IDM for zone %u\n", zones[i]);
+            handle_table_cleanup();
+            idm_cleanup();
+            return 1;
+        }
+    }
+    pin_bulk_regions();
+    printf("IDM initialized\n\n");
+
+    /* The receive thread stays next to the first GPU */
+    if (pin_threads && devices_bind_thread(0, -1) < 0) {
+        fprintf(stderr, "Failed to pin the receive thread\n");
+    }
+
+    /* One stats shard per worker */
+    unsigned int shards = num_workers;
+    if (shards == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        shards = cpus > 0 ? (unsigned int)cpus : 1;
+    }
+    if (shards < (unsigned int)devices_count()) {
+        shards = (unsigned int)devices_count();   /* Workers are at least one per GPU */
+    }
+    if (shards > DISPATCH_MAX_WORKERS) {
+        shards = DISPATCH_MAX_WORKERS;
+    }
+    int ret = stats_init(zones, zone_count, shards);
+    if (ret < 0) {
+        fprintf(stderr, "Request statistics disabled: %s\n", strerror(-ret));
+    }
+
+    /* Start workers */
+    if (dispatch_init(num_workers, run_message,
+                      worker_thread_init, handlers_thread_cleanup) < 0) {
+        fprintf(stderr, "Failed to start dispatch workers\n");
+        stats_cleanup();
         handle_table_cleanup();
         idm_cleanup();
         return 1;
@@ -204,62 +653,64 @@ static int run_server(void)
 
     /* Main loop */
     int requests_handled = 0;
+    time_t last_check = 0;
     while (running) {
-        struct idm_message *msg = NULL;
+        struct idm_connection *ready[MAX_ZONES];
 
-        /* Receive message (blocking with 1 second timeout) */
-        int ret = idm_recv(&msg, 1000);
-        if (ret < 0) {
-            if (ret == -EAGAIN) {
-                /* Timeout - check if we should exit */
-                continue;
+        time_t now = time(NULL);
+        if (now - last_check >= LIVENESS_INTERVAL_SEC) {
+            check_zones();
+            last_check = now;
+        }
+
+        /* Wait for any zone (1 second timeout to check if we should exit) */
+        int n = idm_poll(ready, MAX_ZONES, 1000);
+        if (n <= 0) {
+            if (n < 0) {
+                fprintf(stderr, "idm_poll failed: %d\n", n);
             }
-            fprintf(stderr, "idm_recv failed: %d\n", ret);
             continue;
         }
 
-        /* Dispatch based on message type */
-        switch (msg->header.msg_type) {
-            case IDM_GPU_ALLOC:
-                handle_gpu_alloc(msg);
-                break;
-
-            case IDM_GPU_FREE:
-                handle_gpu_free(msg);
-                break;
-
-            case IDM_GPU_COPY_H2D:
-                handle_gpu_copy_h2d(msg);
-                break;
-
-            case IDM_GPU_COPY_D2H:
-                handle_gpu_copy_d2h(msg);
-                break;
+        for (int i = 0; i < n; i++) {
+            /* Bounded drain so one busy zone can't starve the others */
+            int before = requests_handled;
+            int queued = drain_connection(ready[i], RECV_BUDGET);
+            requests_handled += queued;
 
-            case IDM_GPU_SYNC:
-                handle_gpu_sync(msg);
-                break;
+            /* Short-lived guests may come and go between liveness checks */
+            if (queued > 0) {
+                mark_seen(ready[i]);
+            }
 
-            default:
-                fprintf(stderr, "Unknown message type: 0x%x\n", msg->header.msg_type);
-                break;
+            /* Print stats every 100 requests (-v; otherwise see -s) */
+            if (proxy_verbose && requests_handled / 100 != before / 100) {
+                print_stats();
+            }
         }
+    }
 
-        idm_free_message(msg);
+    printf("\nShutting down...\n");
 
-        requests_handled++;
+    /* Finish everything already received */
+    dispatch_shutdown();
+    print_full_stats();
 
-        /* Print stats every 100 requests */
-        if (requests_handled % 100 == 0) {
-            print_stats();
+    if (trace_path) {
+        ret = idm_trace_dump(trace_path);
+        if (ret < 0) {
+            fprintf(stderr, "Failed to write trace %s: %s\n", trace_path, strerror(-ret));
+        } else {
+            printf("Trace written to %s\n", trace_path);
         }
     }
 
-    printf("\nShutting down...\n");
-    print_stats();
-
     /* Cleanup */
     handle_table_cleanup();
+    evict_cleanup();
+    mem_pool_cleanup();
+    devices_cleanup();
+    stats_cleanup();
     idm_cleanup();
 
     printf("GPU Proxy Daemon exited\n");
@@ -267,13 +718,241 @@ static int run_server(void)
     return 0;
 }
 
+/**
+ * Parse zone list ("2,3,10-19")
+ *
+ * @param out Zones are appended here (MAX_ZONES entries)
+ * @param count [in/out] Entries used in out
+ */
+static int parse_zone_list(const char *arg, uint32_t *out, int *count)
+{
+    const char *p = arg;
+
+    while (*p) {
+        char *end;
+        unsigned long first = strtoul(p, &end, 10);
+        unsigned long last = first;
+        if (end == p) {
+            fprintf(stderr, "Invalid zone list: %s\n", arg);
+            return -1;
+        }
+        if (*end == '-') {
+            p = end + 1;
+            last = strtoul(p, &end, 10);
+            if (end == p || last < first) {
+                fprintf(stderr, "Invalid zone range in: %s\n", arg);
+                return -1;
+            }
+        }
+
+        for (unsigned long z = first; z <= last; z++) {
+            if (z == DRIVER_ZONE_ID) {
+                fprintf(stderr, "Zone %lu is the driver zone\n", z);
+                return -1;
+            }
+            if (*count == MAX_ZONES) {
+                fprintf(stderr, "Too many zones (max %d)\n", MAX_ZONES);
+                return -1;
+            }
+            out[(*count)++] = (uint32_t)z;
+        }
+
+        p = (*end == ',') ? end + 1 : end;
+        if (*end && *end != ',') {
+            fprintf(stderr, "Invalid zone list: %s\n", arg);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Mark zones latency-sensitive ("2,3")
+ */
+static int parse_latency_zones(const char *arg)
+{
+    uint32_t list[MAX_ZONES];
+    int count = 0;
+    if (parse_zone_list(arg, list, &count) < 0) {
+        return -1;
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (dispatch_set_zone_class(list[i], DISPATCH_LATENCY) < 0) {
+            fprintf(stderr, "Cannot set class of zone %u\n", list[i]);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Set zone weights ("2,3:4" = weight 4 for zones 2 and 3)
+ */
+static int parse_weights(const char *arg)
+{
+    char buf[256];
+    snprintf(buf, sizeof(buf), "%s", arg);
+
+    char *colon = strrchr(buf, ':');
+    if (!colon) {
+        fprintf(stderr, "Invalid weight (want ZONES:WEIGHT): %s\n", arg);
+        return -1;
+    }
+    *colon = '\0';
+
+    char *end;
+    unsigned long weight = strtoul(colon + 1, &end, 10);
+    if (end == colon + 1 || *end) {
+        fprintf(stderr, "Invalid weight in: %s\n", arg);
+        return -1;
+    }
+
+    uint32_t list[MAX_ZONES];
+    int count = 0;
+    if (parse_zone_list(buf, list, &count) < 0) {
+        return -1;
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (dispatch_set_zone_weight(list[i], (unsigned int)weight) < 0) {
+            fprintf(stderr, "Invalid weight %lu for zone %u (1-1024)\n", weight, list[i]);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Parse GPU list ("0,2,3") into gpu_ordinals[]
+ */
+static int parse_gpus(const char *arg)
+{
+    const char *p = arg;
+
+    gpu_ordinal_count = 0;
+    while (*p) {
+        char *end;
+        long ordinal = strtol(p, &end, 10);
+        if (end == p || ordinal < 0 || (*end && *end != ',')) {
+            fprintf(stderr, "Invalid GPU list: %s\n", arg);
+            return -1;
+        }
+        if (gpu_ordinal_count == DEVICES_MAX) {
+            fprintf(stderr, "Too many GPUs (max %d)\n", DEVICES_MAX);
+            return -1;
+        }
+        gpu_ordinals[gpu_ordinal_count++] = (int)ordinal;
+        p = *end ? end + 1 : end;
+    }
+
+    return 0;
+}
+
 /**
  * Main
  */
 int main(int argc, char **argv)
 {
-    (void)argc;
-    (void)argv;
+    int opt;
+    while ((opt = getopt(argc, argv, "w:z:q:E:M:g:G:p:P:W:A:at:svh")) != -1) {
+        switch (opt) {
+            case 'w':
+                num_workers = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 'q':
+                zone_quota = (uint64_t)strtoull(optarg, NULL, 10) << 20;
+                break;
+            case 'E':
+                evict_limit = (uint64_t)strtoull(optarg, NULL, 10) << 20;
+                break;
+            case 'M':
+                warm_bytes = (uint64_t)strtoull(optarg, NULL, 10) << 20;
+                break;
+            case 'z':
+                if (parse_zone_list(optarg, zones, &zone_count) < 0) {
+                    return 1;
+                }
+                break;
+            case 'g':
+                if (parse_gpus(optarg) < 0) {
+                    return 1;
+                }
+                break;
+            case 'G':
+                devices_per_zone = atoi(optarg);
+                if (devices_per_zone < 1 || devices_per_zone > DEVICES_MAX) {
+                    fprintf(stderr, "Devices per zone must be 1-%d\n", DEVICES_MAX);
+                    return 1;
+                }
+                break;
+            case 'p':
+                if (devices_parse_policy(optarg, &placement) < 0) {
+                    fprintf(stderr, "Unknown placement policy: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'P':
+                if (parse_latency_zones(optarg) < 0) {
+                    return 1;
+                }
+                break;
+            case 'W':
+                if (parse_weights(optarg) < 0) {
+                    return 1;
+                }
+                break;
+            case 'A':
+                dispatch_set_admission((uint64_t)strtoull(optarg, NULL, 10) << 20);
+                break;
+            case 's': {
+                int ret = stats_print_live(stdout);
+                if (ret < 0) {
+                    fprintf(stderr, "No running proxy statistics: %s\n", strerror(-ret));
+                    return 1;
+                }
+                return 0;
+            }
+            case 'v':
+                proxy_verbose = true;
+                break;
+            case 'a':
+                pin_threads = true;
+                break;
+            case 't':
+                trace_path = optarg;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-w workers] [-z zones] [-q MB] [-E MB] [-M MB] [-g GPUs] [-G N] [-p policy] "
+                        "[-P zones] [-W zones:N] [-A MB] [-a] [-t FILE] [-v] | -s\n", argv[0]);
+                fprintf(stderr, "  -w N      Worker threads (default: one per CPU)\n");
+                fprintf(stderr, "  -q MB     Device memory quota per zone (default: unlimited)\n");
+                fprintf(stderr, "  -E MB     Evict idle device memory to up to MB of host memory when\n"
+                                "            a GPU is full (default: off)\n");
+                fprintf(stderr, "  -M MB     Device memory kept reserved for each zone across guest\n"
+                                "            restarts, so allocations skip the driver (default: 0)\n");
+                fprintf(stderr, "  -z LIST   User zones to serve, e.g. 2,3,10-19 (default: %d)\n",
+                        USER_ZONE_ID);
+                fprintf(stderr, "  -g LIST   GPUs to serve, e.g. 0,2 (default: all)\n");
+                fprintf(stderr, "  -G N      Devices each zone sees (default: 1)\n");
+                fprintf(stderr, "  -p NAME   Placement: pack, spread or memory (default: spread)\n");
+                fprintf(stderr, "  -P LIST   Latency-sensitive zones, served before the rest\n");
+                fprintf(stderr, "  -W LIST:N Share of these zones within their class (default: 1)\n");
+                fprintf(stderr, "  -A MB     Data in flight before batch zones wait (default: %llu, 0 = no limit)\n",
+                        (unsigned long long)(DISPATCH_ADMIT_DEFAULT >> 20));
+                fprintf(stderr, "  -a        Pin workers, the receive thread and zone rings to the\n"
+                                "            CPUs and NUMA node of their GPU\n");
+                fprintf(stderr, "  -t FILE   Write requests guests trace to FILE (Chrome trace JSON)\n");
+                fprintf(stderr, "  -v        Log every request\n");
+                fprintf(stderr, "  -s        Print the running proxy's request latencies and exit\n");
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (zone_count == 0) {
+        zones[zone_count++] = USER_ZONE_ID;
+    }
 
     /* Setup signal handlers */
     signal(SIGINT, signal_handler);
@@ -0,0 +1,725 @@
+/*
+ * Device Memory Pool Implementation
+ *
+ * Each zone owns a set of segments, each one cuMemAlloc'd block of device
+ * memory cut into equal blocks:
+ *
+ *   slab     MEM_POOL_SLAB_SIZE bytes, blocks of one size class
+ *   large    one block spanning the whole segment
+ *
+ * A segment's free blocks are a stack of indices kept on the host (device
+ * memory can't hold list links). A segment is on at most one list:
+ *
+ *   partial[device][class]  some blocks free, some handed out
+ *   cached[device]          all blocks free, may be re-cut for any size
+ *                           class or reused whole for a large request
+ *                           of its size
+ *   (none)                  all blocks handed out
+ *
+ * The zone's segments are also kept sorted by base address, so a free
+ * finds its segment with a binary search. Zones map to a single worker,
+ * so a zone's lock is practically uncontended.
+ */
+
+#include "mem_pool.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+/* Zones that may own memory */
+#define MEM_POOL_MAX_ZONE 0xFFFFu
+
+/* Size classes: MEM_POOL_MIN_BLOCK << class, up to MEM_POOL_MAX_BLOCK */
+#define NUM_CLASSES     12
+#define LARGE_CLASS     (-1)
+
+/* One cuMemAlloc'd region */
+struct segment {
+    CUdeviceptr base;
+    size_t size;
+    size_t block_size;
+    int size_class;            /* Class of its blocks, or LARGE_CLASS */
+    int device;                /* Device it was allocated on */
+    uint32_t block_count;
+    uint32_t free_count;
+    uint32_t free_cap;         /* Capacity of free_blocks */
+    uint16_t *free_blocks;     /* Stack of free block indices */
+    struct segment **list;     /* List head it's on (NULL = none) */
+    struct segment *prev;
+    struct segment *next;
+};
+
+/* A zone's memory */
+struct zone_pool {
+    pthread_mutex_t lock;
+    struct segment **segments; /* Sorted by base */
+    size_t segment_count;
+    size_t segment_cap;
+    struct segment *partial[MEM_POOL_MAX_DEVICES][NUM_CLASSES];
+    struct segment *cached[MEM_POOL_MAX_DEVICES];
+    uint64_t reserved;         /* Sum of segment sizes */
+    uint64_t allocated;        /* Block bytes handed out */
+    uint64_t warm;             /* Slab bytes kept on release (mem_pool_warm) */
+};
+
+static struct zone_pool *pools[MEM_POOL_MAX_ZONE + 1];
+static pthread_mutex_t pools_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t zone_quota = 0;
+
+/* Totals over all zones */
+static uint64_t total_reserved = 0;
+static uint64_t total_allocated = 0;
+static uint64_t device_reserved[MEM_POOL_MAX_DEVICES];
+static uint64_t device_allocated[MEM_POOL_MAX_DEVICES];
+
+#define ADD(p, v) __atomic_add_fetch((p), (v), __ATOMIC_RELAXED)
+#define SUB(p, v) __atomic_sub_fetch((p), (v), __ATOMIC_RELAXED)
+#define LOAD(p)   __atomic_load_n((p), __ATOMIC_RELAXED)
+
+/**
+ * Get a zone's pool
+ *
+ * @param create Set it up if the zone has none yet
+ * @return Pool, or NULL
+ */
+static struct zone_pool *zone_pool_get(uint32_t zone_id, bool create)
+{
+    if (zone_id > MEM_POOL_MAX_ZONE) {
+        return NULL;
+    }
+
+    struct zone_pool *zp = __atomic_load_n(&pools[zone_id], __ATOMIC_ACQUIRE);
+    if (zp || !create) {
+        return zp;
+    }
+
+    pthread_mutex_lock(&pools_lock);
+    zp = pools[zone_id];
+    if (!zp) {
+        zp = calloc(1, sizeof(*zp));
+        if (zp) {
+            pthread_mutex_init(&zp->lock, NULL);
+            __atomic_store_n(&pools[zone_id], zp, __ATOMIC_RELEASE);
+        }
+    }
+    pthread_mutex_unlock(&pools_lock);
+
+    return zp;
+}
+
+/* ============================================================================
+ * Segment Lists
+ * ============================================================================ */
+
+static void list_unlink(struct segment *seg)
+{
+    if (!seg->list) {
+        return;
+    }
+    if (seg->prev) {
+        seg->prev->next = seg->next;
+    } else {
+        *seg->list = seg->next;
+    }
+    if (seg->next) {
+        seg->next->prev = seg->prev;
+    }
+    seg->list = NULL;
+    seg->prev = NULL;
+    seg->next = NULL;
+}
+
+static void list_push(struct segment **head, struct segment *seg)
+{
+    seg->list = head;
+    seg->prev = NULL;
+    seg->next = *head;
+    if (*head) {
+        (*head)->prev = seg;
+    }
+    *head = seg;
+}
+
+/**
+ * Move a segment to the list matching its free block count
+ */
+static void list_update_locked(struct zone_pool *zp, struct segment *seg)
+{
+    struct segment **want = NULL;
+
+    if (seg->free_count == seg->block_count) {
+        want = &zp->cached[seg->device];
+    } else if (seg->free_count > 0) {
+        want = &zp->partial[seg->device][seg->size_class];
+    }
+
+    if (seg->list != want) {
+        list_unlink(seg);
+        if (want) {
+            list_push(want, seg);
+        }
+    }
+}
+
+/* ============================================================================
+ * Segments
+ * ============================================================================ */
+
+/**
+ * Cut a free segment into blocks of one size
+ *
+ * @return 0 on success, -ENOMEM if the index stack can't grow
+ */
+static int segment_carve(struct segment *seg, size_t block_size, int size_class)
+{
+    uint32_t count = (uint32_t)(seg->size / block_size);
+
+    if (count > seg->free_cap) {
+        uint16_t *blocks = realloc(seg->free_blocks, count * sizeof(*blocks));
+        if (!blocks) {
+            return -ENOMEM;
+        }
+        seg->free_blocks = blocks;
+        seg->free_cap = count;
+    }
+
+    seg->block_size = block_size;
+    seg->size_class = size_class;
+    seg->block_count = count;
+    seg->free_count = count;
+
+    /* Lowest address on top */
+    for (uint32_t i = 0; i < count; i++) {
+        seg->free_blocks[i] = (uint16_t)(count - 1 - i);
+    }
+
+    return 0;
+}
+
+/**
+ * Find the segment containing ptr
+ *
+ * @return Index in zp->segments, or -1
+ */
+static ssize_t segment_find_locked(struct zone_pool *zp, CUdeviceptr ptr)
+{
+    size_t lo = 0;
+    size_t hi = zp->segment_count;
+
+    /* First segment whose base is above ptr */
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (zp->segments[mid]->base <= ptr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    if (lo == 0) {
+        return -1;
+    }
+
+    struct segment *seg = zp->segments[lo - 1];
+    if (ptr - seg->base >= seg->size) {
+        return -1;
+    }
+    return (ssize_t)(lo - 1);
+}
+
+/**
+ * Give a segment back to the driver
+ */
+static void segment_destroy_locked(struct zone_pool *zp, size_t index)
+{
+    struct segment *seg = zp->segments[index];
+
+    list_unlink(seg);
+    memmove(&zp->segments[index], &zp->segments[index + 1],
+            (zp->segment_count - index - 1) * sizeof(*zp->segments));
+    zp->segment_count--;
+
+    zp->reserved -= seg->size;
+    SUB(&total_reserved, seg->size);
+    SUB(&device_reserved[seg->device], seg->size);
+
+    uint64_t handed_out = (uint64_t)(seg->block_count - seg->free_count) * seg->block_size;
+    zp->allocated -= handed_out;
+    SUB(&total_allocated, handed_out);
+    SUB(&device_allocated[seg->device], handed_out);
+
+    cuMemFree(seg->base);
+    free(seg->free_blocks);
+    free(seg);
+}
+
+/**
+ * Release a zone's cached segments
+ *
+ * @return Bytes released
+ */
+static uint64_t trim_locked(struct zone_pool *zp)
+{
+    uint64_t released = 0;
+
+    for (int device = 0; device < MEM_POOL_MAX_DEVICES; device++) {
+        while (zp->cached[device]) {
+            struct segment *seg = zp->cached[device];
+            ssize_t index = segment_find_locked(zp, seg->base);
+            released += seg->size;
+            if (index < 0) {
+                list_unlink(seg);  /* Can't happen: cached segments are indexed */
+                continue;
+            }
+            segment_destroy_locked(zp, (size_t)index);
+        }
+    }
+
+    return released;
+}
+
+/**
+ * Reserve a new segment from the driver
+ *
+ * @return CUresult (CUDA_ERROR_OUT_OF_MEMORY when over quota)
+ */
+static CUresult segment_create_locked(struct zone_pool *zp, int device, size_t size,
+                                      struct segment **seg_out)
+{
+    if (zone_quota && zp->reserved + size > zone_quota) {
+        /* Cached segments of other sizes count too; drop them first */
+        trim_locked(zp);
+        if (zp->reserved + size > zone_quota) {
+            return CUDA_ERROR_OUT_OF_MEMORY;
+        }
+    }
+
+    if (zp->segment_count == zp->segment_cap) {
+        size_t cap = zp->segment_cap ? zp->segment_cap * 2 : 16;
+        struct segment **segments = realloc(zp->segments, cap * sizeof(*segments));
+        if (!segments) {
+            return CUDA_ERROR_OUT_OF_MEMORY;
+        }
+        zp->segments = segments;
+        zp->segment_cap = cap;
+    }
+
+    struct segment *seg = calloc(1, sizeof(*seg));
+    if (!seg) {
+        return CUDA_ERROR_OUT_OF_MEMORY;
+    }
+
+    CUresult res = cuMemAlloc(&seg->base, size);
+    if (res == CUDA_ERROR_OUT_OF_MEMORY && trim_locked(zp) > 0) {
+        res = cuMemAlloc(&seg->base, size);
+    }
+    if (res != CUDA_SUCCESS) {
+        free(seg);
+        return res;
+    }
+    seg->size = size;
+    seg->device = device;
+
+    /* Insert in address order */
+    size_t index = zp->segment_count;
+    while (index > 0 && zp->segments[index - 1]->base > seg->base) {
+        index--;
+    }
+    memmove(&zp->segments[index + 1], &zp->segments[index],
+            (zp->segment_count - index) * sizeof(*zp->segments));
+    zp->segments[index] = seg;
+    zp->segment_count++;
+
+    zp->reserved += size;
+    ADD(&total_reserved, size);
+    ADD(&device_reserved[device], size);
+
+    *seg_out = seg;
+    return CUDA_SUCCESS;
+}
+
+/**
+ * Take a cached segment of exactly this size
+ */
+static struct segment *take_cached_locked(struct zone_pool *zp, int device, size_t size)
+{
+    for (struct segment *seg = zp->cached[device]; seg; seg = seg->next) {
+        if (seg->size == size) {
+            list_unlink(seg);
+            return seg;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Hand out one block of a class (LARGE_CLASS: one segment of seg_size)
+ */
+static CUresult alloc_locked(struct zone_pool *zp, int device, int size_class,
+                             size_t block_size, size_t seg_size, CUdeviceptr *ptr_out)
+{
+    struct segment *seg = size_class != LARGE_CLASS ? zp->partial[device][size_class] : NULL;
+
+    if (!seg) {
+        seg = take_cached_locked(zp, device, seg_size);
+        if (!seg) {
+            CUresult res = segment_create_locked(zp, device, seg_size, &seg);
+            if (res != CUDA_SUCCESS) {
+                return res;
+            }
+        }
+
+        if (segment_carve(seg, block_size, size_class) < 0) {
+            list_update_locked(zp, seg);
+            return CUDA_ERROR_OUT_OF_MEMORY;
+        }
+    }
+
+    uint16_t index = seg->free_blocks[--seg->free_count];
+    list_update_locked(zp, seg);
+
+    zp->allocated += block_size;
+    ADD(&total_allocated, block_size);
+    ADD(&device_allocated[device], block_size);
+
+    *ptr_out = seg->base + (CUdeviceptr)index * block_size;
+    return CUDA_SUCCESS;
+}
+
+/* ============================================================================
+ * API
+ * ============================================================================ */
+
+/**
+ * Initialize pool
+ */
+int mem_pool_init(uint64_t quota)
+{
+    zone_quota = quota;
+    total_reserved = 0;
+    total_allocated = 0;
+    memset(device_reserved, 0, sizeof(device_reserved));
+    memset(device_allocated, 0, sizeof(device_allocated));
+
+    if (quota) {
+        printf("Memory pool: %lu MB quota per zone\n", quota >> 20);
+    }
+
+    return 0;
+}
+
+/**
+ * Get the per-zone quota
+ */
+uint64_t mem_pool_zone_quota(void)
+{
+    return zone_quota;
+}
+
+/**
+ * Allocate device memory for a zone
+ */
+CUresult mem_pool_alloc(uint32_t zone_id, int device, size_t size, CUdeviceptr *ptr_out)
+{
+    if (size == 0 || device < 0 || device >= MEM_POOL_MAX_DEVICES) {
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+
+    int size_class;
+    size_t block_size;
+    size_t seg_size;
+
+    if (size <= MEM_POOL_MAX_BLOCK) {
+        size_class = 0;
+        block_size = MEM_POOL_MIN_BLOCK;
+        while (block_size < size) {
+            block_size <<= 1;
+            size_class++;
+        }
+        seg_size = MEM_POOL_SLAB_SIZE;
+    } else {
+        if (size > SIZE_MAX - MEM_POOL_SLAB_SIZE) {
+            return CUDA_ERROR_OUT_OF_MEMORY;
+        }
+        size_class = LARGE_CLASS;
+        block_size = (size + MEM_POOL_SLAB_SIZE - 1) & ~(size_t)(MEM_POOL_SLAB_SIZE - 1);
+        seg_size = block_size;
+    }
+
+    struct zone_pool *zp = zone_pool_get(zone_id, true);
+    if (!zp) {
+        return CUDA_ERROR_OUT_OF_MEMORY;
+    }
+
+    pthread_mutex_lock(&zp->lock);
+    CUresult res = alloc_locked(zp, device, size_class, block_size, seg_size, ptr_out);
+    pthread_mutex_unlock(&zp->lock);
+
+    if (res == CUDA_ERROR_OUT_OF_MEMORY && mem_pool_trim() > 0) {
+        /* Other zones were sitting on free memory */
+        pthread_mutex_lock(&zp->lock);
+        res = alloc_locked(zp, device, size_class, block_size, seg_size, ptr_out);
+        pthread_mutex_unlock(&zp->lock);
+    }
+
+    return res;
+}
+
+/**
+ * Return memory to the zone's cache
+ */
+CUresult mem_pool_free(uint32_t zone_id, CUdeviceptr ptr)
+{
+    struct zone_pool *zp = zone_pool_get(zone_id, false);
+    if (!zp) {
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+
+    CUresult res = CUDA_ERROR_INVALID_VALUE;
+
+    pthread_mutex_lock(&zp->lock);
+
+    ssize_t index = segment_find_locked(zp, ptr);
+    if (index >= 0) {
+        struct segment *seg = zp->segments[index];
+        CUdeviceptr offset = ptr - seg->base;
+
+        if (offset % seg->block_size == 0 && seg->free_count < seg->block_count) {
+            seg->free_blocks[seg->free_count++] = (uint16_t)(offset / seg->block_size);
+            list_update_locked(zp, seg);
+
+            zp->allocated -= seg->block_size;
+            SUB(&total_allocated, seg->block_size);
+            SUB(&device_allocated[seg->device], seg->block_size);
+            res = CUDA_SUCCESS;
+        }
+    }
+
+    pthread_mutex_unlock(&zp->lock);
+
+    return res;
+}
+
+/**
+ * Find the device a zone's memory is on
+ */
+int mem_pool_device(uint32_t zone_id, CUdeviceptr ptr)
+{
+    struct zone_pool *zp = zone_pool_get(zone_id, false);
+    if (!zp) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&zp->lock);
+    ssize_t index = segment_find_locked(zp, ptr);
+    int device = index >= 0 ? zp->segments[index]->device : -1;
+    pthread_mutex_unlock(&zp->lock);
+
+    return device;
+}
+
+/**
+ * Keep slabs ready for a zone
+ */
+CUresult mem_pool_warm(uint32_t zone_id, int device, uint64_t bytes)
+{
+    if (device < 0 || device >= MEM_POOL_MAX_DEVICES) {
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+
+    struct zone_pool *zp = zone_pool_get(zone_id, true);
+    if (!zp) {
+        return CUDA_ERROR_OUT_OF_MEMORY;
+    }
+
+    CUresult res = CUDA_SUCCESS;
+
+    pthread_mutex_lock(&zp->lock);
+
+    zp->warm = bytes;
+
+    uint64_t cached = 0;
+    for (struct segment *seg = zp->cached[device]; seg; seg = seg->next) {
+        cached += seg->size;
+    }
+
+    while (cached < bytes) {
+        struct segment *seg;
+        res = segment_create_locked(zp, device, MEM_POOL_SLAB_SIZE, &seg);
+        if (res != CUDA_SUCCESS) {
+            break;
+        }
+        if (segment_carve(seg, seg->size, LARGE_CLASS) < 0) {
+            segment_destroy_locked(zp, (size_t)segment_find_locked(zp, seg->base));
+            res = CUDA_ERROR_OUT_OF_MEMORY;
+            break;
+        }
+        list_update_locked(zp, seg);
+        cached += seg->size;
+    }
+
+    pthread_mutex_unlock(&zp->lock);
+
+    return res;
+}
+
+/**
+ * Give all of a zone's memory back to the driver
+ */
+void mem_pool_release_zone(uint32_t zone_id)
+{
+    struct zone_pool *zp = zone_pool_get(zone_id, false);
+    if (!zp) {
+        return;
+    }
+
+    pthread_mutex_lock(&zp->lock);
+
+    uint64_t kept = 0;
+    for (size_t i = zp->segment_count; i-- > 0;) {
+        struct segment *seg = zp->segments[i];
+
+        if (seg->size != MEM_POOL_SLAB_SIZE || kept + seg->size > zp->warm) {
+            segment_destroy_locked(zp, i);
+            continue;
+        }
+
+        /* Same zone next time, so its data may stay */
+        uint64_t handed_out = (uint64_t)(seg->block_count - seg->free_count) * seg->block_size;
+        zp->allocated -= handed_out;
+        SUB(&total_allocated, handed_out);
+        SUB(&device_allocated[seg->device], handed_out);
+        seg->free_count = seg->block_count;
+        list_update_locked(zp, seg);
+        kept += seg->size;
+    }
+
+    pthread_mutex_unlock(&zp->lock);
+}
+
+/**
+ * Give every zone's cached segments back to the driver
+ */
+uint64_t mem_pool_trim(void)
+{
+    uint64_t released = 0;
+
+    for (uint32_t zone_id = 0; zone_id <= MEM_POOL_MAX_ZONE; zone_id++) {
+        struct zone_pool *zp = zone_pool_get(zone_id, false);
+        if (!zp) {
+            continue;
+        }
+        pthread_mutex_lock(&zp->lock);
+        released += trim_locked(zp);
+        pthread_mutex_unlock(&zp->lock);
+    }
+
+    return released;
+}
+
+/**
+ * List zones that hold device memory
+ */
+uint32_t mem_pool_zones(uint32_t *zones_out, uint32_t max)
+{
+    uint32_t count = 0;
+
+    for (uint32_t zone_id = 0; zone_id <= MEM_POOL_MAX_ZONE && count < max; zone_id++) {
+        struct zone_pool *zp = zone_pool_get(zone_id, false);
+        if (zp && LOAD(&zp->reserved) > 0) {
+            zones_out[count++] = zone_id;
+        }
+    }
+
+    return count;
+}
+
+/**
+ * Get statistics
+ */
+void mem_pool_stats(uint64_t *reserved_out, uint64_t *cached_out)
+{
+    uint64_t reserved = LOAD(&total_reserved);
+    uint64_t allocated = LOAD(&total_allocated);
+
+    if (reserved_out) {
+        *reserved_out = reserved;
+    }
+    if (cached_out) {
+        *cached_out = reserved > allocated ? reserved - allocated : 0;
+    }
+}
+
+/**
+ * Get one device's statistics
+ */
+void mem_pool_device_stats(int device, uint64_t *reserved_out, uint64_t *cached_out)
+{
+    uint64_t reserved = 0;
+    uint64_t allocated = 0;
+
+    if (device >= 0 && device < MEM_POOL_MAX_DEVICES) {
+        reserved = LOAD(&device_reserved[device]);
+        allocated = LOAD(&device_allocated[device]);
+    }
+
+    if (reserved_out) {
+        *reserved_out = reserved;
+    }
+    if (cached_out) {
+        *cached_out = reserved > allocated ? reserved - allocated : 0;
+    }
+}
+
+/**
+ * Get one zone's statistics
+ */
+void mem_pool_zone_stats(uint32_t zone_id, uint64_t *reserved_out, uint64_t *cached_out)
+{
+    uint64_t reserved = 0;
+    uint64_t allocated = 0;
+
+    struct zone_pool *zp = zone_pool_get(zone_id, false);
+    if (zp) {
+        pthread_mutex_lock(&zp->lock);
+        reserved = zp->reserved;
+        allocated = zp->allocated;
+        pthread_mutex_unlock(&zp->lock);
+    }
+
+    if (reserved_out) {
+        *reserved_out = reserved;
+    }
+    if (cached_out) {
+        *cached_out = reserved - allocated;
+    }
+}
+
+/**
+ * Free everything
+ */
+void mem_pool_cleanup(void)
+{
+    for (uint32_t zone_id = 0; zone_id <= MEM_POOL_MAX_ZONE; zone_id++) {
+        struct zone_pool *zp = pools[zone_id];
+        if (!zp) {
+            continue;
+        }
+
+        zp->warm = 0;
+        mem_pool_release_zone(zone_id);
+        free(zp->segments);
+        pthread_mutex_destroy(&zp->lock);
+        free(zp);
+        pools[zone_id] = NULL;
+    }
+
+    total_reserved = 0;
+    total_allocated = 0;
+    memset(device_reserved, 0, sizeof(device_reserved));
+    memset(device_allocated, 0, sizeof(device_allocated));
+}
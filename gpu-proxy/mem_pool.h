@@ -0,0 +1,139 @@
+/*
+ * Device Memory Pool
+ *
+ * Caching allocator between the handlers and cuMemAlloc/cuMemFree, which
+ * are slow and synchronize the device on real drivers.
+ *
+ * - Small requests (<= MEM_POOL_MAX_BLOCK) are rounded up to a power of
+ *   two and carved out of MEM_POOL_SLAB_SIZE slabs
+ * - Larger requests get a segment of their own, rounded up to the slab size
+ * - Freed memory stays cached and is handed out again to the same zone
+ *   only, so one guest never sees another guest's data, and on the
+ *   same device only
+ * - Every zone's reservation (live plus cached) counts against its quota
+ *
+ * Cached memory goes back to the driver when a zone is released, or when
+ * the driver runs out of memory. A zone may be kept warm: some slabs are
+ * reserved for it up front and survive its release, so a new guest in
+ * it allocates without calling the driver. All functions are thread-safe.
+ */
+
+#ifndef MEM_POOL_H
+#define MEM_POOL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifndef STUB_CUDA
+#include <cuda.h>
+#else
+#include "cuda_stub.h"
+#endif
+
+/* Pool geometry */
+#define MEM_POOL_MIN_BLOCK  512u
+#define MEM_POOL_MAX_BLOCK  (1u << 20)
+#define MEM_POOL_SLAB_SIZE  (2u << 20)
+
+/* Devices memory may come from (indices chosen by the caller) */
+#define MEM_POOL_MAX_DEVICES 16
+
+/**
+ * Initialize pool
+ *
+ * @param zone_quota Most bytes one zone may reserve (0 = unlimited)
+ * @return 0 on success, negative errno on failure
+ */
+int mem_pool_init(uint64_t zone_quota);
+
+/**
+ * Get the per-zone quota (0 = unlimited)
+ */
+uint64_t mem_pool_zone_quota(void);
+
+/**
+ * Allocate device memory for a zone
+ *
+ * New segments come from cuMemAlloc in the calling thread's current
+ * context, which must be that of device.
+ *
+ * @param zone_id Owner zone
+ * @param device Device the memory must be on (< MEM_POOL_MAX_DEVICES)
+ * @param size Requested bytes
+ * @param ptr_out [out] Device pointer
+ * @return CUDA_SUCCESS, CUDA_ERROR_OUT_OF_MEMORY (driver or quota), or
+ *         the driver's error
+ */
+CUresult mem_pool_alloc(uint32_t zone_id, int device, size_t size, CUdeviceptr *ptr_out);
+
+/**
+ * Return memory from mem_pool_alloc to the zone's cache
+ *
+ * @return CUDA_SUCCESS, or CUDA_ERROR_INVALID_VALUE if ptr isn't a live
+ *         block of this zone
+ */
+CUresult mem_pool_free(uint32_t zone_id, CUdeviceptr ptr);
+
+/**
+ * Find the device a zone's memory is on
+ *
+ * @return Device passed to mem_pool_alloc, or -1 if ptr isn't in the pool
+ */
+int mem_pool_device(uint32_t zone_id, CUdeviceptr ptr);
+
+/**
+ * Keep slabs ready for a zone
+ *
+ * Reserves slabs on device until the zone has bytes cached there. Up to
+ * bytes of slabs then stay cached whenever the zone is released (they
+ * still go back when the driver runs out of memory). Like
+ * mem_pool_alloc, the calling thread's current context must be device's.
+ *
+ * @return CUDA_SUCCESS, or the error of the reservation that failed
+ */
+CUresult mem_pool_warm(uint32_t zone_id, int device, uint64_t bytes);
+
+/**
+ * Give all of a zone's memory back to the driver (live blocks included),
+ * except the slabs mem_pool_warm keeps, which become free cached slabs
+ */
+void mem_pool_release_zone(uint32_t zone_id);
+
+/**
+ * Give every zone's cached (unused) segments back to the driver
+ *
+ * @return Bytes released
+ */
+uint64_t mem_pool_trim(void);
+
+/**
+ * List zones that hold device memory
+ *
+ * @return Number of zones written to zones_out (at most max)
+ */
+uint32_t mem_pool_zones(uint32_t *zones_out, uint32_t max);
+
+/**
+ * Get statistics
+ *
+ * @param reserved [out] Bytes held from the driver (optional)
+ * @param cached [out] Part of reserved not handed out to guests (optional)
+ */
+void mem_pool_stats(uint64_t *reserved, uint64_t *cached);
+
+/**
+ * Get one device's statistics (see mem_pool_stats)
+ */
+void mem_pool_device_stats(int device, uint64_t *reserved, uint64_t *cached);
+
+/**
+ * Get one zone's statistics (see mem_pool_stats)
+ */
+void mem_pool_zone_stats(uint32_t zone_id, uint64_t *reserved, uint64_t *cached);
+
+/**
+ * Free everything (no other thread may use the pool any more)
+ */
+void mem_pool_cleanup(void);
+
+#endif /* MEM_POOL_H */
@@ -0,0 +1,593 @@
+/*
+ * Proxy Statistics Implementation
+ *
+ * A shard is written by one thread only, so updates are plain
+ * load/add/store sequences; the stores are relaxed atomics just so a
+ * reader in another process never sees half of a 64-bit value.
+ */
+
+#include "stats.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* Forward declarations from transport.c */
+extern struct idm_connection *idm_conn_lookup(uint32_t remote_zone_id);
+extern bool idm_trace_enabled(void);
+extern void idm_conn_trace(struct idm_connection *conn, const struct idm_trace_span *span);
+
+/* Single-writer update; readers may run concurrently */
+#define BUMP(p, v) __atomic_store_n((p), *(p) + (v), __ATOMIC_RELAXED)
+#define SET(p, v)  __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+#define LOAD(p)    __atomic_load_n((p), __ATOMIC_RELAXED)
+
+/* Message types with a row of their own (row 0 collects the rest) */
+static const struct {
+    uint16_t code;
+    const char *name;
+} type_rows[] = {
+    { 0,                           "OTHER" },
+    { IDM_GPU_ALLOC,               "ALLOC" },
+    { IDM_GPU_FREE,                "FREE" },
+    { IDM_HOST_REGISTER,           "HOST_REGISTER" },
+    { IDM_HOST_UNREGISTER,         "HOST_UNREGISTER" },
+    { IDM_GPU_MEM_EXPORT,          "MEM_EXPORT" },
+    { IDM_GPU_MEM_IMPORT,          "MEM_IMPORT" },
+    { IDM_GPU_COPY_H2D,            "COPY_H2D" },
+    { IDM_GPU_COPY_D2H,            "COPY_D2H" },
+    { IDM_GPU_COPY_D2D,            "COPY_D2D" },
+    { IDM_GPU_MEMSET,              "MEMSET" },
+    { IDM_GPU_LAUNCH_KERNEL,       "LAUNCH_KERNEL" },
+    { IDM_GPU_SYNC,                "SYNC" },
+    { IDM_GPU_STREAM_CREATE,       "STREAM_CREATE" },
+    { IDM_GPU_STREAM_DESTROY,      "STREAM_DESTROY" },
+    { IDM_GPU_STREAM_SYNC,         "STREAM_SYNC" },
+    { IDM_GPU_STREAM_WAIT_EVENT,   "STREAM_WAIT_EVENT" },
+    { IDM_GPU_EVENT_CREATE,        "EVENT_CREATE" },
+    { IDM_GPU_EVENT_DESTROY,       "EVENT_DESTROY" },
+    { IDM_GPU_EVENT_RECORD,        "EVENT_RECORD" },
+    { IDM_GPU_EVENT_SYNC,          "EVENT_SYNC" },
+    { IDM_GPU_EVENT_QUERY,         "EVENT_QUERY" },
+    { IDM_GPU_EVENT_ELAPSED,       "EVENT_ELAPSED" },
+    { IDM_GPU_MODULE_LOAD,         "MODULE_LOAD" },
+    { IDM_GPU_MODULE_UNLOAD,       "MODULE_UNLOAD" },
+    { IDM_GPU_MODULE_GET_FUNCTION, "MODULE_GET_FUNCTION" },
+    { IDM_GPU_GET_INFO,            "GET_INFO" },
+    { IDM_GPU_GET_PROPS,           "GET_PROPS" },
+    { IDM_GPU_GRAPH_INSTANTIATE,   "GRAPH_INSTANTIATE" },
+    { IDM_GPU_GRAPH_LAUNCH,        "GRAPH_LAUNCH" },
+    { IDM_GPU_GRAPH_DESTROY,       "GRAPH_DESTROY" },
+    { IDM_BATCH,                   "BATCH" },
+    { IDM_DISCONNECT,              "DISCONNECT" },
+    { IDM_HELLO,                   "HELLO" },
+};
+
+#define TYPE_ROWS (sizeof(type_rows) / sizeof(type_rows[0]))
+
+_Static_assert(TYPE_ROWS <= STATS_MAX_TYPES, "too many stats type rows");
+
+static const char *stage_names[STATS_STAGES] = { "queue", "handler", "cuda", "send" };
+
+/* Our page */
+static struct stats_page *page = NULL;
+static size_t page_size = 0;
+static uint8_t type_index[256];         /* msg_type & 0xFF -> row */
+static unsigned int next_shard = 0;
+
+/* Per-thread recording state */
+static __thread struct stats_shard *my_shard = NULL;
+static __thread struct stats_op *current_op = NULL;
+static __thread uint64_t pending_queue_ns = 0;
+static __thread uint32_t last_zone_id = UINT32_MAX;
+static __thread int last_zone_row = -1;
+
+/* ============================================================================
+ * Histograms
+ * ============================================================================ */
+
+/**
+ * Bucket holding a value
+ */
+static unsigned int hist_bucket(uint64_t v)
+{
+    if (v < (1u << STATS_SUB_BITS)) {
+        return (unsigned int)v;
+    }
+
+    unsigned int msb = 63u - (unsigned int)__builtin_clzll(v);
+    if (msb >= STATS_MAX_BIT) {
+        return STATS_BUCKETS - 1;
+    }
+
+    unsigned int sub = (unsigned int)(v >> (msb - STATS_SUB_BITS)) & ((1u << STATS_SUB_BITS) - 1);
+    return ((msb - STATS_SUB_BITS + 1) << STATS_SUB_BITS) + sub;
+}
+
+/**
+ * Largest value a bucket holds
+ */
+static uint64_t hist_bucket_max(unsigned int b)
+{
+    if (b < (1u << STATS_SUB_BITS)) {
+        return b;
+    }
+
+    unsigned int msb = (b >> STATS_SUB_BITS) + STATS_SUB_BITS - 1;
+    uint64_t sub = b & ((1u << STATS_SUB_BITS) - 1);
+    uint64_t lower = ((1ull << STATS_SUB_BITS) + sub) << (msb - STATS_SUB_BITS);
+    return lower + (1ull << (msb - STATS_SUB_BITS)) - 1;
+}
+
+static void hist_record(struct stats_hist *h, uint64_t ns)
+{
+    BUMP(&h->count, 1);
+    BUMP(&h->sum_ns, ns);
+    if (ns > h->max_ns) {
+        SET(&h->max_ns, ns);
+    }
+    BUMP(&h->buckets[hist_bucket(ns)], 1);
+}
+
+static void hist_merge(struct stats_hist *dst, const struct stats_hist *src)
+{
+    uint64_t count = LOAD(&src->count);
+    if (count == 0) {
+        return;
+    }
+
+    dst->count += count;
+    dst->sum_ns += LOAD(&src->sum_ns);
+    uint64_t max = LOAD(&src->max_ns);
+    if (max > dst->max_ns) {
+        dst->max_ns = max;
+    }
+    for (unsigned int b = 0; b < STATS_BUCKETS; b++) {
+        dst->buckets[b] += LOAD(&src->buckets[b]);
+    }
+}
+
+/**
+ * Value at a quantile (0..1), as the upper edge of its bucket
+ */
+static uint64_t hist_quantile(const struct stats_hist *h, double q)
+{
+    uint64_t total = 0;
+    for (unsigned int b = 0; b < STATS_BUCKETS; b++) {
+        total += h->buckets[b];
+    }
+    if (total == 0) {
+        return 0;
+    }
+
+    uint64_t rank = (uint64_t)(q * (double)(total - 1)) + 1;
+    uint64_t seen = 0;
+    for (unsigned int b = 0; b < STATS_BUCKETS; b++) {
+        seen += h->buckets[b];
+        if (seen >= rank) {
+            uint64_t v = hist_bucket_max(b);
+            return v < h->max_ns ? v : h->max_ns;
+        }
+    }
+
+    return h->max_ns;
+}
+
+/* ============================================================================
+ * Recording
+ * ============================================================================ */
+
+/**
+ * Create the stats page
+ */
+int stats_init(const uint32_t *zones, int zone_count, unsigned int shards)
+{
+    if (page) {
+        return -EALREADY;
+    }
+
+    if (shards == 0 || shards > STATS_MAX_SHARDS) {
+        shards = STATS_MAX_SHARDS;
+    }
+
+    size_t size = sizeof(struct stats_page) + (size_t)shards * sizeof(struct stats_shard);
+
+    /* A page left by a proxy that didn't exit cleanly is just replaced */
+    shm_unlink(STATS_SHM_NAME);
+
+    int fd = shm_open(STATS_SHM_NAME, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0) {
+        return -errno;
+    }
+
+    if (ftruncate(fd, (off_t)size) < 0) {
+        int err = errno;
+        close(fd);
+        shm_unlink(STATS_SHM_NAME);
+        return -err;
+    }
+
+    void *addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        int err = errno;
+        shm_unlink(STATS_SHM_NAME);
+        return -err;
+    }
+
+    page = addr;
+    page_size = size;
+
+    memset(type_index, 0, sizeof(type_index));
+    for (unsigned int i = 1; i < TYPE_ROWS; i++) {
+        type_index[type_rows[i].code & 0xFF] = (uint8_t)i;
+        page->type_codes[i] = type_rows[i].code;
+    }
+
+    if (zone_count > STATS_MAX_ZONES) {
+        zone_count = STATS_MAX_ZONES;
+    }
+    for (int i = 0; i < zone_count; i++) {
+        page->zone_ids[i] = zones[i];
+    }
+    page->zone_count = (uint32_t)zone_count;
+    page->shard_count = shards;
+    page->start_time = (uint64_t)time(NULL);
+    page->version = STATS_VERSION;
+
+    /* Readers check the magic last */
+    __atomic_store_n(&page->magic, STATS_MAGIC, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+/**
+ * Claim a shard for the calling thread
+ */
+void stats_thread_init(void)
+{
+    if (!page || my_shard) {
+        return;
+    }
+
+    unsigned int i = __atomic_fetch_add(&next_shard, 1, __ATOMIC_RELAXED);
+    if (i < page->shard_count) {
+        my_shard = &page->shards[i];
+    }
+}
+
+/**
+ * Monotonic clock in nanoseconds
+ */
+uint64_t stats_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * Remember the next request's queue time
+ */
+void stats_note_queue(uint64_t ns)
+{
+    pending_queue_ns = ns;
+}
+
+/**
+ * Row of a zone (-1 = not tracked)
+ */
+static int zone_row(uint32_t zone_id)
+{
+    if (zone_id == last_zone_id) {
+        return last_zone_row;
+    }
+
+    int row = -1;
+    for (uint32_t i = 0; i < page->zone_count; i++) {
+        if (page->zone_ids[i] == zone_id) {
+            row = (int)i;
+            break;
+        }
+    }
+
+    last_zone_id = zone_id;
+    last_zone_row = row;
+    return row;
+}
+
+/**
+ * Record a span of a traced request
+ */
+static void trace_span(const struct stats_op *op, enum idm_trace_stage stage,
+                       uint64_t start_ns, uint64_t end_ns)
+{
+    struct idm_trace_span span = {
+        .start_ns = start_ns,
+        .end_ns = end_ns,
+        .seq_num = op->seq_num,
+        .zone = op->zone_id,
+        .msg_type = op->msg_type,
+        .stage = stage,
+    };
+    idm_conn_trace(op->trace_conn, &span);
+}
+
+/**
+ * Start measuring a request
+ */
+void stats_op_begin(struct stats_op *op, const struct idm_message *msg)
+{
+    memset(op, 0, sizeof(*op));
+    op->msg_type = msg->header.msg_type;
+    op->zone_id = msg->header.src_zone;
+    op->seq_num = msg->header.seq_num;
+    op->outer = current_op;
+
+    if ((msg->header.reserved & IDM_TRACE_SAMPLED) && idm_trace_enabled()) {
+        op->trace_conn = idm_conn_lookup(op->zone_id);
+    }
+
+    if (!op->outer) {
+        op->stage_ns[STATS_QUEUE] = pending_queue_ns;
+        pending_queue_ns = 0;
+    }
+
+    current_op = op;
+    op->start_ns = stats_now_ns();
+}
+
+/**
+ * Finish measuring a request
+ */
+void stats_op_end(struct stats_op *op)
+{
+    uint64_t end_ns = stats_now_ns();
+    op->stage_ns[STATS_HANDLER] = end_ns - op->start_ns;
+    current_op = op->outer;
+
+    if (op->trace_conn) {
+        if (!op->outer) {
+            trace_span(op, IDM_TRACE_QUEUE, op->start_ns - op->stage_ns[STATS_QUEUE],
+                       op->start_ns);
+        }
+        trace_span(op, IDM_TRACE_HANDLER, op->start_ns, end_ns);
+    }
+
+    /* A sub-command's driver and send time is also its batch's */
+    if (op->outer) {
+        op->outer->stage_ns[STATS_CUDA] += op->stage_ns[STATS_CUDA];
+        op->outer->stage_ns[STATS_SEND] += op->stage_ns[STATS_SEND];
+    }
+
+    struct stats_shard *shard = my_shard;
+    if (!shard) {
+        return;
+    }
+
+    unsigned int row = (op->msg_type & 0xFF00) ? 0 : type_index[op->msg_type];
+    struct stats_hist *h = shard->types[row];
+
+    if (!op->outer) {
+        hist_record(&h[STATS_QUEUE], op->stage_ns[STATS_QUEUE]);
+    }
+    hist_record(&h[STATS_HANDLER], op->stage_ns[STATS_HANDLER]);
+    if (op->stage_ns[STATS_CUDA]) {
+        hist_record(&h[STATS_CUDA], op->stage_ns[STATS_CUDA]);
+    }
+    if (op->stage_ns[STATS_SEND]) {
+        hist_record(&h[STATS_SEND], op->stage_ns[STATS_SEND]);
+    }
+    if (op->error) {
+        BUMP(&shard->type_errors[row], 1);
+    }
+
+    /* Zones see whole requests only, not a batch's sub-commands */
+    if (!op->outer) {
+        int zrow = zone_row(op->zone_id);
+        if (zrow >= 0) {
+            hist_record(&shard->zones[zrow],
+                        op->stage_ns[STATS_QUEUE] + op->stage_ns[STATS_HANDLER]);
+            if (op->error) {
+                BUMP(&shard->zone_errors[zrow], 1);
+            }
+        }
+    }
+}
+
+/**
+ * Charge time to a stage of the current request
+ */
+void stats_add(enum stats_stage stage, uint64_t ns)
+{
+    struct stats_op *op = current_op;
+    if (!op) {
+        return;
+    }
+
+    op->stage_ns[stage] += ns;
+
+    /* The stage just ended */
+    if (op->trace_conn && (stage == STATS_CUDA || stage == STATS_SEND)) {
+        uint64_t now = stats_now_ns();
+        trace_span(op, stage == STATS_CUDA ? IDM_TRACE_CUDA : IDM_TRACE_RESPOND, now - ns, now);
+    }
+}
+
+/**
+ * Count the current request as failed
+ */
+void stats_error(void)
+{
+    if (current_op) {
+        current_op->error = true;
+    }
+}
+
+/* ============================================================================
+ * Reporting
+ * ============================================================================ */
+
+static void print_hist_line(FILE *out, const char *label, const struct stats_hist *h)
+{
+    fprintf(out, "  %-22s %10lu %9.1f %9.1f %9.1f %9.1f %9.1f\n",
+            label, h->count,
+            h->sum_ns / 1000.0 / h->count,
+            hist_quantile(h, 0.50) / 1000.0,
+            hist_quantile(h, 0.99) / 1000.0,
+            hist_quantile(h, 0.999) / 1000.0,
+            h->max_ns / 1000.0);
+}
+
+static void print_header(FILE *out, const char *title)
+{
+    fprintf(out, "%-24s %10s %9s %9s %9s %9s %9s\n",
+            title, "count", "mean(us)", "p50", "p99", "p99.9", "max");
+}
+
+/**
+ * Name of a type row (pages are only read by the same build)
+ */
+static const char *row_name(const struct stats_page *p, unsigned int row)
+{
+    if (row < TYPE_ROWS && type_rows[row].code == p->type_codes[row]) {
+        return type_rows[row].name;
+    }
+    return "?";
+}
+
+/**
+ * Print a page's totals
+ */
+void stats_print(FILE *out, const struct stats_page *p)
+{
+    if (!p) {
+        return;
+    }
+
+    struct stats_hist *sum = malloc(sizeof(*sum));
+    if (!sum) {
+        return;
+    }
+
+    uint32_t shards = p->shard_count;
+    time_t started = (time_t)p->start_time;
+    fprintf(out, "=== Request Latency (up %lds, %u shard(s)) ===\n",
+            (long)(time(NULL) - started), shards);
+
+    print_header(out, "Type / stage");
+    for (unsigned int row = 0; row < STATS_MAX_TYPES; row++) {
+        uint64_t errors = 0;
+        bool shown = false;
+
+        for (unsigned int s = 0; s < shards; s++) {
+            errors += LOAD(&p->shards[s].type_errors[row]);
+        }
+
+        for (unsigned int stage = 0; stage < STATS_STAGES; stage++) {
+            memset(sum, 0, sizeof(*sum));
+            for (unsigned int s = 0; s < shards; s++) {
+                hist_merge(sum, &p->shards[s].types[row][stage]);
+            }
+            if (sum->count == 0) {
+                continue;
+            }
+
+            if (!shown) {
+                fprintf(out, "%s", row_name(p, row));
+                if (errors) {
+                    fprintf(out, " (%lu error(s))", errors);
+                }
+                fprintf(out, "\n");
+                shown = true;
+            }
+            print_hist_line(out, stage_names[stage], sum);
+        }
+    }
+
+    print_header(out, "Zone (queue + handler)");
+    for (uint32_t z = 0; z < p->zone_count; z++) {
+        uint64_t errors = 0;
+        memset(sum, 0, sizeof(*sum));
+        for (unsigned int s = 0; s < shards; s++) {
+            hist_merge(sum, &p->shards[s].zones[z]);
+            errors += LOAD(&p->shards[s].zone_errors[z]);
+        }
+        if (sum->count == 0) {
+            continue;
+        }
+
+        char label[32];
+        snprintf(label, sizeof(label), "zone %u (%lu err)", p->zone_ids[z], errors);
+        print_hist_line(out, label, sum);
+    }
+
+    fprintf(out, "==================\n");
+    free(sum);
+}
+
+/**
+ * Print the running proxy's statistics
+ */
+int stats_print_live(FILE *out)
+{
+    int fd = shm_open(STATS_SHM_NAME, O_RDONLY, 0);
+    if (fd < 0) {
+        return -errno;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(struct stats_page)) {
+        close(fd);
+        return -ENODATA;
+    }
+
+    void *addr = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        return -errno;
+    }
+
+    const struct stats_page *p = addr;
+    int ret = 0;
+    if (__atomic_load_n(&p->magic, __ATOMIC_ACQUIRE) != STATS_MAGIC ||
+        p->version != STATS_VERSION ||
+        p->shard_count > STATS_MAX_SHARDS ||
+        p->zone_count > STATS_MAX_ZONES ||
+        sizeof(*p) + (size_t)p->shard_count * sizeof(struct stats_shard) > (size_t)st.st_size) {
+        ret = -EPROTO;
+    } else {
+        stats_print(out, p);
+    }
+
+    munmap(addr, (size_t)st.st_size);
+    return ret;
+}
+
+/**
+ * Get our page
+ */
+const struct stats_page *stats_page(void)
+{
+    return page;
+}
+
+/**
+ * Remove the page
+ */
+void stats_cleanup(void)
+{
+    if (!page) {
+        return;
+    }
+
+    munmap(page, page_size);
+    shm_unlink(STATS_SHM_NAME);
+    page = NULL;
+    page_size = 0;
+    next_shard = 0;
+}
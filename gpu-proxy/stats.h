@@ -0,0 +1,164 @@
+/*
+ * Proxy Statistics
+ *
+ * Latency histograms for every request, by message type and by zone,
+ * kept in a shared memory page (STATS_SHM_NAME) that `gpu_proxy -s`
+ * reads while the proxy runs.
+ *
+ * Each worker thread owns one shard of the page and is its only writer,
+ * so recording takes no lock and no atomic read-modify-write. Readers sum
+ * the shards; a total may trail by a request, but never tears.
+ *
+ * Stages of a request:
+ * - QUEUE: received until a worker picks it up
+ * - HANDLER: the handler, start to finish
+ * - CUDA: time inside driver calls (part of HANDLER)
+ * - SEND: building and publishing responses (part of HANDLER)
+ *
+ * Histograms are log-linear (HDR-style): 8 sub-buckets per power of two,
+ * so a reported percentile is within 12.5% of the true value.
+ *
+ * Requests a guest marked IDM_TRACE_SAMPLED also leave their stages as
+ * trace spans on the zone's connection (when tracing is enabled).
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include "../idm-protocol/idm.h"
+#include <stdio.h>
+
+#define STATS_SHM_NAME   "/gpu_proxy_stats"
+#define STATS_MAGIC      0x47505354u      /* "GPST" */
+#define STATS_VERSION    1
+
+#define STATS_MAX_TYPES  48               /* Message types tracked (0 = other) */
+#define STATS_MAX_ZONES  64
+#define STATS_MAX_SHARDS 64
+
+/* Buckets: 8 exact values below 8 ns, then 8 per power of two up to 2^40 ns */
+#define STATS_SUB_BITS   3
+#define STATS_MAX_BIT    40
+#define STATS_BUCKETS    ((STATS_MAX_BIT - STATS_SUB_BITS + 1) << STATS_SUB_BITS)
+
+enum stats_stage {
+    STATS_QUEUE = 0,
+    STATS_HANDLER,
+    STATS_CUDA,
+    STATS_SEND,
+    STATS_STAGES
+};
+
+struct stats_hist {
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t max_ns;
+    uint64_t buckets[STATS_BUCKETS];
+};
+
+/* One writer thread's counters */
+struct stats_shard {
+    struct stats_hist types[STATS_MAX_TYPES][STATS_STAGES];
+    struct stats_hist zones[STATS_MAX_ZONES];    /* QUEUE + HANDLER */
+    uint64_t type_errors[STATS_MAX_TYPES];
+    uint64_t zone_errors[STATS_MAX_ZONES];
+};
+
+/* The shared page: header, then shard_count shards */
+struct stats_page {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t shard_count;
+    uint32_t zone_count;
+    uint64_t start_time;                    /* Unix time the proxy started */
+    uint16_t type_codes[STATS_MAX_TYPES];   /* idm_msg_type of each type row */
+    uint32_t zone_ids[STATS_MAX_ZONES];
+    struct stats_shard shards[];
+};
+
+/* A request being measured (on the handler's stack) */
+struct stats_op {
+    uint64_t start_ns;
+    uint64_t stage_ns[STATS_STAGES];
+    struct stats_op *outer;    /* Enclosing request (BATCH sub-commands) */
+    struct idm_connection *trace_conn;   /* Where spans go (NULL = not traced) */
+    uint64_t seq_num;
+    uint32_t zone_id;
+    uint16_t msg_type;
+    bool error;
+};
+
+/**
+ * Create the stats page
+ *
+ * @param zones User zones served (per-zone rows beyond STATS_MAX_ZONES
+ *              are not kept)
+ * @param shards Writer threads that will call stats_thread_init
+ * @return 0 on success, negative errno on failure
+ */
+int stats_init(const uint32_t *zones, int zone_count, unsigned int shards);
+
+/**
+ * Claim a shard for the calling thread (workers, once at startup)
+ *
+ * Threads without one record nothing.
+ */
+void stats_thread_init(void);
+
+/**
+ * Monotonic clock in nanoseconds
+ */
+uint64_t stats_now_ns(void);
+
+/**
+ * Remember how long the next request on this thread waited in its queue
+ */
+void stats_note_queue(uint64_t ns);
+
+/**
+ * Start/finish measuring a request on this thread (they nest)
+ */
+void stats_op_begin(struct stats_op *op, const struct idm_message *msg);
+void stats_op_end(struct stats_op *op);
+
+/**
+ * Charge time to a stage of the current request
+ */
+void stats_add(enum stats_stage stage, uint64_t ns);
+
+/**
+ * Count the current request as failed
+ */
+void stats_error(void);
+
+/* Run a driver call and charge its time to the current request */
+#define STATS_CUDA_CALL(call) ({                               \
+    uint64_t stats_t0_ = stats_now_ns();                       \
+    __typeof__(call) stats_r_ = (call);                        \
+    stats_add(STATS_CUDA, stats_now_ns() - stats_t0_);         \
+    stats_r_;                                                  \
+})
+
+/**
+ * Print a page's totals (ours, or one mapped by stats_print_live)
+ */
+void stats_print(FILE *out, const struct stats_page *page);
+
+/**
+ * Print the running proxy's statistics
+ *
+ * @return 0 on success, negative errno if no proxy page exists
+ */
+int stats_print_live(FILE *out);
+
+/**
+ * Get our page (NULL before stats_init)
+ */
+const struct stats_page *stats_page(void);
+
+/**
+ * Remove the page
+ */
+void stats_cleanup(void);
+
+#endif /* STATS_H */
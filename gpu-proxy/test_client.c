@@ -6,11 +6,14 @@
  */
 
 #include "../idm-protocol/idm.h"
+#include "handle_table.h"
+#include "dispatch.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <time.h>
+#include <pthread.h>
 
 /* Forward declarations */
 extern int idm_init(uint32_t local_zone_id, uint32_t remote_zone_id, bool is_server);
@@ -20,14 +23,20 @@ extern struct idm_message *idm_build_message(uint32_t dst_zone, enum idm_msg_typ
                                               const void *payload, size_t payload_len);
 extern void idm_free_message(struct idm_message *msg);
 extern void idm_cleanup(void);
+extern void *idm_bulk_region(size_t *size_out);
 
 #define DRIVER_ZONE_ID 1
-#define USER_ZONE_ID 2
+#define USER_ZONE_ID 2   /* Default; IDM_ZONE_ID overrides */
+
+static uint32_t user_zone_id = USER_ZONE_ID;
 
 /**
  * Wait for response matching request sequence
+ *
+ * @param error_out [out] IDM error code of an error response (optional;
+ *                  when given, the error isn't reported)
  */
-static int wait_for_response(uint64_t req_seq, uint64_t *handle_out)
+static int wait_for_reply(uint64_t req_seq, uint64_t *handle_out, uint32_t *error_out)
 {
     struct idm_message *resp = NULL;
 
@@ -50,8 +59,12 @@ static int wait_for_response(uint64_t req_seq, uint64_t *handle_out)
             const struct idm_response_error *err = (const struct idm_response_error *)resp->payload;
 
             if (err->request_seq == req_seq) {
-                fprintf(stderr, "Error response: %s (code=%u, cuda=%u)\n",
-                        err->error_msg, err->error_code, err->cuda_error);
+                if (error_out) {
+                    *error_out = err->error_code;
+                } else {
+                    fprintf(stderr, "Error response: %s (code=%u, cuda=%u)\n",
+                            err->error_msg, err->error_code, err->cuda_error);
+                }
                 idm_free_message(resp);
                 return -1;
             }
@@ -64,6 +77,33 @@ static int wait_for_response(uint64_t req_seq, uint64_t *handle_out)
     return -1;
 }
 
+static int wait_for_response(uint64_t req_seq, uint64_t *handle_out)
+{
+    return wait_for_reply(req_seq, handle_out, NULL);
+}
+
+/**
+ * Send one request and wait for its response
+ */
+static int request(enum idm_msg_type type, const void *payload, size_t len,
+                   uint64_t *handle_out, uint32_t *error_out)
+{
+    struct idm_message *msg = idm_build_message(DRIVER_ZONE_ID, type, payload, len);
+    if (!msg) {
+        return -1;
+    }
+
+    uint64_t req_seq = msg->header.seq_num;
+    if (idm_send(msg) < 0) {
+        fprintf(stderr, "Failed to send\n");
+        idm_free_message(msg);
+        return -1;
+    }
+    idm_free_message(msg);
+
+    return wait_for_reply(req_seq, handle_out, error_out);
+}
+
 /**
  * Test: Allocate and free GPU memory
  */
@@ -252,7 +292,7 @@ static int test_copy_h2d(void)
     msg->header.magic = IDM_MAGIC;
     msg->header.version = IDM_VERSION;
     msg->header.msg_type = IDM_GPU_COPY_H2D;
-    msg->header.src_zone = USER_ZONE_ID;
+    msg->header.src_zone = user_zone_id;
     msg->header.dst_zone = DRIVER_ZONE_ID;
     msg->header.seq_num = 100;  /* Dummy seq */
     msg->header.payload_len = sizeof(struct idm_gpu_copy_h2d) + 256;
@@ -261,6 +301,9 @@ static int test_copy_h2d(void)
     copy_req->dst_handle = handle;
     copy_req->dst_offset = 0;
     copy_req->size = 256;
+    copy_req->bulk_offset = 0;
+    copy_req->flags = IDM_COPY_INLINE;
+    copy_req->reserved = 0;
 
     memcpy(msg->payload + sizeof(struct idm_gpu_copy_h2d), host_data, 256);
 
@@ -285,12 +328,91 @@ static int test_copy_h2d(void)
     return 0;
 }
 
+/**
+ * Test: Host to Device copy through the bulk region
+ */
+static int test_copy_h2d_bulk(void)
+{
+    printf("\n=== Test 4: Bulk Host to Device Copy ===\n");
+
+    size_t bulk_size = 0;
+    uint8_t *bulk = idm_bulk_region(&bulk_size);
+    if (!bulk) {
+        fprintf(stderr, "No bulk region\n");
+        return -1;
+    }
+
+    /* Allocate 8MB GPU buffer (far beyond one ring entry) */
+    const size_t size = 8 * 1024 * 1024;
+    struct idm_gpu_alloc alloc_req = { .size = size, .flags = 0 };
+    struct idm_message *msg = idm_build_message(
+        DRIVER_ZONE_ID, IDM_GPU_ALLOC, &alloc_req, sizeof(alloc_req));
+
+    uint64_t req_seq = msg->header.seq_num;
+    idm_send(msg);
+    idm_free_message(msg);
+
+    uint64_t handle = 0;
+    if (wait_for_response(req_seq, &handle) < 0) {
+        return -1;
+    }
+
+    /* Stage data in the bulk region, send only the descriptor */
+    for (size_t i = 0; i < size; i++) {
+        bulk[i] = (uint8_t)(i * 7);
+    }
+
+    printf("Copying %zu bytes to GPU via bulk region...\n", size);
+
+    struct idm_gpu_copy_h2d copy_req = {
+        .dst_handle = handle,
+        .dst_offset = 0,
+        .size = size,
+        .bulk_offset = 0,
+        .flags = IDM_COPY_BULK
+    };
+    msg = idm_build_message(DRIVER_ZONE_ID, IDM_GPU_COPY_H2D, &copy_req, sizeof(copy_req));
+    req_seq = msg->header.seq_num;
+    idm_send(msg);
+    idm_free_message(msg);
+
+    int ret = wait_for_response(req_seq, NULL);
+    if (ret == 0) {
+        printf("✓ Bulk copy succeeded\n");
+
+        /* A descriptor pointing past the bulk region must be rejected */
+        copy_req.size = 4096;
+        copy_req.bulk_offset = bulk_size - 1024;
+        msg = idm_build_message(DRIVER_ZONE_ID, IDM_GPU_COPY_H2D, &copy_req, sizeof(copy_req));
+        req_seq = msg->header.seq_num;
+        idm_send(msg);
+        idm_free_message(msg);
+
+        if (wait_for_response(req_seq, NULL) == 0) {
+            fprintf(stderr, "Out-of-bounds bulk descriptor was accepted\n");
+            ret = -1;
+        } else {
+            printf("✓ Out-of-bounds descriptor rejected\n");
+        }
+    }
+
+    /* Free */
+    struct idm_gpu_free free_req = { .handle = handle };
+    msg = idm_build_message(DRIVER_ZONE_ID, IDM_GPU_FREE, &free_req, sizeof(free_req));
+    req_seq = msg->header.seq_num;
+    idm_send(msg);
+    idm_free_message(msg);
+    wait_for_response(req_seq, NULL);
+
+    return ret;
+}
+
 /**
  * Test: Synchronization
  */
 static int test_sync(void)
 {
-    printf("\n=== Test 4: Synchronization ===\n");
+    printf("\n=== Test 5: Synchronization ===\n");
 
     struct idm_gpu_sync sync_req = {
         .flags = 0
@@ -317,11 +439,132 @@ static int test_sync(void)
 }
 
 /**
- * Performance test
+ * Append one sub-command to a batch payload
+ *
+ * @return New payload length
+ */
+static size_t batch_append(uint8_t *buf, size_t len, uint64_t seq,
+                           enum idm_msg_type type, const void *payload, uint32_t payload_len)
+{
+    struct idm_batch_cmd cmd = {
+        .seq_num = seq,
+        .msg_type = type,
+        .payload_len = payload_len
+    };
+
+    memset(buf + len, 0, IDM_BATCH_CMD_SPACE(payload_len));
+    memcpy(buf + len, &cmd, sizeof(cmd));
+    memcpy(buf + len + sizeof(cmd), payload, payload_len);
+
+    return len + IDM_BATCH_CMD_SPACE(payload_len);
+}
+
+/**
+ * Test: Batched commands
+ */
+static int test_batch(void)
+{
+    printf("\n=== Test 6: Batched Commands ===\n");
+
+    /* alloc, alloc, free(bogus), sync in one message */
+    uint8_t buf[1024];
+    size_t len = sizeof(struct idm_batch);
+    uint64_t seqs[4] = { 1000001, 1000002, 1000003, 1000004 };
+
+    struct idm_gpu_alloc alloc_req = { .size = 4096, .flags = 0 };
+    struct idm_gpu_free bogus_free = { .handle = 0xdeadbeef };
+    struct idm_gpu_sync sync_req = { .flags = 0 };
+
+    len = batch_append(buf, len, seqs[0], IDM_GPU_ALLOC, &alloc_req, sizeof(alloc_req));
+    len = batch_append(buf, len, seqs[1], IDM_GPU_ALLOC, &alloc_req, sizeof(alloc_req));
+    len = batch_append(buf, len, seqs[2], IDM_GPU_FREE, &bogus_free, sizeof(bogus_free));
+    len = batch_append(buf, len, seqs[3], IDM_GPU_SYNC, &sync_req, sizeof(sync_req));
+
+    struct idm_batch *batch = (struct idm_batch *)buf;
+    batch->count = 4;
+    batch->reserved = 0;
+
+    struct idm_message *msg = idm_build_message(DRIVER_ZONE_ID, IDM_BATCH, buf, len);
+    if (idm_send(msg) < 0) {
+        fprintf(stderr, "Failed to send\n");
+        idm_free_message(msg);
+        return -1;
+    }
+    idm_free_message(msg);
+
+    struct idm_message *resp = NULL;
+    if (idm_recv(&resp, 5000) < 0) {
+        fprintf(stderr, "Timeout waiting for batch response\n");
+        return -1;
+    }
+
+    if (resp->header.msg_type != IDM_RESPONSE_BATCH ||
+        ((const struct idm_batch *)resp->payload)->count != 4) {
+        fprintf(stderr, "Expected one RESPONSE_BATCH with 4 results, got %s\n",
+                idm_msg_type_str(resp->header.msg_type));
+        idm_free_message(resp);
+        return -1;
+    }
+
+    const struct idm_batch_result *results =
+        (const struct idm_batch_result *)(resp->payload + sizeof(struct idm_batch));
+    int ret = 0;
+    for (int i = 0; i < 4; i++) {
+        bool want_error = (i == 2);
+        if (results[i].request_seq != seqs[i] ||
+            (results[i].error_code != IDM_ERROR_NONE) != want_error) {
+            fprintf(stderr, "Unexpected result %d: seq=%lu error=%u\n",
+                    i, results[i].request_seq, results[i].error_code);
+            ret = -1;
+        }
+    }
+
+    uint64_t handles[2] = { results[0].result_handle, results[1].result_handle };
+    idm_free_message(resp);
+
+    if (ret < 0) {
+        return -1;
+    }
+    printf("✓ 4 commands answered by one response (bogus free rejected)\n");
+
+    /* Release both allocations with a second batch */
+    len = sizeof(struct idm_batch);
+    for (int i = 0; i < 2; i++) {
+        struct idm_gpu_free free_req = { .handle = handles[i] };
+        len = batch_append(buf, len, seqs[i] + 10, IDM_GPU_FREE, &free_req, sizeof(free_req));
+    }
+    batch->count = 2;
+
+    msg = idm_build_message(DRIVER_ZONE_ID, IDM_BATCH, buf, len);
+    idm_send(msg);
+    idm_free_message(msg);
+
+    if (idm_recv(&resp, 5000) < 0) {
+        fprintf(stderr, "Timeout waiting for batch response\n");
+        return -1;
+    }
+
+    results = (const struct idm_batch_result *)(resp->payload + sizeof(struct idm_batch));
+    if (resp->header.msg_type != IDM_RESPONSE_BATCH ||
+        results[0].error_code != IDM_ERROR_NONE || results[1].error_code != IDM_ERROR_NONE) {
+        fprintf(stderr, "Batched free failed\n");
+        idm_free_message(resp);
+        return -1;
+    }
+    idm_free_message(resp);
+
+    printf("✓ Freed both allocations in one batch\n");
+
+    return 0;
+}
+
+/**
+ * Performance smoke test (alloc/free round trips keep working under load;
+ * for real numbers use libvgpu/bench)
  */
 static int test_performance(void)
 {
-    printf("\n=== Test 5: Performance ===\n");
+    printf("\n=== Test 7: Performance ===\n");
 
     const int iterations = 1000;
     struct timespec start, end;
@@ -367,6 +610,346 @@ static int test_performance(void)
     return 0;
 }
 
+/* Handle table stress: threads, live handles each, rounds per thread */
+#define HT_THREADS 8
+#define HT_LIVE 64
+#define HT_ROUNDS 20000
+
+static int ht_failed = 0;
+
+/**
+ * Insert/lookup/remove churn in a zone of its own; handles from the other
+ * threads keep landing in the slots this one frees
+ */
+static void *handle_table_worker(void *arg)
+{
+    uint32_t t = (uint32_t)(uintptr_t)arg;
+    uint32_t zone = 40 + t;
+    uint64_t handles[HT_LIVE];
+    uintptr_t ptrs[HT_LIVE];
+    int head = 0, live = 0;
+
+    for (uint32_t i = 0; i < HT_ROUNDS; i++) {
+        if (live == HT_LIVE) {
+            void *ptr = handle_table_remove(zone, HANDLE_TYPE_MEMORY, handles[head]);
+            if ((uintptr_t)ptr != ptrs[head]) {
+                __atomic_fetch_add(&ht_failed, 1, __ATOMIC_RELAXED);
+            }
+            head = (head + 1) % HT_LIVE;
+            live--;
+        }
+
+        int idx = (head + live) % HT_LIVE;
+        ptrs[idx] = ((uintptr_t)(t + 1) << 32) | (i + 1);
+        handles[idx] = handle_table_insert(zone, HANDLE_TYPE_MEMORY, (void *)ptrs[idx], 4096);
+        if (!handles[idx]) {
+            __atomic_fetch_add(&ht_failed, 1, __ATOMIC_RELAXED);
+            break;
+        }
+        live++;
+
+        int probe = (head + (int)(i * 7919 % (uint32_t)live)) % HT_LIVE;
+        size_t size = 0;
+        void *ptr = handle_table_lookup(zone, HANDLE_TYPE_MEMORY, handles[probe], &size);
+        if ((uintptr_t)ptr != ptrs[probe] || size != 4096) {
+            __atomic_fetch_add(&ht_failed, 1, __ATOMIC_RELAXED);
+        }
+    }
+
+    for (; live > 0; live--, head = (head + 1) % HT_LIVE) {
+        if ((uintptr_t)handle_table_remove(zone, HANDLE_TYPE_MEMORY, handles[head]) != ptrs[head]) {
+            __atomic_fetch_add(&ht_failed, 1, __ATOMIC_RELAXED);
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Test: Handle table (in this process, no proxy involved)
+ */
+static int test_handle_table(void)
+{
+    printf("\n=== Test 8: Handle Table ===\n");
+
+    if (handle_table_init() < 0) {
+        return -1;
+    }
+
+    /* A freed slot is reused, but its old handle must not reach the new entry */
+    uint64_t stale = handle_table_insert(2, HANDLE_TYPE_MEMORY, (void *)0x1000, 64);
+    handle_table_remove(2, HANDLE_TYPE_MEMORY, stale);
+    uint64_t fresh = handle_table_insert(2, HANDLE_TYPE_MEMORY, (void *)0x2000, 64);
+
+    if ((uint32_t)stale != (uint32_t)fresh || stale == fresh) {
+        fprintf(stderr, "Slot not reused with a new generation (0x%lx, 0x%lx)\n", stale, fresh);
+        return -1;
+    }
+    if (handle_table_lookup(2, HANDLE_TYPE_MEMORY, stale, NULL) ||
+        handle_table_remove(2, HANDLE_TYPE_MEMORY, stale)) {
+        fprintf(stderr, "Stale handle 0x%lx still works\n", stale);
+        return -1;
+    }
+    if (handle_table_lookup(2, HANDLE_TYPE_MEMORY, fresh, NULL) != (void *)0x2000) {
+        fprintf(stderr, "Live handle lost\n");
+        return -1;
+    }
+    printf("✓ Stale handle rejected after its slot was reused\n");
+
+    /* Another zone can't use it, not even with its own zone in the handle
+     * (the proxy reports both attempts as SECURITY) */
+    uint64_t forged = (fresh & ~(0xFFFFull << 48)) | (3ull << 48);
+    if (handle_table_lookup(3, HANDLE_TYPE_MEMORY, fresh, NULL) ||
+        handle_table_lookup(3, HANDLE_TYPE_MEMORY, forged, NULL) ||
+        handle_table_remove(3, HANDLE_TYPE_MEMORY, fresh) ||
+        handle_table_lookup(2, HANDLE_TYPE_STREAM, fresh, NULL)) {
+        fprintf(stderr, "Handle usable from another zone or as another type\n");
+        return -1;
+    }
+    if (handle_table_remove(2, HANDLE_TYPE_MEMORY, fresh) != (void *)0x2000) {
+        fprintf(stderr, "Owner can't free its handle\n");
+        return -1;
+    }
+    printf("✓ Handle rejected for another zone and another type\n");
+
+    /* Concurrent churn */
+    pthread_t threads[HT_THREADS];
+    for (uintptr_t t = 0; t < HT_THREADS; t++) {
+        pthread_create(&threads[t], NULL, handle_table_worker, (void *)t);
+    }
+    for (int t = 0; t < HT_THREADS; t++) {
+        pthread_join(threads[t], NULL);
+    }
+
+    uint64_t handles, memory;
+    handle_table_stats(&handles, &memory);
+    if (ht_failed || handles != 0 || memory != 0) {
+        fprintf(stderr, "%d bad result(s), %lu handle(s) and %lu bytes left\n",
+                ht_failed, handles, memory);
+        return -1;
+    }
+
+    /* No slot went missing: as many handles as were ever live at once fit
+     * in the slots already used, without growing the table */
+    uint64_t refill[HT_THREADS * HT_LIVE];
+    uint32_t max_slot = 0;
+    for (int i = 0; i < HT_THREADS * HT_LIVE; i++) {
+        refill[i] = handle_table_insert(2, HANDLE_TYPE_MEMORY, (void *)0x3000, 64);
+        if ((uint32_t)refill[i] > max_slot) {
+            max_slot = (uint32_t)refill[i];
+        }
+    }
+    for (int i = 0; i < HT_THREADS * HT_LIVE; i++) {
+        handle_table_remove(2, HANDLE_TYPE_MEMORY, refill[i]);
+    }
+    if (max_slot >= HT_THREADS * HT_LIVE) {
+        fprintf(stderr, "Slots lost: refill reached slot %u\n", max_slot);
+        return -1;
+    }
+    printf("✓ %d threads x %d insert/lookup/remove, no slot lost\n", HT_THREADS, HT_ROUNDS);
+
+    handle_table_cleanup();
+    return 0;
+}
+
+/* Dispatch test zones (served by one worker, never seen by a proxy) */
+#define DS_ZONE_LIGHT 50    /* Batch, weight 1 */
+#define DS_ZONE_HEAVY 51    /* Batch, weight 3 */
+#define DS_ZONE_LATENCY 52  /* Latency class */
+#define DS_ZONE_GATE 53     /* Holds the worker while the queues fill */
+#define DS_BATCH 24         /* Requests per batch zone */
+#define DS_LATENCY 4        /* Latency requests */
+
+static pthread_mutex_t ds_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ds_cond = PTHREAD_COND_INITIALIZER;
+static bool ds_gate_entered = false;
+static bool ds_gate_open = false;
+static uint32_t ds_order[2 * DS_BATCH + DS_LATENCY];
+static int ds_done = 0;
+
+/**
+ * Record which zone each request came from, in the order they run
+ */
+static void dispatch_record(const struct idm_message *msg)
+{
+    pthread_mutex_lock(&ds_lock);
+    if (msg->header.src_zone == DS_ZONE_GATE) {
+        ds_gate_entered = true;
+        pthread_cond_broadcast(&ds_cond);
+        while (!ds_gate_open) {
+            pthread_cond_wait(&ds_cond, &ds_lock);
+        }
+    } else if (ds_done < (int)(sizeof(ds_order) / sizeof(ds_order[0]))) {
+        ds_order[ds_done++] = msg->header.src_zone;
+        pthread_cond_broadcast(&ds_cond);
+    }
+    pthread_mutex_unlock(&ds_lock);
+}
+
+/**
+ * Queue a request from zone; bytes is the host data it claims to move
+ */
+static int dispatch_queue(uint32_t zone, uint64_t bytes)
+{
+    enum idm_msg_type type = bytes ? IDM_GPU_COPY_H2D : IDM_GPU_SYNC;
+    size_t len = bytes ? sizeof(struct idm_gpu_copy_h2d) : sizeof(struct idm_gpu_sync);
+
+    struct idm_message *msg = calloc(1, sizeof(struct idm_message) + len);
+    if (!msg) {
+        return -1;
+    }
+    msg->header.magic = IDM_MAGIC;
+    msg->header.version = IDM_VERSION;
+    msg->header.msg_type = type;
+    msg->header.src_zone = zone;
+    msg->header.dst_zone = DRIVER_ZONE_ID;
+    msg->header.payload_len = len;
+    if (bytes) {
+        ((struct idm_gpu_copy_h2d *)msg->payload)->size = bytes;
+    }
+
+    if (dispatch_submit(NULL, msg) < 0) {
+        free(msg);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Test: Dispatch scheduling (in this process, no proxy involved)
+ *
+ * One worker is held busy while a weight-1 and a weight-3 batch zone each
+ * queue requests costing one quantum, and a latency zone queues a few
+ * small ones behind them. Once released, the latency requests must run
+ * first, then the batch zones in a 1:3 ratio.
+ */
+static int test_dispatch(void)
+{
+    printf("\n=== Test 9: Dispatch Scheduling ===\n");
+
+    dispatch_set_zone_weight(DS_ZONE_LIGHT, 1);
+    dispatch_set_zone_weight(DS_ZONE_HEAVY, 3);
+    dispatch_set_zone_class(DS_ZONE_LATENCY, DISPATCH_LATENCY);
+    dispatch_set_admission(0);
+
+    if (dispatch_init(1, dispatch_record, NULL, NULL) < 0) {
+        fprintf(stderr, "Failed to start dispatch\n");
+        return -1;
+    }
+
+    int ret = dispatch_queue(DS_ZONE_GATE, 0);
+
+    pthread_mutex_lock(&ds_lock);
+    while (ret == 0 && !ds_gate_entered) {
+        pthread_cond_wait(&ds_cond, &ds_lock);
+    }
+    pthread_mutex_unlock(&ds_lock);
+
+    uint64_t bytes = DISPATCH_QUANTUM - DISPATCH_BASE_COST;
+    for (int i = 0; i < DS_BATCH && ret == 0; i++) {
+        ret = dispatch_queue(DS_ZONE_LIGHT, bytes);
+        if (ret == 0) {
+            ret = dispatch_queue(DS_ZONE_HEAVY, bytes);
+        }
+    }
+    for (int i = 0; i < DS_LATENCY && ret == 0; i++) {
+        ret = dispatch_queue(DS_ZONE_LATENCY, 0);
+    }
+
+    pthread_mutex_lock(&ds_lock);
+    ds_gate_open = true;
+    pthread_cond_broadcast(&ds_cond);
+    pthread_mutex_unlock(&ds_lock);
+
+    dispatch_shutdown();  /* Drains the queues */
+
+    if (ret < 0 || ds_done != 2 * DS_BATCH + DS_LATENCY) {
+        fprintf(stderr, "Only %d of %d requests ran\n", ds_done, 2 * DS_BATCH + DS_LATENCY);
+        return -1;
+    }
+
+    for (int i = 0; i < DS_LATENCY; i++) {
+        if (ds_order[i] != DS_ZONE_LATENCY) {
+            fprintf(stderr, "Request %d came from zone %u, not the latency zone\n",
+                    i, ds_order[i]);
+            return -1;
+        }
+    }
+    printf("✓ Latency requests ran ahead of %d queued batch requests\n", 2 * DS_BATCH);
+
+    /* While both batch zones have work, the heavy one gets 3 of every 4 turns */
+    int light = 0, heavy = 0;
+    for (int i = DS_LATENCY; i < DS_LATENCY + 4 * (DS_BATCH / 3); i++) {
+        if (ds_order[i] == DS_ZONE_LIGHT) {
+            light++;
+        } else if (ds_order[i] == DS_ZONE_HEAVY) {
+            heavy++;
+        }
+    }
+    if (heavy != 3 * light) {
+        fprintf(stderr, "Weights 1:3 gave %d:%d\n", light, heavy);
+        return -1;
+    }
+    printf("✓ Weights 1:3 completed %d:%d\n", light, heavy);
+
+    return 0;
+}
+
+/**
+ * Test: A guest that goes away without freeing loses its memory
+ *
+ * Detaches with live allocations, waits out the proxy's liveness check,
+ * then attaches again (without IDM_HELLO, which would release them too):
+ * the old handles must be gone.
+ */
+static int test_disconnect(void)
+{
+    printf("\n=== Test 10: Disconnect Releases Memory ===\n");
+
+    uint64_t handles[2];
+    for (int i = 0; i < 2; i++) {
+        struct idm_gpu_alloc alloc_req = { .size = 1024 * 1024, .flags = 0 };
+        if (request(IDM_GPU_ALLOC, &alloc_req, sizeof(alloc_req), &handles[i], NULL) < 0) {
+            return -1;
+        }
+    }
+    printf("Allocated 2MB, detaching without freeing...\n");
+
+    idm_cleanup();
+    sleep(3);  /* The proxy checks every second */
+
+    if (idm_init(user_zone_id, DRIVER_ZONE_ID, false) < 0) {
+        fprintf(stderr, "Failed to reattach\n");
+        return -1;
+    }
+
+    for (int i = 0; i < 2; i++) {
+        struct idm_gpu_free free_req = { .handle = handles[i] };
+        uint32_t error = IDM_ERROR_NONE;
+        if (request(IDM_GPU_FREE, &free_req, sizeof(free_req), NULL, &error) == 0 ||
+            error != IDM_ERROR_INVALID_HANDLE) {
+            fprintf(stderr, "Handle 0x%lx survived the disconnect (error %u)\n",
+                    handles[i], error);
+            return -1;
+        }
+    }
+    printf("✓ Proxy released both allocations\n");
+
+    /* The zone is usable again */
+    struct idm_gpu_alloc alloc_req = { .size = 1024 * 1024, .flags = 0 };
+    uint64_t handle = 0;
+    if (request(IDM_GPU_ALLOC, &alloc_req, sizeof(alloc_req), &handle, NULL) < 0) {
+        return -1;
+    }
+    struct idm_gpu_free free_req = { .handle = handle };
+    if (request(IDM_GPU_FREE, &free_req, sizeof(free_req), NULL, NULL) < 0) {
+        return -1;
+    }
+    printf("✓ New session allocates and frees\n");
+
+    return 0;
+}
+
 /**
  * Main
  */
@@ -382,7 +965,12 @@ int main(int argc, char **argv)
     sleep(2);
 
     /* Initialize IDM */
-    if (idm_init(USER_ZONE_ID, DRIVER_ZONE_ID, false) < 0) {
+    const char *zone_env = getenv("IDM_ZONE_ID");
+    if (zone_env && *zone_env) {
+        user_zone_id = (uint32_t)strtoul(zone_env, NULL, 10);
+    }
+
+    if (idm_init(user_zone_id, DRIVER_ZONE_ID, false) < 0) {
         fprintf(stderr, "Failed to initialize IDM\n");
         return 1;
     }
@@ -407,20 +995,46 @@ int main(int argc, char **argv)
         failed++;
     }
 
-    if (test_sync() < 0) {
+    if (test_copy_h2d_bulk() < 0) {
         fprintf(stderr, "✗ Test 4 FAILED\n");
         failed++;
     }
 
-    if (test_performance() < 0) {
+    if (test_sync() < 0) {
         fprintf(stderr, "✗ Test 5 FAILED\n");
         failed++;
     }
 
+    if (test_batch() < 0) {
+        fprintf(stderr, "✗ Test 6 FAILED\n");
+        failed++;
+    }
+
+    if (test_performance() < 0) {
+        fprintf(stderr, "✗ Test 7 FAILED\n");
+        failed++;
+    }
+
+    if (test_handle_table() < 0) {
+        fprintf(stderr, "✗ Test 8 FAILED\n");
+        failed++;
+    }
+
+    if (test_dispatch() < 0) {
+        fprintf(stderr, "✗ Test 9 FAILED\n");
+        failed++;
+    }
+
+    /* Last: it detaches and reattaches */
+    if (test_disconnect() < 0) {
+        fprintf(stderr, "✗ Test 10 FAILED\n");
+        failed++;
+    }
+
     /* Summary */
     printf("\n=== Test Summary ===\n");
-    printf("Total tests: 5\n");
-    printf("Passed: %d\n", 5 - failed);
+    printf("Total tests: 10\n");
+    printf("Passed: %d\n", 10 - failed);
     printf("Failed: %d\n", failed);
 
     if (failed == 0) {
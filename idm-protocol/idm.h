@@ -21,17 +21,33 @@
 /* Protocol magic number ("IDM\0") */
 #define IDM_MAGIC 0x49444D00
 
-/* Protocol version */
+/* Protocol version (both ends must run the same one; see idm_message_valid) */
 #define IDM_VERSION_MAJOR 1
-#define IDM_VERSION_MINOR 0
+#define IDM_VERSION_MINOR 1
 #define IDM_VERSION ((IDM_VERSION_MAJOR << 8) | IDM_VERSION_MINOR)
 
+/* First minor version that reads v2 (variable-length record) rings */
+#define IDM_RING_V2_MINOR 1
+
 /* Maximum payload size (4MB - enough for small transfers) */
 #define IDM_MAX_PAYLOAD_SIZE (4 * 1024 * 1024)
 
 /* Ring buffer size (power of 2) - reduced for macOS limits */
 #define IDM_RING_SIZE 32
 
+/* Page size used for grant mappings */
+#define IDM_PAGE_SIZE 4096
+
+/*
+ * Bulk staging region (per connection)
+ *
+ * Large copies don't go through the ring. Each connection has a separate
+ * shared region (grant-ref array in Xen mode, shm segment in stub mode) and
+ * copy requests only carry an offset/length into it.
+ */
+#define IDM_BULK_SIZE  (16 * 1024 * 1024)
+#define IDM_BULK_PAGES (IDM_BULK_SIZE / IDM_PAGE_SIZE)
+
 /* ============================================================================
  * Message Types
  * ============================================================================ */
@@ -40,6 +56,10 @@ enum idm_msg_type {
     /* GPU Memory Management */
     IDM_GPU_ALLOC           = 0x01,    /* cudaMalloc() */
     IDM_GPU_FREE            = 0x02,    /* cudaFree() */
+    IDM_HOST_REGISTER       = 0x03,    /* Map a shared host region, pin it (cuMemAllocHost) */
+    IDM_HOST_UNREGISTER     = 0x04,    /* Unpin and unmap it (cuMemFreeHost) */
+    IDM_GPU_MEM_EXPORT      = 0x05,    /* Share memory with other zones (grant list) */
+    IDM_GPU_MEM_IMPORT      = 0x06,    /* Open memory another zone shared (cuIpcOpenMemHandle) */
 
     /* GPU Data Transfer */
     IDM_GPU_COPY_H2D        = 0x10,    /* Host to Device */
@@ -51,13 +71,44 @@ enum idm_msg_type {
     IDM_GPU_LAUNCH_KERNEL   = 0x20,    /* Launch kernel */
     IDM_GPU_SYNC            = 0x21,    /* Synchronize */
 
+    /* Streams and Events */
+    IDM_GPU_STREAM_CREATE   = 0x22,    /* cuStreamCreate() */
+    IDM_GPU_STREAM_DESTROY  = 0x23,    /* cuStreamDestroy() */
+    IDM_GPU_STREAM_SYNC     = 0x24,    /* cuStreamSynchronize() */
+    IDM_GPU_STREAM_WAIT_EVENT = 0x25,  /* cuStreamWaitEvent() */
+    IDM_GPU_EVENT_CREATE    = 0x26,    /* cuEventCreate() */
+    IDM_GPU_EVENT_DESTROY   = 0x27,    /* cuEventDestroy() */
+    IDM_GPU_EVENT_RECORD    = 0x28,    /* cuEventRecord() */
+    IDM_GPU_EVENT_SYNC      = 0x29,    /* cuEventSynchronize() */
+    IDM_GPU_EVENT_QUERY     = 0x2A,    /* cuEventQuery() */
+    IDM_GPU_EVENT_ELAPSED   = 0x2B,    /* cuEventElapsedTime() */
+
+    /* Modules */
+    IDM_GPU_MODULE_LOAD     = 0x2C,    /* cuModuleLoadData() */
+    IDM_GPU_MODULE_UNLOAD   = 0x2D,    /* cuModuleUnload() */
+    IDM_GPU_MODULE_GET_FUNCTION = 0x2E,/* cuModuleGetFunction() + parameter layout */
+
     /* GPU Information */
     IDM_GPU_GET_INFO        = 0x30,    /* Get GPU info */
     IDM_GPU_GET_PROPS       = 0x31,    /* Get device properties */
 
+    /* Graphs */
+    IDM_GPU_GRAPH_INSTANTIATE = 0x38,  /* Build executable graph from recorded commands */
+    IDM_GPU_GRAPH_LAUNCH    = 0x39,    /* cuGraphLaunch() */
+    IDM_GPU_GRAPH_DESTROY   = 0x3A,    /* cuGraphExecDestroy() */
+
+    /* Command Batching */
+    IDM_BATCH               = 0x40,    /* Packed list of sub-commands */
+
+    /* Session */
+    IDM_DISCONNECT          = 0x50,    /* Zone gone: release all it owns (no response) */
+    IDM_RECLAIM             = 0x51,    /* Proxy -> guest: return cached memory (no response) */
+    IDM_HELLO               = 0x52,    /* Guest process attached: start a session */
+
     /* Responses */
     IDM_RESPONSE_OK         = 0xF0,    /* Success */
     IDM_RESPONSE_ERROR      = 0xF1,    /* Error */
+    IDM_RESPONSE_BATCH      = 0xF2,    /* Results for a BATCH */
 };
 
 /* ============================================================================
@@ -72,14 +123,75 @@ struct idm_header {
     uint32_t dst_zone;     /* Destination zone ID */
     uint64_t seq_num;      /* Sequence number (for matching req/resp) */
     uint32_t payload_len;  /* Size of payload in bytes */
-    uint32_t reserved;     /* Reserved for future use */
+    uint32_t reserved;     /* Flags (IDM_TRACE_SAMPLED) and device, see below */
 } __attribute__((packed));
 
+/*
+ * Devices
+ *
+ * A guest sees the virtual devices the proxy placed it on (0..count-1,
+ * GET_INFO IDM_INFO_DEVICE_COUNT). Every request names the guest's
+ * current device in bits 8-15 of header.reserved, and runs on the
+ * physical GPU behind it; a BATCH's sub-commands run on the BATCH's.
+ */
+#define IDM_MAX_DEVICES    16
+#define IDM_DEVICE_SHIFT   8
+#define IDM_DEVICE_MASK    (0xFFu << IDM_DEVICE_SHIFT)
+
+static inline uint32_t idm_header_device(const struct idm_header *header)
+{
+    return (header->reserved & IDM_DEVICE_MASK) >> IDM_DEVICE_SHIFT;
+}
+
+static inline void idm_header_set_device(struct idm_header *header, uint32_t device)
+{
+    header->reserved = (header->reserved & ~IDM_DEVICE_MASK) |
+                       ((device << IDM_DEVICE_SHIFT) & IDM_DEVICE_MASK);
+}
+
 /* ============================================================================
  * Message Payloads
  * ============================================================================ */
 
-/* GPU_ALLOC: Allocate GPU memory */
+/*
+ * Device addresses
+ *
+ * Guests don't see real device pointers. Each memory handle owns a range
+ * of a virtual address space, found from the slot in the handle's low
+ * bits; an address inside it is that handle plus an offset:
+ *
+ *   IDM_VA_BASE | slot << IDM_VA_SLOT_SHIFT | offset
+ *
+ * Requests name memory as handle + offset. Only kernel arguments carry
+ * addresses, which the proxy translates. Host regions (HOST_REGISTER) use
+ * the same layout for IDM_COPY_HOST copies.
+ */
+#define IDM_VA_BASE        (1ull << 56)
+#define IDM_VA_SLOT_SHIFT  36
+#define IDM_VA_SLOT_MASK   0xFFFFFull           /* Slots per address space */
+#define IDM_VA_OFFSET_MASK ((1ull << IDM_VA_SLOT_SHIFT) - 1)
+#define IDM_VA_RANGE_MAX   (1ull << IDM_VA_SLOT_SHIFT)  /* Largest allocation */
+
+/* Base address of a memory handle's range */
+static inline uint64_t idm_va_of_handle(uint64_t handle)
+{
+    return IDM_VA_BASE | (handle & IDM_VA_SLOT_MASK) << IDM_VA_SLOT_SHIFT;
+}
+
+/* Is addr inside the device address space? */
+static inline bool idm_va_valid(uint64_t addr)
+{
+    /* Slot and offset fill every bit below the base */
+    return (addr & ~(IDM_VA_BASE - 1)) == IDM_VA_BASE;
+}
+
+/* Slot of an address (idm_va_valid(addr)) */
+static inline uint32_t idm_va_slot(uint64_t addr)
+{
+    return (uint32_t)((addr >> IDM_VA_SLOT_SHIFT) & IDM_VA_SLOT_MASK);
+}
+
+/* GPU_ALLOC: Allocate GPU memory (at most IDM_VA_RANGE_MAX bytes) */
 struct idm_gpu_alloc {
     uint64_t size;         /* Size in bytes */
     uint32_t flags;        /* Allocation flags */
@@ -91,12 +203,71 @@ struct idm_gpu_free {
     uint64_t handle;       /* Handle from GPU_ALLOC */
 } __attribute__((packed));
 
+/*
+ * HOST_REGISTER: Map a guest-shared host region and pin it
+ *
+ * The guest creates the region with idm_conn_region_create(); in Xen mode
+ * it grants one page per grant reference, the list sitting in the bulk
+ * region (stub mode finds the region by ID and sends no list). The proxy
+ * maps it once and registers it with the driver, so copies to and from it
+ * (IDM_COPY_HOST) DMA straight from guest pages. Region handle in
+ * result_handle.
+ */
+#define IDM_HOST_REGION_MAX (256ull << 20)   /* Largest region (whole pages) */
+#define IDM_HOST_REGION_IDS 4096             /* Region IDs per zone */
+
+struct idm_host_register {
+    uint64_t size;         /* Bytes, multiple of IDM_PAGE_SIZE */
+    uint64_t gref_offset;  /* Grant list offset in the bulk region */
+    uint32_t gref_count;   /* size / IDM_PAGE_SIZE, or 0 without grants */
+    uint32_t region_id;    /* Guest's ID for the region */
+} __attribute__((packed));
+
+/* HOST_UNREGISTER: Unpin and unmap (waits for the device like cuMemFreeHost) */
+struct idm_host_unregister {
+    uint64_t region_handle;/* Handle from HOST_REGISTER */
+} __attribute__((packed));
+
+/*
+ * GPU_MEM_EXPORT: Share one of our allocations with other zones
+ *
+ * Granted zones may use the handle (and addresses inside it) like one of
+ * their own, for copies, fills and kernels; only the owner can free it or
+ * change the grants. A new list replaces the old one (zone_count 0
+ * revokes all). Work the other zones already queued is not cancelled;
+ * freeing the memory ends every grant.
+ */
+#define IDM_GRANT_MAX 8
+
+struct idm_gpu_mem_export {
+    uint64_t handle;       /* Handle from GPU_ALLOC */
+    uint32_t zone_count;   /* Entries in zones (<= IDM_GRANT_MAX) */
+    uint32_t reserved;
+    uint32_t zones[IDM_GRANT_MAX];
+} __attribute__((packed));
+
+/* GPU_MEM_IMPORT: Check access to another zone's handle (its size as a
+ * uint64_t in the response data) */
+struct idm_gpu_mem_import {
+    uint64_t handle;       /* Owner's handle */
+} __attribute__((packed));
+
+/* Copy flags (where the host side of a copy lives) */
+#define IDM_COPY_INLINE  0x0   /* Data follows the request in the ring */
+#define IDM_COPY_BULK    0x1   /* Data lives in the bulk region at bulk_offset */
+#define IDM_COPY_HOST    0x2   /* bulk_offset is idm_va_of_handle(region handle) +
+                                * offset in a registered host region */
+
 /* GPU_COPY_H2D: Copy host to device */
 struct idm_gpu_copy_h2d {
     uint64_t dst_handle;   /* Destination GPU handle */
     uint64_t dst_offset;   /* Offset in destination */
     uint64_t size;         /* Size to copy */
-    /* Data follows immediately after this struct */
+    uint64_t bulk_offset;  /* Offset in bulk region (IDM_COPY_BULK) */
+    uint64_t stream_handle;/* Stream handle (0 = synchronous copy) */
+    uint32_t flags;        /* IDM_COPY_* */
+    uint32_t reserved;
+    /* Data follows immediately after this struct (IDM_COPY_INLINE) */
 } __attribute__((packed));
 
 /* GPU_COPY_D2H: Copy device to host */
@@ -104,37 +275,98 @@ struct idm_gpu_copy_d2h {
     uint64_t src_handle;   /* Source GPU handle */
     uint64_t src_offset;   /* Offset in source */
     uint64_t size;         /* Size to copy */
+    uint64_t bulk_offset;  /* Offset in bulk region (IDM_COPY_BULK) */
+    uint64_t stream_handle;/* Stream handle (0 = synchronous copy) */
+    uint32_t flags;        /* IDM_COPY_* */
+    uint32_t reserved;
 } __attribute__((packed));
 
-/* GPU_COPY_D2D: Copy device to device */
+/* GPU_COPY_D2D: Copy device to device (on the device, answered once queued;
+ * across GPUs it is a peer copy) */
 struct idm_gpu_copy_d2d {
     uint64_t dst_handle;   /* Destination GPU handle */
     uint64_t src_handle;   /* Source GPU handle */
     uint64_t dst_offset;   /* Offset in destination */
     uint64_t src_offset;   /* Offset in source */
     uint64_t size;         /* Size to copy */
+    uint64_t stream_handle;/* Stream handle (0 = default stream) */
 } __attribute__((packed));
 
-/* GPU_MEMSET: Fill GPU memory */
+/*
+ * GPU_MEMSET: Fill GPU memory with a 1, 2 or 4 byte value
+ *
+ * Fills height rows of width elements, pitch bytes apart (height 1 for a
+ * plain range). Runs on the device: the cost doesn't grow with the size.
+ * Answered once queued, like a kernel launch.
+ */
 struct idm_gpu_memset {
     uint64_t handle;       /* GPU handle */
-    uint64_t offset;       /* Offset */
-    uint32_t value;        /* Value to fill (repeated byte) */
-    uint64_t size;         /* Size */
+    uint64_t offset;       /* Offset of the first row */
+    uint64_t pitch;        /* Bytes between rows (height > 1) */
+    uint64_t width;        /* Elements per row */
+    uint64_t height;       /* Rows */
+    uint64_t stream_handle;/* Stream handle (0 = default stream) */
+    uint32_t value;        /* Element value (low element_size bytes) */
+    uint32_t element_size; /* 1, 2 or 4 */
+} __attribute__((packed));
+
+/* Kernel argument limits (the driver's own limit is 4 KB) */
+#define IDM_KERNEL_ARGS_MAX   4096
+#define IDM_KERNEL_PARAMS_MAX 256
+
+/* GPU_MODULE_LOAD: Load a PTX/cubin/fatbin image (module handle in result_handle) */
+struct idm_gpu_module_load {
+    uint64_t size;         /* Image bytes (PTX includes its NUL) */
+    uint64_t bulk_offset;  /* Offset in bulk region (IDM_COPY_BULK) */
+    uint32_t flags;        /* IDM_COPY_* */
+    uint32_t reserved;
+    /* Image follows immediately after this struct (IDM_COPY_INLINE) */
+} __attribute__((packed));
+
+/* GPU_MODULE_UNLOAD: Unload module (its function handles go with it) */
+struct idm_gpu_module {
+    uint64_t module_handle;/* Handle from GPU_MODULE_LOAD */
+} __attribute__((packed));
+
+/*
+ * GPU_MODULE_GET_FUNCTION: Look up a kernel
+ *
+ * Answered with the function handle in result_handle, the parameter count
+ * in result_value and one idm_kernel_param per parameter as response data.
+ * Launches pack their arguments at those offsets.
+ */
+struct idm_gpu_module_get_function {
+    uint64_t module_handle;/* Handle from GPU_MODULE_LOAD */
+    uint32_t name_len;     /* Bytes of name that follow (no NUL) */
+    uint32_t reserved;
+    /* Kernel name follows */
+} __attribute__((packed));
+
+struct idm_kernel_param {
+    uint32_t offset;       /* Offset in the argument blob */
+    uint32_t size;         /* Bytes */
 } __attribute__((packed));
 
-/* GPU_LAUNCH_KERNEL: Launch GPU kernel */
+/*
+ * GPU_LAUNCH_KERNEL: Launch GPU kernel
+ *
+ * Arguments travel as one blob in the function's parameter layout (see
+ * GPU_MODULE_GET_FUNCTION). 8-byte arguments holding an address inside
+ * one of the zone's allocations are translated to the device pointer by
+ * the proxy.
+ */
 struct idm_gpu_launch_kernel {
-    uint64_t function_handle;  /* Kernel function handle */
+    uint64_t function_handle;  /* Handle from GPU_MODULE_GET_FUNCTION */
+    uint64_t stream_handle;    /* Stream handle (0 = default stream) */
     uint32_t grid_dim_x;       /* Grid dimensions */
     uint32_t grid_dim_y;
     uint32_t grid_dim_z;
     uint32_t block_dim_x;      /* Block dimensions */
     uint32_t block_dim_y;
     uint32_t block_dim_z;
-    uint32_t shared_mem;       /* Shared memory size */
-    uint32_t num_args;         /* Number of kernel arguments */
-    /* Kernel arguments follow */
+    uint32_t shared_mem;       /* Dynamic shared memory bytes */
+    uint32_t arg_size;         /* Bytes of argument blob that follow */
+    /* Argument blob follows */
 } __attribute__((packed));
 
 /* GPU_SYNC: Synchronize */
@@ -143,9 +375,188 @@ struct idm_gpu_sync {
     uint32_t reserved;
 } __attribute__((packed));
 
+/*
+ * Stream-ordered requests (copies with a stream_handle, event records,
+ * stream waits) are answered once the work has actually run on the GPU,
+ * so the sender can keep staging buffers until then.
+ */
+
+/* GPU_STREAM_CREATE: Create stream */
+struct idm_gpu_stream_create {
+    uint32_t flags;        /* CU_STREAM_* flags */
+    int32_t priority;      /* Stream priority */
+} __attribute__((packed));
+
+/* GPU_STREAM_DESTROY / GPU_STREAM_SYNC: Stream operations */
+struct idm_gpu_stream {
+    uint64_t stream_handle;/* Handle from GPU_STREAM_CREATE */
+} __attribute__((packed));
+
+/* GPU_STREAM_WAIT_EVENT: Make stream wait on event */
+struct idm_gpu_stream_wait_event {
+    uint64_t stream_handle;/* Stream handle (0 = default stream) */
+    uint64_t event_handle; /* Event to wait for */
+    uint32_t flags;
+    uint32_t reserved;
+} __attribute__((packed));
+
+/* GPU_EVENT_CREATE: Create event */
+struct idm_gpu_event_create {
+    uint32_t flags;        /* CU_EVENT_* flags */
+    uint32_t reserved;
+} __attribute__((packed));
+
+/* GPU_EVENT_DESTROY / GPU_EVENT_SYNC / GPU_EVENT_QUERY: Event operations */
+struct idm_gpu_event {
+    uint64_t event_handle; /* Handle from GPU_EVENT_CREATE */
+} __attribute__((packed));
+
+/* GPU_EVENT_RECORD: Record event on stream */
+struct idm_gpu_event_record {
+    uint64_t event_handle; /* Event to record */
+    uint64_t stream_handle;/* Stream handle (0 = default stream) */
+} __attribute__((packed));
+
+/* GPU_EVENT_ELAPSED: Time between two events (float ms in result_value) */
+struct idm_gpu_event_elapsed {
+    uint64_t start_handle;
+    uint64_t end_handle;
+} __attribute__((packed));
+
 /* GPU_GET_INFO: Get GPU information */
 struct idm_gpu_get_info {
-    uint32_t info_type;    /* What info to get */
+    uint32_t info_type;    /* What info to get (idm_info_type) */
+    uint32_t reserved;
+} __attribute__((packed));
+
+enum idm_info_type {
+    IDM_INFO_DEVICE_COUNT  = 1,    /* Virtual devices, in result_value */
+    IDM_INFO_DEVICE_MEMORY = 2,    /* Bytes of the header's device, in result_handle */
+};
+
+/*
+ * GPU_GET_PROPS: Everything static about the header's device (no payload)
+ *
+ * Answered with a struct idm_gpu_props as response data and the zone's
+ * device count in result_value, so a guest fetches it once per device at
+ * startup and answers name/UUID/memory/attribute queries locally. One
+ * device per request keeps the response within a ring entry.
+ */
+#define IDM_PROPS_NAME_MAX   256
+#define IDM_PROPS_ATTR_MAX   192   /* Attribute IDs covered (CUdevice_attribute) */
+
+struct idm_gpu_props {
+    char name[IDM_PROPS_NAME_MAX];
+    uint8_t uuid[16];
+    uint64_t total_mem;            /* Bytes (the zone's quota if smaller) */
+    int32_t driver_version;
+    uint32_t attr_count;           /* Attribute IDs below this were queried */
+    uint8_t attr_valid[IDM_PROPS_ATTR_MAX / 8];    /* Bit per ID: the driver knew it */
+    int32_t attrs[IDM_PROPS_ATTR_MAX];             /* Value by attribute ID */
+} __attribute__((packed));
+
+static inline bool idm_props_attr(const struct idm_gpu_props *props, uint32_t attr, int32_t *value)
+{
+    if (attr >= props->attr_count || attr >= IDM_PROPS_ATTR_MAX ||
+        !(props->attr_valid[attr / 8] & (1u << (attr % 8)))) {
+        return false;
+    }
+    *value = props->attrs[attr];
+    return true;
+}
+
+/*
+ * BATCH: Several requests in one message
+ *
+ * Sub-commands keep their own seq_num and payload layout and run in order,
+ * exactly as if they had been sent one by one. The proxy answers with a
+ * single RESPONSE_BATCH carrying one result per sub-command (sub-commands
+ * answered later from the GPU, e.g. stream-ordered ones, get their own
+ * RESPONSE_OK/ERROR instead).
+ */
+struct idm_batch {
+    uint32_t count;        /* Number of sub-commands / results */
+    uint32_t reserved;
+    /* BATCH: count x (idm_batch_cmd + payload padded to 8 bytes) follow */
+    /* RESPONSE_BATCH: count x idm_batch_result follow */
+} __attribute__((packed));
+
+struct idm_batch_cmd {
+    uint64_t seq_num;      /* Sequence number of this sub-command */
+    uint16_t msg_type;     /* One of idm_msg_type (not IDM_BATCH) */
+    uint16_t reserved;
+    uint32_t payload_len;  /* Payload bytes following this record */
+} __attribute__((packed));
+
+struct idm_batch_result {
+    uint64_t request_seq;  /* Sub-command sequence number */
+    uint64_t result_handle;/* As in RESPONSE_OK */
+    uint32_t result_value; /* As in RESPONSE_OK */
+    uint32_t error_code;   /* IDM error code (IDM_ERROR_NONE = success) */
+    uint32_t cuda_error;   /* CUDA error code (if applicable) */
+    uint32_t reserved;
+} __attribute__((packed));
+
+/* Most sub-commands per batch (one pending slot each on the client) */
+#define IDM_BATCH_MAX_CMDS IDM_RING_SIZE
+
+/* Space a sub-command occupies in a BATCH payload */
+#define IDM_BATCH_CMD_SPACE(payload_len) \
+    (sizeof(struct idm_batch_cmd) + (((payload_len) + 7) & ~(size_t)7))
+
+/*
+ * GPU_GRAPH_INSTANTIATE: Turn a recorded command list into a graph
+ *
+ * The list has the layout of a BATCH payload's records (idm_batch_cmd with
+ * seq_num 0, payload padded to 8 bytes) and is replayed in order into a
+ * stream capture. Only commands that run entirely on the GPU can be
+ * recorded (GPU_LAUNCH_KERNEL, GPU_MEMSET, GPU_COPY_D2D); their
+ * stream_handle is ignored. Memory handles are resolved once, here. Answered with the
+ * graph handle in result_handle.
+ */
+struct idm_gpu_graph_instantiate {
+    uint64_t size;         /* Bytes of records */
+    uint64_t bulk_offset;  /* Offset in bulk region (IDM_COPY_BULK) */
+    uint32_t flags;        /* IDM_COPY_* */
+    uint32_t count;        /* Number of records */
+    /* Records follow immediately after this struct (IDM_COPY_INLINE) */
+} __attribute__((packed));
+
+/* GPU_GRAPH_LAUNCH: Replay graph on stream (answered once queued) */
+struct idm_gpu_graph_launch {
+    uint64_t graph_handle; /* Handle from GPU_GRAPH_INSTANTIATE */
+    uint64_t stream_handle;/* Stream handle (0 = default stream) */
+} __attribute__((packed));
+
+/* GPU_GRAPH_DESTROY: Destroy graph (launches already queued still run) */
+struct idm_gpu_graph {
+    uint64_t graph_handle; /* Handle from GPU_GRAPH_INSTANTIATE */
+} __attribute__((packed));
+
+/* RECLAIM: Device memory is short, give back what you don't use */
+struct idm_reclaim {
+    uint64_t bytes;        /* Bytes the proxy is missing (0 = unknown) */
+} __attribute__((packed));
+
+/*
+ * HELLO: A guest process attached to the zone's rings
+ *
+ * The rings outlive guest processes, so a new one only maps them and
+ * says hello. This starts a session: whatever the zone still holds from
+ * an earlier process is released (as for DISCONNECT), and the answer has
+ * the first seq_num to use in result_handle and the zone's device count
+ * in result_value.
+ *
+ * Each session's seq_nums start at a new multiple of 2^IDM_SESSION_SHIFT,
+ * above every earlier one, so responses an earlier process left in the
+ * ring never match a new request. HELLO's own seq_num has
+ * IDM_HELLO_SEQ_BIT set for the same reason.
+ */
+#define IDM_SESSION_SHIFT  32
+#define IDM_HELLO_SEQ_BIT  (1ULL << 63)
+
+struct idm_hello {
+    uint32_t pid;          /* Guest process (for the log) */
     uint32_t reserved;
 } __attribute__((packed));
 
@@ -201,13 +612,154 @@ struct idm_ring_entry {
     uint8_t padding[4096 - sizeof(struct idm_message)];  /* Align to page */
 } __attribute__((packed));
 
+/*
+ * v1 ring: IDM_RING_SIZE fixed 4KB slots.
+ *
+ * The first 16 bytes are common to both ring formats. The receiver
+ * advertises its IDM_VERSION_MINOR in reader_minor (0 when IDM_RING_FORMAT=1
+ * makes it read v1 only); before its first message the sender picks the
+ * format and stores it in ring_format (0 = not picked yet, read as v1).
+ * A peer advertising another minor version is refused at attach time.
+ */
 struct idm_ring {
     uint32_t producer;     /* Producer index (written by sender) */
     uint32_t consumer;     /* Consumer index (written by receiver) */
-    uint32_t reserved[2];
+    uint32_t consumer_polling;  /* Receiver is spinning, sender may skip notify */
+    uint16_t reader_minor; /* Receiver's IDM_VERSION_MINOR (written by receiver) */
+    uint16_t ring_format;  /* IDM_RING_FORMAT_* in use (written by sender) */
     struct idm_ring_entry entries[IDM_RING_SIZE];
 } __attribute__((packed));
 
+/* Ring formats */
+#define IDM_RING_FORMAT_V1 1   /* Fixed slots (struct idm_ring) */
+#define IDM_RING_FORMAT_V2 2   /* Variable-length records (struct idm_ring_v2) */
+
+#define IDM_CACHE_LINE 64
+
+/* v2 record area (power of 2, byte offsets run freely mod 2^32) */
+#define IDM_RING_V2_DATA_SIZE (128 * 1024)
+
+/* Records start on this boundary */
+#define IDM_RECORD_ALIGN 8
+
+/* Record length marking "rest of the ring is unused, continue at 0" */
+#define IDM_RECORD_WRAP 0xFFFFFFFFu
+
+/*
+ * v2 record: length word followed by the message. A record never
+ * straddles the end of the data area; the sender writes a wrap marker
+ * instead and starts again at offset 0.
+ */
+struct idm_record {
+    uint32_t len;          /* Record bytes incl. this header (aligned), or IDM_RECORD_WRAP */
+    uint32_t reserved;
+} __attribute__((packed));
+
+/* Bytes used by a record carrying a msg_size byte message */
+#define IDM_RECORD_SPACE(msg_size) \
+    ((sizeof(struct idm_record) + (msg_size) + IDM_RECORD_ALIGN - 1) & \
+     ~(size_t)(IDM_RECORD_ALIGN - 1))
+
+/*
+ * v2 ring: producer and consumer on their own cache lines (no false
+ * sharing between domains), and a byte-addressed record area so small
+ * control messages pack densely.
+ */
+struct idm_ring_v2 {
+    /* Line 0: common header (see struct idm_ring); producer/consumer unused */
+    uint32_t v1_producer;
+    uint32_t v1_consumer;
+    uint32_t consumer_polling;
+    uint16_t reader_minor;
+    uint16_t ring_format;
+    uint8_t pad0[IDM_CACHE_LINE - 16];
+
+    /* Line 1: written by the sender */
+    uint32_t producer;     /* Byte offset after the last published record */
+    uint8_t pad1[IDM_CACHE_LINE - 4];
+
+    /* Line 2: written by the receiver */
+    uint32_t consumer;     /* Byte offset of the oldest unreleased record */
+    uint8_t pad2[IDM_CACHE_LINE - 4];
+
+    uint8_t data[IDM_RING_V2_DATA_SIZE];
+
+    /* Slack: a reader clamped to one entry's size never leaves the mapping */
+    uint8_t tail_pad[sizeof(struct idm_ring_entry)];
+} __attribute__((aligned(IDM_CACHE_LINE)));
+
+/* Shared memory backing one ring (large enough for either format) */
+#define IDM_RING_SEGMENT_SIZE \
+    (sizeof(struct idm_ring_v2) > sizeof(struct idm_ring) ? \
+     sizeof(struct idm_ring_v2) : sizeof(struct idm_ring))
+
+/* Pages per ring (Xen mode grants each one; a ring is one grant ref array) */
+#define IDM_RING_PAGES ((IDM_RING_SEGMENT_SIZE + IDM_PAGE_SIZE - 1) / IDM_PAGE_SIZE)
+
+/* Huge page size for rings and bulk regions (stub mode, IDM_HUGEPAGES=1) */
+#define IDM_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+/* Largest payload that fits in a single ring entry */
+#define IDM_ENTRY_PAYLOAD_MAX \
+    (sizeof(struct idm_ring_entry) - sizeof(struct idm_message))
+
+/* Largest H2D copy that still fits inline in a single ring entry */
+#define IDM_INLINE_DATA_MAX \
+    (IDM_ENTRY_PAYLOAD_MAX - sizeof(struct idm_gpu_copy_h2d))
+
+/* Largest argument blob a launch can carry (tighter than IDM_KERNEL_ARGS_MAX) */
+#define IDM_LAUNCH_ARGS_MAX \
+    (IDM_ENTRY_PAYLOAD_MAX - sizeof(struct idm_gpu_launch_kernel))
+
+/* ============================================================================
+ * Tracing
+ *
+ * A sender sets IDM_TRACE_SAMPLED in header.reserved to ask every hop to
+ * record the request. Each side keeps timed spans in per-connection
+ * buffers (see idm_trace_enable) and writes them out as Chrome trace
+ * JSON (chrome://tracing, ui.perfetto.dev), one process per zone, spans
+ * tagged with seq_num and the requesting zone. Peers that don't trace
+ * ignore the bit.
+ *
+ * Timestamps are CLOCK_MONOTONIC. Guest and proxy files line up when both
+ * run on one host (stub mode); across Xen domains only spans of the same
+ * file are comparable.
+ * ============================================================================ */
+
+/* header.reserved bits */
+#define IDM_TRACE_SAMPLED 0x1u     /* Record spans for this request */
+
+/* Spans per connection buffer (power of 2; the oldest are overwritten) */
+#define IDM_TRACE_EVENTS 65536
+
+enum idm_trace_stage {
+    IDM_TRACE_CALL = 0,    /* Guest: submitted until the response arrived */
+    IDM_TRACE_SUBMIT,      /* Guest: marshalling, batching, slot waits */
+    IDM_TRACE_SEND,        /* Writing a message into the TX ring */
+    IDM_TRACE_RING_FULL,   /* Send refused, TX ring full (-ENOSPC) */
+    IDM_TRACE_QUEUE,       /* Proxy: received until a worker took it */
+    IDM_TRACE_HANDLER,     /* Proxy: the request's handler */
+    IDM_TRACE_CUDA,        /* Proxy: one driver call */
+    IDM_TRACE_RESPOND,     /* Proxy: building and publishing a response */
+    IDM_TRACE_STAGES
+};
+
+struct idm_trace_span {
+    uint64_t start_ns;
+    uint64_t end_ns;
+    uint64_t seq_num;      /* Request the span belongs to */
+    uint32_t zone;         /* Zone that sent the request */
+    uint16_t msg_type;     /* idm_msg_type of the request */
+    uint16_t stage;        /* idm_trace_stage */
+};
+
+/* ============================================================================
+ * Transport Connection
+ * ============================================================================ */
+
+/* One zone-to-zone link (rings, notifications, bulk region); see transport.c */
+struct idm_connection;
+
 /* ============================================================================
  * Helper Functions
  * ============================================================================ */
@@ -222,6 +774,9 @@ static inline size_t idm_message_size(const struct idm_message *msg)
 
 /**
  * Validate message header
+ *
+ * Headers from any other protocol version, major or minor, are rejected:
+ * versions are not interoperable (1.0 peers also use other stub keys).
  */
 static inline bool idm_message_valid(const struct idm_message *msg)
 {
@@ -254,16 +809,41 @@ static inline const char *idm_msg_type_str(enum idm_msg_type type)
     switch (type) {
         case IDM_GPU_ALLOC:         return "GPU_ALLOC";
         case IDM_GPU_FREE:          return "GPU_FREE";
+        case IDM_HOST_REGISTER:     return "HOST_REGISTER";
+        case IDM_HOST_UNREGISTER:   return "HOST_UNREGISTER";
+        case IDM_GPU_MEM_EXPORT:    return "GPU_MEM_EXPORT";
+        case IDM_GPU_MEM_IMPORT:    return "GPU_MEM_IMPORT";
         case IDM_GPU_COPY_H2D:      return "GPU_COPY_H2D";
         case IDM_GPU_COPY_D2H:      return "GPU_COPY_D2H";
         case IDM_GPU_COPY_D2D:      return "GPU_COPY_D2D";
         case IDM_GPU_MEMSET:        return "GPU_MEMSET";
         case IDM_GPU_LAUNCH_KERNEL: return "GPU_LAUNCH_KERNEL";
         case IDM_GPU_SYNC:          return "GPU_SYNC";
+        case IDM_GPU_STREAM_CREATE: return "GPU_STREAM_CREATE";
+        case IDM_GPU_STREAM_DESTROY: return "GPU_STREAM_DESTROY";
+        case IDM_GPU_STREAM_SYNC:   return "GPU_STREAM_SYNC";
+        case IDM_GPU_STREAM_WAIT_EVENT: return "GPU_STREAM_WAIT_EVENT";
+        case IDM_GPU_EVENT_CREATE:  return "GPU_EVENT_CREATE";
+        case IDM_GPU_EVENT_DESTROY: return "GPU_EVENT_DESTROY";
+        case IDM_GPU_EVENT_RECORD:  return "GPU_EVENT_RECORD";
+        case IDM_GPU_EVENT_SYNC:    return "GPU_EVENT_SYNC";
+        case IDM_GPU_EVENT_QUERY:   return "GPU_EVENT_QUERY";
+        case IDM_GPU_EVENT_ELAPSED: return "GPU_EVENT_ELAPSED";
+        case IDM_GPU_MODULE_LOAD:   return "GPU_MODULE_LOAD";
+        case IDM_GPU_MODULE_UNLOAD: return "GPU_MODULE_UNLOAD";
+        case IDM_GPU_MODULE_GET_FUNCTION: return "GPU_MODULE_GET_FUNCTION";
         case IDM_GPU_GET_INFO:      return "GPU_GET_INFO";
         case IDM_GPU_GET_PROPS:     return "GPU_GET_PROPS";
+        case IDM_GPU_GRAPH_INSTANTIATE: return "GPU_GRAPH_INSTANTIATE";
+        case IDM_GPU_GRAPH_LAUNCH:  return "GPU_GRAPH_LAUNCH";
+        case IDM_GPU_GRAPH_DESTROY: return "GPU_GRAPH_DESTROY";
+        case IDM_BATCH:             return "BATCH";
+        case IDM_DISCONNECT:        return "DISCONNECT";
+        case IDM_RECLAIM:           return "RECLAIM";
+        case IDM_HELLO:             return "HELLO";
         case IDM_RESPONSE_OK:       return "RESPONSE_OK";
         case IDM_RESPONSE_ERROR:    return "RESPONSE_ERROR";
+        case IDM_RESPONSE_BATCH:    return "RESPONSE_BATCH";
         default:                     return "UNKNOWN";
     }
 }
@@ -7,14 +7,16 @@
  * Usage:
  *   Terminal 1: ./idm_test server
  *   Terminal 2: ./idm_test client
+ *
+ *   ./idm_test ring   (both ends in one process, checks ring framing)
  */
 
 #include "idm.h"
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <time.h>
 
 /* Declare transport functions */
 int idm_init(uint32_t local_zone_id, uint32_t remote_zone_id, bool is_server);
@@ -24,10 +26,18 @@ struct idm_message *idm_build_message(uint32_t dst_zone, enum idm_msg_type msg_t
                                        const void *payload, size_t payload_len);
 void idm_free_message(struct idm_message *msg);
 void idm_cleanup(void);
+struct idm_connection *idm_conn_open(uint32_t local_zone_id, uint32_t remote_zone_id,
+                                     bool is_server);
+struct idm_message *idm_conn_reserve(struct idm_connection *conn, enum idm_msg_type msg_type,
+                                     size_t payload_len);
+int idm_conn_commit(struct idm_connection *conn, struct idm_message *msg);
+int idm_conn_recv(struct idm_connection *conn, struct idm_message **msg_out, int timeout_ms);
+void idm_conn_close(struct idm_connection *conn);
 
 /* Zone IDs */
 #define DRIVER_ZONE_ID 1
 #define USER_ZONE_ID 2
+#define RING_TEST_ZONE_ID 200  /* Out of the way of a running proxy's zones */
 
 /* ============================================================================
  * Server (Driver Domain) Mode
@@ -233,8 +243,6 @@ void run_client(void)
             continue;
         }
 
-        uint64_t req_seq = req->header.seq_num;
-
         if (idm_send(req) < 0) {
             fprintf(stderr, "Failed to send request\n");
             idm_free_message(req);
@@ -266,59 +274,153 @@ void run_client(void)
 }
 
 /* ============================================================================
- * Performance Test
+ * Ring Test (both ends in this process)
  * ============================================================================ */
 
-void run_perf_test(void)
+/**
+ * Publish a message whose payload is payload_len bytes of pattern
+ *
+ * @return The message as it sits in the ring (the peer's view), or NULL
+ */
+static struct idm_message *ring_send(struct idm_connection *conn, size_t payload_len,
+                                     uint8_t pattern)
 {
-    printf("=== Performance Test ===\n");
-
-    sleep(2);
-
-    if (idm_init(USER_ZONE_ID, DRIVER_ZONE_ID, false) < 0) {
-        fprintf(stderr, "Failed to initialize IDM\n");
-        return;
+    struct idm_message *msg = idm_conn_reserve(conn, IDM_GPU_SYNC, payload_len);
+    if (!msg) {
+        return NULL;
     }
+    memset(msg->payload, pattern, payload_len);
+    idm_conn_commit(conn, msg);
+    return msg;
+}
 
-    printf("Measuring IDM round-trip latency...\n");
+/**
+ * Receive one message and check its size and payload
+ */
+static int ring_expect(struct idm_connection *conn, size_t payload_len, uint8_t pattern)
+{
+    struct idm_message *msg = NULL;
+    int ret = idm_conn_recv(conn, &msg, 1000);
+    if (ret < 0) {
+        fprintf(stderr, "    recv failed: %d\n", ret);
+        return -1;
+    }
 
-    const int iterations = 1000;
-    struct timespec start, end;
+    int bad = msg->header.payload_len != payload_len;
+    for (size_t i = 0; !bad && i < payload_len; i++) {
+        bad = msg->payload[i] != pattern;
+    }
+    if (bad) {
+        fprintf(stderr, "    Got %u bytes, expected %zu of 0x%02x\n",
+                msg->header.payload_len, payload_len, pattern);
+    }
 
-    clock_gettime(CLOCK_MONOTONIC, &start);
+    idm_free_message(msg);
+    return bad ? -1 : 0;
+}
 
-    for (int i = 0; i < iterations; i++) {
-        /* Send request */
-        struct idm_gpu_alloc alloc = { .size = 1024, .flags = 0 };
-        struct idm_message *req = idm_build_message(
-            DRIVER_ZONE_ID,
-            IDM_GPU_ALLOC,
-            &alloc,
-            sizeof(alloc)
-        );
+/**
+ * Odd-sized messages through many wraps of the v2 record area, then
+ * records a broken or hostile sender could publish: each must be dropped
+ * with -EINVAL, and the ring must keep working afterwards.
+ */
+int run_ring_test(void)
+{
+    printf("=== Ring Test ===\n");
 
-        idm_send(req);
-        idm_free_message(req);
+    struct idm_connection *rx = idm_conn_open(DRIVER_ZONE_ID, RING_TEST_ZONE_ID, true);
+    struct idm_connection *tx = idm_conn_open(RING_TEST_ZONE_ID, DRIVER_ZONE_ID, false);
+    if (!rx || !tx) {
+        fprintf(stderr, "Failed to open connections\n");
+        return 1;
+    }
 
-        /* Receive response */
-        struct idm_message *resp = NULL;
-        idm_recv(&resp, 5000);
-        idm_free_message(resp);
+    int failed = 0;
+
+    /* Enough traffic to wrap the data area many times, a few records in flight */
+    const int count = 4000;
+    const int in_flight = 7;
+    size_t total = 0;
+    printf("Sending %d odd-sized messages...\n", count);
+    for (int i = 0; i < count && !failed; i += in_flight) {
+        int n = count - i < in_flight ? count - i : in_flight;
+        for (int j = 0; j < n; j++) {
+            size_t len = ((size_t)(i + j) * 1237) % (IDM_ENTRY_PAYLOAD_MAX + 1);
+            if (!ring_send(tx, len, (uint8_t)(i + j))) {
+                fprintf(stderr, "    Send %d failed\n", i + j);
+                failed++;
+                break;
+            }
+            total += IDM_RECORD_SPACE(sizeof(struct idm_header) + len);
+        }
+        for (int j = 0; j < n && !failed; j++) {
+            size_t len = ((size_t)(i + j) * 1237) % (IDM_ENTRY_PAYLOAD_MAX + 1);
+            if (ring_expect(rx, len, (uint8_t)(i + j)) < 0) {
+                fprintf(stderr, "    Message %d corrupted\n", i + j);
+                failed++;
+            }
+        }
     }
+    printf("  %s: %zu bytes, %zu wraps\n", failed ? "FAILED" : "OK",
+           total, total / IDM_RING_V2_DATA_SIZE);
+
+    /* Corrupt a published record in place, as the peer could */
+    static const struct {
+        const char *what;
+        uint32_t len;             /* Record length written (0 = keep) */
+        uint32_t payload_len;     /* Message payload_len written (0 = keep) */
+    } bad[] = {
+        { "record shorter than a header", IDM_RECORD_ALIGN, 0 },
+        { "unaligned record",             IDM_RECORD_SPACE(sizeof(struct idm_header)) + 1, 0 },
+        { "record larger than an entry",
+          IDM_RECORD_SPACE(sizeof(struct idm_ring_entry)) + IDM_RECORD_ALIGN, 0 },
+        { "record past the producer",     IDM_RING_V2_DATA_SIZE - IDM_RECORD_ALIGN, 0 },
+        { "record length all ones",       0xFFFFFFF8u, 0 },
+        { "payload longer than record",   0, IDM_ENTRY_PAYLOAD_MAX },
+        { "payload over protocol max",    0, IDM_MAX_PAYLOAD_SIZE + 1 },
+    };
+
+    for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+        printf("Publishing %s...\n", bad[i].what);
+
+        struct idm_message *msg = ring_send(tx, 16, 0xAA);
+        if (!msg) {
+            fprintf(stderr, "    Send failed\n");
+            failed++;
+            continue;
+        }
+        if (bad[i].len) {
+            ((struct idm_record *)msg - 1)->len = bad[i].len;
+        }
+        if (bad[i].payload_len) {
+            msg->header.payload_len = bad[i].payload_len;
+        }
 
-    clock_gettime(CLOCK_MONOTONIC, &end);
+        struct idm_message *got = NULL;
+        int ret = idm_conn_recv(rx, &got, 1000);
+        if (ret != -EINVAL) {
+            fprintf(stderr, "    Expected -EINVAL, got %d\n", ret);
+            if (ret == 0) {
+                idm_free_message(got);
+            }
+            failed++;
+            continue;
+        }
 
-    double elapsed = (end.tv_sec - start.tv_sec) +
-                     (end.tv_nsec - start.tv_nsec) / 1e9;
-    double avg_latency = (elapsed / iterations) * 1e6;  /* microseconds */
+        /* The ring recovers: the next good message arrives intact */
+        if (!ring_send(tx, 100 + i, (uint8_t)i) || ring_expect(rx, 100 + i, (uint8_t)i) < 0) {
+            fprintf(stderr, "    Ring unusable afterwards\n");
+            failed++;
+            continue;
+        }
+        printf("  OK: rejected\n");
+    }
 
-    printf("\nResults:\n");
-    printf("  Iterations: %d\n", iterations);
-    printf("  Total time: %.3f seconds\n", elapsed);
-    printf("  Average round-trip: %.2f µs\n", avg_latency);
-    printf("  Throughput: %.2f ops/sec\n", iterations / elapsed);
+    idm_conn_close(tx);
+    idm_conn_close(rx);
 
-    idm_cleanup();
+    printf("\n%s\n", failed ? "Ring test FAILED" : "Ring test passed");
+    return failed ? 1 : 0;
 }
 
 /* ============================================================================
@@ -328,15 +430,15 @@ void run_perf_test(void)
 int main(int argc, char **argv)
 {
     if (argc < 2) {
-        fprintf(stderr, "Usage: %s {server|client|perf}\n", argv[0]);
+        fprintf(stderr, "Usage: %s {server|client|ring}\n", argv[0]);
         fprintf(stderr, "\n");
         fprintf(stderr, "Run in two terminals:\n");
         fprintf(stderr, "  Terminal 1: %s server\n", argv[0]);
         fprintf(stderr, "  Terminal 2: %s client\n", argv[0]);
         fprintf(stderr, "\n");
-        fprintf(stderr, "Or for performance test:\n");
-        fprintf(stderr, "  Terminal 1: %s server\n", argv[0]);
-        fprintf(stderr, "  Terminal 2: %s perf\n", argv[0]);
+        fprintf(stderr, "Ring framing self-test (one process): %s ring\n", argv[0]);
+        fprintf(stderr, "\n");
+        fprintf(stderr, "For performance, see gpu-proxy/libvgpu/bench.c\n");
         return 1;
     }
 
@@ -344,8 +446,8 @@ int main(int argc, char **argv)
         run_server();
     } else if (strcmp(argv[1], "client") == 0) {
         run_client();
-    } else if (strcmp(argv[1], "perf") == 0) {
-        run_perf_test();
+    } else if (strcmp(argv[1], "ring") == 0) {
+        return run_ring_test();
     } else {
         fprintf(stderr, "Unknown mode: %s\n", argv[1]);
         return 1;
@@ -5,6 +5,22 @@
  * Also includes stub mode using POSIX shared memory for local testing.
  *
  * Compile with -DUSE_XEN for Xen mode, without for stub mode.
+ *
+ * A process may hold many connections (the proxy has one per guest zone).
+ * Every open connection is in a registry keyed by remote zone, so
+ * idm_send() can route a response by its dst_zone and idm_poll() can
+ * report which connections have messages waiting.
+ *
+ * Two ring formats exist (see idm.h): v1 fixed 4KB slots and v2
+ * variable-length records. Each ring's format is chosen by its sender from
+ * what the receiver advertises (IDM_RING_FORMAT=1 keeps a receiver on v1).
+ * Both ends must run the same protocol version: a peer advertising another
+ * one is refused at attach time, and headers of another version are
+ * dropped as invalid.
+ *
+ * Receive policy is spin-then-block: a receiver first busy-polls its ring
+ * for up to IDM_SPIN_US microseconds (default 0 = block right away) and
+ * flags the ring while doing so, letting senders skip the notification.
  */
 
 #include "idm.h"
@@ -15,13 +31,17 @@
 #include <unistd.h>
 #include <pthread.h>
 #include <sys/mman.h>
+#include <poll.h>
+#include <time.h>
 
 #ifdef USE_XEN
 #include <xenctrl.h>
 #include <xenstore.h>
 #include <xenevtchn.h>
+#include <xengnttab.h>
 #include <xen/xen.h>
 #include <xen/grant_table.h>
+#include <sys/epoll.h>
 #else
 /* Stub mode: POSIX shared memory */
 #include <sys/ipc.h>
@@ -34,6 +54,16 @@
  * Connection State
  * ============================================================================ */
 
+/* A peeked record: where it starts and where consumer goes once it's done */
+struct rx_borrow {
+    uint32_t start;
+    uint32_t end;
+    bool done;       /* Released (or dropped as invalid) */
+};
+
+/* Most records a v2 ring can hold at once (power of 2) */
+#define RX_BORROW_MAX 4096
+
 struct idm_connection {
     uint32_t local_zone_id;
     uint32_t remote_zone_id;
@@ -45,13 +75,27 @@ struct idm_connection {
     evtchn_port_t local_port;
     evtchn_port_t remote_port;
 
-    /* Grant table references */
-    uint32_t tx_gref;  /* TX ring grant reference */
-    uint32_t rx_gref;  /* RX ring grant reference */
+    /* Maps the remote domain's grants */
+    xengnttab_handle *gnttab;
+
+    /* Grants host regions to the remote domain (opened on first use,
+     * under conn_lock) */
+    xengntshr_handle *gntshr;
+
+    /* Grant table references (one per ring page) */
+    uint32_t tx_grefs[IDM_RING_PAGES];
+    uint32_t rx_grefs[IDM_RING_PAGES];
 
     /* Mapped ring buffers */
     struct idm_ring *tx_ring;
     struct idm_ring *rx_ring;
+
+    /* Bulk staging region (granted by the user domain) */
+    uint32_t bulk_grefs[IDM_BULK_PAGES];
+    void *bulk;
+
+    /* Liveness checks (opened on first use) */
+    struct xs_handle *xs;
 #else
     /* Stub mode: POSIX shared memory */
     int tx_shmid;
@@ -59,21 +103,76 @@ struct idm_connection {
     struct idm_ring *tx_ring;
     struct idm_ring *rx_ring;
 
+    /* Bulk staging region */
+    int bulk_shmid;
+    void *bulk;
+
     sem_t *tx_sem;  /* Notify remote */
     sem_t *rx_sem;  /* Wait for messages */
 #endif
 
-    /* Sequence number tracking */
+    /* The same rings as v2 (struct idm_ring is packed, so these are set
+     * from the mapped address rather than cast from tx_ring/rx_ring) */
+    struct idm_ring_v2 *tx_ring_v2;
+    struct idm_ring_v2 *rx_ring_v2;
+
+    /* Sequence number tracking (taken with an atomic add, any thread) */
     uint64_t next_seq;
-    pthread_mutex_t seq_lock;
+
+    /* Serializes producers on tx_ring (senders may be on any thread);
+     * held from idm_conn_reserve() until idm_conn_commit() */
+    pthread_mutex_t tx_lock;
+
+    /* Ring formats in use (IDM_RING_FORMAT_*, 0 = not settled yet) */
+    uint16_t tx_format;
+    uint16_t rx_format;
+
+    /* Reserved TX record (idm_conn_reserve() until idm_conn_commit()) */
+    struct idm_message *tx_reserved;
+    uint32_t tx_reserved_end;        /* Producer value once committed */
+
+    /* RX cursor: next slot (v1) or byte offset (v2) to hand out. The
+     * ring's consumer trails it by the borrowed (peeked, not yet released)
+     * records, which are tracked in rx_borrowed. */
+    uint32_t rx_next;
+    struct rx_borrow *rx_borrowed;   /* FIFO of RX_BORROW_MAX entries */
+    uint32_t rx_borrow_head;
+    uint32_t rx_borrow_tail;
+    pthread_mutex_t rx_lock;         /* Guards consumer and rx_borrowed */
+
+    /* Current spin budget in µs (adapts between spin_budget() and 1/8 of it) */
+    unsigned int spin_us;
+
+    /* Trace spans recorded on this connection (NULL = tracing off) */
+    struct trace_buf *trace;
 
     /* Connection state */
     bool connected;
     pthread_mutex_t conn_lock;
 };
 
-/* Global connection (simplified for POC - one connection per process) */
-static struct idm_connection *global_conn = NULL;
+/* Most connections one process can hold */
+#define IDM_MAX_CONNECTIONS 64
+
+/* Open connections (registry_lock) */
+static struct idm_connection *registry[IDM_MAX_CONNECTIONS];
+static pthread_rwlock_t registry_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/* Connection behind the legacy idm_init()/idm_recv() API */
+static struct idm_connection *default_conn = NULL;
+
+void idm_conn_close(struct idm_connection *conn);
+
+#ifdef USE_XEN
+/* Readiness set over all event channel fds (idm_poll) */
+static int poll_epfd = -1;
+#endif
+
+/* Configured spin budget in µs (-1 = IDM_SPIN_US not read yet) */
+static int spin_budget_us = -1;
+
+/* idm_poll()'s own adaptive spin budget */
+static unsigned int poll_spin_us = 0;
 
 /* ============================================================================
  * Memory Barriers
@@ -96,6 +195,15 @@ static struct idm_connection *global_conn = NULL;
 #define mb()  __asm__ __volatile__("":::"memory")
 #endif
 
+/* Spin-wait hint (lets the sibling hyperthread run, saves power) */
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __asm__ __volatile__("pause":::"memory")
+#elif defined(__aarch64__) || defined(__arm__)
+#define cpu_relax() __asm__ __volatile__("yield":::"memory")
+#else
+#define cpu_relax() __asm__ __volatile__("":::"memory")
+#endif
+
 /* ============================================================================
  * Xen-Specific Functions
  * ============================================================================ */
@@ -114,63 +222,132 @@ static int init_event_channel(struct idm_connection *conn)
     }
 
     /* Bind to remote domain's event channel */
-    conn->local_port = xenevtchn_bind_interdomain(
+    xenevtchn_port_or_error_t port = xenevtchn_bind_interdomain(
         conn->evtchn_handle,
         conn->remote_zone_id,
         conn->remote_port
     );
 
-    if (conn->local_port < 0) {
+    if (port < 0) {
         fprintf(stderr, "Failed to bind event channel: %s\n", strerror(errno));
         xenevtchn_close(conn->evtchn_handle);
         return -1;
     }
 
+    conn->local_port = port;
     return 0;
 }
 
+/**
+ * Wait for an event on the connection's channel
+ *
+ * @return 0 if notified, -EAGAIN on timeout (timeout_ms < 0 = forever)
+ */
+static int wait_event_channel(struct idm_connection *conn, int timeout_ms)
+{
+    struct pollfd pfd = {
+        .fd = xenevtchn_fd(conn->evtchn_handle),
+        .events = POLLIN
+    };
+
+    if (poll(&pfd, 1, timeout_ms) <= 0) {
+        return -EAGAIN;
+    }
+
+    return 0;
+}
+
+/**
+ * Acknowledge a pending event and re-arm the channel
+ */
+static void ack_event_channel(struct idm_connection *conn)
+{
+    xenevtchn_port_or_error_t port = xenevtchn_pending(conn->evtchn_handle);
+    if (port >= 0) {
+        xenevtchn_unmask(conn->evtchn_handle, port);
+    }
+}
+
 /**
  * Map grant table pages
+ *
+ * A ring spans IDM_RING_PAGES pages, each granted separately; they are
+ * mapped as one virtually contiguous ring.
  */
 static int map_grant_pages(struct idm_connection *conn)
 {
+    conn->gnttab = xengnttab_open(NULL, 0);
+    if (!conn->gnttab) {
+        fprintf(stderr, "Failed to open grant table: %s\n", strerror(errno));
+        return -1;
+    }
+
     /* Map TX ring (we write, remote reads) */
-    void *tx_addr = xc_gnttab_map_grant_ref(
-        conn->local_zone_id,
+    void *tx_addr = xengnttab_map_domain_grant_refs(
+        conn->gnttab,
+        IDM_RING_PAGES,
         conn->remote_zone_id,
-        conn->tx_gref,
+        conn->tx_grefs,
         PROT_READ | PROT_WRITE
     );
 
     if (tx_addr == NULL) {
-        fprintf(stderr, "Failed to map TX grant page\n");
+        fprintf(stderr, "Failed to map TX grant pages\n");
+        xengnttab_close(conn->gnttab);
         return -1;
     }
 
     conn->tx_ring = (struct idm_ring *)tx_addr;
+    conn->tx_ring_v2 = (struct idm_ring_v2 *)tx_addr;
 
     /* Map RX ring (remote writes, we read) */
-    void *rx_addr = xc_gnttab_map_grant_ref(
-        conn->local_zone_id,
+    void *rx_addr = xengnttab_map_domain_grant_refs(
+        conn->gnttab,
+        IDM_RING_PAGES,
         conn->remote_zone_id,
-        conn->rx_gref,
+        conn->rx_grefs,
         PROT_READ | PROT_WRITE
     );
 
     if (rx_addr == NULL) {
-        fprintf(stderr, "Failed to map RX grant page\n");
-        xc_gnttab_munmap(tx_addr, 1);
+        fprintf(stderr, "Failed to map RX grant pages\n");
+        xengnttab_unmap(conn->gnttab, tx_addr, IDM_RING_PAGES);
+        xengnttab_close(conn->gnttab);
         return -1;
     }
 
     conn->rx_ring = (struct idm_ring *)rx_addr;
+    conn->rx_ring_v2 = (struct idm_ring_v2 *)rx_addr;
 
     /* Initialize ring indices */
     if (conn->is_server) {
         conn->tx_ring->producer = 0;
         conn->tx_ring->consumer = 0;
+        conn->tx_ring->ring_format = 0;
+    }
+
+    return 0;
+}
+
+/**
+ * Map bulk staging region (one grant ref per page)
+ */
+static int map_bulk_pages(struct idm_connection *conn)
+{
+    void *bulk_addr = xengnttab_map_domain_grant_refs(
+        conn->gnttab,
+        IDM_BULK_PAGES,
+        conn->remote_zone_id,
+        conn->bulk_grefs,
+        PROT_READ | PROT_WRITE
+    );
+
+    if (bulk_addr == NULL) {
+        fprintf(stderr, "Failed to map bulk grant pages\n");
+        return -1;
     }
 
+    conn->bulk = bulk_addr;
     return 0;
 }
 
@@ -182,31 +359,70 @@ static int map_grant_pages(struct idm_connection *conn)
 
 #ifndef USE_XEN
 
+/*
+ * Ring segment key for messages from src to dst zone (one segment per
+ * direction per zone pair, so a driver zone can serve many user zones)
+ */
+#define STUB_RING_KEY(src, dst) (0x10000 + (((src) & 0xFF) << 8) + ((dst) & 0xFF))
+
+/* Highest zone ID the stub keys can tell apart (ring, bulk and region
+ * keys keep 8 bits of it); idm_conn_open refuses larger ones */
+#define STUB_MAX_ZONE 0xFF
+
+/**
+ * Get (or create) a shared memory segment
+ *
+ * With IDM_HUGEPAGES=1 a new segment is backed by huge pages (its size
+ * rounded up to IDM_HUGE_PAGE_SIZE), so a ring or bulk region takes one
+ * TLB entry instead of hundreds. Falls back to normal pages when none
+ * are reserved (see /proc/sys/vm/nr_hugepages). A segment that already
+ * exists is attached as it is.
+ */
+static int stub_shmget(key_t key, size_t size)
+{
+    const char *env = getenv("IDM_HUGEPAGES");
+    if (env && atoi(env) > 0) {
+        size_t huge_size = (size + IDM_HUGE_PAGE_SIZE - 1) & ~(size_t)(IDM_HUGE_PAGE_SIZE - 1);
+        int shmid = shmget(key, huge_size, IPC_CREAT | SHM_HUGETLB | 0666);
+        if (shmid >= 0) {
+            return shmid;
+        }
+    }
+
+    return shmget(key, size, IPC_CREAT | 0666);
+}
+
 /**
  * Initialize POSIX shared memory (for testing without Xen)
+ *
+ * Semaphores are per receiving zone: every sender to a zone posts the same
+ * one, so it works as a doorbell for all of that zone's connections. A post
+ * only means "some ring may have data", readers always check the ring.
  */
 static int init_shm(struct idm_connection *conn)
 {
-    key_t tx_key = 0x1000 + conn->local_zone_id;
-    key_t rx_key = 0x1000 + conn->remote_zone_id;
+    key_t tx_key = STUB_RING_KEY(conn->local_zone_id, conn->remote_zone_id);
+    key_t rx_key = STUB_RING_KEY(conn->remote_zone_id, conn->local_zone_id);
 
     /* Create or get TX shared memory */
-    size_t ring_size = sizeof(struct idm_ring);
-    conn->tx_shmid = shmget(tx_key, ring_size, IPC_CREAT | 0666);
+    size_t ring_size = IDM_RING_SEGMENT_SIZE;
+    conn->tx_shmid = stub_shmget(tx_key, ring_size);
     if (conn->tx_shmid < 0) {
         fprintf(stderr, "Failed to create TX shared memory: %s\n", strerror(errno));
         return -1;
     }
 
     /* Attach TX shared memory */
-    conn->tx_ring = (struct idm_ring *)shmat(conn->tx_shmid, NULL, 0);
-    if (conn->tx_ring == (void *)-1) {
+    void *tx_addr = shmat(conn->tx_shmid, NULL, 0);
+    if (tx_addr == (void *)-1) {
         fprintf(stderr, "Failed to attach TX shared memory: %s\n", strerror(errno));
         return -1;
     }
+    conn->tx_ring = (struct idm_ring *)tx_addr;
+    conn->tx_ring_v2 = (struct idm_ring_v2 *)tx_addr;
 
     /* Create or get RX shared memory */
-    conn->rx_shmid = shmget(rx_key, ring_size, IPC_CREAT | 0666);
+    conn->rx_shmid = stub_shmget(rx_key, ring_size);
     if (conn->rx_shmid < 0) {
         fprintf(stderr, "Failed to create RX shared memory: %s\n", strerror(errno));
         shmdt(conn->tx_ring);
@@ -214,12 +430,14 @@ static int init_shm(struct idm_connection *conn)
     }
 
     /* Attach RX shared memory */
-    conn->rx_ring = (struct idm_ring *)shmat(conn->rx_shmid, NULL, 0);
-    if (conn->rx_ring == (void *)-1) {
+    void *rx_addr = shmat(conn->rx_shmid, NULL, 0);
+    if (rx_addr == (void *)-1) {
         fprintf(stderr, "Failed to attach RX shared memory: %s\n", strerror(errno));
         shmdt(conn->tx_ring);
         return -1;
     }
+    conn->rx_ring = (struct idm_ring *)rx_addr;
+    conn->rx_ring_v2 = (struct idm_ring_v2 *)rx_addr;
 
     /* Initialize rings if server */
     if (conn->is_server) {
@@ -257,246 +475,1435 @@ static int init_shm(struct idm_connection *conn)
     return 0;
 }
 
+/**
+ * Initialize bulk staging region
+ *
+ * The segment is keyed by the user domain's zone ID, so both sides of a
+ * connection attach the same one.
+ */
+static int init_bulk_shm(struct idm_connection *conn)
+{
+    uint32_t user_zone = conn->is_server ? conn->remote_zone_id : conn->local_zone_id;
+    key_t bulk_key = 0x2000 + user_zone;
+
+    conn->bulk_shmid = stub_shmget(bulk_key, IDM_BULK_SIZE);
+    if (conn->bulk_shmid < 0) {
+        fprintf(stderr, "Failed to create bulk shared memory: %s\n", strerror(errno));
+        return -1;
+    }
+
+    conn->bulk = shmat(conn->bulk_shmid, NULL, 0);
+    if (conn->bulk == (void *)-1) {
+        fprintf(stderr, "Failed to attach bulk shared memory: %s\n", strerror(errno));
+        conn->bulk = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
 #endif /* !USE_XEN */
 
 /* ============================================================================
- * Public API
+ * Connection Registry
  * ============================================================================ */
 
 /**
- * Initialize IDM connection
+ * Add connection to registry (one per remote zone)
  */
-int idm_init(uint32_t local_zone_id, uint32_t remote_zone_id, bool is_server)
+static int registry_add(struct idm_connection *conn)
 {
-    if (global_conn != NULL) {
-        fprintf(stderr, "IDM already initialized\n");
-        return -EALREADY;
+    int ret = -ENOSPC;
+
+    pthread_rwlock_wrlock(&registry_lock);
+
+    for (int i = 0; i < IDM_MAX_CONNECTIONS; i++) {
+        if (registry[i] && registry[i]->remote_zone_id == conn->remote_zone_id) {
+            ret = -EEXIST;
+            break;
+        }
     }
 
-    struct idm_connection *conn = calloc(1, sizeof(*conn));
-    if (!conn) {
-        return -ENOMEM;
+    if (ret != -EEXIST) {
+        for (int i = 0; i < IDM_MAX_CONNECTIONS; i++) {
+            if (!registry[i]) {
+                registry[i] = conn;
+                ret = 0;
+                break;
+            }
+        }
     }
 
-    conn->local_zone_id = local_zone_id;
-    conn->remote_zone_id = remote_zone_id;
-    conn->is_server = is_server;
-    conn->next_seq = 1;
+    pthread_rwlock_unlock(&registry_lock);
 
-    pthread_mutex_init(&conn->seq_lock, NULL);
-    pthread_mutex_init(&conn->conn_lock, NULL);
+    return ret;
+}
 
-#ifdef USE_XEN
-    fprintf(stderr, "IDM: Initializing Xen transport\n");
+/**
+ * Remove connection from registry
+ */
+static void registry_remove(struct idm_connection *conn)
+{
+    pthread_rwlock_wrlock(&registry_lock);
 
-    if (init_event_channel(conn) < 0) {
-        free(conn);
-        return -1;
+    for (int i = 0; i < IDM_MAX_CONNECTIONS; i++) {
+        if (registry[i] == conn) {
+            registry[i] = NULL;
+        }
     }
 
-    if (map_grant_pages(conn) < 0) {
-        xenevtchn_close(conn->evtchn_handle);
-        free(conn);
-        return -1;
-    }
+    pthread_rwlock_unlock(&registry_lock);
+}
 
-    fprintf(stderr, "IDM: Xen transport initialized\n");
-#else
-    fprintf(stderr, "IDM: Initializing stub mode (POSIX shared memory)\n");
+/**
+ * Find connection to a remote zone
+ */
+struct idm_connection *idm_conn_lookup(uint32_t remote_zone_id)
+{
+    struct idm_connection *found = NULL;
 
-    if (init_shm(conn) < 0) {
-        free(conn);
-        return -1;
-    }
+    pthread_rwlock_rdlock(&registry_lock);
 
-    fprintf(stderr, "IDM: Stub mode initialized\n");
-#endif
+    for (int i = 0; i < IDM_MAX_CONNECTIONS; i++) {
+        if (registry[i] && registry[i]->remote_zone_id == remote_zone_id) {
+            found = registry[i];
+            break;
+        }
+    }
 
-    conn->connected = true;
-    global_conn = conn;
+    pthread_rwlock_unlock(&registry_lock);
 
-    return 0;
+    return found;
 }
 
+/* ============================================================================
+ * Ring Formats
+ * ============================================================================ */
+
 /**
- * Send message
+ * Highest ring format this process may use (IDM_RING_FORMAT=1 forces v1)
  */
-int idm_send(struct idm_message *msg)
+static uint16_t local_ring_format(void)
 {
-    if (!global_conn || !global_conn->connected) {
-        return -ENOTCONN;
+    const char *env = getenv("IDM_RING_FORMAT");
+    if (env && atoi(env) == IDM_RING_FORMAT_V1) {
+        return IDM_RING_FORMAT_V1;
     }
+    return IDM_RING_FORMAT_V2;
+}
 
-    struct idm_connection *conn = global_conn;
-    struct idm_ring *ring = conn->tx_ring;
-
-    /* Validate message */
-    if (!idm_message_valid(msg)) {
-        fprintf(stderr, "IDM: Invalid message\n");
-        return -EINVAL;
+/**
+ * Work out which format the sender uses on our RX ring
+ *
+ * @return IDM_RING_FORMAT_*, or 0 while neither format has seen traffic
+ */
+static uint16_t rx_ring_format(struct idm_connection *conn)
+{
+    if (conn->rx_format) {
+        return conn->rx_format;
     }
 
-    size_t msg_size = idm_message_size(msg);
-    if (msg_size > sizeof(struct idm_ring_entry)) {
-        fprintf(stderr, "IDM: Message too large: %zu (max %zu)\n",
-                msg_size, sizeof(struct idm_ring_entry));
-        return -EINVAL;
+    volatile struct idm_ring *ring = conn->rx_ring;
+
+    /* A v2 sender sets ring_format before publishing its first record */
+    if (ring->ring_format == IDM_RING_FORMAT_V2) {
+        conn->rx_format = IDM_RING_FORMAT_V2;
+        conn->rx_next = conn->rx_ring_v2->consumer;
+    } else if (ring->producer != ring->consumer) {
+        conn->rx_format = IDM_RING_FORMAT_V1;
+        conn->rx_next = ring->consumer;
     }
 
-    /* Get producer/consumer indices */
-    uint32_t prod = ring->producer;
-    uint32_t cons = ring->consumer;
+    return conn->rx_format;
+}
 
-    /* Check if ring is full */
-    if (prod - cons >= IDM_RING_SIZE) {
-        fprintf(stderr, "IDM: Ring buffer full\n");
-        return -ENOSPC;
+/**
+ * Check whether the RX ring holds a message we haven't handed out
+ */
+static bool rx_pending(struct idm_connection *conn)
+{
+    switch (rx_ring_format(conn)) {
+    case IDM_RING_FORMAT_V1:
+        return conn->rx_next != ((volatile struct idm_ring *)conn->rx_ring)->producer;
+    case IDM_RING_FORMAT_V2:
+        return conn->rx_next != ((volatile struct idm_ring_v2 *)conn->rx_ring_v2)->producer;
+    default:
+        return false;
     }
+}
 
-    /* Write message to ring */
-    uint32_t idx = prod % IDM_RING_SIZE;
-    memcpy(&ring->entries[idx].msg, msg, msg_size);
+/* ============================================================================
+ * Spin-Then-Block Receive
+ *
+ * While a receiver busy-polls it sets consumer_polling in its RX ring (the
+ * inverse of Xen's req_event). A sender publishes the producer index,
+ * issues a full barrier, then reads the flag and skips the notification if
+ * it is set. Before blocking, the receiver clears the flag, issues a full
+ * barrier and checks the ring once more, so one side always sees the
+ * other and no wakeup is lost. The flag may stay set after a successful
+ * spin; that only suppresses notifications until the next block.
+ * ============================================================================ */
 
-    /* Memory barrier before updating producer */
-    wmb();
+/* Ring checks between clock reads while spinning */
+#define SPIN_CHECKS_PER_CLOCK 64
 
-    /* Update producer index */
-    ring->producer = prod + 1;
+static int64_t monotonic_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
-    /* Notify remote domain */
-#ifdef USE_XEN
-    xenevtchn_notify(conn->evtchn_handle, conn->local_port);
-#else
-    sem_post(conn->tx_sem);
-#endif
+/**
+ * Configured spin budget in µs (IDM_SPIN_US unless idm_set_spin_us() was called)
+ *
+ * Spinning is off on single-CPU systems.
+ */
+static unsigned int spin_budget(void)
+{
+    if (spin_budget_us < 0) {
+        const char *env = getenv("IDM_SPIN_US");
+        int us = env ? atoi(env) : 0;
 
-    return 0;
+        /* On one CPU the sender can't run while we spin */
+        if (sysconf(_SC_NPROCESSORS_ONLN) <= 1) {
+            us = 0;
+        }
+        spin_budget_us = us > 0 ? us : 0;
+    }
+    return (unsigned int)spin_budget_us;
 }
 
 /**
- * Receive message (blocking)
+ * Next spin budget: full after a hit, halved (down to 1/8) after a miss
+ *
+ * Keeps spinning cheap on an idle link while bursts still get the full
+ * budget.
  */
-int idm_recv(struct idm_message **msg_out, int timeout_ms)
+static unsigned int spin_adapt(unsigned int cur, bool hit)
 {
-    if (!global_conn || !global_conn->connected) {
-        return -ENOTCONN;
+    unsigned int max = spin_budget();
+    unsigned int floor = max / 8;
+
+    if (hit) {
+        return max;
     }
 
-    struct idm_connection *conn = global_conn;
-    struct idm_ring *ring = conn->rx_ring;
+    cur /= 2;
+    return cur < floor ? floor : cur;
+}
 
-#ifdef USE_XEN
-    /* Wait for event channel notification */
-    evtchn_port_or_error_t port = xenevtchn_pending(conn->evtchn_handle);
+/**
+ * Advertise (or stop advertising) that we poll this RX ring
+ */
+static void set_polling(struct idm_connection *conn, bool polling)
+{
+    volatile struct idm_ring *ring = conn->rx_ring;
+    ring->consumer_polling = polling ? 1 : 0;
+    mb();
+}
 
-    if (port < 0) {
-        if (timeout_ms == 0) {
-            return -EAGAIN;
+/**
+ * Busy-poll a connection's RX ring
+ *
+ * @param budget_us Longest time to spin
+ * @return true if a message arrived
+ */
+static bool spin_rx(struct idm_connection *conn, unsigned int budget_us)
+{
+    set_polling(conn, true);
+
+    int64_t end = monotonic_us() + budget_us;
+    do {
+        for (int i = 0; i < SPIN_CHECKS_PER_CLOCK; i++) {
+            if (rx_pending(conn)) {
+                return true;
+            }
+            cpu_relax();
         }
+    } while (monotonic_us() < end);
 
-        /* TODO: Implement timeout using select/poll */
-        port = xenevtchn_pending(conn->evtchn_handle);
-        if (port < 0) {
-            return -EAGAIN;
+    return false;
+}
+
+/**
+ * Set or clear the polling flag on every registered RX ring
+ */
+static void set_polling_all(bool polling)
+{
+    pthread_rwlock_rdlock(&registry_lock);
+    for (int i = 0; i < IDM_MAX_CONNECTIONS; i++) {
+        if (registry[i] && registry[i]->connected) {
+            set_polling(registry[i], polling);
         }
     }
+    pthread_rwlock_unlock(&registry_lock);
+}
 
-    /* Unmask event channel */
-    xenevtchn_unmask(conn->evtchn_handle, port);
-#else
-    /* Wait for semaphore */
-    if (timeout_ms < 0) {
-        /* Block forever */
-        if (sem_wait(conn->rx_sem) < 0) {
-            return -errno;
-        }
-    } else if (timeout_ms == 0) {
-        /* Non-blocking */
-        if (sem_trywait(conn->rx_sem) < 0) {
-            return -EAGAIN;
-        }
-    } else {
-        /* Timed wait */
-#ifdef __APPLE__
-        /* macOS doesn't support sem_timedwait, use polling */
-        int waited_ms = 0;
-        while (sem_trywait(conn->rx_sem) < 0) {
-            if (waited_ms >= timeout_ms) {
-                return -EAGAIN;
-            }
-            usleep(1000);  /* Sleep 1ms */
-            waited_ms++;
-        }
-#else
-        struct timespec ts;
-        clock_gettime(CLOCK_REALTIME, &ts);
-        ts.tv_sec += timeout_ms / 1000;
-        ts.tv_nsec += (timeout_ms % 1000) * 1000000;
+/**
+ * Change the receive spin budget
+ *
+ * Applies to all connections, open or future. 0 disables spinning.
+ */
+void idm_set_spin_us(unsigned int spin_us)
+{
+    spin_budget_us = (int)spin_us;
+    poll_spin_us = spin_us;
 
-        if (sem_timedwait(conn->rx_sem, &ts) < 0) {
-            return -EAGAIN;
+    pthread_rwlock_rdlock(&registry_lock);
+    for (int i = 0; i < IDM_MAX_CONNECTIONS; i++) {
+        if (registry[i]) {
+            registry[i]->spin_us = spin_us;
         }
-#endif
     }
-#endif
+    pthread_rwlock_unlock(&registry_lock);
+}
 
-    /* Read from ring */
-    uint32_t cons = ring->consumer;
-    uint32_t prod = ring->producer;
+/* ============================================================================
+ * Tracing
+ *
+ * Each connection has a ring of IDM_TRACE_EVENTS span slots. A writer (any
+ * thread) claims a slot with one atomic add and marks it complete by
+ * storing its ticket last, so recording never blocks. The dump skips
+ * slots that are mid-write or were lapped while it read them.
+ * ============================================================================ */
+
+struct trace_slot {
+    uint64_t ticket;   /* Claim number + 1 once written (0 = being written) */
+    uint32_t tid;      /* Recording thread (small per-process number) */
+    struct idm_trace_span span;
+};
+
+struct trace_buf {
+    uint64_t next;     /* Slots claimed so far */
+    struct trace_slot slots[IDM_TRACE_EVENTS];
+};
+
+static bool trace_on = false;
+static uint32_t trace_tids = 0;
+static __thread uint32_t trace_tid = 0;
+
+static const char *trace_stage_names[IDM_TRACE_STAGES] = {
+    [IDM_TRACE_CALL] = "call",
+    [IDM_TRACE_SUBMIT] = "submit",
+    [IDM_TRACE_SEND] = "send",
+    [IDM_TRACE_RING_FULL] = "ring full",
+    [IDM_TRACE_QUEUE] = "queue",
+    [IDM_TRACE_HANDLER] = "handler",
+    [IDM_TRACE_CUDA] = "cuda",
+    [IDM_TRACE_RESPOND] = "respond",
+};
+
+static uint64_t monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * Give a connection a trace buffer (if tracing is on and it has none)
+ */
+static void trace_attach(struct idm_connection *conn)
+{
+    if (!trace_on || __atomic_load_n(&conn->trace, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+
+    struct trace_buf *buf = calloc(1, sizeof(*buf));
+    if (!buf) {
+        fprintf(stderr, "IDM: No memory for trace buffer (zone %u)\n", conn->remote_zone_id);
+        return;
+    }
+
+    struct trace_buf *expected = NULL;
+    if (!__atomic_compare_exchange_n(&conn->trace, &expected, buf, false,
+                                     __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        free(buf);
+    }
+}
+
+/**
+ * Start recording trace spans on every connection, open or opened later
+ */
+void idm_trace_enable(void)
+{
+    trace_on = true;
+
+    pthread_rwlock_rdlock(&registry_lock);
+    for (int i = 0; i < IDM_MAX_CONNECTIONS; i++) {
+        if (registry[i]) {
+            trace_attach(registry[i]);
+        }
+    }
+    pthread_rwlock_unlock(&registry_lock);
+}
+
+/**
+ * Whether idm_trace_enable() was called
+ */
+bool idm_trace_enabled(void)
+{
+    return trace_on;
+}
+
+/**
+ * Record a span on a connection (no-op without a trace buffer)
+ */
+void idm_conn_trace(struct idm_connection *conn, const struct idm_trace_span *span)
+{
+    struct trace_buf *buf = conn ? __atomic_load_n(&conn->trace, __ATOMIC_ACQUIRE) : NULL;
+    if (!buf) {
+        return;
+    }
+
+    if (trace_tid == 0) {
+        trace_tid = __atomic_add_fetch(&trace_tids, 1, __ATOMIC_RELAXED);
+    }
+
+    uint64_t ticket = __atomic_fetch_add(&buf->next, 1, __ATOMIC_RELAXED);
+    struct trace_slot *slot = &buf->slots[ticket & (IDM_TRACE_EVENTS - 1)];
+
+    __atomic_store_n(&slot->ticket, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    slot->tid = trace_tid;
+    slot->span = *span;
+    __atomic_store_n(&slot->ticket, ticket + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Record a span of sending a traced message
+ */
+static void trace_send(struct idm_connection *conn, const struct idm_header *hdr,
+                       enum idm_trace_stage stage, uint64_t start_ns)
+{
+    struct idm_trace_span span = {
+        .start_ns = start_ns,
+        .end_ns = monotonic_ns(),
+        .seq_num = hdr->seq_num,
+        .zone = hdr->src_zone,
+        .msg_type = hdr->msg_type,
+        .stage = stage,
+    };
+    idm_conn_trace(conn, &span);
+}
+
+/**
+ * Write one connection's spans as Chrome trace events
+ *
+ * Events are separated by commas; *first says whether one was written yet.
+ */
+static void trace_dump_conn(FILE *out, struct idm_connection *conn, bool *first)
+{
+    struct trace_buf *buf = __atomic_load_n(&conn->trace, __ATOMIC_ACQUIRE);
+    if (!buf) {
+        return;
+    }
+
+    uint32_t pid = conn->local_zone_id;
+    fprintf(out, "%s{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%u,"
+            "\"args\":{\"name\":\"%s (zone %u)\"}}",
+            *first ? "" : ",\n", pid, conn->is_server ? "gpu-proxy" : "guest", pid);
+    *first = false;
+
+    uint64_t end = __atomic_load_n(&buf->next, __ATOMIC_ACQUIRE);
+    uint64_t begin = end > IDM_TRACE_EVENTS ? end - IDM_TRACE_EVENTS : 0;
+
+    for (uint64_t t = begin; t < end; t++) {
+        struct trace_slot *slot = &buf->slots[t & (IDM_TRACE_EVENTS - 1)];
+        if (__atomic_load_n(&slot->ticket, __ATOMIC_ACQUIRE) != t + 1) {
+            continue;
+        }
+        struct idm_trace_span span = slot->span;
+        uint32_t tid = slot->tid;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->ticket, __ATOMIC_RELAXED) != t + 1 ||
+            span.stage >= IDM_TRACE_STAGES || span.end_ns < span.start_ns) {
+            continue;
+        }
+
+        const char *type = idm_msg_type_str((enum idm_msg_type)span.msg_type);
+        const char *stage = trace_stage_names[span.stage];
+        const char *name = span.stage == IDM_TRACE_CALL || span.stage == IDM_TRACE_HANDLER ?
+                           type : stage;
+        unsigned long seq = (unsigned long)span.seq_num;
+        double ts = span.start_ns / 1000.0;
+        double end_ts = span.end_ns / 1000.0;
+
+        if (span.stage == IDM_TRACE_CALL || span.stage == IDM_TRACE_QUEUE) {
+            /* Overlap freely (detached requests, a backed-up queue): async */
+            fprintf(out, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"b\",\"id\":\"%u:%lu\","
+                    "\"pid\":%u,\"tid\":%u,\"ts\":%.3f,"
+                    "\"args\":{\"seq\":%lu,\"zone\":%u,\"type\":\"%s\"}}"
+                    ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"e\",\"id\":\"%u:%lu\","
+                    "\"pid\":%u,\"tid\":%u,\"ts\":%.3f}",
+                    name, stage, span.zone, seq, pid, tid, ts, seq, span.zone, type,
+                    name, stage, span.zone, seq, pid, tid, end_ts);
+            continue;
+        }
+
+        fprintf(out, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":%u,\"tid\":%u,"
+                "\"ts\":%.3f,\"dur\":%.3f,"
+                "\"args\":{\"seq\":%lu,\"zone\":%u,\"type\":\"%s\"}}",
+                name, stage, pid, tid, ts, end_ts - ts, seq, span.zone, type);
+
+        /* Arrows from a guest's send to the proxy's handler of that message */
+        if (span.stage == IDM_TRACE_SEND && !conn->is_server) {
+            fprintf(out, ",\n{\"name\":\"request\",\"cat\":\"flow\",\"ph\":\"s\","
+                    "\"id\":\"%u:%lu\",\"pid\":%u,\"tid\":%u,\"ts\":%.3f}",
+                    span.zone, seq, pid, tid, end_ts);
+        } else if (span.stage == IDM_TRACE_HANDLER) {
+            fprintf(out, ",\n{\"name\":\"request\",\"cat\":\"flow\",\"ph\":\"f\",\"bp\":\"e\","
+                    "\"id\":\"%u:%lu\",\"pid\":%u,\"tid\":%u,\"ts\":%.3f}",
+                    span.zone, seq, pid, tid, ts);
+        }
+    }
+}
+
+/**
+ * Write every connection's spans to a Chrome trace JSON file
+ *
+ * Files from guest and proxy can be merged with
+ *   jq -s '{traceEvents: map(.traceEvents) | add}' a.json b.json
+ *
+ * @return 0 on success, negative errno on failure
+ */
+int idm_trace_dump(const char *path)
+{
+    FILE *out = fopen(path, "w");
+    if (!out) {
+        return -errno;
+    }
+
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+
+    bool first = true;
+    pthread_rwlock_rdlock(&registry_lock);
+    for (int i = 0; i < IDM_MAX_CONNECTIONS; i++) {
+        if (registry[i]) {
+            trace_dump_conn(out, registry[i], &first);
+        }
+    }
+    pthread_rwlock_unlock(&registry_lock);
+
+    fprintf(out, "\n]}\n");
+
+    if (fclose(out) != 0) {
+        return -errno;
+    }
+    return 0;
+}
+
+/* ============================================================================
+ * Connection API
+ * ============================================================================ */
+
+/**
+ * Open connection to a remote zone
+ *
+ * @return Connection, or NULL on failure
+ */
+struct idm_connection *idm_conn_open(uint32_t local_zone_id, uint32_t remote_zone_id,
+                                     bool is_server)
+{
+#ifndef USE_XEN
+    if (local_zone_id > STUB_MAX_ZONE || remote_zone_id > STUB_MAX_ZONE) {
+        fprintf(stderr, "IDM: Stub mode supports zone IDs up to %u (zone %u <-> %u)\n",
+                STUB_MAX_ZONE, local_zone_id, remote_zone_id);
+        return NULL;
+    }
+#endif
+
+    if (idm_conn_lookup(remote_zone_id)) {
+        fprintf(stderr, "IDM: Already connected to zone %u\n", remote_zone_id);
+        return NULL;
+    }
+
+    struct idm_connection *conn = calloc(1, sizeof(*conn));
+    if (!conn) {
+        return NULL;
+    }
+
+    conn->local_zone_id = local_zone_id;
+    conn->remote_zone_id = remote_zone_id;
+    conn->is_server = is_server;
+    conn->next_seq = 1;
+
+    pthread_mutex_init(&conn->tx_lock, NULL);
+    pthread_mutex_init(&conn->rx_lock, NULL);
+    pthread_mutex_init(&conn->conn_lock, NULL);
+
+#ifdef USE_XEN
+    fprintf(stderr, "IDM: Initializing Xen transport (zone %u <-> %u)\n",
+            local_zone_id, remote_zone_id);
+
+    if (init_event_channel(conn) < 0) {
+        free(conn);
+        return NULL;
+    }
+
+    if (map_grant_pages(conn) < 0) {
+        xenevtchn_close(conn->evtchn_handle);
+        free(conn);
+        return NULL;
+    }
+
+    if (map_bulk_pages(conn) < 0) {
+        xengnttab_unmap(conn->gnttab, conn->tx_ring, IDM_RING_PAGES);
+        xengnttab_unmap(conn->gnttab, conn->rx_ring, IDM_RING_PAGES);
+        xengnttab_close(conn->gnttab);
+        xenevtchn_close(conn->evtchn_handle);
+        free(conn);
+        return NULL;
+    }
+
+    /* Add the channel fd to the shared readiness set */
+    if (poll_epfd < 0) {
+        poll_epfd = epoll_create1(EPOLL_CLOEXEC);
+    }
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = conn };
+    if (poll_epfd < 0 ||
+        epoll_ctl(poll_epfd, EPOLL_CTL_ADD, xenevtchn_fd(conn->evtchn_handle), &ev) < 0) {
+        fprintf(stderr, "IDM: Failed to register event channel: %s\n", strerror(errno));
+    }
+
+    fprintf(stderr, "IDM: Xen transport initialized\n");
+#else
+    fprintf(stderr, "IDM: Initializing stub mode (zone %u <-> %u)\n",
+            local_zone_id, remote_zone_id);
+
+    if (init_shm(conn) < 0) {
+        free(conn);
+        return NULL;
+    }
+
+    if (init_bulk_shm(conn) < 0) {
+        shmdt(conn->tx_ring);
+        shmdt(conn->rx_ring);
+        sem_close(conn->tx_sem);
+        sem_close(conn->rx_sem);
+        free(conn);
+        return NULL;
+    }
+
+    fprintf(stderr, "IDM: Stub mode initialized\n");
+#endif
+
+    conn->rx_borrowed = calloc(RX_BORROW_MAX, sizeof(*conn->rx_borrowed));
+    if (!conn->rx_borrowed) {
+        idm_conn_close(conn);
+        return NULL;
+    }
+
+    /* A peer already attached tells its version on our TX ring (0 = not
+     * attached yet, or reading v1 only) */
+    uint16_t peer_minor = ((volatile struct idm_ring *)conn->tx_ring)->reader_minor;
+    if (peer_minor != 0 && peer_minor != IDM_VERSION_MINOR) {
+        fprintf(stderr, "IDM: Zone %u speaks protocol %u.%u, we speak %u.%u\n",
+                remote_zone_id, IDM_VERSION_MAJOR, peer_minor,
+                IDM_VERSION_MAJOR, IDM_VERSION_MINOR);
+        idm_conn_close(conn);
+        return NULL;
+    }
+
+    /* We own the RX ring's reader fields; a previous receiver may have died spinning */
+    conn->rx_ring->consumer_polling = 0;
+    conn->rx_ring->reader_minor =
+        local_ring_format() == IDM_RING_FORMAT_V2 ? IDM_VERSION_MINOR : 0;
+    conn->spin_us = spin_budget();
+    if (poll_spin_us == 0) {
+        poll_spin_us = conn->spin_us;
+    }
+
+    conn->connected = true;
+    trace_attach(conn);
+
+    if (registry_add(conn) < 0) {
+        fprintf(stderr, "IDM: Too many connections\n");
+        conn->connected = false;
+        idm_conn_close(conn);
+        return NULL;
+    }
+
+    return conn;
+}
+
+/**
+ * Pick the TX ring format (once, before the first message)
+ */
+static uint16_t tx_ring_format(struct idm_connection *conn)
+{
+    if (!conn->tx_format) {
+        volatile struct idm_ring *ring = conn->tx_ring;
+        bool v2 = local_ring_format() == IDM_RING_FORMAT_V2 &&
+                  ring->reader_minor >= IDM_RING_V2_MINOR;
+
+        conn->tx_format = v2 ? IDM_RING_FORMAT_V2 : IDM_RING_FORMAT_V1;
+        if (v2) {
+            conn->tx_ring_v2->producer = conn->tx_ring_v2->consumer;
+            ring->ring_format = IDM_RING_FORMAT_V2;
+            wmb();
+        }
+    }
+
+    return conn->tx_format;
+}
+
+/**
+ * Find room for a msg_size byte message in the TX ring (tx_lock held)
+ *
+ * Sets tx_reserved/tx_reserved_end; nothing is visible to the peer until
+ * tx_publish_locked().
+ *
+ * @return Where to write the message, or NULL if the ring is full
+ */
+static struct idm_message *tx_slot_locked(struct idm_connection *conn, size_t msg_size)
+{
+    struct idm_message *msg;
+
+    if (tx_ring_format(conn) == IDM_RING_FORMAT_V1) {
+        struct idm_ring *ring = conn->tx_ring;
+        uint32_t prod = ring->producer;
+
+        /* Check if ring is full */
+        if (prod - ((volatile struct idm_ring *)ring)->consumer >= IDM_RING_SIZE) {
+            return NULL;
+        }
+
+        msg = &ring->entries[prod % IDM_RING_SIZE].msg;
+        conn->tx_reserved_end = prod + 1;
+    } else {
+        struct idm_ring_v2 *ring = conn->tx_ring_v2;
+        uint32_t prod = ring->producer;
+        uint32_t used = prod - ((volatile struct idm_ring_v2 *)ring)->consumer;
+        uint32_t need = IDM_RECORD_SPACE(msg_size);
+
+        /* Records don't straddle the end; skip the tail if it's too short */
+        uint32_t off = prod & (IDM_RING_V2_DATA_SIZE - 1);
+        uint32_t skip = IDM_RING_V2_DATA_SIZE - off < need ? IDM_RING_V2_DATA_SIZE - off : 0;
+
+        if (IDM_RING_V2_DATA_SIZE - used < skip + need) {
+            return NULL;
+        }
+
+        if (skip) {
+            ((struct idm_record *)&ring->data[off])->len = IDM_RECORD_WRAP;
+            off = 0;
+        }
+
+        struct idm_record *rec = (struct idm_record *)&ring->data[off];
+        rec->len = need;
+        rec->reserved = 0;
+
+        msg = (struct idm_message *)(rec + 1);
+        conn->tx_reserved_end = prod + skip + need;
+    }
+
+    conn->tx_reserved = msg;
+    return msg;
+}
+
+/**
+ * Publish the reserved message and notify the peer (tx_lock held, released here)
+ */
+static void tx_publish_locked(struct idm_connection *conn)
+{
+    /* Memory barrier before updating producer */
+    wmb();
+
+    /* Update producer index */
+    if (conn->tx_format == IDM_RING_FORMAT_V1) {
+        conn->tx_ring->producer = conn->tx_reserved_end;
+    } else {
+        conn->tx_ring_v2->producer = conn->tx_reserved_end;
+    }
+    conn->tx_reserved = NULL;
+
+    /* Order the producer store before reading the peer's polling flag */
+    mb();
+    bool peer_polling = ((volatile struct idm_ring *)conn->tx_ring)->consumer_polling != 0;
+
+    pthread_mutex_unlock(&conn->tx_lock);
+
+    /* Notify remote domain (unless it is spinning on the ring anyway) */
+    if (!peer_polling) {
+#ifdef USE_XEN
+        xenevtchn_notify(conn->evtchn_handle, conn->local_port);
+#else
+        sem_post(conn->tx_sem);
+#endif
+    }
+}
+
+/**
+ * Send message on a connection
+ */
+int idm_conn_send(struct idm_connection *conn, struct idm_message *msg)
+{
+    if (!conn || !conn->connected) {
+        return -ENOTCONN;
+    }
+
+    /* Validate message */
+    if (!idm_message_valid(msg)) {
+        fprintf(stderr, "IDM: Invalid message\n");
+        return -EINVAL;
+    }
+
+    size_t msg_size = idm_message_size(msg);
+    if (msg_size > sizeof(struct idm_ring_entry)) {
+        fprintf(stderr, "IDM: Message too large: %zu (max %zu)\n",
+                msg_size, sizeof(struct idm_ring_entry));
+        return -EINVAL;
+    }
+
+    bool traced = (msg->header.reserved & IDM_TRACE_SAMPLED) &&
+                  __atomic_load_n(&conn->trace, __ATOMIC_RELAXED);
+    uint64_t start_ns = traced ? monotonic_ns() : 0;
+
+    pthread_mutex_lock(&conn->tx_lock);
+
+    struct idm_message *slot = tx_slot_locked(conn, msg_size);
+    if (!slot) {
+        pthread_mutex_unlock(&conn->tx_lock);
+        if (traced) {
+            trace_send(conn, &msg->header, IDM_TRACE_RING_FULL, start_ns);
+        }
+        fprintf(stderr, "IDM: Ring buffer full\n");
+        return -ENOSPC;
+    }
+
+    /* Write message to ring */
+    memcpy(slot, msg, msg_size);
+
+    tx_publish_locked(conn);
+
+    if (traced) {
+        trace_send(conn, &msg->header, IDM_TRACE_SEND, start_ns);
+    }
+
+    return 0;
+}
+
+/**
+ * Reserve room in the TX ring and build a message header there
+ *
+ * The caller fills in msg->payload directly and then calls
+ * idm_conn_commit() (or idm_conn_abort()). The connection's TX side stays
+ * locked in between, so keep it short and don't reserve twice.
+ *
+ * @return Message in the ring, or NULL (ring full, too large, ...)
+ */
+struct idm_message *idm_conn_reserve(struct idm_connection *conn,
+                                     enum idm_msg_type msg_type,
+                                     size_t payload_len)
+{
+    if (!conn || !conn->connected) {
+        return NULL;
+    }
+
+    if (payload_len > IDM_ENTRY_PAYLOAD_MAX) {
+        fprintf(stderr, "IDM: Message too large: %zu (max %zu)\n",
+                sizeof(struct idm_header) + payload_len, sizeof(struct idm_ring_entry));
+        return NULL;
+    }
+
+    pthread_mutex_lock(&conn->tx_lock);
+
+    struct idm_message *msg = tx_slot_locked(conn, sizeof(struct idm_header) + payload_len);
+    if (!msg) {
+        pthread_mutex_unlock(&conn->tx_lock);
+        fprintf(stderr, "IDM: Ring buffer full\n");
+        return NULL;
+    }
+
+    uint64_t seq = __atomic_fetch_add(&conn->next_seq, 1, __ATOMIC_RELAXED);
+
+    msg->header.magic = IDM_MAGIC;
+    msg->header.version = IDM_VERSION;
+    msg->header.msg_type = msg_type;
+    msg->header.src_zone = conn->local_zone_id;
+    msg->header.dst_zone = conn->remote_zone_id;
+    msg->header.seq_num = seq;
+    msg->header.payload_len = payload_len;
+    msg->header.reserved = 0;
+
+    return msg;
+}
+
+/**
+ * Send a message built with idm_conn_reserve()
+ */
+int idm_conn_commit(struct idm_connection *conn, struct idm_message *msg)
+{
+    if (msg != conn->tx_reserved) {
+        fprintf(stderr, "IDM: Commit of a message that was not reserved\n");
+        conn->tx_reserved = NULL;
+        pthread_mutex_unlock(&conn->tx_lock);
+        return -EINVAL;
+    }
+
+    tx_publish_locked(conn);
+
+    return 0;
+}
+
+/**
+ * Drop a message built with idm_conn_reserve() without sending it
+ */
+void idm_conn_abort(struct idm_connection *conn)
+{
+    conn->tx_reserved = NULL;
+    pthread_mutex_unlock(&conn->tx_lock);
+}
+
+/**
+ * Wait for a notification on the connection
+ *
+ * @return 0 if notified, -EAGAIN on timeout, negative errno on error
+ */
+static int wait_notify(struct idm_connection *conn, int timeout_ms)
+{
+#ifdef USE_XEN
+    int ret = wait_event_channel(conn, timeout_ms);
+    if (ret == 0) {
+        ack_event_channel(conn);
+    }
+    return ret;
+#else
+    if (timeout_ms < 0) {
+        /* Block forever */
+        if (sem_wait(conn->rx_sem) < 0) {
+            return -errno;
+        }
+    } else if (timeout_ms == 0) {
+        /* Non-blocking */
+        if (sem_trywait(conn->rx_sem) < 0) {
+            return -EAGAIN;
+        }
+    } else {
+        /* Timed wait */
+#ifdef __APPLE__
+        /* macOS doesn't support sem_timedwait, use polling */
+        int waited_ms = 0;
+        while (sem_trywait(conn->rx_sem) < 0) {
+            if (waited_ms >= timeout_ms) {
+                return -EAGAIN;
+            }
+            usleep(1000);  /* Sleep 1ms */
+            waited_ms++;
+        }
+#else
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += timeout_ms / 1000;
+        ts.tv_nsec += (timeout_ms % 1000) * 1000000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+
+        if (sem_timedwait(conn->rx_sem, &ts) < 0) {
+            return -EAGAIN;
+        }
+#endif
+    }
+
+    return 0;
+#endif
+}
+
+static int64_t monotonic_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Wait until the RX ring has a message we haven't handed out yet
+ *
+ * @return 0 when one is there, -EAGAIN on timeout, negative errno on error
+ */
+static int wait_rx(struct idm_connection *conn, int timeout_ms)
+{
+    int64_t deadline = monotonic_ms() + timeout_ms;
+    bool armed = false;
+
+    /* Wait until our ring has something (notifications may be shared) */
+    while (!rx_pending(conn)) {
+        int remaining = -1;
+        if (timeout_ms >= 0) {
+            int64_t left = deadline - monotonic_ms();
+            if (timeout_ms == 0 || left <= 0) {
+                return -EAGAIN;
+            }
+            remaining = (int)left;
+        }
+
+        if (!armed) {
+            /* Spin first (bounded by the timeout), then arm and recheck */
+            unsigned int budget = conn->spin_us;
+            if (remaining >= 0 && (uint64_t)budget > (uint64_t)remaining * 1000) {
+                budget = (unsigned int)remaining * 1000;
+            }
+
+            bool hit = budget > 0 && spin_rx(conn, budget);
+            conn->spin_us = spin_adapt(conn->spin_us, hit);
+            if (hit) {
+                break;
+            }
+
+            set_polling(conn, false);
+            armed = true;
+            continue;
+        }
+
+        int ret = wait_notify(conn, remaining);
+        if (ret < 0 && ret != -EAGAIN) {
+            return ret;
+        }
+    }
+
+#ifndef USE_XEN
+    /* Consume the post that came with this message (if still there) */
+    sem_trywait(conn->rx_sem);
+#endif
+
+    return 0;
+}
+
+/**
+ * Advance consumer past finished records at the head of rx_borrowed (rx_lock held)
+ */
+static void advance_consumer_locked(struct idm_connection *conn)
+{
+    uint32_t cons = 0;
+    bool moved = false;
+
+    while (conn->rx_borrow_head != conn->rx_borrow_tail) {
+        struct rx_borrow *b = &conn->rx_borrowed[conn->rx_borrow_head % RX_BORROW_MAX];
+        if (!b->done) {
+            break;
+        }
+        cons = b->end;
+        moved = true;
+        conn->rx_borrow_head++;
+    }
+
+    if (!moved) {
+        return;
+    }
+
+    if (conn->rx_format == IDM_RING_FORMAT_V1) {
+        conn->rx_ring->consumer = cons;
+    } else {
+        conn->rx_ring_v2->consumer = cons;
+    }
+}
+
+/**
+ * Track a peeked record (done = dropped right away)
+ */
+static void rx_borrow(struct idm_connection *conn, uint32_t start, uint32_t end, bool done)
+{
+    pthread_mutex_lock(&conn->rx_lock);
+
+    struct rx_borrow *b = &conn->rx_borrowed[conn->rx_borrow_tail % RX_BORROW_MAX];
+    b->start = start;
+    b->end = end;
+    b->done = done;
+    conn->rx_borrow_tail++;
+    conn->rx_next = end;
+
+    if (done) {
+        advance_consumer_locked(conn);
+    }
+
+    pthread_mutex_unlock(&conn->rx_lock);
+}
+
+/**
+ * Message of a borrowed record
+ */
+static const struct idm_message *rx_message_at(struct idm_connection *conn, uint32_t start)
+{
+    if (conn->rx_format == IDM_RING_FORMAT_V1) {
+        return &conn->rx_ring->entries[start % IDM_RING_SIZE].msg;
+    }
+
+    const uint8_t *rec = &conn->rx_ring_v2->data[start & (IDM_RING_V2_DATA_SIZE - 1)];
+    return (const struct idm_message *)(rec + sizeof(struct idm_record));
+}
+
+/**
+ * Locate the next record on a v2 RX ring
+ *
+ * @param start [out] Offset of the record (after any wrap marker)
+ * @param end [out] Offset after it
+ * @return 0, or -EINVAL if the framing is broken
+ */
+static int rx_next_record_v2(struct idm_connection *conn, uint32_t *start, uint32_t *end)
+{
+    volatile struct idm_ring_v2 *ring = conn->rx_ring_v2;
+    uint32_t prod = ring->producer;
+    uint32_t pos = conn->rx_next;
 
     /* Memory barrier before reading */
     rmb();
 
-    /* Check if messages available */
-    if (cons == prod) {
-        return -EAGAIN;
+    uint32_t off = pos & (IDM_RING_V2_DATA_SIZE - 1);
+    uint32_t len = prod - pos >= sizeof(struct idm_record) ?
+        ((volatile struct idm_record *)&ring->data[off])->len : 0;
+
+    if (len == IDM_RECORD_WRAP) {
+        pos += IDM_RING_V2_DATA_SIZE - off;
+        off = 0;
+        len = prod - pos >= sizeof(struct idm_record) ?
+            ((volatile struct idm_record *)&ring->data[0])->len : 0;
+    }
+
+    /* Whole record published, inside the data area, plausible size */
+    if (len < IDM_RECORD_SPACE(sizeof(struct idm_header)) ||
+        len > IDM_RECORD_SPACE(sizeof(struct idm_ring_entry)) ||
+        len % IDM_RECORD_ALIGN != 0 ||
+        len > prod - pos ||
+        len > IDM_RING_V2_DATA_SIZE - off) {
+        return -EINVAL;
+    }
+
+    *start = pos;
+    *end = pos + len;
+    return 0;
+}
+
+/**
+ * Borrow the next message in place from the RX ring
+ *
+ * The message stays in the ring (no copy, no allocation) until
+ * idm_conn_release(). Several messages may be borrowed at once, but they
+ * must be released in the order they were peeked; their space doesn't go
+ * back to the sender before that, so a slow consumer throttles its peer.
+ *
+ * The ring is memory the peer can still write: the header was validated
+ * here, but handlers must not trust fields they re-read from it (anything
+ * within IDM_ENTRY_PAYLOAD_MAX of msg->payload stays inside the ring).
+ *
+ * @param timeout_ms 0 = don't block, < 0 = block forever
+ * @return 0 on success, -EAGAIN if nothing arrived in time
+ */
+int idm_conn_peek(struct idm_connection *conn, const struct idm_message **msg_out,
+                  int timeout_ms)
+{
+    if (!conn || !conn->connected) {
+        return -ENOTCONN;
+    }
+
+    int ret = wait_rx(conn, timeout_ms);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (conn->rx_borrow_tail - conn->rx_borrow_head >= RX_BORROW_MAX) {
+        return -ENOBUFS;
+    }
+
+    uint32_t start, end;
+    size_t max_size = sizeof(struct idm_ring_entry);
+
+    if (conn->rx_format == IDM_RING_FORMAT_V1) {
+        start = conn->rx_next;
+        end = start + 1;
+
+        /* Memory barrier before reading */
+        rmb();
+    } else {
+        if (rx_next_record_v2(conn, &start, &end) < 0) {
+            /* Lost framing: drop everything published so far */
+            fprintf(stderr, "IDM: Received corrupt record\n");
+            start = conn->rx_next;
+            end = ((volatile struct idm_ring_v2 *)conn->rx_ring_v2)->producer;
+            rx_borrow(conn, start, end, true);
+            return -EINVAL;
+        }
+        max_size = end - start - sizeof(struct idm_record);
     }
 
     /* Get message from ring */
-    uint32_t idx = cons % IDM_RING_SIZE;
-    struct idm_message *ring_msg = &ring->entries[idx].msg;
+    const struct idm_message *ring_msg = rx_message_at(conn, start);
 
     /* Validate message */
-    if (!idm_message_valid(ring_msg)) {
+    ret = 0;
+    if (!idm_message_valid(ring_msg) || idm_message_size(ring_msg) > max_size) {
         fprintf(stderr, "IDM: Received invalid message\n");
-        ring->consumer = cons + 1;
+        ret = -EINVAL;
+    } else if (ring_msg->header.src_zone != conn->remote_zone_id) {
+        /* A guest can only speak for itself */
+        fprintf(stderr, "IDM: Dropping message from zone %u claiming to be zone %u\n",
+                conn->remote_zone_id, ring_msg->header.src_zone);
+        ret = -EPERM;
+    }
+
+    /* Invalid records are consumed once everything borrowed before them is released */
+    rx_borrow(conn, start, end, ret < 0);
+    if (ret < 0) {
+        return ret;
+    }
+
+    *msg_out = ring_msg;
+    return 0;
+}
+
+/**
+ * Return a borrowed message's ring space to the sender
+ *
+ * May be called from any thread, but in peek order.
+ *
+ * @return 0 on success, -EINVAL if msg is not the oldest borrowed message
+ */
+int idm_conn_release(struct idm_connection *conn, const struct idm_message *msg)
+{
+    pthread_mutex_lock(&conn->rx_lock);
+
+    struct rx_borrow *b = &conn->rx_borrowed[conn->rx_borrow_head % RX_BORROW_MAX];
+    if (conn->rx_borrow_head == conn->rx_borrow_tail ||
+        msg != rx_message_at(conn, b->start)) {
+        pthread_mutex_unlock(&conn->rx_lock);
+        fprintf(stderr, "IDM: Out-of-order release\n");
+        return -EINVAL;
+    }
+
+    /* All reads of the record happen before the sender may reuse it */
+    mb();
+
+    b->done = true;
+    advance_consumer_locked(conn);
+
+    pthread_mutex_unlock(&conn->rx_lock);
+
+    return 0;
+}
+
+/**
+ * Put back the most recently peeked message (nothing borrowed before it)
+ */
+static void rx_unpeek(struct idm_connection *conn)
+{
+    pthread_mutex_lock(&conn->rx_lock);
+    conn->rx_borrow_tail--;
+    conn->rx_next = conn->rx_borrowed[conn->rx_borrow_tail % RX_BORROW_MAX].start;
+    pthread_mutex_unlock(&conn->rx_lock);
+}
+
+/**
+ * Give back the most recently peeked message so the next peek returns it again
+ *
+ * For a consumer that can't take the message right now. Only the newest
+ * borrow can be put back; older ones stay borrowed.
+ *
+ * @return 0 on success, -EINVAL if msg is not the newest borrowed message
+ */
+int idm_conn_unpeek(struct idm_connection *conn, const struct idm_message *msg)
+{
+    pthread_mutex_lock(&conn->rx_lock);
+
+    struct rx_borrow *b = &conn->rx_borrowed[(conn->rx_borrow_tail - 1) % RX_BORROW_MAX];
+    if (conn->rx_borrow_head == conn->rx_borrow_tail ||
+        msg != rx_message_at(conn, b->start)) {
+        pthread_mutex_unlock(&conn->rx_lock);
+        fprintf(stderr, "IDM: Unpeek of a message that isn't the newest\n");
         return -EINVAL;
     }
 
-    /* Allocate copy for caller */
+    conn->rx_borrow_tail--;
+    conn->rx_next = b->start;
+
+    pthread_mutex_unlock(&conn->rx_lock);
+
+    return 0;
+}
+
+/**
+ * Receive message from a connection (copied out, free with idm_free_message)
+ *
+ * Not to be mixed with outstanding idm_conn_peek() borrows.
+ *
+ * @param timeout_ms 0 = don't block, < 0 = block forever
+ * @return 0 on success, -EAGAIN if nothing arrived in time
+ */
+int idm_conn_recv(struct idm_connection *conn, struct idm_message **msg_out, int timeout_ms)
+{
+    if (!conn || !conn->connected) {
+        return -ENOTCONN;
+    }
+
+    if (conn->rx_borrow_head != conn->rx_borrow_tail) {
+        return -EBUSY;
+    }
+
+    const struct idm_message *ring_msg;
+    int ret = idm_conn_peek(conn, &ring_msg, timeout_ms);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* Allocate copy for caller (size was validated by peek; clamp a re-read) */
+    const struct rx_borrow *b = &conn->rx_borrowed[(conn->rx_borrow_tail - 1) % RX_BORROW_MAX];
+    size_t max_size = conn->rx_format == IDM_RING_FORMAT_V1 ?
+        sizeof(struct idm_ring_entry) : b->end - b->start - sizeof(struct idm_record);
+
     size_t msg_size = idm_message_size(ring_msg);
+    if (msg_size > max_size) {
+        msg_size = max_size;
+    }
+
     struct idm_message *msg = malloc(msg_size);
     if (!msg) {
+        rx_unpeek(conn);  /* Leave it in the ring for the next call */
         return -ENOMEM;
     }
 
     memcpy(msg, ring_msg, msg_size);
+    msg->header.payload_len = msg_size - sizeof(struct idm_header);
 
-    /* Memory barrier before updating consumer */
-    wmb();
+    idm_conn_release(conn, ring_msg);
+
+    *msg_out = msg;
+    return 0;
+}
+
+/**
+ * Collect registered connections whose RX ring is non-empty
+ *
+ * @param any [out] Some open connection, NULL if there are none
+ * @return Number of entries stored in ready
+ */
+static int scan_ready(struct idm_connection **ready, int max_ready,
+                      struct idm_connection **any)
+{
+    int count = 0;
+
+    pthread_rwlock_rdlock(&registry_lock);
+    for (int i = 0; i < IDM_MAX_CONNECTIONS && count < max_ready; i++) {
+        struct idm_connection *conn = registry[i];
+        if (!conn || !conn->connected) {
+            continue;
+        }
+        *any = conn;
+        if (rx_pending(conn)) {
+            ready[count++] = conn;
+        }
+    }
+    pthread_rwlock_unlock(&registry_lock);
+
+    return count;
+}
+
+/**
+ * Wait until at least one registered connection has a message
+ *
+ * Stub mode waits on the local zone's doorbell semaphore (shared by all
+ * of its connections); Xen mode waits on an epoll set of event channels.
+ * Either way the reported connections are those whose RX ring is
+ * non-empty, so idm_conn_recv(conn, ..., 0) on them will not block.
+ * With a spin budget set, all rings are busy-polled before blocking.
+ *
+ * @param ready [out] Connections with pending messages
+ * @param max_ready Capacity of ready
+ * @param timeout_ms < 0 = block forever
+ * @return Number of ready connections (0 on timeout), negative errno on error
+ */
+int idm_poll(struct idm_connection **ready, int max_ready, int timeout_ms)
+{
+    int64_t deadline = monotonic_ms() + timeout_ms;
+    bool armed = false;
+
+    for (;;) {
+        struct idm_connection *any = NULL;
+        int count = scan_ready(ready, max_ready, &any);
+
+        if (count > 0) {
+            return count;
+        }
+
+        if (!any) {
+            return -ENOTCONN;
+        }
 
-    /* Update consumer index */
-    ring->consumer = cons + 1;
+        int remaining = -1;
+        if (timeout_ms >= 0) {
+            int64_t left = deadline - monotonic_ms();
+            if (left <= 0) {
+                return 0;
+            }
+            remaining = (int)left;
+        }
+
+        if (!armed) {
+            /* Spin over all rings first, then arm every ring and rescan */
+            unsigned int budget = poll_spin_us;
+            if (remaining >= 0 && (uint64_t)budget > (uint64_t)remaining * 1000) {
+                budget = (unsigned int)remaining * 1000;
+            }
+
+            if (budget > 0) {
+                set_polling_all(true);
+
+                int64_t end = monotonic_us() + budget;
+                do {
+                    for (int i = 0; i < SPIN_CHECKS_PER_CLOCK; i++) {
+                        count = scan_ready(ready, max_ready, &any);
+                        if (count > 0) {
+                            break;
+                        }
+                        cpu_relax();
+                    }
+                } while (count == 0 && monotonic_us() < end);
+
+                poll_spin_us = spin_adapt(poll_spin_us, count > 0);
+                if (count > 0) {
+                    return count;
+                }
+            }
+
+            set_polling_all(false);
+            armed = true;
+            continue;
+        }
 
-    *msg_out = msg;
-    return 0;
+#ifdef USE_XEN
+        struct epoll_event events[IDM_MAX_CONNECTIONS];
+        int n = epoll_wait(poll_epfd, events, IDM_MAX_CONNECTIONS, remaining);
+        if (n < 0 && errno != EINTR) {
+            return -errno;
+        }
+        for (int i = 0; i < n; i++) {
+            ack_event_channel(events[i].data.ptr);
+        }
+#else
+        /* All connections of this zone share one doorbell */
+        if (wait_notify(any, remaining) == 0) {
+            /* Rings are rescanned below; later posts will wake us again */
+            while (sem_trywait(any->rx_sem) == 0) {
+            }
+        }
+#endif
+    }
 }
 
 /**
- * Build message helper
+ * Build message for a connection
  */
-struct idm_message *idm_build_message(
-    uint32_t dst_zone,
+struct idm_message *idm_conn_build_message(
+    struct idm_connection *conn,
     enum idm_msg_type msg_type,
     const void *payload,
     size_t payload_len)
 {
-    if (!global_conn) {
+    if (!conn) {
         return NULL;
     }
 
-    struct idm_connection *conn = global_conn;
-
     /* Allocate message */
     size_t total_size = sizeof(struct idm_header) + payload_len;
     struct idm_message *msg = malloc(total_size);
@@ -505,16 +1912,14 @@ struct idm_message *idm_build_message(
     }
 
     /* Get sequence number */
-    pthread_mutex_lock(&conn->seq_lock);
-    uint64_t seq = conn->next_seq++;
-    pthread_mutex_unlock(&conn->seq_lock);
+    uint64_t seq = __atomic_fetch_add(&conn->next_seq, 1, __ATOMIC_RELAXED);
 
     /* Fill header */
     msg->header.magic = IDM_MAGIC;
     msg->header.version = IDM_VERSION;
     msg->header.msg_type = msg_type;
     msg->header.src_zone = conn->local_zone_id;
-    msg->header.dst_zone = dst_zone;
+    msg->header.dst_zone = conn->remote_zone_id;
     msg->header.seq_num = seq;
     msg->header.payload_len = payload_len;
     msg->header.reserved = 0;
@@ -528,29 +1933,300 @@ struct idm_message *idm_build_message(
 }
 
 /**
- * Free message
+ * Set the sequence number the next message built on a connection gets
+ *
+ * Used to resync with the peer when reattaching to rings that were in use
+ * before (see IDM_HELLO).
  */
-void idm_free_message(struct idm_message *msg)
+void idm_conn_set_next_seq(struct idm_connection *conn, uint64_t seq)
 {
-    free(msg);
+    if (!conn) {
+        return;
+    }
+
+    __atomic_store_n(&conn->next_seq, seq, __ATOMIC_RELAXED);
 }
 
 /**
- * Cleanup
+ * Get connection's bulk staging region
+ *
+ * Both sides of the connection see the same bytes; copy messages refer to
+ * it by offset (IDM_COPY_BULK).
  */
-void idm_cleanup(void)
+void *idm_conn_bulk_region(struct idm_connection *conn, size_t *size_out)
+{
+    if (!conn || !conn->connected) {
+        return NULL;
+    }
+
+    if (size_out) {
+        *size_out = IDM_BULK_SIZE;
+    }
+
+    return conn->bulk;
+}
+
+/**
+ * Check whether the other end is still attached
+ *
+ * Stub mode counts attachments of the shared bulk segment: ours plus at
+ * least one from the peer process. Xen mode checks that the remote domain
+ * still has its xenstore directory, which the toolstack removes when the
+ * domain is destroyed. A guest process that exits while its domain lives
+ * on is not noticed there; the next process's IDM_HELLO releases what it
+ * left.
+ */
+bool idm_conn_peer_alive(struct idm_connection *conn)
+{
+    if (!conn || !conn->connected) {
+        return false;
+    }
+
+#ifdef USE_XEN
+    if (!conn->xs) {
+        conn->xs = xs_open(0);
+        if (!conn->xs) {
+            return true;  /* Can't tell; keep its resources */
+        }
+    }
+
+    char path[64];
+    snprintf(path, sizeof(path), "/local/domain/%u", conn->remote_zone_id);
+
+    unsigned int len;
+    void *val = xs_read(conn->xs, XBT_NULL, path, &len);
+    if (!val) {
+        return errno != ENOENT;
+    }
+    free(val);
+    return true;
+#else
+    struct shmid_ds ds;
+    if (shmctl(conn->bulk_shmid, IPC_STAT, &ds) < 0) {
+        return false;
+    }
+    return ds.shm_nattch >= 2;
+#endif
+}
+
+/* ============================================================================
+ * Shared Host Regions
+ *
+ * Guest memory the proxy maps once and then uses in place, so copies
+ * to and from it skip the bulk staging (see IDM_HOST_REGISTER). The user
+ * domain creates a region, the driver domain maps it by ID (stub mode) or
+ * by its grant references (Xen mode).
+ * ============================================================================ */
+
+#ifndef USE_XEN
+/* Region segment key; IDM_HOST_REGION_IDS regions per user zone */
+#define STUB_REGION_KEY(zone, id) (0x100000 + (((zone) & 0xFF) << 12) + ((id) & 0xFFF))
+#endif
+
+static bool region_args_valid(uint32_t region_id, size_t size)
+{
+    return region_id < IDM_HOST_REGION_IDS && size > 0 &&
+           size <= IDM_HOST_REGION_MAX && size % IDM_PAGE_SIZE == 0;
+}
+
+/**
+ * Create a region shared with the connection's driver domain
+ *
+ * @param region_id Caller-chosen ID (< IDM_HOST_REGION_IDS), unique among
+ *                  the caller's live regions
+ * @param size Bytes (whole pages, at most IDM_HOST_REGION_MAX)
+ * @param grefs [out] One grant reference per page (Xen mode)
+ * @param gref_count [out] Entries written to grefs (0 in stub mode, where
+ *                   the peer finds the region by ID)
+ * @return Mapping, or NULL on failure
+ */
+void *idm_conn_region_create(struct idm_connection *conn, uint32_t region_id, size_t size,
+                             uint32_t *grefs, uint32_t *gref_count)
+{
+    if (!conn || !conn->connected || conn->is_server || !region_args_valid(region_id, size)) {
+        return NULL;
+    }
+
+#ifdef USE_XEN
+    pthread_mutex_lock(&conn->conn_lock);
+    if (!conn->gntshr) {
+        conn->gntshr = xengntshr_open(NULL, 0);
+    }
+    pthread_mutex_unlock(&conn->conn_lock);
+    if (!conn->gntshr) {
+        fprintf(stderr, "Failed to open grant sharing: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    void *addr = xengntshr_share_pages(
+        conn->gntshr,
+        conn->remote_zone_id,
+        size / IDM_PAGE_SIZE,
+        grefs,
+        1
+    );
+    if (addr == NULL) {
+        fprintf(stderr, "Failed to grant host region pages\n");
+        return NULL;
+    }
+
+    *gref_count = size / IDM_PAGE_SIZE;
+    return addr;
+#else
+    (void)grefs;
+    if (conn->local_zone_id > STUB_MAX_ZONE) {
+        return NULL;  /* Its key would be another zone's */
+    }
+    key_t key = STUB_REGION_KEY(conn->local_zone_id, region_id);
+
+    int shmid = shmget(key, size, IPC_CREAT | IPC_EXCL | 0666);
+    if (shmid < 0 && errno == EEXIST) {
+        /* Left over from a run that died before the proxy mapped it */
+        int stale = shmget(key, 0, 0);
+        if (stale >= 0) {
+            shmctl(stale, IPC_RMID, NULL);
+        }
+        shmid = shmget(key, size, IPC_CREAT | IPC_EXCL | 0666);
+    }
+    if (shmid < 0) {
+        fprintf(stderr, "Failed to create host region: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    void *addr = shmat(shmid, NULL, 0);
+    if (addr == (void *)-1) {
+        fprintf(stderr, "Failed to attach host region: %s\n", strerror(errno));
+        shmctl(shmid, IPC_RMID, NULL);
+        return NULL;
+    }
+
+    *gref_count = 0;
+    return addr;
+#endif
+}
+
+/**
+ * Map a region the connection's user domain created
+ *
+ * @param grefs Grant references from the creator (Xen mode; unused in
+ *              stub mode)
+ * @return Mapping, or NULL on failure
+ */
+void *idm_conn_region_map(struct idm_connection *conn, uint32_t region_id, size_t size,
+                          const uint32_t *grefs)
+{
+    if (!conn || !conn->connected || !conn->is_server || !region_args_valid(region_id, size)) {
+        return NULL;
+    }
+
+#ifdef USE_XEN
+    void *addr = xengnttab_map_domain_grant_refs(
+        conn->gnttab,
+        size / IDM_PAGE_SIZE,
+        conn->remote_zone_id,
+        (uint32_t *)grefs,
+        PROT_READ | PROT_WRITE
+    );
+    if (addr == NULL) {
+        fprintf(stderr, "Failed to map host region grant pages\n");
+    }
+    return addr;
+#else
+    (void)grefs;
+    int shmid = shmget(STUB_REGION_KEY(conn->remote_zone_id, region_id), size, 0);
+    if (shmid < 0) {
+        return NULL;
+    }
+
+    void *addr = shmat(shmid, NULL, 0);
+    if (addr == (void *)-1) {
+        return NULL;
+    }
+
+    /* Both attachments keep it alive; gone once both sides detach or exit */
+    shmctl(shmid, IPC_RMID, NULL);
+    return addr;
+#endif
+}
+
+/**
+ * Unmap a region (either side)
+ */
+void idm_conn_region_unmap(struct idm_connection *conn, uint32_t region_id, void *addr,
+                           size_t size)
+{
+    if (!conn || !addr) {
+        return;
+    }
+
+#ifdef USE_XEN
+    if (conn->is_server) {
+        xengnttab_unmap(conn->gnttab, addr, size / IDM_PAGE_SIZE);
+    } else if (conn->gntshr) {
+        xengntshr_unshare(conn->gntshr, addr, size / IDM_PAGE_SIZE);
+    }
+    (void)region_id;
+#else
+    (void)size;
+    shmdt(addr);
+
+    /* Creator: in case the proxy never mapped (and removed) it */
+    if (!conn->is_server) {
+        int shmid = shmget(STUB_REGION_KEY(conn->local_zone_id, region_id), 0, 0);
+        if (shmid >= 0) {
+            shmctl(shmid, IPC_RMID, NULL);
+        }
+    }
+#endif
+}
+
+/**
+ * Get zone on the other end of a connection
+ */
+uint32_t idm_conn_remote_zone(const struct idm_connection *conn)
+{
+    return conn->remote_zone_id;
+}
+
+/**
+ * Close connection
+ */
+void idm_conn_close(struct idm_connection *conn)
 {
-    if (!global_conn) {
+    if (!conn) {
         return;
     }
 
-    struct idm_connection *conn = global_conn;
+    registry_remove(conn);
+    if (conn == default_conn) {
+        default_conn = NULL;
+    }
 
 #ifdef USE_XEN
     if (conn->evtchn_handle) {
+        if (poll_epfd >= 0) {
+            epoll_ctl(poll_epfd, EPOLL_CTL_DEL, xenevtchn_fd(conn->evtchn_handle), NULL);
+        }
         xenevtchn_close(conn->evtchn_handle);
     }
-    /* TODO: Unmap grant pages */
+    if (conn->xs) {
+        xs_close(conn->xs);
+    }
+    if (conn->bulk) {
+        xengnttab_unmap(conn->gnttab, conn->bulk, IDM_BULK_PAGES);
+    }
+    if (conn->tx_ring) {
+        xengnttab_unmap(conn->gnttab, conn->tx_ring, IDM_RING_PAGES);
+    }
+    if (conn->rx_ring) {
+        xengnttab_unmap(conn->gnttab, conn->rx_ring, IDM_RING_PAGES);
+    }
+    if (conn->gnttab) {
+        xengnttab_close(conn->gnttab);
+    }
+    if (conn->gntshr) {
+        xengntshr_close(conn->gntshr);
+    }
 #else
     if (conn->tx_ring) {
         shmdt(conn->tx_ring);
@@ -558,6 +2234,9 @@ void idm_cleanup(void)
     if (conn->rx_ring) {
         shmdt(conn->rx_ring);
     }
+    if (conn->bulk) {
+        shmdt(conn->bulk);
+    }
     if (conn->tx_sem) {
         sem_close(conn->tx_sem);
     }
@@ -566,9 +2245,168 @@ void idm_cleanup(void)
     }
 #endif
 
-    pthread_mutex_destroy(&conn->seq_lock);
+    pthread_mutex_destroy(&conn->tx_lock);
+    pthread_mutex_destroy(&conn->rx_lock);
     pthread_mutex_destroy(&conn->conn_lock);
 
+    free(conn->rx_borrowed);
+    free(conn->trace);
     free(conn);
-    global_conn = NULL;
+}
+
+/* ============================================================================
+ * Legacy Single-Connection API
+ *
+ * idm_init() opens the process's default connection. Sends and message
+ * builds are routed by destination zone, so callers holding several
+ * connections (the proxy) can keep using these from any thread.
+ * ============================================================================ */
+
+/**
+ * Initialize IDM connection
+ */
+int idm_init(uint32_t local_zone_id, uint32_t remote_zone_id, bool is_server)
+{
+    if (default_conn != NULL) {
+        fprintf(stderr, "IDM already initialized\n");
+        return -EALREADY;
+    }
+
+    struct idm_connection *conn = idm_conn_open(local_zone_id, remote_zone_id, is_server);
+    if (!conn) {
+        return -1;
+    }
+
+    default_conn = conn;
+
+    return 0;
+}
+
+/**
+ * Connection for a destination zone (default connection as fallback)
+ */
+static struct idm_connection *route(uint32_t dst_zone)
+{
+    if (default_conn && default_conn->remote_zone_id == dst_zone) {
+        return default_conn;
+    }
+
+    struct idm_connection *conn = idm_conn_lookup(dst_zone);
+    return conn ? conn : default_conn;
+}
+
+/**
+ * Send message
+ */
+int idm_send(struct idm_message *msg)
+{
+    return idm_conn_send(route(msg->header.dst_zone), msg);
+}
+
+/**
+ * Receive message (blocking)
+ */
+int idm_recv(struct idm_message **msg_out, int timeout_ms)
+{
+    return idm_conn_recv(default_conn, msg_out, timeout_ms);
+}
+
+/**
+ * Build message helper
+ */
+struct idm_message *idm_build_message(
+    uint32_t dst_zone,
+    enum idm_msg_type msg_type,
+    const void *payload,
+    size_t payload_len)
+{
+    struct idm_connection *conn = route(dst_zone);
+    if (!conn) {
+        return NULL;
+    }
+
+    struct idm_message *msg = idm_conn_build_message(conn, msg_type, payload, payload_len);
+    if (msg) {
+        msg->header.dst_zone = dst_zone;
+    }
+
+    return msg;
+}
+
+/**
+ * Set the next sequence number of the default connection
+ */
+void idm_set_next_seq(uint64_t seq)
+{
+    idm_conn_set_next_seq(default_conn, seq);
+}
+
+/**
+ * Get bulk staging region of the default connection
+ */
+void *idm_bulk_region(size_t *size_out)
+{
+    return idm_conn_bulk_region(default_conn, size_out);
+}
+
+/**
+ * Create a shared host region on the default connection
+ */
+void *idm_region_create(uint32_t region_id, size_t size, uint32_t *grefs, uint32_t *gref_count)
+{
+    return idm_conn_region_create(default_conn, region_id, size, grefs, gref_count);
+}
+
+/**
+ * Unmap a region created with idm_region_create()
+ */
+void idm_region_destroy(uint32_t region_id, void *addr, size_t size)
+{
+    idm_conn_region_unmap(default_conn, region_id, addr, size);
+}
+
+/**
+ * Record a trace span on the default connection
+ */
+void idm_trace(const struct idm_trace_span *span)
+{
+    idm_conn_trace(default_conn, span);
+}
+
+/**
+ * Free message
+ */
+void idm_free_message(struct idm_message *msg)
+{
+    free(msg);
+}
+
+/**
+ * Cleanup (closes every connection)
+ */
+void idm_cleanup(void)
+{
+    for (;;) {
+        struct idm_connection *conn = NULL;
+
+        pthread_rwlock_rdlock(&registry_lock);
+        for (int i = 0; i < IDM_MAX_CONNECTIONS && !conn; i++) {
+            conn = registry[i];
+        }
+        pthread_rwlock_unlock(&registry_lock);
+
+        if (!conn) {
+            break;
+        }
+        idm_conn_close(conn);
+    }
+
+#ifdef USE_XEN
+    if (poll_epfd >= 0) {
+        close(poll_epfd);
+        poll_epfd = -1;
+    }
+#endif
+
+    default_conn = NULL;
 }